@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Races connects over two tun interfaces in a private network namespace
+ * (Linux, needs CAP_SYS_ADMIN and /dev/net/tun). Behind each one a
+ * stand-in server answers SYNs with a SYN-ACK after an artificial delay,
+ * or not at all, so that every interface has the connect latency the
+ * check sets. Checks the winner, the cancelled losers, failover and
+ * timeouts, that learned statistics reorder later races, and reports
+ * connect latency percentiles over a flaky primary against connecting
+ * over it alone.
+ *
+ *  cc -O2 -Wall -o connection_racer_check connection_racer_check.c harness.c \
+ *      ../NetworkInterface/connection_racer.c ../NetworkInterface/socket_pool.c \
+ *      ../NetworkInterface/netif_stats.c -lpthread
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+
+#include "../NetworkInterface/connection_racer.h"
+#include "../NetworkInterface/netif_stats.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/if_tun.h>
+
+#define DROP    -1
+
+/* A tun interface with a server behind it at 10.9.<n>.2 */
+struct standin {
+    char name[IFNAMSIZ];
+    unsigned ifindex;
+    int fd;
+    atomic_int delay_ms;            /* SYN to SYN-ACK, or DROP */
+    pthread_t thread;
+};
+
+static struct standin standins[2];
+static atomic_int stopping;
+
+static int
+open_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int n = 0;
+
+    while (dir && readdir(dir)) {
+        n++;
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return n;
+}
+
+static uint16_t
+checksum(const void *data, size_t len, uint32_t sum)
+{
+    const uint8_t *p = data;
+
+    for (; len > 1; p += 2, len -= 2) {
+        sum += (uint32_t)(p[0] << 8 | p[1]);
+    }
+    if (len) {
+        sum += (uint32_t)(p[0] << 8);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+/* Turns the SYN in `pkt` into the matching SYN-ACK */
+static void
+make_syn_ack(uint8_t *pkt)
+{
+    struct iphdr *ip = (struct iphdr *)pkt;
+    struct tcphdr *tcp = (struct tcphdr *)(pkt + ip->ihl * 4);
+    uint8_t pseudo[12];
+    uint32_t addr = ip->saddr, sum = 0;
+    uint16_t port = tcp->source;
+    size_t i;
+
+    ip->saddr = ip->daddr;
+    ip->daddr = addr;
+    ip->ihl = 5;
+    ip->tot_len = htons(40);
+    ip->ttl = 64;
+    ip->check = 0;
+    ip->check = htons(checksum(ip, 20, 0));
+    tcp = (struct tcphdr *)(pkt + 20);
+    memmove(tcp, pkt + 20 + (((struct iphdr *)pkt)->ihl * 4 - 20), 20);
+    tcp->source = tcp->dest;
+    tcp->dest = port;
+    tcp->ack_seq = htonl(ntohl(tcp->seq) + 1);
+    tcp->seq = htonl(0x1000);
+    tcp->doff = 5;
+    tcp->syn = 1;
+    tcp->ack = 1;
+    tcp->window = htons(65535);
+    tcp->check = 0;
+    memcpy(pseudo, &ip->saddr, 4);
+    memcpy(pseudo + 4, &ip->daddr, 4);
+    pseudo[8] = 0;
+    pseudo[9] = IPPROTO_TCP;
+    pseudo[10] = 0;
+    pseudo[11] = 20;
+    for (i = 0; i < sizeof(pseudo); i += 2) {
+        sum += (uint32_t)(pseudo[i] << 8 | pseudo[i + 1]);
+    }
+    tcp->check = htons(checksum(tcp, 20, sum));
+}
+
+/* Replies to SYNs after the interface's delay; everything else is dropped */
+static void *
+standin_thread(void *arg)
+{
+    struct standin *s = arg;
+    struct { uint64_t due; uint8_t pkt[60]; } pending[64];
+    size_t npending = 0, i;
+    uint8_t buf[2048];
+
+    while (!atomic_load(&stopping)) {
+        struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+        uint64_t now = netif_stats_now();
+        int timeout = 5, delay;
+        struct iphdr *ip = (struct iphdr *)buf;
+        struct tcphdr *tcp;
+        ssize_t len;
+
+        for (i = 0; i < npending; ) {
+            if (pending[i].due <= now) {
+                if (write(s->fd, pending[i].pkt, 40) != 40) {
+                    warn("write %s", s->name);
+                }
+                pending[i] = pending[--npending];
+            } else {
+                i++;
+            }
+        }
+        if (poll(&pfd, 1, timeout) != 1) {
+            continue;
+        }
+        len = read(s->fd, buf, sizeof(buf));
+        if (len < 40 || ip->version != 4 || ip->protocol != IPPROTO_TCP ||
+            (size_t)len < (size_t)ip->ihl * 4 + 20) {
+            continue;
+        }
+        tcp = (struct tcphdr *)(buf + ip->ihl * 4);
+        delay = atomic_load(&s->delay_ms);
+        if (!tcp->syn || tcp->ack) {
+            continue;
+        }
+        if (delay == DROP || npending == 64) {
+            continue;
+        }
+        memcpy(pending[npending].pkt, buf, (size_t)ip->ihl * 4 + 20);
+        make_syn_ack(pending[npending].pkt);
+        pending[npending].due = now + (uint64_t)delay * 1000000;
+        npending++;
+    }
+    return NULL;
+}
+
+static void
+ifconfig(int sock, const char *name, const char *addr)
+{
+    struct ifreq ifr;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ifr.ifr_addr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, name);
+    sin->sin_family = AF_INET;
+    inet_pton(AF_INET, addr, &sin->sin_addr);
+    if (ioctl(sock, SIOCSIFADDR, &ifr) != 0) {
+        err(1, "SIOCSIFADDR %s", name);
+    }
+    inet_pton(AF_INET, "255.255.255.0", &sin->sin_addr);
+    if (ioctl(sock, SIOCSIFNETMASK, &ifr) != 0) {
+        err(1, "SIOCSIFNETMASK %s", name);
+    }
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0) {
+        err(1, "SIOCGIFFLAGS %s", name);
+    }
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(sock, SIOCSIFFLAGS, &ifr) != 0) {
+        err(1, "SIOCSIFFLAGS %s", name);
+    }
+}
+
+static void
+setup(void)
+{
+    struct ifreq ifr;
+    char addr[32];
+    int sock, i;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        err(1, "unshare(CLONE_NEWNET)");
+    }
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    for (i = 0; i < 2; i++) {
+        struct standin *s = &standins[i];
+        snprintf(s->name, sizeof(s->name), "race%d", i);
+        if ((s->fd = open("/dev/net/tun", O_RDWR)) < 0) {
+            err(1, "/dev/net/tun");
+        }
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+        strcpy(ifr.ifr_name, s->name);
+        if (ioctl(s->fd, TUNSETIFF, &ifr) != 0) {
+            err(1, "TUNSETIFF");
+        }
+        snprintf(addr, sizeof(addr), "10.9.%d.1", i);
+        ifconfig(sock, s->name, addr);
+        s->ifindex = if_nametoindex(s->name);
+        pthread_create(&s->thread, NULL, standin_thread, s);
+    }
+    close(sock);
+}
+
+static void
+candidate(struct race_candidate *c, unsigned ifindex, const char *addr)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&c->addr;
+
+    memset(c, 0, sizeof(*c));
+    c->ifindex = ifindex;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(443);
+    inet_pton(AF_INET, addr, &sin->sin_addr);
+    c->addrlen = sizeof(*sin);
+}
+
+static void
+candidate6(struct race_candidate *c, unsigned ifindex)
+{
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&c->addr;
+
+    memset(c, 0, sizeof(*c));
+    c->ifindex = ifindex;
+    sin6->sin6_family = AF_INET6;
+    c->addrlen = sizeof(*sin6);
+}
+
+static void
+check_order(void)
+{
+    struct connection_racer racer;
+    struct race_candidate c[5];
+    size_t order[5];
+
+    connection_racer_init(&racer, 0, 4);
+    CHECK(racer.attempt_delay_ms == RACER_ATTEMPT_DELAY_MS);
+    candidate(&c[0], 1, "192.0.2.1");
+    candidate(&c[1], 1, "192.0.2.2");
+    candidate6(&c[2], 1);
+    candidate6(&c[3], 2);
+    candidate(&c[4], 2, "192.0.2.3");
+    // Families interleaved from the first's, at most max_attempts started
+    CHECK(connection_racer_order(&racer, c, 5, order) == 4);
+    CHECK(order[0] == 0 && order[1] == 2 && order[2] == 1 && order[3] == 3 && order[4] == 4);
+    connection_racer_destroy(&racer);
+
+    connection_racer_init(&racer, 1, 0);
+    CHECK(racer.attempt_delay_ms == RACER_MIN_ATTEMPT_DELAY_MS);
+    CHECK(racer.max_attempts == RACER_MAX_ATTEMPTS);
+    connection_racer_destroy(&racer);
+}
+
+static void
+check_race(void)
+{
+    struct connection_racer racer;
+    struct race_candidate c[2], failover[2];
+    struct racer_interface s0, s1;
+    struct race_result r;
+    uint64_t cancelled = netif_stats_counter(NETIF_RACE_ATTEMPTS_CANCELLED), t0;
+    int fd, fds = open_fds();
+
+    connection_racer_init(&racer, 50, 0);
+    candidate(&c[0], standins[0].ifindex, "10.9.0.2");
+    candidate(&c[1], standins[1].ifindex, "10.9.1.2");
+
+    // The primary is slow: the second, started 50 ms later, wins
+    atomic_store(&standins[0].delay_ms, 300);
+    atomic_store(&standins[1].delay_ms, 20);
+    fd = connection_racer_connect(&racer, c, 2, 2000, &r);
+    CHECK(fd >= 0 && r.candidate == 1 && r.ifindex == standins[1].ifindex && r.started == 2);
+    CHECK(r.connect_ns >= 60000000 && r.connect_ns < 250000000);
+    CHECK(netif_stats_counter(NETIF_RACE_ATTEMPTS_CANCELLED) == cancelled + 1);
+    close(fd);
+    CHECK(connection_racer_interface(&racer, standins[0].ifindex, &s0) == 0);
+    CHECK(connection_racer_interface(&racer, standins[1].ifindex, &s1) == 0);
+    CHECK(s0.attempts == 1 && s0.wins == 0 && s1.wins == 1);
+    CHECK(s1.srtt_ns >= 20000000 && s1.srtt_ns < 200000000);
+
+    // Learned: the second interface now goes first and wins alone
+    fd = connection_racer_connect(&racer, c, 2, 2000, &r);
+    CHECK(fd >= 0 && r.candidate == 1 && r.started == 1 && r.connect_ns < 50000000);
+    close(fd);
+
+    // A candidate that fails at once (lo is down in the namespace) hands
+    // over to the next without waiting for the attempt delay
+    connection_racer_destroy(&racer);
+    connection_racer_init(&racer, 1000, 0);
+    candidate(&failover[0], 0, "127.0.0.1");
+    failover[1] = c[1];
+    fd = connection_racer_connect(&racer, failover, 2, 2000, &r);
+    CHECK(fd >= 0 && r.candidate == 1 && r.started == 2 && r.failed == 1);
+    CHECK(r.connect_ns < 500000000);
+    close(fd);
+    CHECK(connection_racer_interface(&racer, 0, &s0) == 0 && s0.failures == 1);
+
+    // Nothing answers: times out, every attempt closed
+    atomic_store(&standins[0].delay_ms, DROP);
+    atomic_store(&standins[1].delay_ms, DROP);
+    connection_racer_destroy(&racer);
+    connection_racer_init(&racer, 50, 0);
+    t0 = netif_stats_now();
+    CHECK(connection_racer_connect(&racer, c, 2, 200, &r) == -1 && errno == ETIMEDOUT);
+    CHECK(netif_stats_now() - t0 < 400000000);
+    CHECK(connection_racer_interface(&racer, standins[1].ifindex, &s1) == 0);
+    CHECK(s1.attempts == 1 && s1.wins == 0);
+    connection_racer_destroy(&racer);
+    CHECK(open_fds() == fds);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * The primary usually answers in 5 ms but one connect in five takes
+ * 400 ms; the secondary steadily takes 40 ms.
+ */
+static void
+report_flaky(void)
+{
+    enum { RACES = 60 };
+    struct connection_racer racer, primary;
+    struct race_candidate c[2];
+    struct race_result r;
+    uint64_t alone[RACES], raced[RACES];
+    int i, fd;
+
+    connection_racer_init(&racer, 50, 0);
+    connection_racer_init(&primary, 50, 0);
+    candidate(&c[0], standins[0].ifindex, "10.9.0.2");
+    candidate(&c[1], standins[1].ifindex, "10.9.1.2");
+    atomic_store(&standins[1].delay_ms, 40);
+    srand(1);
+    for (i = 0; i < RACES; i++) {
+        int delay = rand() % 5 == 0 ? 400 : 5;
+        uint64_t t0;
+
+        atomic_store(&standins[0].delay_ms, delay);
+        // Connecting over the primary alone
+        t0 = netif_stats_now();
+        fd = connection_racer_connect(&primary, c, 1, 2000, NULL);
+        alone[i] = netif_stats_now() - t0;
+        CHECK(fd >= 0);
+        close(fd);
+        fd = connection_racer_connect(&racer, c, 2, 2000, &r);
+        raced[i] = r.connect_ns;
+        CHECK(fd >= 0);
+        close(fd);
+    }
+    qsort(alone, RACES, sizeof(*alone), compare_u64);
+    qsort(raced, RACES, sizeof(*raced), compare_u64);
+    printf("connect over a flaky primary: p50 %.1f ms, p90 %.1f ms, max %.1f ms alone; "
+           "p50 %.1f ms, p90 %.1f ms, max %.1f ms raced\n",
+           alone[RACES / 2] / 1e6, alone[RACES * 9 / 10] / 1e6, alone[RACES - 1] / 1e6,
+           raced[RACES / 2] / 1e6, raced[RACES * 9 / 10] / 1e6, raced[RACES - 1] / 1e6);
+    CHECK(raced[RACES - 1] < alone[RACES - 1]);
+    connection_racer_destroy(&racer);
+    connection_racer_destroy(&primary);
+}
+
+int
+main(void)
+{
+    int i;
+
+    setup();
+    check_order();
+    check_race();
+    report_flaky();
+    atomic_store(&stopping, 1);
+    for (i = 0; i < 2; i++) {
+        pthread_join(standins[i].thread, NULL);
+        close(standins[i].fd);
+    }
+    printf("connection_racer_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the Linux gateway discovery backend: the filtered default
+ * route query agrees with a full dump of the host table, and then, in a
+ * private network namespace (needs CAP_SYS_ADMIN), with a large table
+ * where it is compared against the full dump for speed. Also checks that
+ * monitor hub updates report default gateway changes from their own routes.
+ *
+ *  cc -O2 -Wall -o default_gateway_check default_gateway_check.c harness.c \
+ *      ../NetworkInterface/default_gateway.c ../NetworkInterface/interface_registry.c \
+ *      ../NetworkInterface/egress_selector.c ../NetworkInterface/route_diff.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/route_lpm.c \
+ *      ../NetworkInterface/route_netlink.c ../NetworkInterface/route_snapshot.c \
+ *      ../NetworkInterface/route_compact.c ../NetworkInterface/route_arena.c \
+ *      ../NetworkInterface/route_table.c ../NetworkInterface/route_tracker.c \
+ *      ../NetworkInterface/flight_recorder.c ../NetworkInterface/netif_stats.c -lpthread
+ *
+ *  ./default_gateway_check [routes]
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+
+#include "../NetworkInterface/default_gateway.h"
+#include "../NetworkInterface/monitor_hub.h"
+#include "../NetworkInterface/route_netlink.h"
+
+#include <err.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/rtnetlink.h>
+
+static size_t
+count_defaults(const struct route_table *table, int family)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < table->count; i++) {
+        n += table->entries[i].family == family && table->entries[i].prefixlen == 0;
+    }
+    return n;
+}
+
+/* The filtered query returns the same default routes as a full dump */
+static void
+check_against_dump(void)
+{
+    static const int families[] = { AF_INET, AF_INET6 };
+    struct route_table table;
+    struct route_entry defaults[16];
+    size_t f;
+    int i, n;
+
+    route_table_init(&table);
+    CHECK(route_netlink_load_table(&table) >= 0);
+    for (f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+        n = route_netlink_get_defaults(families[f], defaults, 16);
+        CHECK(n >= 0 && (size_t)n == count_defaults(&table, families[f]));
+        for (i = 0; i < n && i < 16; i++) {
+            const struct route_entry *e = route_table_find(&table, &defaults[i]);
+            CHECK(e && route_entry_equal(e, &defaults[i]));
+        }
+    }
+    route_table_free(&table);
+}
+
+/*
+ * Calls print_monitor_update() for an update holding `routes` with
+ * stdout captured, and returns how many "Default gateway `what`" lines
+ * it printed
+ */
+static int
+count_monitor_changes(const struct route_entry *routes, size_t count, const char *what)
+{
+    struct monitor_update update;
+    char line[256], needle[64];
+    FILE *out = tmpfile();
+    int saved, n = 0;
+
+    memset(&update, 0, sizeof(update));
+    if (out == NULL || route_compact_build(&update.routes, routes, count) != 0) {
+        err(1, "monitor update");
+    }
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(fileno(out), STDOUT_FILENO);
+    print_monitor_update(&update);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    snprintf(needle, sizeof(needle), "Default gateway %s:", what);
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        n += strstr(line, needle) != NULL;
+    }
+    fclose(out);
+    route_compact_free(&update.routes);
+    return n;
+}
+
+/* Hub updates report the default gateway changes from their own table */
+static void
+check_monitor_update(void)
+{
+    struct route_table table;
+    size_t defaults;
+
+    route_table_init(&table);
+    CHECK(route_netlink_load_table(&table) >= 0);
+    defaults = count_defaults(&table, AF_INET);
+    // Reported by print_default_gateway_changes() already
+    CHECK(count_monitor_changes(table.entries, table.count, "added") == 0);
+    CHECK(count_monitor_changes(table.entries, table.count, "removed") == 0);
+    CHECK(count_monitor_changes(NULL, 0, "removed") == (int)defaults);
+    CHECK(count_monitor_changes(table.entries, table.count, "added") == (int)defaults);
+    route_table_free(&table);
+}
+
+/*
+ * Adds `dst`/`prefixlen` via the loopback interface, and through
+ * `gateway` when not 0, with a RTM_NEWROUTE request
+ */
+static int
+add_route(int fd, uint32_t seq, uint32_t dst, int prefixlen, uint32_t gateway, uint32_t metric)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct rtmsg rtm;
+        char attrs[64];
+    } req;
+    struct rtattr *rta;
+    uint32_t oif = if_nametoindex("lo");
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_type = RTM_NEWROUTE;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL;
+    req.nlh.nlmsg_seq = seq;
+    req.rtm.rtm_family = AF_INET;
+    req.rtm.rtm_dst_len = (unsigned char)prefixlen;
+    req.rtm.rtm_table = RT_TABLE_MAIN;
+    req.rtm.rtm_protocol = RTPROT_STATIC;
+    req.rtm.rtm_scope = RT_SCOPE_LINK;
+    req.rtm.rtm_type = RTN_UNICAST;
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm));
+
+    rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nlh.nlmsg_len));
+    rta->rta_type = RTA_DST;
+    rta->rta_len = RTA_LENGTH(4);
+    memcpy(RTA_DATA(rta), &dst, 4);
+    req.nlh.nlmsg_len = NLMSG_ALIGN(req.nlh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+    rta = (struct rtattr *)((char *)&req + req.nlh.nlmsg_len);
+    rta->rta_type = RTA_OIF;
+    rta->rta_len = RTA_LENGTH(4);
+    memcpy(RTA_DATA(rta), &oif, 4);
+    req.nlh.nlmsg_len += RTA_ALIGN(rta->rta_len);
+
+    rta = (struct rtattr *)((char *)&req + req.nlh.nlmsg_len);
+    rta->rta_type = RTA_PRIORITY;
+    rta->rta_len = RTA_LENGTH(4);
+    memcpy(RTA_DATA(rta), &metric, 4);
+    req.nlh.nlmsg_len += RTA_ALIGN(rta->rta_len);
+
+    if (gateway) {
+        req.rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+        req.rtm.rtm_flags |= RTNH_F_ONLINK;
+        rta = (struct rtattr *)((char *)&req + req.nlh.nlmsg_len);
+        rta->rta_type = RTA_GATEWAY;
+        rta->rta_len = RTA_LENGTH(4);
+        memcpy(RTA_DATA(rta), &gateway, 4);
+        req.nlh.nlmsg_len += RTA_ALIGN(rta->rta_len);
+    }
+
+    return send(fd, &req, req.nlh.nlmsg_len, 0) < 0 ? -1 : 0;
+}
+
+/* Fills a private namespace with `count` /24 routes and two default routes */
+static int
+setup_namespace(size_t count)
+{
+    struct ifreq ifr;
+    size_t i;
+    int fd;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        return -1;
+    }
+    // Bring up the loopback interface so routes can point at it
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, "lo", IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFFLAGS, &ifr) != 0) {
+        close(fd);
+        return -1;
+    }
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(fd, SIOCSIFFLAGS, &ifr) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if ((fd = route_netlink_open(0)) < 0) {
+        return -1;
+    }
+    // Requests are not acknowledged, failures show up as missing routes.
+    // The defaults go through on-link TEST-NET-1 gateways.
+    if (add_route(fd, 1, 0, 0, htonl(0xc0000202), 100) != 0 ||
+        add_route(fd, 2, 0, 0, htonl(0xc0000203), 200) != 0 ||
+        add_route(fd, 3, htonl(0x00000000), 8, 0, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        uint32_t dst = htonl(0x0b000000u + ((uint32_t)i << 8));
+        if (add_route(fd, (uint32_t)(i + 4), dst, 24, 0, 0) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static void
+check_large_table(size_t count)
+{
+    struct route_table table;
+    struct route_entry defaults[16];
+    struct egress_choice choice;
+    double t0, dump_ns, query_ns;
+    int i, n = 0, iterations = 20;
+
+    if (setup_namespace(count) != 0) {
+        warn("network namespace (skipping large table check)");
+        return;
+    }
+
+    route_table_init(&table);
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        CHECK(route_netlink_load_table(&table) >= 0);
+    }
+    dump_ns = (now_ns() - t0) / iterations;
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        n = route_netlink_get_defaults(AF_INET, defaults, 16);
+    }
+    query_ns = (now_ns() - t0) / iterations;
+
+    printf("%lu routes: full dump %.0f us, default query %.0f us\n", (unsigned long)table.count,
+           dump_ns / 1000, query_ns / 1000);
+    CHECK(table.count >= count);
+    CHECK(n == 2);
+    CHECK((size_t)n == count_defaults(&table, AF_INET));
+    CHECK(n >= 2 && defaults[0].priority + defaults[1].priority == 300);
+    // The lower metric is preferred
+    CHECK(preferred_egress(&choice) == 0 && choice.route.priority == 100);
+    CHECK(choice.has_runner_up && choice.reason == EGRESS_PRIORITY);
+    print_preferred_egress();
+    route_table_free(&table);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct route_nexthop nexthop;
+    struct in_addr probe;
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+
+    check_against_dump();
+
+    print_default_gateway();
+    // The first call reports every default gateway as added, the second nothing
+    print_default_gateway_changes();
+    print_default_gateway_changes();
+    check_monitor_update();
+    print_preferred_egress();
+    inet_pton(AF_INET, "198.51.100.1", &probe);
+    update_route_snapshot();
+    if (lookup_egress(AF_INET, &probe, &nexthop) == 0) {
+        struct route_entry defaults[16];
+        char ifname[IFNAMSIZ] = "";
+        int n = route_netlink_get_defaults(AF_INET, defaults, 16);
+        printf("egress for 198.51.100.1: %s\n", if_indextoname(nexthop.ifindex, ifname));
+        // Only the default route covers it
+        CHECK(n >= 1 && nexthop.ifindex == defaults[0].ifindex &&
+              memcmp(nexthop.gateway, defaults[0].gateway, 4) == 0);
+    }
+
+    check_large_table(count);
+    printf("default_gateway_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
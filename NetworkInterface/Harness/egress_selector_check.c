@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks egress_select() on the default routes of the example in
+ * default_gateway.c and on candidates that differ in one ranked field
+ * at a time, and that egress_update() reports a change only when the
+ * chosen route changes.
+ *
+ *  cc -O2 -Wall -o egress_selector_check egress_selector_check.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/egress_selector.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/netif_stats.c
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/egress_selector.h"
+#include "../NetworkInterface/route_dump.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/* en8 is the unscoped default, en0 is scoped but has the lower RTT */
+static void
+check_example(void)
+{
+    static const uint8_t any4[4] = { 0 };
+    static const uint8_t gw_en8[4] = { 192, 168, 1, 5 };
+    static const uint8_t gw_en0[4] = { 192, 168, 9, 1 };
+    static const uint8_t net_en8[4] = { 192, 168, 1, 0 };
+    static const uint8_t any6[16] = { 0 };
+    static const uint8_t gw6[16] = { 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+    struct rtdump_builder b;
+    struct route_table table;
+    struct egress_choice choice;
+
+    rtdump_builder_init(&b);
+    rtdump_builder_add(&b, AF_INET, any4, 0, gw_en8, 8, RTF_STATIC | RTF_PRCLONING, 1500, 30000);
+    rtdump_builder_add(&b, AF_INET, any4, 0, gw_en0, 4,
+                       RTF_STATIC | RTF_PRCLONING | RTF_IFSCOPE, 1500, 12000);
+    rtdump_builder_add(&b, AF_INET, net_en8, 24, NULL, 8, RTF_CLONING, 1500, 0);
+    rtdump_builder_add(&b, AF_INET6, any6, 0, gw6, 4, RTF_STATIC | RTF_PRCLONING, 1500, 0);
+    route_table_init(&table);
+    CHECK(route_table_load_dump(&table, b.buf, b.len) == 4);
+
+    CHECK(egress_select(table.entries, table.count, AF_INET, NULL, &choice) == 0);
+    CHECK(choice.candidates == 2 && choice.has_runner_up);
+    CHECK(choice.route.ifindex == 8 && choice.runner_up.ifindex == 4);
+    CHECK(choice.reason == EGRESS_UNSCOPED);
+    printf("example: if%u over if%u (%s)\n", choice.route.ifindex, choice.runner_up.ifindex,
+           egress_reason_text(choice.reason));
+
+    CHECK(egress_select(table.entries, table.count, AF_INET6, NULL, &choice) == 0);
+    CHECK(choice.candidates == 1 && !choice.has_runner_up && choice.reason == EGRESS_ONLY_CANDIDATE);
+    CHECK(egress_select(table.entries, table.count, AF_UNSPEC, NULL, &choice) == 0);
+    CHECK(choice.candidates == 3);
+
+    route_table_free(&table);
+    rtdump_builder_free(&b);
+}
+
+static struct route_entry
+candidate(uint32_t ifindex)
+{
+    struct route_entry e;
+
+    memset(&e, 0, sizeof(e));
+    e.family = AF_INET;
+    e.gateway_family = AF_INET;
+    e.flags = ROUTE_F_UP | ROUTE_F_GATEWAY | ROUTE_F_STATIC | ROUTE_F_IFSCOPE;
+    e.ifindex = ifindex;
+    e.mtu = 1500;
+    e.rtt = 20000;
+    e.rttvar = 1000;
+    e.hopcount = 3;
+    e.gateway[0] = 10;
+    e.gateway[3] = (uint8_t)ifindex;
+    return e;
+}
+
+/* The second candidate is made better in one field: it wins for `reason` */
+static void
+check_each_field(void)
+{
+    struct route_entry c[3];
+    struct egress_choice choice;
+    enum egress_reason reason;
+    int field;
+
+    for (field = EGRESS_USABLE; field <= EGRESS_TIE; field++) {
+        c[0] = candidate(5);
+        c[1] = candidate(2);
+        c[2] = candidate(9);
+        c[1].ifindex = field == EGRESS_TIE ? 2 : 7;
+        switch (field) {
+            case EGRESS_USABLE: c[0].flags |= ROUTE_F_REJECT; c[2].flags &= ~ROUTE_F_UP; break;
+            case EGRESS_UNSCOPED: c[1].flags &= ~ROUTE_F_IFSCOPE; c[0].priority = c[2].priority = 0; break;
+            case EGRESS_PRIORITY: c[0].priority = c[2].priority = 20; c[1].priority = 10; break;
+            case EGRESS_RTT: c[1].rtt = 10000; break;
+            case EGRESS_MTU: c[1].mtu = 9000; c[0].rtt = 0; break;
+            case EGRESS_HOPCOUNT: c[1].hopcount = 1; break;
+            default: break;
+        }
+        CHECK(egress_select(c, 3, AF_INET, NULL, &choice) == 0);
+        CHECK(choice.route.ifindex == c[1].ifindex);
+        CHECK(choice.reason == (enum egress_reason)field);
+        CHECK(egress_compare(&c[1], &c[0], &reason) < 0 && reason == (enum egress_reason)field);
+        CHECK(egress_compare(&c[0], &c[1], NULL) > 0);
+    }
+
+    // Unmeasured metrics are skipped rather than ranked as smallest
+    c[0] = candidate(5);
+    c[1] = candidate(7);
+    c[0].rtt = 0;
+    c[1].rtt = 50000;
+    c[1].hopcount = 1;
+    CHECK(egress_compare(&c[1], &c[0], &reason) < 0 && reason == EGRESS_HOPCOUNT);
+
+    // No usable route
+    c[0].flags &= ~ROUTE_F_UP;
+    c[1].flags |= ROUTE_F_REJECT;
+    errno = 0;
+    CHECK(egress_select(c, 2, AF_INET, NULL, &choice) == -1 && errno == ENOENT);
+    CHECK(egress_select(c, 0, AF_INET, NULL, &choice) == -1 && errno == ENOENT);
+}
+
+static void
+check_sticky(void)
+{
+    struct route_entry c[2], previous;
+    struct egress_choice choice;
+
+    c[0] = candidate(5);
+    c[1] = candidate(7);
+    c[1].rtt = c[0].rtt - 500;
+    CHECK(egress_select(c, 2, AF_INET, NULL, &choice) == 0 && choice.route.ifindex == 7);
+
+    // Within the RTT variance the previous choice stays
+    previous = c[0];
+    CHECK(egress_select(c, 2, AF_INET, &previous, &choice) == 0);
+    CHECK(choice.route.ifindex == 5 && choice.runner_up.ifindex == 7);
+    CHECK(choice.reason == EGRESS_STICKY);
+
+    // Beyond it, or on a stronger criterion, it does not
+    c[1].rtt = c[0].rtt - 5000;
+    CHECK(egress_select(c, 2, AF_INET, &previous, &choice) == 0);
+    CHECK(choice.route.ifindex == 7 && choice.reason == EGRESS_RTT);
+    c[1].rtt = c[0].rtt;
+    c[1].priority = 0;
+    c[0].priority = 1;
+    CHECK(egress_select(c, 2, AF_INET, &previous, &choice) == 0);
+    CHECK(choice.route.ifindex == 7 && choice.reason == EGRESS_PRIORITY);
+
+    // Nor once the previous route is gone or down
+    c[0].priority = 0;
+    c[1].rtt = c[0].rtt - 500;
+    c[0].flags &= ~ROUTE_F_UP;
+    CHECK(egress_select(c, 2, AF_INET, &previous, &choice) == 0);
+    CHECK(choice.route.ifindex == 7 && choice.reason == EGRESS_USABLE);
+    CHECK(egress_select(&c[1], 1, AF_INET, &previous, &choice) == 0);
+    CHECK(choice.route.ifindex == 7 && choice.reason == EGRESS_ONLY_CANDIDATE);
+}
+
+/* egress_update() reports changes of the chosen route only */
+static void
+check_update(void)
+{
+    struct route_table table;
+    struct route_entry c[2];
+    struct egress_choice egress;
+    int has_egress = 0;
+
+    route_table_init(&table);
+    c[0] = candidate(5);
+    c[1] = candidate(7);
+    c[1].hopcount = 1;
+    CHECK(egress_update(&table, AF_INET, &has_egress, &egress) == 0 && !has_egress);
+    CHECK(route_table_upsert(&table, &c[0]) >= 0);
+    CHECK(egress_update(&table, AF_INET, &has_egress, &egress) == 1);
+    CHECK(has_egress && egress.route.ifindex == 5 && egress.reason == EGRESS_ONLY_CANDIDATE);
+
+    // A runner-up that loses is not a change, though the choice records it
+    c[1].flags &= ~ROUTE_F_UP;
+    CHECK(route_table_upsert(&table, &c[1]) >= 0);
+    CHECK(egress_update(&table, AF_INET, &has_egress, &egress) == 0);
+    CHECK(egress.route.ifindex == 5 && egress.has_runner_up && egress.reason == EGRESS_USABLE);
+
+    c[1].flags |= ROUTE_F_UP;
+    CHECK(route_table_upsert(&table, &c[1]) >= 0);
+    CHECK(egress_update(&table, AF_INET, &has_egress, &egress) == 1);
+    CHECK(egress.route.ifindex == 7 && egress.reason == EGRESS_HOPCOUNT);
+
+    route_table_clear(&table);
+    CHECK(egress_update(&table, AF_INET, &has_egress, &egress) == 1 && !has_egress);
+    route_table_free(&table);
+}
+
+int
+main(void)
+{
+    check_example();
+    check_each_field();
+    check_sticky();
+    check_update();
+    printf("egress_selector_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the flight recorder: records come back in order and whole,
+ * the oldest are overwritten, concurrent writers never produce a torn
+ * record in a concurrent snapshot, and the dump is written on demand and
+ * when the process crashes, even from a stack overflow. Reports the
+ * cost of a record.
+ *
+ *  cc -O2 -Wall -o flight_recorder_check flight_recorder_check.c harness.c \
+ *      ../NetworkInterface/flight_recorder.c ../NetworkInterface/netif_stats.c -lpthread
+ */
+
+#include "harness.h"
+
+#include "../NetworkInterface/flight_recorder.h"
+#include "../NetworkInterface/netif_stats.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define NTHREADS        4
+#define PER_THREAD      200000
+
+static struct flight_record records[FLIGHT_RECORDER_CAPACITY];
+static atomic_int writing;
+static uint64_t torn;
+
+/* Every field derives from the thread and the record number */
+static void
+record_numbered(uint32_t thread, uint32_t n)
+{
+    uint64_t data[2] = { (uint64_t)thread << 32 | n, ~((uint64_t)thread << 32 | n) };
+
+    flight_recorder_record(FLIGHT_INTERFACE, n, thread, data, sizeof(data), n ^ thread);
+}
+
+static int
+record_whole(const struct flight_record *r)
+{
+    uint64_t data[2];
+
+    memcpy(data, r->data, sizeof(data));
+    return r->event == FLIGHT_INTERFACE && data[0] == ((uint64_t)r->aux << 32 | r->ifindex) &&
+           data[1] == ~data[0] && r->latency_ns == (r->ifindex ^ r->aux);
+}
+
+static void *
+writer(void *arg)
+{
+    uint32_t thread = (uint32_t)(uintptr_t)arg, n;
+
+    for (n = 0; n < PER_THREAD; n++) {
+        record_numbered(thread, n);
+    }
+    atomic_fetch_sub(&writing, 1);
+    return NULL;
+}
+
+static void
+check_order(void)
+{
+    struct flight_path_state path = { 1, FLIGHT_PATH_DNS | FLIGHT_PATH_IPV4, 1, 0, 3, 0, 7, 4 };
+    uint8_t gateway[16] = { 192, 168, 1, 1 };
+    uint64_t before;
+    size_t count, i;
+
+    flight_recorder_reset();
+    before = netif_stats_now();
+    flight_recorder_path_update(&path, 1500);
+    flight_recorder_record(FLIGHT_EGRESS, 4, AF_INET | 3 << 8, gateway, sizeof(gateway), 31250);
+    flight_recorder_record(FLIGHT_INTERFACE, 4, 0, "en0", 3, 800);
+
+    count = flight_recorder_snapshot(records, FLIGHT_RECORDER_CAPACITY);
+    CHECK(count == 3 && flight_recorder_count() == 3);
+    CHECK(records[0].seq == 0 && records[0].event == FLIGHT_PATH_UPDATE);
+    CHECK(records[0].ifindex == 4 && records[0].aux == 7 && records[0].latency_ns == 1500);
+    CHECK(memcmp(records[0].data, &path, sizeof(path)) == 0);
+    CHECK(records[1].seq == 1 && records[1].event == FLIGHT_EGRESS && records[1].aux >> 8 == 3);
+    CHECK(memcmp(records[1].data, gateway, 16) == 0);
+    CHECK(records[2].seq == 2 && memcmp(records[2].data, "en0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) == 0);
+    for (i = 0; i < count; i++) {
+        CHECK(records[i].time_ns >= before && (i == 0 || records[i].time_ns >= records[i - 1].time_ns));
+    }
+    // The latest only
+    CHECK(flight_recorder_snapshot(records, 1) == 1 && records[0].seq == 2);
+
+    // Saturated latency
+    flight_recorder_record(FLIGHT_EGRESS, 0, 0, NULL, 0, UINT64_MAX);
+    CHECK(flight_recorder_snapshot(records, 1) == 1 && records[0].latency_ns == UINT32_MAX);
+}
+
+static void
+check_overwrite(void)
+{
+    size_t count, i;
+
+    flight_recorder_reset();
+    for (i = 0; i < FLIGHT_RECORDER_CAPACITY * 3 + 5; i++) {
+        record_numbered(0, (uint32_t)i);
+    }
+    count = flight_recorder_snapshot(records, FLIGHT_RECORDER_CAPACITY);
+    CHECK(count == FLIGHT_RECORDER_CAPACITY);
+    for (i = 0; i < count; i++) {
+        CHECK(records[i].seq == FLIGHT_RECORDER_CAPACITY * 2 + 5 + i && records[i].ifindex == records[i].seq);
+    }
+}
+
+static void
+check_concurrent(void)
+{
+    pthread_t threads[NTHREADS];
+    uint64_t snapshots = 0, dropped;
+    size_t count, i;
+    uintptr_t t;
+
+    flight_recorder_reset();
+    dropped = netif_stats_counter(NETIF_FLIGHT_RECORDS_DROPPED);
+    atomic_store(&writing, NTHREADS);
+    for (t = 0; t < NTHREADS; t++) {
+        if (pthread_create(&threads[t], NULL, writer, (void *)t) != 0) {
+            err(1, "pthread_create");
+        }
+    }
+    // Snapshots taken while the writers lap the ring
+    while (atomic_load(&writing) > 0) {
+        count = flight_recorder_snapshot(records, FLIGHT_RECORDER_CAPACITY);
+        for (i = 0; i < count; i++) {
+            torn += !record_whole(&records[i]) || (i > 0 && records[i].seq <= records[i - 1].seq);
+        }
+        snapshots++;
+    }
+    for (t = 0; t < NTHREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    CHECK(torn == 0);
+    CHECK(flight_recorder_count() == (uint64_t)NTHREADS * PER_THREAD);
+
+    // Once quiet, the ring is full of whole records, less any dropped
+    dropped = netif_stats_counter(NETIF_FLIGHT_RECORDS_DROPPED) - dropped;
+    count = flight_recorder_snapshot(records, FLIGHT_RECORDER_CAPACITY);
+    CHECK(count + dropped >= FLIGHT_RECORDER_CAPACITY && count <= FLIGHT_RECORDER_CAPACITY);
+    for (i = 0; i < count; i++) {
+        CHECK(record_whole(&records[i]));
+    }
+    printf("%d writers: %llu snapshots, %llu records dropped\n", NTHREADS,
+           (unsigned long long)snapshots, (unsigned long long)dropped);
+}
+
+/* Reads everything from `fd` into `buf` */
+static size_t
+read_all(int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+    ssize_t n;
+
+    while (len < size - 1 && (n = read(fd, buf + len, size - 1 - len)) > 0) {
+        len += (size_t)n;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static void
+check_dump(void)
+{
+    struct flight_path_state path = { 1, FLIGHT_PATH_IPV4, 1, 0, 2, 0, 9, 4 };
+    uint8_t gateway[16] = { 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+    char buf[4096];
+    int fds[2];
+
+    flight_recorder_reset();
+    flight_recorder_path_update(&path, 250000000);
+    flight_recorder_record(FLIGHT_EGRESS, 4, AF_INET6 | 1 << 8, gateway, sizeof(gateway), 31250);
+    flight_recorder_record(FLIGHT_EGRESS, 0, 0, NULL, 0, 100);
+    flight_recorder_record(FLIGHT_INTERFACE, 4, 0x1043, "en0", 3, 800);
+    if (pipe(fds) != 0) {
+        err(1, "pipe");
+    }
+    CHECK(flight_recorder_dump(fds[1]) == 4);
+    close(fds[1]);
+    read_all(fds[0], buf, sizeof(buf));
+    close(fds[0]);
+    CHECK(strstr(buf, "0 ") == buf);
+    CHECK(strstr(buf, " path if=4 lat=250000000 status=1 flags=0x8 type=1 reason=0 interfaces=2 count=9\n"));
+    CHECK(strstr(buf, " egress if=4 lat=31250 gateway=fe80:0:0:0:0:0:0:1 reason=1\n"));
+    CHECK(strstr(buf, "\n2 ") && strstr(buf, " egress if=0 lat=100 gateway=none reason=0\n"));
+    CHECK(strstr(buf, "\n3 ") && strstr(buf, " interface if=4 lat=800 name=en0 flags=0x1043\n"));
+}
+
+static volatile int overflow_depth = -1;
+
+/* Recurses until the stack runs out */
+static int
+overflow(int depth)
+{
+    volatile char frame[1024];
+
+    frame[0] = (char)depth;
+    if (depth == overflow_depth) {
+        return 0;
+    }
+    return overflow(depth + 1) + frame[0];
+}
+
+/* Crashes with SIGSEGV, from a stack overflow when `stack` is set */
+static void
+check_crash(int stack)
+{
+    uint8_t gateway[16] = { 10, 0, 0, 1 };
+    char buf[4096];
+    int fds[2], status;
+    pid_t pid;
+
+    if (pipe(fds) != 0) {
+        err(1, "pipe");
+    }
+    if ((pid = fork()) == 0) {
+        close(fds[0]);
+        flight_recorder_reset();
+        flight_recorder_record(FLIGHT_EGRESS, 2, AF_INET, gateway, sizeof(gateway), 10);
+        if (flight_recorder_install_crash_handler(fds[1]) != 0 ||
+            flight_recorder_install_crash_handler(fds[1]) != 0) {
+            _exit(2);
+        }
+        if (stack) {
+            overflow(0);
+        } else {
+            raise(SIGSEGV);
+        }
+        _exit(3);
+    }
+    close(fds[1]);
+    read_all(fds[0], buf, sizeof(buf));
+    close(fds[0]);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    // The dump, then the default action
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    CHECK(strstr(buf, " egress if=2 lat=10 gateway=10.0.0.1 reason=0\n") != NULL);
+}
+
+static void
+report_cost(void)
+{
+    uint64_t start, elapsed;
+    uint32_t n;
+
+    flight_recorder_reset();
+    start = netif_stats_now();
+    for (n = 0; n < 1000000; n++) {
+        record_numbered(0, n);
+    }
+    elapsed = netif_stats_now() - start;
+    printf("record: %.1f ns\n", elapsed / 1e6);
+}
+
+int
+main(void)
+{
+    check_order();
+    check_overwrite();
+    check_concurrent();
+    check_dump();
+    check_crash(0);
+    check_crash(1);
+    report_cost();
+    printf("flight_recorder_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "harness.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <linux/if_tun.h>
+#endif
+
+int failures;
+
+double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+void
+set_sin(struct sockaddr *sa, const char *addr)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    inet_pton(AF_INET, addr, &sin->sin_addr);
+}
+
+#ifdef __linux__
+
+/* Runs an interface ioctl on a socket of the calling thread's namespace */
+static int
+ifreq_ioctl(unsigned long request, struct ifreq *ifr)
+{
+    int sock, rc;
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    rc = ioctl(sock, request, ifr);
+    close(sock);
+    return rc;
+}
+
+int
+set_flags(const char *name, short set, short clear)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ifreq_ioctl(SIOCGIFFLAGS, &ifr) != 0) {
+        return -1;
+    }
+    ifr.ifr_flags = (short)((ifr.ifr_flags | set) & ~clear);
+    return ifreq_ioctl(SIOCSIFFLAGS, &ifr);
+}
+
+int
+add_tun(const char *name, const char *addr)
+{
+    struct ifreq ifr;
+    int fd;
+
+    if ((fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) != 0) {
+        close(fd);
+        return -1;
+    }
+    set_sin(&ifr.ifr_addr, addr);
+    if (ifreq_ioctl(SIOCSIFADDR, &ifr) != 0) {
+        close(fd);
+        return -1;
+    }
+    set_sin(&ifr.ifr_netmask, "255.255.255.0");
+    if (ifreq_ioctl(SIOCSIFNETMASK, &ifr) != 0 || set_flags(name, IFF_UP, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+#endif
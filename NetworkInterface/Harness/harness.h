@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Helpers shared by the harnesses: the CHECK macro and the failure count
+ * it keeps, a monotonic clock, and on Linux the tun interfaces the
+ * monitors and resolvers are run against.
+ */
+
+#ifndef harness_h
+#define harness_h
+
+#include <err.h>
+#include <sys/socket.h>
+
+/* Checks failed so far; a harness reports FAILED when not 0 */
+extern int failures;
+
+#define CHECK(cond) \
+do { if (!(cond)) { warnx("check failed: %s (line %d)", #cond, __LINE__); failures++; } } while (0)
+
+/* CLOCK_MONOTONIC in nanoseconds */
+double
+now_ns(void);
+
+/* Fills `sa` with the IPv4 address `addr` */
+void
+set_sin(struct sockaddr *sa, const char *addr);
+
+#ifdef __linux__
+
+/* Sets the IFF_* `set` flags of interface `name` and clears `clear`. Returns 0 or -1. */
+int
+set_flags(const char *name, short set, short clear);
+
+/*
+ * Creates tun interface `name` with `addr`/24 and brings it up, in the
+ * calling thread's network namespace. Returns its fd (closing it
+ * removes the interface) or -1.
+ */
+int
+add_tun(const char *name, const char *addr);
+
+#endif
+
+#endif /* harness_h */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the interface registry against getifaddrs() and if_nametoindex()
+ * on the host, and compares the cost of a registry lookup with the
+ * getifaddrs() scan it replaces.
+ *
+ *  cc -O2 -Wall -o interface_registry_check interface_registry_check.c harness.c \
+ *      ../NetworkInterface/interface_registry.c ../NetworkInterface/flight_recorder.c \
+ *      ../NetworkInterface/netif_stats.c -lpthread
+ */
+
+#include "harness.h"
+
+#include "../NetworkInterface/interface_registry.h"
+
+#include <err.h>
+#include <ifaddrs.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/* The lookup interfaceIsActiveAndNotLoopback() used to make on every call */
+static int
+scan_getifaddrs(const char *name)
+{
+    struct ifaddrs *ifaddrs, *ifa;
+    int active = 0;
+
+    if (getifaddrs(&ifaddrs) != 0) {
+        return 0;
+    }
+    for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+        if ((ifa->ifa_flags & IFF_UP) && !(ifa->ifa_flags & IFF_LOOPBACK) &&
+            ifa->ifa_addr && (ifa->ifa_addr->sa_family == AF_INET || ifa->ifa_addr->sa_family == AF_INET6) &&
+            ifa->ifa_name && strcmp(name, ifa->ifa_name) == 0) {
+            active = 1;
+            break;
+        }
+    }
+    freeifaddrs(ifaddrs);
+    return active;
+}
+
+int
+main(void)
+{
+    struct interface_registry registry;
+    struct ifaddrs *ifaddrs, *ifa;
+    const struct interface_info *active = NULL;
+    char name[IFNAMSIZ];
+    size_t i;
+    int iterations = 20000, hits = 0;
+    double t0, registry_ns, scan_ns;
+
+    if (interface_registry_open(&registry) != 0) {
+        err(1, "interface_registry_open");
+    }
+    CHECK(registry.count > 0);
+    CHECK(interface_registry_by_name(&registry, "no-such-interface") == NULL);
+    CHECK(interface_registry_by_index(&registry, 0) == NULL);
+    CHECK(interface_registry_by_index(&registry, 1u << 30) == NULL);
+
+    // Every interface is found by name and index and agrees with the kernel
+    for (i = 0; i < registry.count; i++) {
+        const struct interface_info *info = &registry.interfaces[i];
+        CHECK(interface_registry_by_name(&registry, info->name) == info);
+        CHECK(info->index == if_nametoindex(info->name));
+        CHECK(interface_registry_by_index(&registry, info->index) == info);
+        CHECK(interface_registry_is_active(&registry, info) == scan_getifaddrs(info->name));
+        if (active == NULL && interface_registry_is_active(&registry, info)) {
+            active = info;
+        }
+        printf("%-*s index %u flags 0x%x addresses %lu%s\n", IFNAMSIZ, info->name, info->index,
+               info->flags, (unsigned long)info->naddresses,
+               interface_registry_is_active(&registry, info) ? " active" : "");
+    }
+
+    // Every IPv4 and IPv6 address is attached to its interface
+    if (getifaddrs(&ifaddrs) == 0) {
+        size_t naddresses = 0;
+        for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+            if (ifa->ifa_name && ifa->ifa_addr &&
+                (ifa->ifa_addr->sa_family == AF_INET || ifa->ifa_addr->sa_family == AF_INET6)) {
+                naddresses++;
+            }
+        }
+        CHECK(naddresses == registry.naddresses);
+        freeifaddrs(ifaddrs);
+    }
+
+    // No events arrived, so processing does not refresh
+    CHECK(interface_registry_process(&registry) == 0);
+    CHECK(registry.generation == 1);
+
+    CHECK(interface_name_for_index(registry.interfaces[0].index, name) == 1);
+    CHECK(strcmp(name, registry.interfaces[0].name) == 0);
+
+    if (active) {
+        t0 = now_ns();
+        for (i = 0; i < (size_t)iterations; i++) {
+            hits += interface_is_active_and_not_loopback(active->name);
+        }
+        registry_ns = (now_ns() - t0) / iterations;
+        t0 = now_ns();
+        for (i = 0; i < (size_t)iterations / 100; i++) {
+            hits += scan_getifaddrs(active->name);
+        }
+        scan_ns = (now_ns() - t0) / (iterations / 100);
+        CHECK(hits == iterations + iterations / 100);
+        printf("is active (%s): registry %.0f ns/call, getifaddrs %.0f ns/call\n", active->name,
+               registry_ns, scan_ns);
+    }
+
+    interface_registry_close(&registry);
+    printf("interface_registry_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the batched interface table against getifaddrs() and
+ * if_nametoindex() on the host and reports the cost of a full scan.
+ *
+ *  cc -O2 -Wall -o interface_table_check interface_table_check.c harness.c \
+ *      ../NetworkInterface/interface_table.c ../NetworkInterface/route_netlink.c \
+ *      ../NetworkInterface/route_table.c ../NetworkInterface/route_dump.c \
+ *      ../NetworkInterface/netif_stats.c
+ */
+
+#include "harness.h"
+
+#include "../NetworkInterface/interface_table.h"
+
+#include <err.h>
+#include <ifaddrs.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* Returns 1 if `table` holds the address of `ifa` under the right link */
+static int
+has_address(const struct interface_table *table, const struct ifaddrs *ifa)
+{
+    long pos = interface_table_find(table, if_nametoindex(ifa->ifa_name));
+    const void *addr;
+    size_t alen;
+    uint32_t a;
+
+    if (pos < 0) {
+        return 0;
+    }
+    if (ifa->ifa_addr->sa_family == AF_INET) {
+        addr = &((const struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+        alen = 4;
+    } else {
+        addr = &((const struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+        alen = 16;
+    }
+    for (a = table->addr_first[pos]; a < table->addr_first[pos] + table->addr_count[pos]; a++) {
+        if (table->addr_family[a] == ifa->ifa_addr->sa_family && memcmp(table->addr[a], addr, alen) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+main(void)
+{
+    struct interface_table table;
+    struct ifaddrs *ifaddrs, *ifa;
+    size_t i, naddrs = 0;
+    int iterations = 2000;
+    double t0;
+
+    interface_table_init(&table);
+    CHECK(interface_table_load(&table) > 0);
+    CHECK(table.sorted);
+
+    for (i = 0; i < table.count; i++) {
+        CHECK(table.index[i] == if_nametoindex(table.name[i]));
+        CHECK(interface_table_find(&table, table.index[i]) == (long)i);
+        printf("%-*s index %u flags 0x%x mtu %u addresses %u\n", IFNAMSIZ, table.name[i],
+               table.index[i], table.flags[i], table.mtu[i], table.addr_count[i]);
+    }
+    CHECK(interface_table_find(&table, 0) == -1);
+    for (i = 0; i < table.naddrs; i++) {
+        CHECK(table.addr_link[i] < table.count);
+        CHECK(i >= table.addr_first[table.addr_link[i]]);
+        CHECK(i < table.addr_first[table.addr_link[i]] + table.addr_count[table.addr_link[i]]);
+    }
+
+    if (getifaddrs(&ifaddrs) != 0) {
+        err(1, "getifaddrs");
+    }
+    for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_name && ifa->ifa_addr &&
+            (ifa->ifa_addr->sa_family == AF_INET || ifa->ifa_addr->sa_family == AF_INET6)) {
+            CHECK(has_address(&table, ifa));
+            naddrs++;
+        }
+    }
+    freeifaddrs(ifaddrs);
+    CHECK(naddrs == table.naddrs);
+
+    // Reloading reuses the table's storage
+    t0 = now_ns();
+    for (i = 0; i < (size_t)iterations; i++) {
+        CHECK(interface_table_load(&table) >= 0);
+    }
+    printf("%lu links, %lu addresses: %.1f us per scan\n", (unsigned long)table.count,
+           (unsigned long)table.naddrs, (now_ns() - t0) / iterations / 1000);
+
+    interface_table_free(&table);
+    printf("interface_table_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Drives monitor_core from a caller-owned epoll loop on one thread, in a
+ * private network namespace (Linux, needs CAP_SYS_ADMIN and /dev/net/tun):
+ * interfaces and default routes are added and removed, and each change
+ * must wake the loop and be reported by monitor_core_process(). A
+ * standalone route tracker must decode ECMP routes and follow the
+ * routes Linux flushes silently when a link goes down.
+ *
+ *  cc -O2 -Wall -o monitor_core_check monitor_core_check.c harness.c \
+ *      ../NetworkInterface/monitor_core.c ../NetworkInterface/egress_selector.c \
+ *      ../NetworkInterface/interface_registry.c ../NetworkInterface/route_tracker.c \
+ *      ../NetworkInterface/route_netlink.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/flight_recorder.c \
+ *      ../NetworkInterface/netif_stats.c -lpthread
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+
+#include "../NetworkInterface/monitor_core.h"
+#include "../NetworkInterface/flight_recorder.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/route.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_tun.h>
+#include <linux/rtnetlink.h>
+
+static int sock = -1;
+
+/* Adds or deletes a default route through `gateway` on `dev` */
+static int
+default_route(unsigned long request, const char *gateway, char *dev, short metric)
+{
+    struct rtentry rt;
+
+    memset(&rt, 0, sizeof(rt));
+    set_sin(&rt.rt_dst, "0.0.0.0");
+    set_sin(&rt.rt_genmask, "0.0.0.0");
+    set_sin(&rt.rt_gateway, gateway);
+    rt.rt_flags = RTF_UP | RTF_GATEWAY;
+    rt.rt_dev = dev;
+    rt.rt_metric = (short)(metric + 1);     // the kernel stores rt_metric - 1
+    return ioctl(sock, request, &rt);
+}
+
+static int
+clear_flags(const char *name, short flags)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0) {
+        return -1;
+    }
+    ifr.ifr_flags &= (short)~flags;
+    return ioctl(sock, SIOCSIFFLAGS, &ifr);
+}
+
+static struct rtattr *
+add_attr(struct nlmsghdr *nlh, struct rtattr *rta, unsigned short type, const void *data, size_t len)
+{
+    rta->rta_type = type;
+    rta->rta_len = (unsigned short)RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len += RTA_ALIGN(rta->rta_len);
+    return (struct rtattr *)((char *)rta + RTA_ALIGN(rta->rta_len));
+}
+
+/*
+ * Adds IPv4 route `dst`/`prefixlen` of rtm_type `type` over netlink,
+ * through the `n` gateways on `ifindexes`: an ECMP route when n > 1.
+ */
+static int
+netlink_route(unsigned char type, const char *dst, int prefixlen, const char *const *gateways,
+              const unsigned *ifindexes, size_t n)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct rtmsg rtm;
+        char attrs[256];
+    } req;
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    struct rtattr *rta, *multipath;
+    struct rtnexthop *nh;
+    struct nlmsgerr *e;
+    uint8_t addr[4];
+    char reply[256];
+    int fd, rc = -1;
+    size_t i;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm));
+    req.nlh.nlmsg_type = RTM_NEWROUTE;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL;
+    req.rtm.rtm_family = AF_INET;
+    req.rtm.rtm_dst_len = (unsigned char)prefixlen;
+    req.rtm.rtm_table = RT_TABLE_MAIN;
+    req.rtm.rtm_protocol = RTPROT_STATIC;
+    req.rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+    req.rtm.rtm_type = type;
+
+    inet_pton(AF_INET, dst, addr);
+    rta = add_attr(&req.nlh, (struct rtattr *)req.attrs, RTA_DST, addr, 4);
+    if (n == 1) {
+        inet_pton(AF_INET, gateways[0], addr);
+        rta = add_attr(&req.nlh, rta, RTA_GATEWAY, addr, 4);
+        rta = add_attr(&req.nlh, rta, RTA_OIF, &ifindexes[0], 4);
+    } else if (n > 1) {
+        multipath = rta;
+        multipath->rta_type = RTA_MULTIPATH;
+        nh = RTA_DATA(multipath);
+        for (i = 0; i < n; i++) {
+            memset(nh, 0, sizeof(*nh));
+            nh->rtnh_ifindex = (int)ifindexes[i];
+            inet_pton(AF_INET, gateways[i], addr);
+            rta = RTNH_DATA(nh);
+            rta->rta_type = RTA_GATEWAY;
+            rta->rta_len = RTA_LENGTH(4);
+            memcpy(RTA_DATA(rta), addr, 4);
+            nh->rtnh_len = (unsigned short)(RTNH_LENGTH(RTA_SPACE(4)));
+            nh = RTNH_NEXT(nh);
+        }
+        multipath->rta_len = (unsigned short)((char *)nh - (char *)multipath);
+        req.nlh.nlmsg_len += RTA_ALIGN(multipath->rta_len);
+    }
+
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        return -1;
+    }
+    if (sendto(fd, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) >= 0 &&
+        recv(fd, reply, sizeof(reply), 0) >= (ssize_t)NLMSG_LENGTH(sizeof(*e))) {
+        e = NLMSG_DATA((struct nlmsghdr *)reply);
+        if ((rc = e->error ? -1 : 0) != 0) {
+            errno = -e->error;
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+/* The tracked route to `dst`/`prefixlen`, or NULL */
+static const struct route_entry *
+find_route(const struct route_table *table, const char *dst, int prefixlen)
+{
+    uint8_t addr[4];
+    size_t i;
+
+    inet_pton(AF_INET, dst, addr);
+    for (i = 0; i < table->count; i++) {
+        const struct route_entry *e = &table->entries[i];
+        if (e->family == AF_INET && e->prefixlen == prefixlen && memcmp(e->dst, addr, 4) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Drains the tracker's fd for up to `ms` of quiet. Returns the changes applied. */
+static int
+drain_tracker(struct route_tracker *tracker, int ms)
+{
+    struct pollfd pfd = { tracker->fd, POLLIN, 0 };
+    int changes = 0, rc;
+
+    while (poll(&pfd, 1, ms) == 1) {
+        if ((rc = route_tracker_process(tracker)) < 0) {
+            warn("route_tracker_process");
+            return -1;
+        }
+        changes += rc;
+    }
+    return changes;
+}
+
+/*
+ * A standalone tracker decodes ECMP routes, and prunes the IPv4 routes
+ * the kernel flushes silently when a link goes down, but only those:
+ * not blackholes without an interface, not ECMP routes.
+ */
+static void
+check_tracker_links(unsigned tun0)
+{
+    const char *const gateways[] = { "10.9.2.2", "10.9.0.3" }, *const via[] = { "10.9.2.3" };
+    const uint8_t gateway[4] = { 10, 9, 2, 2 };
+    struct route_tracker tracker;
+    const struct route_entry *e;
+    unsigned ifindexes[2], tun2;
+    int tun2fd;
+
+    if ((tun2fd = add_tun("tun2", "10.9.2.1")) < 0) {
+        warn("tun2");
+        failures++;
+        return;
+    }
+    ifindexes[0] = tun2 = if_nametoindex("tun2");
+    ifindexes[1] = tun0;
+    if (route_tracker_open(&tracker) != 0) {
+        warn("route_tracker_open");
+        failures++;
+        close(tun2fd);
+        return;
+    }
+    CHECK(netlink_route(RTN_BLACKHOLE, "10.66.0.0", 16, NULL, NULL, 0) == 0);
+    CHECK(netlink_route(RTN_UNICAST, "10.77.0.0", 16, gateways, ifindexes, 2) == 0);
+    CHECK(netlink_route(RTN_UNICAST, "10.88.0.0", 16, via, ifindexes, 1) == 0);
+    CHECK(drain_tracker(&tracker, 200) >= 3);
+
+    CHECK((e = find_route(&tracker.table, "10.66.0.0", 16)) != NULL && e->ifindex == 0 &&
+          (e->flags & ROUTE_F_REJECT));
+    CHECK((e = find_route(&tracker.table, "10.77.0.0", 16)) != NULL && e->ifindex == tun2 &&
+          (e->flags & ROUTE_F_MULTIPATH) && e->gateway_family == AF_INET &&
+          memcmp(e->gateway, gateway, 4) == 0);
+    CHECK(find_route(&tracker.table, "10.88.0.0", 16) != NULL);
+
+    // Down: the kernel flushes 10.88/16 without a word, keeps the others
+    CHECK(clear_flags("tun2", IFF_UP) == 0);
+    CHECK(drain_tracker(&tracker, 200) > 0);
+    CHECK(find_route(&tracker.table, "10.88.0.0", 16) == NULL);
+    CHECK(find_route(&tracker.table, "10.66.0.0", 16) != NULL);
+    CHECK(find_route(&tracker.table, "10.77.0.0", 16) != NULL);
+
+    route_tracker_close(&tracker);
+    close(tun2fd);
+}
+
+/*
+ * Waits up to one second for the core's fd to become readable and
+ * processes it, accumulating the changes reported until the fd is idle.
+ */
+static int
+wait_changes(int epfd, struct monitor_core *core)
+{
+    struct epoll_event ev;
+    int changes = 0, rc, timeout = 1000;
+
+    while (epoll_wait(epfd, &ev, 1, timeout) == 1) {
+        if ((rc = monitor_core_process(core)) < 0) {
+            warn("monitor_core_process");
+            return -1;
+        }
+        changes |= rc;
+        timeout = 50;           // related notifications arrive together
+    }
+    return changes;
+}
+
+static int
+thread_count(void)
+{
+    struct dirent *d;
+    DIR *dir = opendir("/proc/self/task");
+    int n = 0;
+
+    while (dir && (d = readdir(dir)) != NULL) {
+        n += d->d_name[0] != '.';
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return n;
+}
+
+/* Position of the first record matching, or -1. Only the `mask` bits of aux are compared. */
+static long
+find_record(const struct flight_record *records, size_t count, uint16_t event,
+            unsigned ifindex, uint32_t mask, uint32_t aux, const char *data)
+{
+    uint8_t expected[16] = { 0 };
+    size_t from;
+
+    if (data) {
+        memcpy(expected, data, strlen(data));
+    }
+    for (from = 0; from < count; from++) {
+        if (records[from].event == event && records[from].ifindex == ifindex &&
+            (records[from].aux & mask) == aux && (data == NULL || memcmp(records[from].data, expected, 16) == 0)) {
+            return (long)from;
+        }
+    }
+    return -1;
+}
+
+static void
+check_flight_records(unsigned tun0, unsigned tun1)
+{
+    static struct flight_record records[FLIGHT_RECORDER_CAPACITY];
+    const uint8_t gateway0[4] = { 10, 9, 0, 2 }, gateway1[4] = { 10, 9, 1, 2 };
+    size_t count = flight_recorder_snapshot(records, FLIGHT_RECORDER_CAPACITY);
+    long up0, egress0, egress1, down1, none;
+
+    up0 = find_record(records, count, FLIGHT_INTERFACE, tun0, IFF_UP, IFF_UP, "tun0");
+    egress0 = find_record(records, count, FLIGHT_EGRESS, tun0, ~0u, AF_INET | EGRESS_ONLY_CANDIDATE << 8, NULL);
+    egress1 = find_record(records, count, FLIGHT_EGRESS, tun1, ~0u, AF_INET | EGRESS_PRIORITY << 8, NULL);
+    down1 = find_record(records, count, FLIGHT_INTERFACE, tun1, ~0u, 0, "tun1");
+    none = find_record(records, count, FLIGHT_EGRESS, 0, ~0u, 0, NULL);
+    CHECK(up0 >= 0 && egress0 > up0 && egress1 > egress0 && down1 > egress1 && none > egress1);
+    CHECK(egress0 >= 0 && memcmp(records[egress0].data, gateway0, 4) == 0);
+    CHECK(egress1 >= 0 && memcmp(records[egress1].data, gateway1, 4) == 0);
+}
+
+int
+main(void)
+{
+    struct monitor_core core;
+    struct epoll_event ev;
+    unsigned tun0, tun1;
+    int epfd, tun0fd, tun1fd, changes;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        warn("unshare(CLONE_NEWNET) (skipping)");
+        printf("monitor_core_check: OK\n");
+        return 0;
+    }
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 || set_flags("lo", IFF_UP, 0) != 0) {
+        err(1, "loopback");
+    }
+
+    if (monitor_core_open(&core, AF_INET) != 0) {
+        err(1, "monitor_core_open");
+    }
+    CHECK(!core.has_egress);
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        err(1, "epoll_create1");
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    CHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, core.fd, &ev) == 0);
+    CHECK(epoll_wait(epfd, &ev, 1, 0) == 0);
+
+    // A new interface: link, address and its prefix route
+    if ((tun0fd = add_tun("tun0", "10.9.0.1")) < 0) {
+        warn("/dev/net/tun (skipping)");
+        monitor_core_close(&core);
+        printf("monitor_core_check: OK\n");
+        return 0;
+    }
+    tun0 = if_nametoindex("tun0");
+    changes = wait_changes(epfd, &core);
+    CHECK(changes == (MONITOR_INTERFACES | MONITOR_ROUTES));
+    CHECK(interface_registry_by_name(&core.interfaces, "tun0") != NULL);
+
+    // A default route becomes the egress
+    CHECK(default_route(SIOCADDRT, "10.9.0.2", "tun0", 200) == 0);
+    changes = wait_changes(epfd, &core);
+    CHECK(changes == (MONITOR_ROUTES | MONITOR_EGRESS));
+    CHECK(core.has_egress && core.egress.route.ifindex == tun0);
+    CHECK(core.egress.reason == EGRESS_ONLY_CANDIDATE);
+
+    // A route without an interface must outlive every link change below
+    CHECK(netlink_route(RTN_BLACKHOLE, "10.55.0.0", 16, NULL, NULL, 0) == 0);
+    CHECK(wait_changes(epfd, &core) == MONITOR_ROUTES);
+
+    // A second default with a lower metric takes over
+    CHECK((tun1fd = add_tun("tun1", "10.9.1.1")) >= 0);
+    tun1 = if_nametoindex("tun1");
+    CHECK(wait_changes(epfd, &core) == (MONITOR_INTERFACES | MONITOR_ROUTES));
+    CHECK(default_route(SIOCADDRT, "10.9.1.2", "tun1", 100) == 0);
+    CHECK(wait_changes(epfd, &core) == (MONITOR_ROUTES | MONITOR_EGRESS));
+    CHECK(core.has_egress && core.egress.route.ifindex == tun1);
+    CHECK(core.egress.reason == EGRESS_PRIORITY && core.egress.runner_up.ifindex == tun0);
+
+    // Routes that do not affect the egress
+    CHECK(default_route(SIOCDELRT, "10.9.0.2", "tun0", 200) == 0);
+    CHECK(wait_changes(epfd, &core) == MONITOR_ROUTES);
+    CHECK(core.has_egress && core.egress.route.ifindex == tun1);
+
+    // Losing the interface takes its routes and the egress with it
+    close(tun1fd);
+    CHECK(wait_changes(epfd, &core) == (MONITOR_INTERFACES | MONITOR_ROUTES | MONITOR_EGRESS));
+    CHECK(!core.has_egress);
+    CHECK(interface_registry_by_name(&core.interfaces, "tun1") == NULL);
+    CHECK(find_route(&core.routes.table, "10.55.0.0", 16) != NULL);
+
+    // The flight recorder has the egress changes and the flaps, in order
+    check_flight_records(tun0, tun1);
+
+    check_tracker_links(tun0);
+    wait_changes(epfd, &core);
+    CHECK(find_route(&core.routes.table, "10.55.0.0", 16) != NULL);
+
+    // Idle again, and everything happened on this thread
+    CHECK(epoll_wait(epfd, &ev, 1, 0) == 0);
+    CHECK(monitor_core_process(&core) == 0);
+    CHECK(thread_count() == 1);
+    printf("%llu wakeups, %llu route events\n", (unsigned long long)core.wakeups,
+           (unsigned long long)core.routes.events);
+
+    close(tun0fd);
+    close(epfd);
+    monitor_core_close(&core);
+    printf("monitor_core_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
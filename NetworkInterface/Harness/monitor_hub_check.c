@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the monitor hub in a private network namespace (Linux, needs
+ * CAP_SYS_ADMIN and /dev/net/tun): every subscriber receives the same
+ * update for a change, built once; a subscriber that never reads only
+ * keeps the newest updates; a consumer thread reading during route
+ * churn sees strictly increasing versions ending with the latest.
+ * Reports the time from an update being built to the last of many
+ * subscribers having it.
+ *
+ *  cc -O2 -Wall -o monitor_hub_check monitor_hub_check.c harness.c \
+ *      ../NetworkInterface/monitor_hub.c ../NetworkInterface/monitor_core.c \
+ *      ../NetworkInterface/egress_selector.c ../NetworkInterface/interface_registry.c \
+ *      ../NetworkInterface/route_tracker.c ../NetworkInterface/route_netlink.c \
+ *      ../NetworkInterface/route_compact.c ../NetworkInterface/route_arena.c \
+ *      ../NetworkInterface/route_table.c ../NetworkInterface/route_dump.c \
+ *      ../NetworkInterface/flight_recorder.c ../NetworkInterface/netif_stats.c -lpthread
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+
+#include "../NetworkInterface/monitor_hub.h"
+#include "../NetworkInterface/netif_stats.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/route.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_tun.h>
+
+#define SUBSCRIBERS 5
+#define FANOUT      200
+#define CHURN       500
+
+static int sock = -1;
+
+/* Adds or deletes a default route through `gateway` on `dev` */
+static int
+default_route(unsigned long request, const char *gateway, char *dev)
+{
+    struct rtentry rt;
+
+    memset(&rt, 0, sizeof(rt));
+    set_sin(&rt.rt_dst, "0.0.0.0");
+    set_sin(&rt.rt_genmask, "0.0.0.0");
+    set_sin(&rt.rt_gateway, gateway);
+    rt.rt_flags = RTF_UP | RTF_GATEWAY;
+    rt.rt_dev = dev;
+    return ioctl(sock, request, &rt);
+}
+
+/*
+ * Waits up to a second for an update on `sub` and returns the newest
+ * pending one, releasing the others.
+ */
+static struct monitor_update *
+wait_update(struct monitor_subscriber *sub)
+{
+    struct pollfd pfd = { .fd = sub->fd, .events = POLLIN };
+    struct monitor_update *u, *newest = NULL;
+
+    if (poll(&pfd, 1, 1000) != 1) {
+        return NULL;
+    }
+    while ((u = monitor_subscriber_next(sub)) != NULL) {
+        monitor_update_release(newest);
+        newest = u;
+    }
+    return newest;
+}
+
+/* Waits until `sub` reports an egress on `ifindex`, or none when 0 */
+static struct monitor_update *
+wait_egress(struct monitor_subscriber *sub, unsigned ifindex)
+{
+    struct monitor_update *u;
+
+    while ((u = wait_update(sub)) != NULL) {
+        if (ifindex ? u->has_egress && u->egress.route.ifindex == ifindex : !u->has_egress) {
+            return u;
+        }
+        monitor_update_release(u);
+    }
+    return NULL;
+}
+
+static void
+check_fanout(struct monitor_hub *hub, unsigned tun0)
+{
+    struct monitor_subscriber *subs[SUBSCRIBERS], *slow;
+    struct monitor_update *u[SUBSCRIBERS], *latest;
+    uint64_t version;
+    int i, j;
+
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        subs[i] = monitor_hub_subscribe(hub, 8);
+        CHECK(subs[i] != NULL);
+    }
+    slow = monitor_hub_subscribe(hub, 2);
+
+    // The latest update is queued on subscription
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        u[i] = wait_update(subs[i]);
+        CHECK(u[i] != NULL && u[i] == u[0] && !u[i]->has_egress);
+        CHECK(monitor_subscriber_next(subs[i]) == NULL);
+    }
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        monitor_update_release(u[i]);
+    }
+
+    // One change, built once: every subscriber gets the same update
+    version = hub->version;
+    CHECK(default_route(SIOCADDRT, "10.9.0.2", "tun0") == 0);
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        u[i] = wait_egress(subs[i], tun0);
+        CHECK(u[i] != NULL && u[i] == u[0]);
+    }
+    CHECK(u[0] && (u[0]->changes & MONITOR_EGRESS) && u[0]->version == hub->version);
+    CHECK(hub->version == version + 1);
+    CHECK(u[0] && u[0]->routes.count4 >= 1 && u[0]->ninterfaces >= 2);
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        monitor_update_release(u[i]);
+    }
+
+    // The slow subscriber never read: it holds the two newest updates
+    for (j = 0; j < 10; j++) {
+        CHECK(default_route(SIOCDELRT, "10.9.0.2", "tun0") == 0);
+        monitor_update_release(wait_egress(subs[0], 0));
+        CHECK(default_route(SIOCADDRT, "10.9.0.2", "tun0") == 0);
+        monitor_update_release(wait_egress(subs[0], tun0));
+    }
+    latest = monitor_hub_latest(hub);
+    u[0] = monitor_subscriber_next(slow);
+    u[1] = monitor_subscriber_next(slow);
+    CHECK(u[0] && u[1] && u[0]->version < u[1]->version && u[1] == latest);
+    CHECK(monitor_subscriber_next(slow) == NULL);
+    CHECK(atomic_load(&slow->dropped) >= 18);
+    printf("slow subscriber: %llu updates dropped, %llu delivered\n",
+           (unsigned long long)atomic_load(&slow->dropped),
+           (unsigned long long)atomic_load(&slow->delivered));
+    monitor_update_release(u[0]);
+    monitor_update_release(u[1]);
+    monitor_update_release(latest);
+
+    monitor_hub_unsubscribe(hub, slow);
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        monitor_hub_unsubscribe(hub, subs[i]);
+    }
+    CHECK(hub->nsubscribers == 0);
+}
+
+struct consumer {
+    struct monitor_subscriber *sub;
+    atomic_int done;
+    uint64_t last;
+    uint64_t received;
+    int out_of_order;
+};
+
+static void *
+consume(void *arg)
+{
+    struct consumer *c = arg;
+    struct pollfd pfd = { .fd = c->sub->fd, .events = POLLIN };
+    struct monitor_update *u;
+
+    for (;;) {
+        int done = atomic_load(&c->done);
+        while ((u = monitor_subscriber_next(c->sub)) != NULL) {
+            c->out_of_order += u->version <= c->last;
+            c->last = u->version;
+            c->received++;
+            monitor_update_release(u);
+        }
+        if (done) {
+            return NULL;
+        }
+        poll(&pfd, 1, 10);
+    }
+}
+
+static void
+check_churn(struct monitor_hub *hub)
+{
+    struct consumer c;
+    struct monitor_subscriber *waiter;
+    struct monitor_update *latest;
+    pthread_t thread;
+    uint64_t first;
+    int i;
+
+    memset(&c, 0, sizeof(c));
+    c.sub = monitor_hub_subscribe(hub, 4);
+    waiter = monitor_hub_subscribe(hub, 4);
+    monitor_update_release(wait_update(waiter));
+    first = hub->version;
+    pthread_create(&thread, NULL, consume, &c);
+    for (i = 0; i < CHURN; i++) {
+        default_route(i & 1 ? SIOCADDRT : SIOCDELRT, "10.9.0.2", "tun0");
+    }
+    // Wait for the last change: CHURN is even, so the route is back
+    monitor_update_release(wait_egress(waiter, if_nametoindex("tun0")));
+    atomic_store(&c.done, 1);
+    pthread_join(thread, NULL);
+
+    latest = monitor_hub_latest(hub);
+    printf("%d route changes: %llu updates built, %llu received, %llu dropped\n", CHURN,
+           (unsigned long long)(latest->version - first), (unsigned long long)c.received,
+           (unsigned long long)atomic_load(&c.sub->dropped));
+    CHECK(c.out_of_order == 0);
+    CHECK(c.last == latest->version);
+    monitor_update_release(latest);
+    monitor_hub_unsubscribe(hub, c.sub);
+    monitor_hub_unsubscribe(hub, waiter);
+}
+
+static void
+report_fanout(struct monitor_hub *hub)
+{
+    struct monitor_subscriber *subs[FANOUT];
+    struct monitor_update *u;
+    uint64_t received, slowest = 0;
+    int i;
+
+    for (i = 0; i < FANOUT; i++) {
+        subs[i] = monitor_hub_subscribe(hub, 4);
+        monitor_update_release(wait_update(subs[i]));
+    }
+    CHECK(default_route(SIOCDELRT, "10.9.0.2", "tun0") == 0);
+    for (i = 0; i < FANOUT; i++) {
+        u = wait_egress(subs[i], 0);
+        received = netif_stats_now();
+        CHECK(u != NULL);
+        if (u && received - u->time_ns > slowest) {
+            slowest = received - u->time_ns;
+        }
+        monitor_update_release(u);
+    }
+    printf("%d subscribers: last one had the update %.1f us after it was built\n",
+           FANOUT, slowest / 1e3);
+    for (i = 0; i < FANOUT; i++) {
+        monitor_hub_unsubscribe(hub, subs[i]);
+    }
+}
+
+int
+main(void)
+{
+    struct monitor_hub hub;
+    unsigned tun0;
+    int tunfd;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        warn("unshare(CLONE_NEWNET) (skipping)");
+        printf("monitor_hub_check: OK\n");
+        return 0;
+    }
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 || set_flags("lo", IFF_UP, 0) != 0) {
+        err(1, "loopback");
+    }
+    if ((tunfd = add_tun("tun0", "10.9.0.1")) < 0) {
+        warn("/dev/net/tun (skipping)");
+        printf("monitor_hub_check: OK\n");
+        return 0;
+    }
+    tun0 = if_nametoindex("tun0");
+    if (monitor_hub_start(&hub, AF_INET) != 0) {
+        err(1, "monitor_hub_start");
+    }
+    CHECK(hub.latest != NULL && hub.version == 1);
+
+    check_fanout(&hub, tun0);
+    check_churn(&hub);
+    report_fanout(&hub);
+
+    monitor_hub_stop(&hub);
+    close(tunfd);
+    printf("monitor_hub_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
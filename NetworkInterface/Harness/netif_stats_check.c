@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks netif_stats histograms and counters, their cost, and prints
+ * what the instrumented discovery paths record on this host.
+ *
+ *  cc -O2 -Wall -pthread -o netif_stats_check netif_stats_check.c harness.c \
+ *      ../NetworkInterface/netif_stats.c ../NetworkInterface/interface_table.c \
+ *      ../NetworkInterface/route_netlink.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_dump.c
+ */
+
+#include "harness.h"
+
+#include "../NetworkInterface/interface_table.h"
+#include "../NetworkInterface/netif_stats.h"
+#include "../NetworkInterface/route_table.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include "../NetworkInterface/route_netlink.h"
+#include <sys/socket.h>
+#endif
+
+#define THREADS     4
+#define PER_THREAD  1000000
+
+/* Returns 1 if `reported` is at least `value` and within 1/16 above it */
+static int
+close_to(uint64_t reported, uint64_t value)
+{
+    return reported >= value && reported - value <= value / 16;
+}
+
+static void
+check_histogram(void)
+{
+    struct netif_stats_summary s;
+    uint64_t v;
+
+    netif_stats_reset();
+    netif_stats_summary(NETIF_SYSCTL_DUMP_NS, &s);
+    CHECK(s.count == 0 && s.min == 0 && s.max == 0 && s.p99 == 0);
+
+    // 1..10000 us, uniformly
+    for (v = 1; v <= 10000; v++) {
+        netif_stats_record(NETIF_SYSCTL_DUMP_NS, v * 1000);
+    }
+    netif_stats_summary(NETIF_SYSCTL_DUMP_NS, &s);
+    CHECK(s.count == 10000);
+    CHECK(s.min == 1000 && s.max == 10000000);
+    CHECK(s.mean == 5000500);
+    CHECK(close_to(s.p50, 5000000));
+    CHECK(close_to(s.p90, 9000000));
+    CHECK(close_to(s.p99, 9900000));
+    CHECK(close_to(s.p999, 9990000));
+    CHECK(netif_stats_percentile(NETIF_SYSCTL_DUMP_NS, 100) == 10000000);
+
+    // Small values are exact and huge values are not lost
+    netif_stats_reset();
+    netif_stats_record(NETIF_GETIFADDRS_NS, 0);
+    netif_stats_record(NETIF_GETIFADDRS_NS, 7);
+    netif_stats_record(NETIF_GETIFADDRS_NS, UINT64_MAX);
+    netif_stats_summary(NETIF_GETIFADDRS_NS, &s);
+    CHECK(s.count == 3 && s.min == 0 && s.max == UINT64_MAX);
+    CHECK(netif_stats_percentile(NETIF_GETIFADDRS_NS, 50) == 7);
+    CHECK(netif_stats_percentile(NETIF_GETIFADDRS_NS, 100) == UINT64_MAX);
+}
+
+static void *
+record(void *arg)
+{
+    uint64_t i;
+
+    (void)arg;
+    for (i = 0; i < PER_THREAD; i++) {
+        netif_stats_record(NETIF_PATH_UPDATE_NS, i);
+        netif_stats_add(NETIF_PATH_UPDATES, 1);
+    }
+    return NULL;
+}
+
+static void
+check_threads(void)
+{
+    pthread_t threads[THREADS];
+    struct netif_stats_summary s;
+    uint64_t start, elapsed;
+    int i;
+
+    netif_stats_reset();
+    start = netif_stats_now();
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, record, NULL);
+    }
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = netif_stats_now() - start;
+    netif_stats_summary(NETIF_PATH_UPDATE_NS, &s);
+    CHECK(s.count == THREADS * PER_THREAD);
+    CHECK(netif_stats_counter(NETIF_PATH_UPDATES) == THREADS * PER_THREAD);
+    CHECK(s.min == 0 && s.max == PER_THREAD - 1);
+    printf("%d threads: %.1f ns per record and count\n", THREADS,
+           (double)elapsed / (THREADS * PER_THREAD));
+}
+
+static void
+check_format(void)
+{
+    char small[16], *buf;
+    size_t need;
+
+    netif_stats_reset();
+    netif_stats_add(NETIF_SYSCTL_RETRIES, 3);
+    netif_stats_record(NETIF_DEFAULT_GATEWAY_NS, 1500);
+
+    need = netif_stats_format(small, sizeof(small), NETIF_STATS_JSON);
+    CHECK(need > sizeof(small) && strlen(small) == sizeof(small) - 1);
+    buf = malloc(need + 1);
+    CHECK(netif_stats_format(buf, need + 1, NETIF_STATS_JSON) == need);
+    CHECK(strlen(buf) == need);
+    CHECK(strstr(buf, "\"sysctl_retries\":3") != NULL);
+    CHECK(strstr(buf, "\"default_gateway_ns\":{\"count\":1,\"min\":1500,") != NULL);
+    CHECK(buf[0] == '{' && buf[need - 1] == '}');
+    free(buf);
+
+    need = netif_stats_format(NULL, 0, NETIF_STATS_TEXT);
+    buf = malloc(need + 1);
+    netif_stats_format(buf, need + 1, NETIF_STATS_TEXT);
+    CHECK(strstr(buf, "sysctl_retries") != NULL && strstr(buf, "p99.9") != NULL);
+    free(buf);
+}
+
+/* Runs the instrumented discovery paths and prints what they recorded */
+static void
+show_host(void)
+{
+    struct interface_table table;
+    char buf[4096];
+    int i;
+
+    netif_stats_reset();
+    interface_table_init(&table);
+    for (i = 0; i < 100; i++) {
+        interface_table_load(&table);
+    }
+    interface_table_free(&table);
+#ifdef __linux__
+    {
+        struct route_table routes;
+        struct route_entry defaults[4];
+
+        route_table_init(&routes);
+        for (i = 0; i < 100; i++) {
+            route_netlink_load_table(&routes);
+            route_netlink_get_defaults(AF_INET, defaults, 4);
+        }
+        route_table_free(&routes);
+    }
+#endif
+    netif_stats_format(buf, sizeof(buf), NETIF_STATS_TEXT);
+    fputs(buf, stdout);
+}
+
+int
+main(void)
+{
+    check_histogram();
+    check_threads();
+    check_format();
+    show_host();
+    printf("netif_stats_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
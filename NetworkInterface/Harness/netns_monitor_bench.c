@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Measures the cost per namespace of monitoring 10 to N network
+ * namespaces from one thread (Linux, needs CAP_SYS_ADMIN): adding them,
+ * the initial synchronisation, heap held, and processing one gateway
+ * change in every namespace. Each namespace has lo and a default route
+ * over it.
+ *
+ *  cc -O2 -Wall -o netns_monitor_bench netns_monitor_bench.c harness.c \
+ *      ../NetworkInterface/netns_monitor.c ../NetworkInterface/egress_selector.c \
+ *      ../NetworkInterface/route_netlink.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/netif_stats.c
+ *
+ * Usage: netns_monitor_bench [max_namespaces]      (default 4000)
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+
+#include "../NetworkInterface/netns_monitor.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/route.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+static int self = -1;
+static size_t reported;
+
+static void
+on_change(struct netns_monitor *mon, struct netns_state *ns, int changes, void *ctx)
+{
+    (void)mon;
+    (void)ns;
+    (void)changes;
+    (void)ctx;
+    reported++;
+}
+
+/* Namespaces whose egress is via 127.0.0.`last` */
+static size_t
+count_egress(const struct netns_monitor *mon, int last)
+{
+    size_t i, count = 0;
+
+    for (i = 0; i < mon->count; i++) {
+        count += mon->namespaces[i]->has_egress && mon->namespaces[i]->egress.route.gateway[3] == last;
+    }
+    return count;
+}
+
+/*
+ * Processes until every namespace's egress is via 127.0.0.`last`;
+ * returns the time taken. `reported` counts the on_change calls.
+ */
+static double
+wait_egress(struct netns_monitor *mon, int last)
+{
+    struct pollfd pfd = { mon->fd, POLLIN, 0 };
+    double start = now_ns();
+
+    reported = 0;
+    while (count_egress(mon, last) < mon->count) {
+        if (poll(&pfd, 1, 5000) == 0) {
+            errx(1, "%zu of %zu namespaces updated", count_egress(mon, last), mon->count);
+        }
+        if (netns_monitor_process(mon) < 0) {
+            err(1, "netns_monitor_process");
+        }
+    }
+    return now_ns() - start;
+}
+
+/* Adds or deletes a default route over lo in the current namespace */
+static void
+lo_default_route(int sock, unsigned long request, const char *gateway)
+{
+    struct rtentry rt;
+
+    memset(&rt, 0, sizeof(rt));
+    set_sin(&rt.rt_dst, "0.0.0.0");
+    set_sin(&rt.rt_genmask, "0.0.0.0");
+    set_sin(&rt.rt_gateway, gateway);
+    rt.rt_flags = RTF_UP | RTF_GATEWAY;
+    rt.rt_dev = "lo";
+    if (ioctl(sock, request, &rt) != 0) {
+        err(1, "default route via %s", gateway);
+    }
+}
+
+/* A namespace with lo up and a default route via 127.0.0.2 */
+static int
+new_namespace(void)
+{
+    struct ifreq ifr;
+    int fd, sock;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        err(1, "unshare(CLONE_NEWNET)");
+    }
+    if ((fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC)) < 0 ||
+        (sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        err(1, "namespace");
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, "lo");
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0) {
+        err(1, "SIOCGIFFLAGS");
+    }
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(sock, SIOCSIFFLAGS, &ifr) != 0) {
+        err(1, "SIOCSIFFLAGS");
+    }
+    lo_default_route(sock, SIOCADDRT, "127.0.0.2");
+    close(sock);
+    if (setns(self, CLONE_NEWNET) != 0) {
+        err(1, "setns");
+    }
+    return fd;
+}
+
+/* Moves every namespace's default route to another gateway */
+static void
+change_gateways(const int *nsfds, size_t count, int round)
+{
+    char from[16], to[16];
+    size_t i;
+    int sock;
+
+    snprintf(from, sizeof(from), "127.0.0.%d", 2 + round);
+    snprintf(to, sizeof(to), "127.0.0.%d", 3 + round);
+    for (i = 0; i < count; i++) {
+        if (setns(nsfds[i], CLONE_NEWNET) != 0 ||
+            (sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+            err(1, "setns");
+        }
+        // Deleted first: the route table keeps one default per metric
+        lo_default_route(sock, SIOCDELRT, from);
+        lo_default_route(sock, SIOCADDRT, to);
+        close(sock);
+    }
+    if (setns(self, CLONE_NEWNET) != 0) {
+        err(1, "setns");
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct netns_monitor mon;
+    struct rlimit rl;
+    size_t max = argc > 1 ? strtoul(argv[1], NULL, 10) : 4000, n, i;
+    double start, add_ns, sync_ns, change_ns;
+    size_t heap;
+    int *nsfds;
+
+    if ((self = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC)) < 0) {
+        err(1, "open");
+    }
+    // Two descriptors per namespace
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 2 * max + 64) {
+        rl.rlim_cur = rl.rlim_max < 2 * max + 64 ? rl.rlim_max : 2 * max + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    printf("%10s %14s %14s %14s %14s %10s %10s\n", "namespaces", "add ns/ns", "sync ns/ns",
+           "change ns/ns", "heap B/ns", "reports", "messages");
+    for (n = 10; n <= max; n *= 10) {
+        if ((nsfds = malloc(n * sizeof(*nsfds))) == NULL) {
+            err(1, "malloc");
+        }
+        for (i = 0; i < n; i++) {
+            nsfds[i] = new_namespace();
+        }
+
+        heap = mallinfo2().uordblks;
+        if (netns_monitor_init(&mon, AF_INET, on_change, NULL) != 0) {
+            err(1, "netns_monitor_init");
+        }
+        start = now_ns();
+        for (i = 0; i < n; i++) {
+            if (netns_monitor_add(&mon, nsfds[i], NULL) == NULL) {
+                err(1, "netns_monitor_add");
+            }
+        }
+        add_ns = now_ns() - start;
+        sync_ns = wait_egress(&mon, 2);
+        heap = mallinfo2().uordblks - heap;
+
+        // Every namespace's notifications are queued before any is read
+        change_gateways(nsfds, n, 0);
+        change_ns = wait_egress(&mon, 3);
+
+        printf("%10zu %14.0f %14.0f %14.0f %14zu %10zu %10llu\n", n, add_ns / n, sync_ns / n,
+               change_ns / n, heap / n, reported, (unsigned long long)mon.messages);
+        netns_monitor_free(&mon);
+        for (i = 0; i < n; i++) {
+            close(nsfds[i]);
+        }
+        free(nsfds);
+        if (n < max && n * 10 > max) {
+            n = max / 10;
+        }
+    }
+    return 0;
+}
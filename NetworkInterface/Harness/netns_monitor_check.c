@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Monitors three private network namespaces from one thread (Linux,
+ * needs CAP_SYS_ADMIN and /dev/net/tun): each must get its own links,
+ * routes and egress, and a change in one must only be reported for it.
+ *
+ *  cc -O2 -Wall -o netns_monitor_check netns_monitor_check.c harness.c \
+ *      ../NetworkInterface/netns_monitor.c ../NetworkInterface/egress_selector.c \
+ *      ../NetworkInterface/route_netlink.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/netif_stats.c
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+
+#include "../NetworkInterface/netns_monitor.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/route.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/if_tun.h>
+
+#define NNAMESPACES 3
+
+static int self = -1;
+static int sock = -1;           /* ioctl socket in the entered namespace */
+
+struct change {
+    struct netns_state *ns;
+    int changes;
+};
+
+static struct change seen[64];
+static size_t nseen;
+
+static void
+on_change(struct netns_monitor *mon, struct netns_state *ns, int changes, void *ctx)
+{
+    (void)mon;
+    (void)ctx;
+    if (nseen < sizeof(seen) / sizeof(seen[0])) {
+        seen[nseen].ns = ns;
+        seen[nseen].changes = changes;
+        nseen++;
+    }
+}
+
+/* Processes until `count` changes have been reported or a second passes */
+static void
+wait_changes(struct netns_monitor *mon, size_t count)
+{
+    struct pollfd pfd = { mon->fd, POLLIN, 0 };
+    int waited = 0;
+
+    while (nseen < count && waited < 1000) {
+        if (poll(&pfd, 1, 10) == 0) {
+            waited += 10;
+            continue;
+        }
+        CHECK(netns_monitor_process(mon) >= 0);
+    }
+    // Anything more would be a spurious report
+    poll(&pfd, 1, 50);
+    netns_monitor_process(mon);
+}
+
+static int
+new_namespace(void)
+{
+    int fd;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        return -1;
+    }
+    fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (setns(self, CLONE_NEWNET) != 0) {
+        err(1, "setns");
+    }
+    return fd;
+}
+
+static void
+enter(int nsfd)
+{
+    if (setns(nsfd, CLONE_NEWNET) != 0 || (sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        err(1, "enter");
+    }
+}
+
+static void
+leave(void)
+{
+    close(sock);
+    if (setns(self, CLONE_NEWNET) != 0) {
+        err(1, "setns");
+    }
+}
+
+static int
+default_route(const char *gateway, char *dev)
+{
+    struct rtentry rt;
+
+    memset(&rt, 0, sizeof(rt));
+    set_sin(&rt.rt_dst, "0.0.0.0");
+    set_sin(&rt.rt_genmask, "0.0.0.0");
+    set_sin(&rt.rt_gateway, gateway);
+    rt.rt_flags = RTF_UP | RTF_GATEWAY;
+    rt.rt_dev = dev;
+    return ioctl(sock, SIOCADDRT, &rt);
+}
+
+static int
+in_own_namespace(void)
+{
+    struct stat a, b;
+
+    return stat("/proc/thread-self/ns/net", &a) == 0 && fstat(self, &b) == 0 &&
+           a.st_ino == b.st_ino && a.st_dev == b.st_dev;
+}
+
+static int
+gateway_is(const struct netns_state *ns, const char *gateway)
+{
+    uint8_t addr[4];
+
+    inet_pton(AF_INET, gateway, addr);
+    return ns->has_egress && memcmp(ns->egress.route.gateway, addr, 4) == 0;
+}
+
+static int
+link_named(const struct netns_state *ns, const char *name, unsigned *flags)
+{
+    size_t i;
+
+    for (i = 0; i < ns->nlinks; i++) {
+        if (strcmp(ns->links[i].name, name) == 0) {
+            if (flags) {
+                *flags = ns->links[i].flags;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+main(void)
+{
+    struct netns_monitor mon;
+    struct netns_state *ns[NNAMESPACES];
+    int nsfd[NNAMESPACES], tun0, tun1, i;
+    unsigned flags;
+    char name[16];
+
+    if ((self = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC)) < 0) {
+        err(1, "open");
+    }
+    for (i = 0; i < NNAMESPACES; i++) {
+        if ((nsfd[i] = new_namespace()) < 0) {
+            warn("unshare(CLONE_NEWNET) (skipping)");
+            printf("netns_monitor_check: OK\n");
+            return 0;
+        }
+    }
+
+    // 0: a tun with a default route; 1: a default route over lo; 2: none
+    enter(nsfd[0]);
+    CHECK(set_flags("lo", IFF_UP, 0) == 0);
+    if ((tun0 = add_tun("tun0", "10.9.0.1")) < 0) {
+        warn("/dev/net/tun (skipping)");
+        printf("netns_monitor_check: OK\n");
+        return 0;
+    }
+    CHECK(default_route("10.9.0.2", "tun0") == 0);
+    leave();
+    enter(nsfd[1]);
+    CHECK(set_flags("lo", IFF_UP, 0) == 0);
+    CHECK(default_route("127.0.0.2", "lo") == 0);
+    leave();
+
+    CHECK(netns_monitor_init(&mon, AF_INET, on_change, NULL) == 0);
+    for (i = 0; i < NNAMESPACES; i++) {
+        snprintf(name, sizeof(name), "ns%d", i);
+        CHECK((ns[i] = netns_monitor_add(&mon, nsfd[i], name)) != NULL);
+    }
+    // Adding does not leave the thread in another namespace
+    CHECK(in_own_namespace());
+
+    // One report per namespace once its dumps are in
+    wait_changes(&mon, NNAMESPACES);
+    CHECK(nseen == NNAMESPACES);
+    for (i = 0; i < NNAMESPACES; i++) {
+        CHECK(ns[i]->live && ns[i]->updates == 1 && ns[i]->errors == 0);
+    }
+    CHECK(gateway_is(ns[0], "10.9.0.2"));
+    CHECK(netns_state_link(ns[0], ns[0]->egress.route.ifindex) != NULL &&
+          strcmp(netns_state_link(ns[0], ns[0]->egress.route.ifindex)->name, "tun0") == 0);
+    CHECK(link_named(ns[0], "tun0", NULL) && link_named(ns[0], "lo", NULL));
+    CHECK(gateway_is(ns[1], "127.0.0.2") && !link_named(ns[1], "tun0", NULL));
+    CHECK(!ns[2]->has_egress && ns[2]->nlinks == 1 && link_named(ns[2], "lo", &flags));
+    CHECK(!(flags & IFF_UP));
+
+    // A new interface and default route in namespace 2 only
+    nseen = 0;
+    enter(nsfd[2]);
+    if ((tun1 = add_tun("tun1", "10.9.1.1")) < 0) {
+        err(1, "add_tun");
+    }
+    CHECK(default_route("10.9.1.2", "tun1") == 0);
+    leave();
+    wait_changes(&mon, 2);
+    CHECK(nseen >= 1);
+    for (i = 0; i < (int)nseen; i++) {
+        CHECK(seen[i].ns == ns[2]);
+    }
+    CHECK(gateway_is(ns[2], "10.9.1.2") && link_named(ns[2], "tun1", NULL));
+    CHECK(gateway_is(ns[0], "10.9.0.2") && ns[0]->updates == 1);
+
+    // Namespace 0's interface goes down: its IPv4 routes go silently
+    nseen = 0;
+    enter(nsfd[0]);
+    CHECK(set_flags("tun0", 0, IFF_UP) == 0);
+    leave();
+    wait_changes(&mon, 1);
+    CHECK(nseen >= 1 && seen[0].ns == ns[0] && (seen[nseen - 1].changes & MONITOR_EGRESS) != 0);
+    CHECK(!ns[0]->has_egress);
+    CHECK(link_named(ns[0], "tun0", &flags) && !(flags & IFF_UP));
+
+    // Removing a namespace
+    netns_monitor_remove(&mon, ns[1]);
+    CHECK(mon.count == 2 && mon.namespaces[ns[2]->slot] == ns[2]);
+    nseen = 0;
+    enter(nsfd[1]);
+    CHECK(set_flags("lo", 0, IFF_UP) == 0);
+    leave();
+    wait_changes(&mon, 1);
+    CHECK(nseen == 0);
+
+    netns_monitor_free(&mon);
+    close(tun0);
+    close(tun1);
+    for (i = 0; i < NNAMESPACES; i++) {
+        close(nsfd[i]);
+    }
+    printf("netns_monitor_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Deterministic checks of path_coalescer driven by a fake clock.
+ *
+ *  cc -O2 -Wall -o path_coalescer_check path_coalescer_check.c harness.c \
+ *      ../NetworkInterface/path_coalescer.c -lpthread
+ */
+
+#include "harness.h"
+
+#include "../NetworkInterface/path_coalescer.h"
+
+#include <err.h>
+#include <stdio.h>
+
+#define MS  1000000ull
+
+/*
+ * Fake clock and a scheduler with a single timer slot, standing in for
+ * dispatch_after() on a serial queue.
+ */
+static uint64_t now;
+static uint64_t timer;
+static int delivered;
+static uint64_t delivered_generation;
+
+static void
+arm(struct path_coalescer *c)
+{
+    timer = path_coalescer_deadline(c);
+}
+
+static void
+event(struct path_coalescer *c)
+{
+    if (path_coalescer_event(c, now)) {
+        arm(c);
+    }
+}
+
+/* Fires the timer if it is due, recomputing and delivering like the monitor */
+static void
+advance(struct path_coalescer *c, uint64_t until)
+{
+    uint64_t generation;
+
+    while (timer != PATH_COALESCER_NO_DEADLINE && timer <= until) {
+        now = timer;
+        timer = PATH_COALESCER_NO_DEADLINE;
+        if (!path_coalescer_begin(c, now, &generation)) {
+            arm(c);
+            continue;
+        }
+        if (path_coalescer_finish(c, generation)) {
+            delivered++;
+            delivered_generation = generation;
+        }
+    }
+    now = until;
+}
+
+static void
+reset(struct path_coalescer *c, uint64_t window_ns, uint64_t max_delay_ns)
+{
+    now = 1000 * MS;
+    timer = PATH_COALESCER_NO_DEADLINE;
+    delivered = 0;
+    delivered_generation = 0;
+    path_coalescer_init(c, window_ns, max_delay_ns);
+}
+
+static void
+check_single_event(void)
+{
+    struct path_coalescer c;
+    uint64_t generation;
+
+    reset(&c, 100 * MS, 0);
+    CHECK(path_coalescer_deadline(&c) == PATH_COALESCER_NO_DEADLINE);
+    CHECK(path_coalescer_begin(&c, now, &generation) == 0);
+
+    CHECK(path_coalescer_event(&c, now) == 1);
+    CHECK(path_coalescer_deadline(&c) == now + 100 * MS);
+    CHECK(path_coalescer_begin(&c, now + 99 * MS, &generation) == 0);
+    CHECK(path_coalescer_begin(&c, now + 100 * MS, &generation) == 1 && generation == 1);
+    CHECK(path_coalescer_deadline(&c) == PATH_COALESCER_NO_DEADLINE);
+    CHECK(path_coalescer_finish(&c, generation) == 1);
+    // A result is delivered at most once
+    CHECK(path_coalescer_finish(&c, generation) == 0);
+    path_coalescer_destroy(&c);
+}
+
+static void
+check_burst(void)
+{
+    struct path_coalescer c;
+    int i;
+
+    // 20 events 20 ms apart (a Wi-Fi to cellular handoff) need one recompute
+    reset(&c, 100 * MS, 0);
+    for (i = 0; i < 20; i++) {
+        event(&c);
+        advance(&c, now + 20 * MS);
+    }
+    CHECK(delivered == 0);
+    advance(&c, now + 80 * MS - 1);
+    CHECK(delivered == 0);
+    advance(&c, now + 1);
+    CHECK(delivered == 1 && delivered_generation == 20);
+    CHECK(c.events == 20 && c.recomputes == 1 && c.stale == 0);
+
+    // Quiet events far apart are each recomputed
+    event(&c);
+    advance(&c, now + 500 * MS);
+    event(&c);
+    advance(&c, now + 500 * MS);
+    CHECK(delivered == 3 && delivered_generation == 22);
+    path_coalescer_destroy(&c);
+}
+
+static void
+check_max_delay(void)
+{
+    struct path_coalescer c;
+    uint64_t start;
+    int i;
+
+    // A steady stream cannot postpone the recompute past max_delay
+    reset(&c, 100 * MS, 300 * MS);
+    start = now;
+    for (i = 0; i < 10; i++) {
+        event(&c);
+        advance(&c, now + 50 * MS);
+        if (i == 5) {
+            // Events at 0..250 ms, the recompute ran at 300 ms
+            CHECK(delivered == 1 && delivered_generation == 6);
+        }
+    }
+    CHECK(now == start + 500 * MS);
+    // The second burst started at 300 ms and was last extended at 450 ms
+    advance(&c, start + 550 * MS);
+    CHECK(delivered == 2 && delivered_generation == 10);
+    path_coalescer_destroy(&c);
+}
+
+static void
+check_stale(void)
+{
+    struct path_coalescer c;
+    uint64_t generation, newer;
+
+    reset(&c, 100 * MS, 0);
+    CHECK(path_coalescer_event(&c, now) == 1);
+    now += 100 * MS;
+    CHECK(path_coalescer_begin(&c, now, &generation) == 1);
+
+    // An event while recomputing makes the result stale and arms the next
+    CHECK(path_coalescer_event(&c, now + 10 * MS) == 1);
+    CHECK(path_coalescer_finish(&c, generation) == 0);
+    CHECK(c.stale == 1);
+
+    CHECK(path_coalescer_begin(&c, now + 110 * MS, &newer) == 1);
+    CHECK(newer == generation + 1);
+    CHECK(path_coalescer_finish(&c, newer) == 1);
+
+    // An out of order finish of an older recompute is never delivered
+    CHECK(path_coalescer_finish(&c, generation) == 0);
+    path_coalescer_destroy(&c);
+}
+
+int
+main(void)
+{
+    check_single_event();
+    check_burst();
+    check_max_delay();
+    check_stale();
+    printf("path_coalescer_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
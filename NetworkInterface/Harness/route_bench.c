@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Regression benchmarks for the code behind print_default_gateway():
+ * route dump decoding (locating the sockaddrs with the generic walker
+ * and with the fixed-offset decoders, then whole routes), loading the
+ * route table, default route selection and interface name resolution
+ * against synthetic NET_RT_DUMP2 tables of 10^2 to 10^6 routes, plus
+ * interface enumeration on the host.
+ *
+ * Each line reports ns/op, heap allocations per op and bytes touched
+ * per op (input bytes read plus output bytes written, or the footprint
+ * of the structure built). Allocations are counted by wrapping malloc
+ * with glibc's __libc_* entry points; elsewhere they read "-".
+ *
+ *  cc -O2 -Wall -o route_bench route_bench.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/interface_registry.c ../NetworkInterface/interface_table.c \
+ *      ../NetworkInterface/route_netlink.c ../NetworkInterface/route_capture.c \
+ *      ../NetworkInterface/flight_recorder.c ../NetworkInterface/netif_stats.c -lpthread
+ *
+ * Usage:
+ *  route_bench [max_exponent]        synthetic tables up to 10^max_exponent routes (default 6)
+ *  route_bench -c CAPTURE...         the NET_RT_DUMP2 section of route captures
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/interface_registry.h"
+#include "../NetworkInterface/interface_table.h"
+#include "../NetworkInterface/route_capture.h"
+#include "../NetworkInterface/route_dump.h"
+#include "../NetworkInterface/route_table.h"
+
+#include <err.h>
+#include <ifaddrs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#ifdef __GLIBC__
+#define COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static unsigned long allocations;
+
+void *
+malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+    allocations++;
+    return __libc_realloc(p, size);
+}
+
+void
+free(void *p)
+{
+    __libc_free(p);
+}
+#else
+#define COUNT_ALLOCATIONS 0
+static unsigned long allocations;
+#endif
+
+/* Operations per measurement: enough to time small tables reliably */
+#define MIN_OPS         2000000
+#define MAX_SYSCALL_OPS 20000       /* for benchmarks that make a system call per op */
+
+struct measure {
+    double start_ns;
+    unsigned long start_allocations;
+};
+
+static volatile size_t sink;
+
+static void
+begin(struct measure *m)
+{
+    m->start_allocations = allocations;
+    m->start_ns = now_ns();
+}
+
+static void
+end(const struct measure *m, const char *name, size_t routes, size_t ops, double bytes_per_op)
+{
+    double ns = now_ns() - m->start_ns;
+    unsigned long allocs = allocations - m->start_allocations;
+
+    printf("%-24s %8lu %12.1f ", name, (unsigned long)routes, ns / (double)ops);
+    if (COUNT_ALLOCATIONS) {
+        printf("%10.3f ", (double)allocs / (double)ops);
+    } else {
+        printf("%10s ", "-");
+    }
+    printf("%12.0f\n", bytes_per_op);
+}
+
+static size_t
+reps_for(size_t ops_per_rep, size_t min_ops)
+{
+    size_t reps = min_ops / (ops_per_rep ? ops_per_rep : 1);
+    return reps ? reps : 1;
+}
+
+static void
+bench_addrs(int (*decode)(struct route_view *, int, const void *, const void *), const char *name,
+            const char *buf, size_t len, size_t n)
+{
+    const struct rt_msghdr2 *rtm;
+    struct route_view view;
+    struct measure m;
+    size_t r, reps, off;
+
+    reps = reps_for(n, MIN_OPS);
+    begin(&m);
+    for (r = 0; r < reps; r++) {
+        for (off = 0; off < len; off += rtm->rtm_msglen) {
+            rtm = (const struct rt_msghdr2 *)(buf + off);
+            if (decode(&view, rtm->rtm_addrs, rtm + 1, buf + off + rtm->rtm_msglen) == 0) {
+                sink += (size_t)view.family;
+            }
+        }
+    }
+    end(&m, name, n, n * reps, (double)len / n);
+}
+
+/* Runs the route benchmarks over the NET_RT_DUMP2 buffer `buf` holding `n` routes */
+static void
+bench_routes(const char *buf, size_t len, size_t n, const struct interface_registry *registry)
+{
+    struct route_table table;
+    struct route_dump_iter iter;
+    struct route_view view;
+    struct route_entry e;
+    struct measure m;
+    size_t i, r, reps, ops, defaults = 0;
+    char ifname[IFNAMSIZ];
+
+    route_table_init(&table);
+
+    // Locating the sockaddrs alone: the generic walk against the
+    // fixed-offset decoders for common layouts
+    bench_addrs(route_view_decode_addrs_generic, "decode_addrs_generic", buf, len, n);
+    bench_addrs(route_view_decode_addrs, "decode_addrs", buf, len, n);
+
+    // Decoding: walk the dump and convert every view to an entry
+    reps = reps_for(n, MIN_OPS);
+    begin(&m);
+    for (r = 0; r < reps; r++) {
+        route_dump_iter_init(&iter, buf, len);
+        while (route_dump_iter_next(&iter, &view) == 1) {
+            route_entry_from_view(&e, &view);
+            sink += e.ifindex;
+        }
+    }
+    end(&m, "decode", n, n * reps, (double)len / n + sizeof(e));
+
+    // Loading: decoding plus hashing every route into the table
+    reps = reps_for(n, MIN_OPS / 4);
+    begin(&m);
+    for (r = 0; r < reps; r++) {
+        if (route_table_load_dump(&table, buf, len) < 0) {
+            errx(1, "route_table_load_dump");
+        }
+    }
+    end(&m, "load_table", n, n * reps,
+        (double)len / n + (double)(table.cap * sizeof(*table.entries) + table.nslots * sizeof(*table.slots)) / n);
+
+    // Default route selection as print_default_gateway() performs it
+    reps = reps_for(n, MIN_OPS);
+    begin(&m);
+    for (r = 0; r < reps; r++) {
+        for (i = 0; i < table.count; i++) {
+            const struct route_entry *t = &table.entries[i];
+            if (t->family == AF_INET && route_entry_is_default(t)) {
+                defaults++;
+            }
+        }
+    }
+    end(&m, "select_default", n, table.count * reps, sizeof(struct route_entry));
+    sink += defaults;
+
+    // Interface names for every route: cached registry against if_indextoname()
+    ops = table.count;
+    reps = reps_for(ops, MIN_OPS);
+    begin(&m);
+    for (r = 0; r < reps; r++) {
+        for (i = 0; i < ops; i++) {
+            const struct interface_info *info = &registry->interfaces[table.entries[i].ifindex % registry->count];
+            info = interface_registry_by_index(registry, info->index);
+            sink += info ? (size_t)info->name[0] : 0;
+        }
+    }
+    end(&m, "ifname_registry", n, ops * reps, sizeof(uint32_t) + sizeof(struct interface_info));
+
+    ops = table.count < MAX_SYSCALL_OPS ? table.count : MAX_SYSCALL_OPS;
+    begin(&m);
+    for (i = 0; i < ops; i++) {
+        unsigned index = registry->interfaces[table.entries[i].ifindex % registry->count].index;
+        sink += if_indextoname(index, ifname) ? (size_t)ifname[0] : 0;
+    }
+    end(&m, "ifname_if_indextoname", n, ops, IFNAMSIZ);
+
+    route_table_free(&table);
+}
+
+static void
+bench_enumeration(struct interface_registry *registry)
+{
+    struct interface_table table;
+    struct ifaddrs *ifaddrs;
+    struct measure m;
+    size_t r, reps = MAX_SYSCALL_OPS / 10;
+
+    interface_table_init(&table);
+    begin(&m);
+    for (r = 0; r < reps; r++) {
+        if (interface_table_load(&table) < 0) {
+            err(1, "interface_table_load");
+        }
+    }
+    end(&m, "enum_interface_table", table.count, reps,
+        (double)table.count * (5 * sizeof(uint32_t) + IFNAMSIZ) +
+        (double)table.naddrs * (sizeof(uint32_t) + 2 + 2 * 16));
+    interface_table_free(&table);
+
+    begin(&m);
+    for (r = 0; r < reps; r++) {
+        if (interface_registry_refresh(registry) != 0) {
+            err(1, "interface_registry_refresh");
+        }
+    }
+    end(&m, "enum_registry_refresh", registry->count, reps,
+        (double)registry->count * sizeof(struct interface_info) +
+        (double)registry->naddresses * sizeof(struct interface_address));
+
+    begin(&m);
+    for (r = 0; r < reps; r++) {
+        if (getifaddrs(&ifaddrs) != 0) {
+            err(1, "getifaddrs");
+        }
+        freeifaddrs(ifaddrs);
+    }
+    end(&m, "enum_getifaddrs", registry->count, reps, 0);
+}
+
+/* Replays the dump captured in `path`, used in place from the mapping */
+static void
+bench_capture(const char *path, const struct interface_registry *registry)
+{
+    struct route_capture capture;
+    struct route_dump_iter iter;
+    struct route_view view;
+    const char *dump;
+    size_t len, n = 0;
+
+    if (route_capture_open(&capture, path) != 0) {
+        err(1, "%s", path);
+    }
+    if ((dump = route_capture_section(&capture, ROUTE_CAPTURE_BSD_DUMP, &len, NULL)) == NULL) {
+        errx(1, "%s: no NET_RT_DUMP2 section", path);
+    }
+    route_dump_iter_init(&iter, dump, len);
+    while (route_dump_iter_next(&iter, &view) == 1) {
+        n++;
+    }
+    printf("%s\n", path);
+    if (n > 0) {
+        bench_routes(dump, len, n, registry);
+    }
+    route_capture_close(&capture);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct interface_registry registry;
+    struct rtdump_builder b;
+    int max_exponent = 6, e, i;
+    size_t n;
+
+    if (interface_registry_open(&registry) != 0) {
+        err(1, "interface_registry_open");
+    }
+    printf("%-24s %8s %12s %10s %12s\n", "benchmark", "routes", "ns/op", "allocs/op", "bytes/op");
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        for (i = 2; i < argc; i++) {
+            bench_capture(argv[i], &registry);
+        }
+    } else {
+        if (argc > 1) {
+            max_exponent = atoi(argv[1]);
+        }
+        if (max_exponent < 2 || max_exponent > 7) {
+            errx(1, "usage: route_bench [max_exponent (2-7)] | -c CAPTURE...");
+        }
+        for (e = 2, n = 100; e <= max_exponent; e++, n *= 10) {
+            rtdump_builder_init(&b);
+            rtdump_builder_synthesize(&b, n, 16);
+            bench_routes(b.buf, b.len, n, &registry);
+            rtdump_builder_free(&b);
+        }
+    }
+    bench_enumeration(&registry);
+
+    interface_registry_close(&registry);
+    return 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Writes and replays route captures (see route_capture.h).
+ *
+ *  cc -O2 -Wall -o route_capture_tool route_capture_tool.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_capture.c ../NetworkInterface/route_dump.c \
+ *      ../NetworkInterface/route_table.c ../NetworkInterface/route_lpm.c \
+ *      ../NetworkInterface/route_netlink.c ../NetworkInterface/interface_table.c \
+ *      ../NetworkInterface/netif_stats.c
+ *
+ * Usage:
+ *  route_capture_tool                check writing and replaying captures, including
+ *                                    captures written with Apple's address families
+ *  route_capture_tool -w FILE        capture this host into FILE
+ *  route_capture_tool FILE...        replay each capture and print a summary
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_capture.h"
+#include "../NetworkInterface/route_dump.h"
+#include "../NetworkInterface/route_lpm.h"
+#include "../NetworkInterface/route_netlink.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static size_t
+count_dump_routes(const struct route_capture *capture)
+{
+    struct route_dump_iter iter;
+    struct route_view view;
+    const void *dump;
+    size_t len, n = 0;
+
+    if ((dump = route_capture_section(capture, ROUTE_CAPTURE_BSD_DUMP, &len, NULL)) == NULL) {
+        return 0;
+    }
+    route_dump_iter_init(&iter, dump, len);
+    while (route_dump_iter_next(&iter, &view) == 1) {
+        n++;
+    }
+    return n;
+}
+
+/* Returns the number of netlink routes that decode, or 0 off Linux */
+static size_t
+count_netlink_routes(const struct route_capture *capture)
+{
+    size_t n = 0;
+#ifdef __linux__
+    const struct nlmsghdr *nlh;
+    struct route_entry e;
+    size_t len;
+    int remaining;
+
+    if ((nlh = route_capture_section(capture, ROUTE_CAPTURE_NETLINK, &len, NULL)) == NULL) {
+        return 0;
+    }
+    for (remaining = (int)len; NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+        n += route_netlink_parse_route(nlh, &e) == 0;
+    }
+#else
+    (void)capture;
+#endif
+    return n;
+}
+
+static void
+replay(const char *path)
+{
+    struct route_capture capture;
+    const struct route_entry *entries;
+    const struct route_capture_interface *interfaces;
+    struct route_lpm lpm;
+    size_t nentries, ninterfaces, i;
+    double t0, open_ns, build_ns;
+
+    t0 = now_ns();
+    if (route_capture_open(&capture, path) != 0) {
+        warn("%s", path);
+        failures++;
+        return;
+    }
+    open_ns = now_ns() - t0;
+
+    entries = route_capture_section(&capture, ROUTE_CAPTURE_ENTRIES, NULL, &nentries);
+    interfaces = route_capture_section(&capture, ROUTE_CAPTURE_INTERFACES, NULL, &ninterfaces);
+
+    printf("%s: %lu bytes, captured at %llu, opened in %.1f us\n", path, (unsigned long)capture.size,
+           (unsigned long long)capture.header->captured_at, open_ns / 1000);
+    printf("  bsd dump routes %lu, netlink routes %lu, entries %lu, interfaces %lu\n",
+           (unsigned long)count_dump_routes(&capture), (unsigned long)count_netlink_routes(&capture),
+           (unsigned long)nentries, (unsigned long)ninterfaces);
+    for (i = 0; i < ninterfaces; i++) {
+        printf("  %-16.16s index %u flags 0x%x mtu %u addresses %u\n", interfaces[i].name,
+               interfaces[i].index, interfaces[i].flags, interfaces[i].mtu, interfaces[i].addr_count);
+    }
+
+    // The lookup index is built straight from the mapped entries
+    t0 = now_ns();
+    if (route_lpm_build(&lpm, entries, nentries) == 0) {
+        build_ns = now_ns() - t0;
+        printf("  lookup index built in %.1f ms\n", build_ns / 1e6);
+        route_lpm_free(&lpm);
+    } else {
+        warnx("%s: route_lpm_build failed", path);
+        failures++;
+    }
+    route_capture_close(&capture);
+}
+
+static void
+check_synthetic(const char *path)
+{
+    struct rtdump_builder b;
+    struct route_table table;
+    struct route_capture capture;
+    struct route_capture_source source;
+    struct route_lpm lpm, heap_lpm;
+    const struct route_entry *entries;
+    const char *dump;
+    size_t len, count, none, i;
+    char *corrupt;
+
+    rtdump_builder_init(&b);
+    rtdump_builder_synthesize(&b, 100000, 16);
+    route_table_init(&table);
+    CHECK(route_table_load_dump(&table, b.buf, b.len) == 100000);
+
+    memset(&source, 0, sizeof(source));
+    source.bsd_dump = b.buf;
+    source.bsd_dump_len = b.len;
+    source.entries = table.entries;
+    source.nentries = table.count;
+    CHECK(route_capture_write(path, &source) == 0);
+
+    CHECK(route_capture_open(&capture, path) == 0);
+    dump = route_capture_section(&capture, ROUTE_CAPTURE_BSD_DUMP, &len, NULL);
+    CHECK(dump && len == b.len && memcmp(dump, b.buf, len) == 0);
+    CHECK(((uintptr_t)dump & 7) == 0);
+    CHECK(count_dump_routes(&capture) == 100000);
+    entries = route_capture_section(&capture, ROUTE_CAPTURE_ENTRIES, &len, &count);
+    CHECK(entries && count == table.count && memcmp(entries, table.entries, len) == 0);
+    CHECK(route_capture_section(&capture, ROUTE_CAPTURE_INTERFACES, NULL, &none) == NULL && none == 0);
+
+    // Lookups over the mapped entries match lookups over the heap table
+    CHECK(route_lpm_build(&lpm, entries, count) == 0);
+    CHECK(route_lpm_build(&heap_lpm, table.entries, table.count) == 0);
+    for (i = 0; i < 1000; i++) {
+        uint8_t probe[4] = { 11, (uint8_t)(i >> 8), (uint8_t)i, 1 };
+        const struct route_nexthop *a = route_lpm_lookup(&lpm, AF_INET, probe);
+        const struct route_nexthop *h = route_lpm_lookup(&heap_lpm, AF_INET, probe);
+        CHECK((a == NULL) == (h == NULL));
+        CHECK(a == NULL || memcmp(a, h, sizeof(*a)) == 0);
+    }
+    route_lpm_free(&heap_lpm);
+    route_lpm_free(&lpm);
+
+    // Damaged captures are rejected
+    corrupt = malloc(capture.size);
+    memcpy(corrupt, capture.base, capture.size);
+    route_capture_close(&capture);
+    CHECK(route_capture_open_buffer(&capture, corrupt, 16) != 0);
+    ((struct route_capture_header *)corrupt)->version++;
+    CHECK(route_capture_open_buffer(&capture, corrupt, b.len) != 0);
+    ((struct route_capture_header *)corrupt)->version--;
+    ((struct route_capture_section *)(corrupt + sizeof(struct route_capture_header)))[1].length += 1;
+    CHECK(route_capture_open_buffer(&capture, corrupt, b.len) != 0);
+    free(corrupt);
+
+    route_table_free(&table);
+    rtdump_builder_free(&b);
+}
+
+/*
+ * A capture written on Apple, where AF_INET6 is 30, replays with this
+ * host's families: IPv6 routes and addresses must not be dropped.
+ */
+static void
+check_foreign_families(const char *path)
+{
+    enum { APPLE_AF_INET = 2, APPLE_AF_INET6 = 30 };
+    static const uint8_t dst6[16] = { 0x20, 0x01, 0x0d, 0xb8 }, gateway6[16] = { 0xfe, 0x80, [15] = 1 };
+    static const uint8_t probe6[16] = { 0x20, 0x01, 0x0d, 0xb8, [15] = 7 }, dst4[4] = { 10 };
+    struct route_entry written[2];
+    struct route_capture_address address;
+    struct route_capture_source source;
+    struct route_capture capture;
+    const struct route_entry *entries;
+    const struct route_capture_address *addresses;
+    const struct route_nexthop *nh;
+    struct route_lpm lpm;
+    size_t count, naddresses, len;
+    uint8_t *buf;
+    FILE *f;
+
+    memset(written, 0, sizeof(written));
+    written[0].family = APPLE_AF_INET6;
+    written[0].prefixlen = 32;
+    written[0].gateway_family = APPLE_AF_INET6;
+    written[0].flags = ROUTE_F_UP | ROUTE_F_GATEWAY;
+    written[0].ifindex = 4;
+    memcpy(written[0].dst, dst6, 16);
+    memcpy(written[0].gateway, gateway6, 16);
+    written[1].family = APPLE_AF_INET;
+    written[1].prefixlen = 8;
+    written[1].flags = ROUTE_F_UP;
+    written[1].ifindex = 5;
+    memcpy(written[1].dst, dst4, 4);
+    memset(&address, 0, sizeof(address));
+    address.family = APPLE_AF_INET6;
+    address.prefixlen = 64;
+
+    memset(&source, 0, sizeof(source));
+    source.entries = written;
+    source.nentries = 2;
+    source.addresses = &address;
+    source.naddresses = 1;
+    CHECK(route_capture_write(path, &source) == 0);
+
+    // Stamp the header as the Apple writer would have
+    if ((f = fopen(path, "rb")) == NULL || fseek(f, 0, SEEK_END) != 0 || (len = (size_t)ftell(f)) == 0 ||
+        fseek(f, 0, SEEK_SET) != 0 || (buf = malloc(len)) == NULL || fread(buf, 1, len, f) != len) {
+        err(1, "%s", path);
+    }
+    fclose(f);
+    ((struct route_capture_header *)buf)->af_inet = APPLE_AF_INET;
+    ((struct route_capture_header *)buf)->af_inet6 = APPLE_AF_INET6;
+
+    CHECK(route_capture_open_buffer(&capture, buf, len) == 0);
+    entries = route_capture_section(&capture, ROUTE_CAPTURE_ENTRIES, NULL, &count);
+    addresses = route_capture_section(&capture, ROUTE_CAPTURE_ADDRESSES, NULL, &naddresses);
+    CHECK(entries && count == 2 && entries[0].family == AF_INET6 && entries[0].gateway_family == AF_INET6);
+    CHECK(entries && entries[1].family == AF_INET && entries[1].gateway_family == AF_UNSPEC);
+    CHECK(addresses && naddresses == 1 && addresses[0].family == AF_INET6);
+
+    CHECK(entries && route_lpm_build(&lpm, entries, count) == 0);
+    if (entries) {
+        nh = route_lpm_lookup(&lpm, AF_INET6, probe6);
+        CHECK(nh && nh->ifindex == 4 && nh->gateway_family == AF_INET6 && memcmp(nh->gateway, gateway6, 16) == 0);
+        nh = route_lpm_lookup(&lpm, AF_INET, dst4);
+        CHECK(nh && nh->ifindex == 5);
+        route_lpm_free(&lpm);
+    }
+    route_capture_close(&capture);
+    free(buf);
+}
+
+static void
+check_host(const char *path)
+{
+    struct route_capture capture;
+    size_t entries, interfaces, addresses;
+
+    if (route_capture_host(path) != 0) {
+        warn("route_capture_host (skipping host check)");
+        return;
+    }
+    CHECK(route_capture_open(&capture, path) == 0);
+    CHECK(route_capture_section(&capture, ROUTE_CAPTURE_ENTRIES, NULL, &entries) != NULL);
+    CHECK(route_capture_section(&capture, ROUTE_CAPTURE_INTERFACES, NULL, &interfaces) != NULL);
+    route_capture_section(&capture, ROUTE_CAPTURE_ADDRESSES, NULL, &addresses);
+#ifdef __linux__
+    CHECK(count_netlink_routes(&capture) == entries);
+#else
+    CHECK(count_dump_routes(&capture) >= entries);
+#endif
+    printf("host capture: %lu routes, %lu interfaces, %lu addresses\n", (unsigned long)entries,
+           (unsigned long)interfaces, (unsigned long)addresses);
+    route_capture_close(&capture);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char path[] = "/tmp/route_capture_XXXXXX";
+    int i, fd;
+
+    if (argc == 3 && strcmp(argv[1], "-w") == 0) {
+        if (route_capture_host(argv[2]) != 0) {
+            err(1, "%s", argv[2]);
+        }
+        return 0;
+    }
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            replay(argv[i]);
+        }
+        return failures ? 1 : 0;
+    }
+
+    if ((fd = mkstemp(path)) < 0) {
+        err(1, "mkstemp");
+    }
+    close(fd);
+    check_synthetic(path);
+    replay(path);
+    check_foreign_families(path);
+    check_host(path);
+    unlink(path);
+    printf("route_capture_tool: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks every route_columns filter kernel available on this CPU against
+ * a plain loop, for each column and operation, and times a few queries
+ * over a million rows.
+ *
+ *  cc -O2 -Wall -o route_columns_check route_columns_check.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_columns.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/netif_stats.c
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_columns.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define NROWS   1000000
+#define ROUNDS  20
+
+static const char *const kernel_names[] = { "avx2", "sse2", "neon", "scalar" };
+
+static uint32_t
+column_value(const struct route_entry *e, enum route_column column)
+{
+    switch (column) {
+        case ROUTE_COL_FLAGS: return e->flags;
+        case ROUTE_COL_KERNEL_FLAGS: return e->kernel_flags;
+        case ROUTE_COL_IFINDEX: return e->ifindex;
+        case ROUTE_COL_PRIORITY: return e->priority;
+        case ROUTE_COL_MTU: return e->mtu;
+        case ROUTE_COL_RTT: return e->rtt;
+        case ROUTE_COL_HOPCOUNT: return e->hopcount;
+        case ROUTE_COL_FAMILY: return e->family;
+        case ROUTE_COL_PREFIXLEN: return e->prefixlen;
+        default: return e->gateway_family;
+    }
+}
+
+static int
+reference(uint32_t x, enum route_op op, uint32_t v)
+{
+    switch (op) {
+        case ROUTE_OP_EQ: return x == v;
+        case ROUTE_OP_NE: return x != v;
+        case ROUTE_OP_LT: return x < v;
+        case ROUTE_OP_LE: return x <= v;
+        case ROUTE_OP_GT: return x > v;
+        case ROUTE_OP_GE: return x >= v;
+        case ROUTE_OP_ALL: return (x & v) == v;
+        case ROUTE_OP_ANY: return (x & v) != 0;
+        default: return (x & v) == 0;
+    }
+}
+
+/* Rows mixing small values, values around the sign bit and the extremes */
+static void
+make_rows(struct route_entry *rows, size_t count)
+{
+    static const uint32_t specials[] = { 0, 1, 0x7fffffff, 0x80000000, 0x80000001, 0xffffffff };
+    size_t i;
+
+    srand(1);
+    for (i = 0; i < count; i++) {
+        struct route_entry *e = &rows[i];
+        memset(e, 0, sizeof(*e));
+        e->family = rand() % 4 ? AF_INET : AF_INET6;
+        e->prefixlen = (uint8_t)(rand() % 129);
+        e->gateway_family = rand() % 3 ? e->family : 0;
+        e->flags = (uint32_t)rand() & 0x7f;
+        e->kernel_flags = rand() % 8 ? (uint32_t)rand() : specials[rand() % 6];
+        e->ifindex = (uint32_t)(rand() % 16 + 1);
+        e->priority = rand() % 8 ? (uint32_t)rand() % 1024 : specials[rand() % 6];
+        e->mtu = rand() % 4 ? 1280 + (uint32_t)rand() % 8000 : 0;
+        e->rtt = (uint32_t)rand() * 2u;
+        e->hopcount = (uint32_t)rand() % 32;
+        e->dst[0] = (uint8_t)i;
+        e->dst[1] = (uint8_t)(i >> 8);
+        e->dst[2] = (uint8_t)(i >> 16);
+    }
+}
+
+/* Compares one predicate against the reference on rows [0, count) */
+static int
+agrees(const struct route_columns *cols, const struct route_entry *rows, size_t count,
+       const struct route_predicate *p, struct route_bitmap *out)
+{
+    size_t i;
+
+    if (route_columns_select(cols, p, out) != 0 || out->nbits != count) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        int bit = (int)(out->words[i / 64] >> (i % 64)) & 1;
+        if (bit != reference(column_value(&rows[i], p->column), p->op, p->value)) {
+            warnx("column %d op %d value %u row %zu: got %d", p->column, p->op, p->value, i, bit);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+check_kernels(const struct route_entry *rows)
+{
+    static const uint32_t values32[] = { 0, 1, 7, 1400, 0x7fffffff, 0x80000000, 0xffffffff };
+    static const uint32_t values8[] = { 0, 2, 24, 127, 128, 255 };
+    // Odd sizes exercise the scalar tail after the last full word
+    static const size_t sizes[] = { 0, 1, 63, 64, 65, 1000, 4099 };
+    const char *fastest = route_columns_kernel();
+    struct route_columns cols;
+    struct route_bitmap out;
+    struct route_predicate p;
+    size_t k, s, v;
+    int column, op;
+
+    route_columns_init(&cols);
+    route_bitmap_init(&out);
+    for (k = 0; k < sizeof(kernel_names) / sizeof(kernel_names[0]); k++) {
+        if (route_columns_use_kernel(kernel_names[k]) != 0) {
+            continue;
+        }
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            CHECK(route_columns_build(&cols, rows, sizes[s]) == 0);
+            for (column = 0; column < ROUTE_COL_COUNT; column++) {
+                int narrow = column >= ROUTE_COL_FAMILY;
+                const uint32_t *values = narrow ? values8 : values32;
+                size_t nvalues = narrow ? sizeof(values8) / sizeof(values8[0]) :
+                                 sizeof(values32) / sizeof(values32[0]);
+                for (op = ROUTE_OP_EQ; op <= ROUTE_OP_NONE; op++) {
+                    for (v = 0; v < nvalues; v++) {
+                        p.column = column;
+                        p.op = op;
+                        p.value = values[v];
+                        CHECK(agrees(&cols, rows, sizes[s], &p, &out));
+                    }
+                }
+            }
+        }
+        printf("%s: kernel agrees with reference\n", kernel_names[k]);
+    }
+    CHECK(route_columns_use_kernel(fastest) == 0);
+
+    // Errors
+    CHECK(route_columns_build(&cols, rows, 100) == 0);
+    p.column = ROUTE_COL_PREFIXLEN;
+    p.op = ROUTE_OP_EQ;
+    p.value = 256;
+    CHECK(route_columns_select(&cols, &p, &out) == -1);
+    p.column = ROUTE_COL_COUNT;
+    p.value = 0;
+    CHECK(route_columns_select(&cols, &p, &out) == -1);
+    p.column = ROUTE_COL_MTU;
+    p.op = ROUTE_OP_NONE + 1;
+    CHECK(route_columns_select(&cols, &p, &out) == -1);
+    CHECK(route_columns_use_kernel("mmx") == -1);
+
+    route_bitmap_free(&out);
+    route_columns_free(&cols);
+}
+
+static void
+check_queries(const struct route_entry *rows)
+{
+    struct route_columns cols;
+    struct route_bitmap a, b;
+    struct route_predicate q[2];
+    struct route_entry e;
+    size_t i, n;
+    long row;
+
+    route_columns_init(&cols);
+    route_bitmap_init(&a);
+    route_bitmap_init(&b);
+    CHECK(route_columns_build(&cols, rows, 5000) == 0);
+    route_columns_get(&cols, 4321, &e);
+    CHECK(route_entry_equal(&e, &rows[4321]));
+
+    // Gateway routes on ifindex 4, by where() and by bitmap operations
+    q[0].column = ROUTE_COL_FLAGS;
+    q[0].op = ROUTE_OP_ALL;
+    q[0].value = ROUTE_F_GATEWAY;
+    q[1].column = ROUTE_COL_IFINDEX;
+    q[1].op = ROUTE_OP_EQ;
+    q[1].value = 4;
+    CHECK(route_columns_where(&cols, q, 2, &a) == 0);
+    n = 0;
+    for (row = route_bitmap_next(&a, 0); row >= 0; row = route_bitmap_next(&a, (size_t)row + 1)) {
+        CHECK((rows[row].flags & ROUTE_F_GATEWAY) && rows[row].ifindex == 4);
+        n++;
+    }
+    CHECK(n == route_bitmap_count(&a));
+    for (i = 0, n = 0; i < 5000; i++) {
+        n += (rows[i].flags & ROUTE_F_GATEWAY) && rows[i].ifindex == 4;
+    }
+    CHECK(n == route_bitmap_count(&a) && n > 0);
+
+    CHECK(route_columns_select(&cols, &q[0], &b) == 0);
+    CHECK(route_bitmap_andnot(&b, &a) == 0);
+    CHECK(route_columns_refine(&cols, &q[1], &b) == 0);
+    CHECK(route_bitmap_count(&b) == 0);
+    CHECK(route_bitmap_or(&b, &a) == 0 && route_bitmap_count(&b) == n);
+    CHECK(route_bitmap_and(&b, &a) == 0 && route_bitmap_count(&b) == n);
+
+    // No predicates select every row; bits past the end stay clear
+    CHECK(route_columns_where(&cols, q, 0, &a) == 0 && route_bitmap_count(&a) == 5000);
+    CHECK(route_bitmap_next(&a, 4999) == 4999 && route_bitmap_next(&a, 5000) == -1);
+
+    CHECK(route_columns_build(&cols, rows, 10) == 0);
+    CHECK(route_columns_refine(&cols, &q[0], &b) == -1);
+    CHECK(route_columns_where(&cols, q, 0, &a) == 0 && route_bitmap_and(&b, &a) == -1);
+
+    route_bitmap_free(&a);
+    route_bitmap_free(&b);
+    route_columns_free(&cols);
+}
+
+static void
+check_load_dump(void)
+{
+    struct rtdump_builder b;
+    struct route_columns cols;
+    struct route_table table;
+    struct route_entry e;
+    size_t i;
+
+    rtdump_builder_init(&b);
+    rtdump_builder_synthesize(&b, 10000, 8);
+    route_columns_init(&cols);
+    route_table_init(&table);
+    CHECK(route_columns_load_dump(&cols, b.buf, b.len) == 10000);
+    CHECK(route_table_load_dump(&table, b.buf, b.len) == 10000);
+    for (i = 0; i < cols.count; i++) {
+        const struct route_entry *t;
+        route_columns_get(&cols, i, &e);
+        t = route_table_find(&table, &e);
+        CHECK(t != NULL && route_entry_equal(t, &e));
+    }
+    route_table_free(&table);
+    route_columns_free(&cols);
+    rtdump_builder_free(&b);
+}
+
+static void
+time_queries(const struct route_entry *rows)
+{
+    static const struct {
+        const char *name;
+        struct route_predicate p[2];
+        size_t n;
+    } queries[] = {
+        { "gateway routes on ifindex 4",
+          { { ROUTE_COL_FLAGS, ROUTE_OP_ALL, ROUTE_F_GATEWAY }, { ROUTE_COL_IFINDEX, ROUTE_OP_EQ, 4 } }, 2 },
+        { "interface-scoped routes", { { ROUTE_COL_FLAGS, ROUTE_OP_ANY, ROUTE_F_IFSCOPE } }, 1 },
+        { "MTU below 1400", { { ROUTE_COL_MTU, ROUTE_OP_LT, 1400 } }, 1 },
+        { "IPv6 /64s", { { ROUTE_COL_FAMILY, ROUTE_OP_EQ, AF_INET6 }, { ROUTE_COL_PREFIXLEN, ROUTE_OP_EQ, 64 } }, 2 },
+    };
+    struct route_columns cols;
+    struct route_bitmap out;
+    size_t k, q, r, matched = 0;
+    double t0, best;
+
+    route_columns_init(&cols);
+    route_bitmap_init(&out);
+    CHECK(route_columns_build(&cols, rows, NROWS) == 0);
+    for (k = 0; k < sizeof(kernel_names) / sizeof(kernel_names[0]); k++) {
+        if (route_columns_use_kernel(kernel_names[k]) != 0) {
+            continue;
+        }
+        for (q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+            best = 1e18;
+            for (r = 0; r < ROUNDS; r++) {
+                t0 = now_ns();
+                CHECK(route_columns_where(&cols, queries[q].p, queries[q].n, &out) == 0);
+                t0 = now_ns() - t0;
+                best = t0 < best ? t0 : best;
+            }
+            matched = route_bitmap_count(&out);
+            printf("%-6s %-28s %7zu of %d rows in %6.1f us\n", kernel_names[k], queries[q].name,
+                   matched, NROWS, best / 1e3);
+        }
+    }
+    route_bitmap_free(&out);
+    route_columns_free(&cols);
+}
+
+int
+main(void)
+{
+    struct route_entry *rows = malloc(NROWS * sizeof(*rows));
+
+    if (rows == NULL) {
+        err(1, "malloc");
+    }
+    make_rows(rows, NROWS);
+    printf("default kernel: %s\n", route_columns_kernel());
+    check_kernels(rows);
+    check_queries(rows);
+    check_load_dump();
+    time_queries(rows);
+    free(rows);
+    printf("route_columns_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
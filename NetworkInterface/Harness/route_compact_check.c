@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks that compact route tables round-trip every route and reports
+ * their size, build and free times for a million routes.
+ *
+ *  cc -O2 -Wall -o route_compact_check route_compact_check.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_compact.c ../NetworkInterface/route_arena.c \
+ *      ../NetworkInterface/route_table.c ../NetworkInterface/route_dump.c \
+ *      ../NetworkInterface/netif_stats.c
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_compact.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define NROUTES 1000000
+
+static void
+check_arena(void)
+{
+    struct route_arena arena;
+    char *a, *b, *big;
+    int i;
+
+    route_arena_init(&arena, 1024);
+    a = route_arena_alloc(&arena, 3, 1);
+    b = route_arena_alloc(&arena, 8, 8);
+    CHECK(a && b && b >= a + 3 && ((uintptr_t)b & 7) == 0);
+    CHECK(arena.reserved == 1024);
+    // Larger than a chunk: a chunk of its own
+    big = route_arena_alloc(&arena, 4096, 16);
+    CHECK(big && ((uintptr_t)big & 15) == 0 && arena.reserved == 1024 + 4096);
+    memset(big, 1, 4096);
+    for (i = 0; i < 1000; i++) {
+        CHECK(route_arena_alloc(&arena, 24, 4) != NULL);
+    }
+    CHECK(arena.allocated >= 3 + 8 + 4096 + 24000);
+    route_arena_free(&arena);
+    CHECK(arena.head == NULL && arena.reserved == 0);
+    CHECK(route_arena_alloc(&arena, 10, 1) != NULL);
+    route_arena_free(&arena);
+}
+
+/* Mixed families, gateway and directly connected routes */
+static void
+check_round_trip(void)
+{
+    struct route_entry routes[6], e;
+    struct route_compact compact;
+    size_t i, i4 = 0, i6 = 0;
+
+    memset(routes, 0, sizeof(routes));
+    for (i = 0; i < 6; i++) {
+        routes[i].family = i % 3 == 2 ? AF_INET6 : AF_INET;
+        routes[i].prefixlen = (uint8_t)(i * 8);
+        routes[i].dst[0] = (uint8_t)(i * 8);
+        routes[i].flags = ROUTE_F_UP | (i & 1 ? ROUTE_F_GATEWAY : ROUTE_F_IFSCOPE);
+        routes[i].kernel_flags = 0x80000000u | (uint32_t)i;
+        routes[i].ifindex = 70000 + (uint32_t)i;
+        routes[i].priority = (uint32_t)i;
+        routes[i].mtu = i == 4 ? 9000 : 1500;
+        routes[i].rtt = 12000;
+        routes[i].hopcount = 2;
+        if (i & 1) {
+            routes[i].gateway_family = routes[i].family;
+            routes[i].gateway[0] = 192;
+            routes[i].gateway[15] = 1;
+        }
+    }
+    routes[5].family = 99;          // neither family: dropped
+
+    CHECK(route_compact_build(&compact, routes, 6) == 0);
+    CHECK(compact.count4 == 4 && compact.count6 == 1);
+    CHECK(compact.ngateways == 2);  // none, and the one shared by routes 1 and 3
+    CHECK(route_compact_bytes(&compact) ==
+          4 * sizeof(struct route_record4) + sizeof(struct route_record6) +
+          2 * sizeof(struct route_gateway) + compact.nattrs * sizeof(struct route_attrs));
+    for (i = 0; i < 5; i++) {
+        if (routes[i].family == AF_INET) {
+            route_compact_get4(&compact, i4++, &e);
+        } else {
+            route_compact_get6(&compact, i6++, &e);
+        }
+        CHECK(route_entry_equal(&e, &routes[i]));
+    }
+    route_compact_free(&compact);
+
+    CHECK(route_compact_build(&compact, routes, 0) == 0);
+    CHECK(compact.count4 == 0 && compact.count6 == 0 && compact.ngateways == 1);
+    CHECK(route_compact_bytes(&compact) == 0);
+    route_compact_free(&compact);
+}
+
+static void
+check_large(void)
+{
+    struct rtdump_builder b;
+    struct route_table table;
+    struct route_compact compact;
+    struct route_entry e;
+    double t0, build_ns, free_ns;
+    size_t i, mismatches = 0;
+
+    rtdump_builder_init(&b);
+    rtdump_builder_synthesize(&b, NROUTES, 64);
+    route_table_init(&table);
+    CHECK(route_table_load_dump(&table, b.buf, b.len) == NROUTES);
+    rtdump_builder_free(&b);
+
+    t0 = now_ns();
+    CHECK(route_compact_build(&compact, table.entries, table.count) == 0);
+    build_ns = now_ns() - t0;
+    CHECK(compact.count4 == NROUTES);
+    for (i = 0; i < compact.count4; i++) {
+        route_compact_get4(&compact, i, &e);
+        mismatches += !route_entry_equal(&e, &table.entries[i]);
+    }
+    CHECK(mismatches == 0);
+
+    printf("%d IPv4 routes: %.1f bytes per route (struct route_entry: %zu), "
+           "%zu gateways, %zu attribute sets\n", NROUTES,
+           (double)route_compact_bytes(&compact) / NROUTES, sizeof(struct route_entry),
+           compact.ngateways, compact.nattrs);
+    CHECK(route_compact_bytes(&compact) < 40.0 * NROUTES);
+    CHECK(compact.arena.head != NULL && compact.arena.reserved == compact.arena.allocated);
+
+    t0 = now_ns();
+    route_compact_free(&compact);
+    free_ns = now_ns() - t0;
+    printf("build %.1f ms, free %.1f us\n", build_ns / 1e6, free_ns / 1e3);
+    route_table_free(&table);
+}
+
+int
+main(void)
+{
+    check_arena();
+    check_round_trip();
+    check_large();
+    printf("route_compact_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Runs the route dump decoder in route_dump.c over recorded
+ * `NET_RT_DUMP2` blobs. Builds and runs on Linux:
+ *
+ *  cc -O2 -Wall -o route_dump_replay route_dump_replay.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_dump.c
+ *
+ * Usage:
+ *  route_dump_replay                 check the decoder against a built-in dump
+ *  route_dump_replay -w FILE         write the built-in dump to FILE
+ *  route_dump_replay FILE...         print the routes in each recorded dump
+ *
+ * A recorded dump is the raw buffer returned by
+ * sysctl({CTL_NET, PF_ROUTE, 0, 0, NET_RT_DUMP2, 0}).
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_dump.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The routing table from the example in default_gateway.c:
+ *
+ *  Destination        Gateway            Flags        Netif Expire
+ *  default            192.168.1.5        UGSc           en8
+ *  default            192.168.9.1        UGScI          en0
+ */
+static void
+build_example(struct rtdump_builder *b)
+{
+    static const uint8_t any4[4] = { 0 };
+    static const uint8_t gw_en8[4] = { 192, 168, 1, 5 };
+    static const uint8_t gw_en0[4] = { 192, 168, 9, 1 };
+    static const uint8_t net_en8[4] = { 192, 168, 1, 0 };
+    static const uint8_t net_en0[4] = { 192, 168, 9, 0 };
+    static const uint8_t loopback4[4] = { 127, 0, 0, 1 };
+    static const uint8_t any6[16] = { 0 };
+    static const uint8_t gw6[16] = { 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+    static const uint8_t loopback6[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+
+    rtdump_builder_add(b, AF_INET, any4, 0, gw_en8, 8, RTF_STATIC | RTF_PRCLONING, 1500, 12000);
+    rtdump_builder_add(b, AF_INET, any4, 0, gw_en0, 4,
+                       RTF_STATIC | RTF_PRCLONING | RTF_IFSCOPE, 1500, 30000);
+    rtdump_builder_add(b, AF_INET, loopback4, 32, NULL, 1, RTF_STATIC, 16384, 0);
+    rtdump_builder_add(b, AF_INET, net_en8, 24, NULL, 8, RTF_CLONING, 1500, 0);
+    rtdump_builder_add(b, AF_INET, net_en0, 24, NULL, 4, RTF_CLONING | RTF_IFSCOPE, 1500, 0);
+    rtdump_builder_add(b, AF_INET6, any6, 0, gw6, 4, RTF_STATIC | RTF_PRCLONING, 1500, 0);
+    rtdump_builder_add(b, AF_INET6, loopback6, 128, NULL, 1, RTF_STATIC, 16384, 0);
+}
+
+static void
+print_route(const struct route_view *view)
+{
+    char dst[INET6_ADDRSTRLEN], gw[INET6_ADDRSTRLEN], prefix[INET6_ADDRSTRLEN + 5];
+    uint8_t addr[16];
+    const uint8_t *bytes;
+    size_t len;
+
+    strcpy(dst, "?");
+    if (view->dst) {
+        bytes = route_sockaddr_addr(view->dst, view->family, &len);
+        if (bytes) {
+            memset(addr, 0, sizeof(addr));
+            memcpy(addr, bytes, len);
+            inet_ntop(view->family, addr, dst, sizeof(dst));
+        }
+    }
+
+    strcpy(gw, "link");
+    if (view->gateway && route_family_from_bsd(RT_SA_FAMILY(view->gateway)) == view->family) {
+        bytes = route_sockaddr_addr(view->gateway, view->family, &len);
+        memset(addr, 0, sizeof(addr));
+        memcpy(addr, bytes, len);
+        inet_ntop(view->family, addr, gw, sizeof(gw));
+    }
+
+    snprintf(prefix, sizeof(prefix), "%s/%d", dst, route_view_prefixlen(view));
+    printf("%-7s %-24s %-24s %08x if%-3u mtu %-5u rtt %u\n",
+           route_view_is_default(view) ? "default" : "",
+           prefix, gw, view->flags, view->ifindex,
+           view->metrics->rmx_mtu, view->metrics->rmx_rtt);
+}
+
+static int
+replay(const char *path)
+{
+    struct route_dump_iter iter;
+    struct route_view view;
+    FILE *f;
+    char *buf;
+    long size;
+    int rc, routes = 0;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        warn("%s", path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if ((buf = malloc(size > 0 ? (size_t)size : 1)) == NULL ||
+        fread(buf, 1, (size_t)size, f) != (size_t)size) {
+        err(1, "%s", path);
+    }
+    fclose(f);
+
+    printf("%s:\n", path);
+    route_dump_iter_init(&iter, buf, (size_t)size);
+    while ((rc = route_dump_iter_next(&iter, &view)) == 1) {
+        print_route(&view);
+        routes++;
+    }
+    printf("%d routes\n", routes);
+    free(buf);
+    if (rc < 0) {
+        warnx("%s: malformed dump after %d routes", path, routes);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+self_check(void)
+{
+    struct rtdump_builder b;
+    struct route_dump_iter iter;
+    struct route_view view;
+    int routes = 0, defaults4 = 0, defaults6 = 0;
+
+    rtdump_builder_init(&b);
+    build_example(&b);
+
+    route_dump_iter_init(&iter, b.buf, b.len);
+    while (route_dump_iter_next(&iter, &view) == 1) {
+        routes++;
+        CHECK((const char *)view.rtm >= b.buf && (const char *)view.rtm < b.buf + b.len);
+        if (route_view_is_default(&view)) {
+            CHECK(route_view_prefixlen(&view) == 0);
+            if (view.family == AF_INET) {
+                defaults4++;
+                CHECK(view.ifindex == (defaults4 == 1 ? 8 : 4));
+                CHECK((view.flags & RTF_IFSCOPE) == (defaults4 == 1 ? 0 : RTF_IFSCOPE));
+            } else {
+                defaults6++;
+            }
+        }
+    }
+    CHECK(routes == 7);
+    CHECK(defaults4 == 2);
+    CHECK(defaults6 == 1);
+
+    // Prefix lengths, including masks truncated by the kernel
+    route_dump_iter_init(&iter, b.buf, b.len);
+    route_dump_iter_next(&iter, &view);
+    route_dump_iter_next(&iter, &view);
+    route_dump_iter_next(&iter, &view);
+    CHECK(route_view_prefixlen(&view) == 32 && !route_view_is_default(&view));
+    route_dump_iter_next(&iter, &view);
+    CHECK(route_view_prefixlen(&view) == 24);
+
+    // Truncated dumps are reported, not overrun
+    route_dump_iter_init(&iter, b.buf, b.len - 1);
+    routes = 0;
+    while (route_dump_iter_next(&iter, &view) == 1) {
+        routes++;
+    }
+    CHECK(routes == 6 && route_dump_iter_next(&iter, &view) == -1);
+
+    // A zero rtm_msglen must not loop forever
+    ((struct rt_msghdr2 *)b.buf)->rtm_msglen = 0;
+    route_dump_iter_init(&iter, b.buf, b.len);
+    CHECK(route_dump_iter_next(&iter, &view) == -1);
+
+    rtdump_builder_free(&b);
+    printf("route_dump_replay: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, rc = 0;
+
+    if (argc == 1) {
+        return self_check();
+    }
+
+    if (argc == 3 && strcmp(argv[1], "-w") == 0) {
+        struct rtdump_builder b;
+        FILE *f;
+
+        rtdump_builder_init(&b);
+        build_example(&b);
+        if ((f = fopen(argv[2], "wb")) == NULL || fwrite(b.buf, 1, b.len, f) != b.len) {
+            err(1, "%s", argv[2]);
+        }
+        fclose(f);
+        rtdump_builder_free(&b);
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        rc |= replay(argv[i]);
+    }
+    return rc;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks that route exports round-trip every route in chunks that each
+ * parse on their own, then exports a large kernel table in a private
+ * network namespace (Linux, needs CAP_SYS_ADMIN and /dev/net/tun) and
+ * compares the heap it takes against loading the table.
+ *
+ *  cc -O2 -Wall -o route_export_check route_export_check.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_export.c ../NetworkInterface/route_netlink.c \
+ *      ../NetworkInterface/route_table.c ../NetworkInterface/route_dump.c \
+ *      ../NetworkInterface/netif_stats.c
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_export.h"
+#include "../NetworkInterface/route_netlink.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_tun.h>
+
+#define NROUTES     100000
+#define CHUNK       4096
+#define NKERNEL     50000
+
+/* Keeps every chunk, checking that each ends on a record boundary */
+struct sink {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t chunks;
+    size_t max_chunk;
+    size_t fail_after;              /* chunks accepted before failing, 0 for never */
+    int binary;                     /* decode each chunk on its own */
+    size_t split;                   /* chunks not ending on a record boundary */
+    size_t heap_peak;               /* largest heap in use at a write */
+};
+
+static size_t
+heap_in_use(void)
+{
+    return mallinfo2().uordblks;
+}
+
+static int
+sink_write(void *ctx, const void *buf, size_t len)
+{
+    struct sink *s = ctx;
+    size_t heap = heap_in_use();
+
+    if (s->fail_after && s->chunks == s->fail_after) {
+        return -1;
+    }
+    if (heap > s->heap_peak) {
+        s->heap_peak = heap;
+    }
+    if (s->cap < s->len + len) {
+        s->cap = (s->len + len) * 2;
+        if ((s->buf = realloc(s->buf, s->cap)) == NULL) {
+            err(1, "realloc");
+        }
+    }
+    if (s->binary) {
+        struct route_entry e;
+        size_t off = s->chunks == 0 ? ROUTE_EXPORT_HEADER_LEN : 0;
+        long n;
+
+        while (off < len && (n = route_export_decode((const char *)buf + off, len - off, &e)) > 0) {
+            off += (size_t)n;
+        }
+        s->split += off != len;
+    } else {
+        s->split += ((const char *)buf)[len - 1] != '\n';
+    }
+    memcpy(s->buf + s->len, buf, len);
+    s->len += len;
+    s->chunks++;
+    if (len > s->max_chunk) {
+        s->max_chunk = len;
+    }
+    return 0;
+}
+
+/* Discards chunks, only sampling the heap */
+static int
+measure_write(void *ctx, const void *buf, size_t len)
+{
+    struct sink *s = ctx;
+    size_t heap = heap_in_use();
+
+    (void)buf;
+    if (heap > s->heap_peak) {
+        s->heap_peak = heap;
+    }
+    s->len += len;
+    s->chunks++;
+    return 0;
+}
+
+/* Decodes a binary export, checking every route against `table` */
+static size_t
+decode_binary(const char *buf, size_t len, const struct route_table *table)
+{
+    struct route_entry e;
+    const struct route_entry *found;
+    size_t off = ROUTE_EXPORT_HEADER_LEN, count = 0;
+    long n;
+
+    CHECK(len >= ROUTE_EXPORT_HEADER_LEN);
+    CHECK(memcmp(buf, ROUTE_EXPORT_MAGIC, sizeof(ROUTE_EXPORT_MAGIC)) == 0);
+    CHECK(buf[sizeof(ROUTE_EXPORT_MAGIC)] == ROUTE_EXPORT_VERSION);
+    while (off < len) {
+        if ((n = route_export_decode(buf + off, len - off, &e)) <= 0) {
+            CHECK(n > 0);
+            break;
+        }
+        found = route_table_find(table, &e);
+        CHECK(found && route_entry_equal(found, &e));
+        off += (size_t)n;
+        count++;
+    }
+    return count;
+}
+
+static void
+check_synthetic(void)
+{
+    static const uint8_t v6dst[16] = { 0x20, 0x01, 0x0d, 0xb8, 0x12, 0x34 };
+    static const uint8_t v6gw[16] = { 0xfe, 0x80, [15] = 1 };
+    struct rtdump_builder b;
+    struct route_table table;
+    struct route_exporter ex;
+    struct sink s;
+    struct route_entry e;
+    size_t off, lines;
+    char *p, *line;
+    long n;
+
+    rtdump_builder_init(&b);
+    rtdump_builder_synthesize(&b, NROUTES, 4);
+    rtdump_builder_add(&b, AF_INET6, v6dst, 48, v6gw, 2, RTF_STATIC, 1280, 1000);
+    route_table_init(&table);
+    CHECK(route_table_load_dump(&table, b.buf, b.len) == NROUTES + 1);
+
+    // Binary
+    memset(&s, 0, sizeof(s));
+    s.binary = 1;
+    CHECK(route_exporter_init(&ex, ROUTE_EXPORT_BINARY, CHUNK, sink_write, &s) == 0);
+    CHECK(route_export_dump(&ex, b.buf, b.len) == NROUTES + 1);
+    CHECK(s.split == 0);
+    CHECK(ex.routes == NROUTES + 1 && ex.bytes == s.len && ex.chunks == s.chunks);
+    CHECK(s.max_chunk <= CHUNK && s.chunks > 1);
+    CHECK(decode_binary(s.buf, s.len, &table) == NROUTES + 1);
+    printf("binary: %zu routes, %zu bytes (%.1f per route) in %zu chunks; dump %zu bytes\n",
+           (size_t)ex.routes, s.len, (double)s.len / ex.routes, s.chunks, b.len);
+    route_exporter_free(&ex);
+
+    // Truncated and malformed records
+    off = ROUTE_EXPORT_HEADER_LEN;
+    n = route_export_decode(s.buf + off, s.len - off, &e);
+    CHECK(n > 3);
+    while (--n >= 0) {
+        CHECK(route_export_decode(s.buf + off, (size_t)n, &e) == 0);
+    }
+    s.buf[off] = 5;
+    CHECK(route_export_decode(s.buf + off, s.len - off, &e) == -1);
+    s.buf[off] = 4;
+    s.buf[off + 1] = 33;
+    CHECK(route_export_decode(s.buf + off, s.len - off, &e) == -1);
+    free(s.buf);
+
+    // NDJSON: whole lines in every chunk
+    memset(&s, 0, sizeof(s));
+    CHECK(route_exporter_init(&ex, ROUTE_EXPORT_NDJSON, CHUNK, sink_write, &s) == 0);
+    CHECK(route_export_dump(&ex, b.buf, b.len) == NROUTES + 1);
+    CHECK(s.split == 0 && s.max_chunk <= CHUNK && s.len > 0);
+    s.buf[s.len - 1] = '\0';
+    lines = 0;
+    for (line = strtok_r(s.buf, "\n", &p); line; line = strtok_r(NULL, "\n", &p)) {
+        CHECK(line[0] == '{' && line[strlen(line) - 1] == '}');
+        lines++;
+    }
+    CHECK(lines == NROUTES + 1);
+    CHECK(strcmp(s.buf, "{\"dst\":\"0.0.0.0/0\",\"gateway\":\"10.0.0.1\",\"ifindex\":1,"
+                 "\"flags\":\"UGS\",\"priority\":0,\"mtu\":1500,\"rtt\":20000,\"rttvar\":0,"
+                 "\"hopcount\":0}") == 0);
+    printf("ndjson: %zu bytes in %zu chunks\n", s.len, s.chunks);
+    route_exporter_free(&ex);
+    free(s.buf);
+
+    // A failed write stops the export
+    memset(&s, 0, sizeof(s));
+    s.fail_after = 2;
+    CHECK(route_exporter_init(&ex, ROUTE_EXPORT_BINARY, CHUNK, sink_write, &s) == 0);
+    CHECK(route_export_dump(&ex, b.buf, b.len) == -1);
+    CHECK(s.chunks == 2 && ex.failed);
+    CHECK(route_exporter_add(&ex, &table.entries[0]) == -1);
+    route_exporter_free(&ex);
+    free(s.buf);
+
+    route_table_free(&table);
+    rtdump_builder_free(&b);
+}
+
+static int sock = -1;
+
+static void
+check_kernel(void)
+{
+    struct route_table table;
+    struct route_exporter ex;
+    struct rtentry rt;
+    struct sink s;
+    char dst[32];
+    size_t base, loaded;
+    int fd, i, count;
+    long n;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        warn("unshare(CLONE_NEWNET) (skipping kernel export)");
+        return;
+    }
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 || set_flags("lo", IFF_UP, 0) != 0) {
+        err(1, "loopback");
+    }
+    if ((fd = add_tun("tun0", "10.9.0.1")) < 0) {
+        warn("/dev/net/tun (skipping kernel export)");
+        return;
+    }
+    memset(&rt, 0, sizeof(rt));
+    set_sin(&rt.rt_genmask, "255.255.255.0");
+    set_sin(&rt.rt_gateway, "10.9.0.2");
+    rt.rt_flags = RTF_UP | RTF_GATEWAY;
+    rt.rt_dev = "tun0";
+    for (i = 0; i < NKERNEL; i++) {
+        snprintf(dst, sizeof(dst), "%d.%d.%d.0", 20 + i / 65536, (i / 256) % 256, i % 256);
+        set_sin(&rt.rt_dst, dst);
+        if (ioctl(sock, SIOCADDRT, &rt) != 0) {
+            err(1, "SIOCADDRT %s", dst);
+        }
+    }
+
+    // Loading the whole table, for comparison
+    base = heap_in_use();
+    route_table_init(&table);
+    count = route_netlink_load_table(&table);
+    loaded = heap_in_use() - base;
+    CHECK(count >= NKERNEL);
+    route_table_free(&table);
+
+    memset(&s, 0, sizeof(s));
+    base = heap_in_use();
+    CHECK(route_exporter_init(&ex, ROUTE_EXPORT_BINARY, CHUNK, measure_write, &s) == 0);
+    n = route_export_kernel(&ex, AF_UNSPEC);
+    CHECK(n == count);
+    // The chunk buffer and the netlink receive buffer, plus allocator slack
+    CHECK(s.heap_peak - base < CHUNK + ROUTE_NETLINK_BUFSIZE + 4096);
+    printf("kernel: %ld routes, %zu bytes exported; heap %zu bytes streaming, %zu loading\n",
+           n, s.len, s.heap_peak - base, loaded);
+    route_exporter_free(&ex);
+    close(fd);
+}
+
+int
+main(void)
+{
+    check_synthetic();
+    check_kernel();
+    printf("route_export_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
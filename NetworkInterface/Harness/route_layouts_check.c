@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks that the fixed-offset sockaddr decoders of route_dump.c agree
+ * with the generic walker on every message of recorded and synthetic
+ * NET_RT_DUMP2 dumps, and on every message with its sockaddr headers
+ * corrupted or cut short, then reports both decoders' cost per route.
+ *
+ *  cc -O2 -Wall -o route_layouts_check route_layouts_check.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_dump.c
+ *
+ * Usage: route_layouts_check [DUMP...]   (default fixtures/example_default_routes.rtdump)
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_dump.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef int (*decode_fn)(struct route_view *, int, const void *, const void *);
+
+static volatile size_t sink;
+
+/* Both decoders over the sockaddrs of `rtm` up to `end`; returns 1 when they agree */
+static int
+agree(const struct rt_msghdr2 *rtm, int addrs, const char *end)
+{
+    struct route_view fast, generic;
+    int rc_fast, rc_generic;
+
+    memset(&fast, 0xa5, sizeof(fast));
+    memset(&generic, 0xa5, sizeof(generic));
+    rc_fast = route_view_decode_addrs(&fast, addrs, rtm + 1, end);
+    rc_generic = route_view_decode_addrs_generic(&generic, addrs, rtm + 1, end);
+    return rc_fast == rc_generic &&
+           (rc_fast != 0 || (fast.dst == generic.dst && fast.gateway == generic.gateway &&
+                             fast.mask == generic.mask && fast.family == generic.family));
+}
+
+/* Every message, whole, corrupted and truncated. Returns the number of messages. */
+static size_t
+check_dump(const char *name, char *buf, size_t len)
+{
+    static const uint8_t values[] = { 0, 1, 2, 3, 4, 5, 8, 12, 16, 17, 18, 20, 28, 29, 30, 0xff };
+    static const int masks[] = { RTA_DST | RTA_GATEWAY, RTA_DST | RTA_GATEWAY | RTA_NETMASK,
+                                 RTA_DST, RTA_GATEWAY | RTA_NETMASK, 0xff };
+    size_t off, n = 0, i, v, cut, disagreements = 0;
+
+    for (off = 0; off + sizeof(struct rt_msghdr2) <= len; n++) {
+        struct rt_msghdr2 *rtm = (struct rt_msghdr2 *)(buf + off);
+        char *sa = (char *)(rtm + 1), *end = buf + off + rtm->rtm_msglen;
+        size_t salen = (size_t)(end - sa);
+
+        if (rtm->rtm_msglen < sizeof(*rtm) || rtm->rtm_msglen > len - off) {
+            errx(1, "%s: malformed at %zu", name, off);
+        }
+        disagreements += !agree(rtm, rtm->rtm_addrs, end);
+        for (i = 0; i < sizeof(masks) / sizeof(masks[0]); i++) {
+            disagreements += !agree(rtm, masks[i], end);
+        }
+        // Every byte that could be a sockaddr header, for a dense sample of the lengths
+        // and families that steer the decoders
+        for (i = 0; i < salen && i < 80; i++) {
+            uint8_t saved = (uint8_t)sa[i];
+            for (v = 0; v < sizeof(values); v++) {
+                sa[i] = (char)values[v];
+                disagreements += !agree(rtm, rtm->rtm_addrs, end);
+            }
+            sa[i] = (char)saved;
+        }
+        for (cut = 0; cut <= salen; cut++) {
+            disagreements += !agree(rtm, rtm->rtm_addrs, end - cut);
+        }
+        off += rtm->rtm_msglen;
+    }
+    CHECK(disagreements == 0);
+    return n;
+}
+
+/* ns per route of `decode` over the messages of `buf` */
+static double
+time_decoder(decode_fn decode, const char *buf, size_t len, size_t n)
+{
+    struct route_view view;
+    size_t reps = 2000000 / (n ? n : 1) + 1, r, off;
+    double start = now_ns();
+
+    for (r = 0; r < reps; r++) {
+        for (off = 0; off < len; off += ((const struct rt_msghdr2 *)(buf + off))->rtm_msglen) {
+            const struct rt_msghdr2 *rtm = (const struct rt_msghdr2 *)(buf + off);
+            if (decode(&view, rtm->rtm_addrs, rtm + 1, buf + off + rtm->rtm_msglen) == 0) {
+                sink += (size_t)view.family;
+            }
+        }
+    }
+    return (now_ns() - start) / (double)(reps * n);
+}
+
+static void
+run(const char *name, char *buf, size_t len)
+{
+    size_t n = check_dump(name, buf, len);
+    double generic, fast;
+
+    if (n == 0) {
+        return;
+    }
+    generic = time_decoder(route_view_decode_addrs_generic, buf, len, n);
+    fast = time_decoder(route_view_decode_addrs, buf, len, n);
+    printf("%-44s %8zu routes: generic %5.1f ns, fixed-offset %5.1f ns\n", name, n, generic, fast);
+}
+
+/* IPv4 and IPv6 network and host routes via IP and link gateways */
+static void
+build_mixed(struct rtdump_builder *b, size_t count)
+{
+    uint8_t dst6[16] = { 0x20, 0x01, 0x0d, 0xb8 }, gw6[16] = { 0xfe, 0x80 };
+    uint8_t dst4[4] = { 11, 0, 0, 0 }, gw4[4] = { 10, 0, 0, 1 };
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        int v6 = i % 3 == 2, host = i % 5 == 0, link = i % 2 == 0;
+        dst4[1] = (uint8_t)(i >> 8);
+        dst4[2] = (uint8_t)i;
+        dst6[4] = (uint8_t)(i >> 8);
+        dst6[5] = (uint8_t)i;
+        gw6[15] = (uint8_t)i;
+        if (v6) {
+            rtdump_builder_add(b, AF_INET6, dst6, host ? 128 : (int)(48 + i % 17), link ? NULL : gw6,
+                               (unsigned short)(1 + i % 4), RTF_STATIC, 1500, 0);
+        } else {
+            rtdump_builder_add(b, AF_INET, dst4, host ? 32 : (int)(8 + i % 17), link ? NULL : gw4,
+                               (unsigned short)(1 + i % 4), RTF_STATIC, 1500, 0);
+        }
+    }
+}
+
+static char *
+read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    long size;
+
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        err(1, "%s", path);
+    }
+    if ((buf = malloc((size_t)size + 1)) == NULL || fread(buf, 1, (size_t)size, f) != (size_t)size) {
+        err(1, "%s", path);
+    }
+    fclose(f);
+    *len = (size_t)size;
+    return buf;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *fixture = "fixtures/example_default_routes.rtdump";
+    struct rtdump_builder b;
+    size_t len;
+    char *buf;
+    int i;
+
+    for (i = 1; i < (argc > 1 ? argc : 2); i++) {
+        buf = read_file(argc > 1 ? argv[i] : fixture, &len);
+        run(argc > 1 ? argv[i] : fixture, buf, len);
+        free(buf);
+    }
+
+    rtdump_builder_init(&b);
+    build_mixed(&b, 3000);
+    run("synthetic IPv4/IPv6, IP/link gateways", b.buf, b.len);
+    rtdump_builder_free(&b);
+
+    rtdump_builder_init(&b);
+    rtdump_builder_synthesize(&b, 3000, 8);
+    run("synthetic IPv4 (route_bench)", b.buf, b.len);
+    rtdump_builder_free(&b);
+
+    printf("route_layouts_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the longest-prefix-match index against a linear scan over
+ * random IPv4 and IPv6 tables, and reports the lookup cost. Then checks
+ * an index updated from another after route changes the same way, and
+ * reports how much of the original it shares. Also checks that reject
+ * routes are marked as such.
+ *
+ *  cc -O2 -Wall -o route_lpm_check route_lpm_check.c harness.c \
+ *      ../NetworkInterface/route_lpm.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/netif_stats.c
+ */
+
+#include "harness.h"
+
+#include "../NetworkInterface/route_lpm.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+static uint64_t
+next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int
+matches(const struct route_entry *e, const uint8_t *addr)
+{
+    int i;
+
+    for (i = 0; i < e->prefixlen; i++) {
+        uint8_t bit = (uint8_t)(0x80 >> (i % 8));
+        if ((e->dst[i / 8] & bit) != (addr[i / 8] & bit)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Linear scan with the same tie break as route_lpm_build (first route wins) */
+static const struct route_entry *
+scan(const struct route_entry *routes, size_t n, int family, const uint8_t *addr)
+{
+    const struct route_entry *best = NULL;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (routes[i].family == family && matches(&routes[i], addr) &&
+            (best == NULL || routes[i].prefixlen > best->prefixlen)) {
+            best = &routes[i];
+        }
+    }
+    return best;
+}
+
+static void
+random_route(struct route_entry *e, int family, int i)
+{
+    int bits = family == AF_INET ? 32 : 128, b;
+    uint64_t r = next_random();
+
+    memset(e, 0, sizeof(*e));
+    e->family = (uint8_t)family;
+    // Favour a handful of common lengths, plus some of every length
+    switch (r % 4) {
+        case 0: e->prefixlen = (uint8_t)(bits == 32 ? 24 : 48); break;
+        case 1: e->prefixlen = (uint8_t)(bits == 32 ? 16 : 64); break;
+        default: e->prefixlen = (uint8_t)((r >> 8) % (bits + 1)); break;
+    }
+    // Keep everything within a narrow range so prefixes nest
+    e->dst[0] = family == AF_INET ? 10 : 0x20;
+    e->dst[1] = (uint8_t)(next_random() & 0x3);
+    for (b = 2; b < bits / 8; b++) {
+        e->dst[b] = (uint8_t)next_random();
+    }
+    for (b = 0; b < 16; b++) {
+        int keep = e->prefixlen - b * 8;
+        e->dst[b] &= keep >= 8 ? 0xff : keep <= 0 ? 0 : (uint8_t)(0xff << (8 - keep));
+    }
+    e->ifindex = (uint32_t)(1 + i % 7);
+    e->flags = ROUTE_F_UP | ROUTE_F_GATEWAY;
+    // A gateway of its own, so a next hop identifies its route
+    e->gateway_family = AF_INET;
+    e->gateway[0] = 192;
+    e->gateway[1] = (uint8_t)(i >> 16);
+    e->gateway[2] = (uint8_t)(i >> 8);
+    e->gateway[3] = (uint8_t)i;
+}
+
+static void
+random_addresses(uint8_t (*addrs)[16], size_t nlookups, int family,
+                 const struct route_entry *routes, size_t nroutes)
+{
+    size_t i, b;
+
+    for (i = 0; i < nlookups; i++) {
+        addrs[i][0] = family == AF_INET ? 10 : 0x20;
+        addrs[i][1] = (uint8_t)(next_random() & 0x3);
+        for (b = 2; b < 16; b++) {
+            addrs[i][b] = (uint8_t)next_random();
+        }
+        // Often hit a route's own prefix exactly
+        if (i % 2 == 0) {
+            const struct route_entry *e = &routes[next_random() % nroutes];
+            if (e->family == family) {
+                memcpy(addrs[i], e->dst, e->prefixlen / 8);
+            }
+        }
+    }
+}
+
+/* Compares `n` lookups against the linear scan; returns the number that matched a route */
+static size_t
+verify(const struct route_lpm *lpm, const struct route_entry *routes, size_t nroutes,
+       int family, uint8_t (*addrs)[16], size_t n)
+{
+    size_t i, hits = 0;
+
+    for (i = 0; i < n; i++) {
+        const struct route_entry *want = scan(routes, nroutes, family, addrs[i]);
+        const struct route_nexthop *got = route_lpm_lookup(lpm, family, addrs[i]);
+        if (want == NULL) {
+            CHECK(got == NULL);
+        } else {
+            CHECK(got != NULL && got->ifindex == want->ifindex &&
+                  got->gateway_family == want->gateway_family &&
+                  memcmp(got->gateway, want->gateway, 4) == 0);
+            hits++;
+        }
+    }
+    return hits;
+}
+
+/* Removes exact duplicates so the scan's first match is the one indexed */
+static void
+drop_duplicates(struct route_entry *routes, size_t nroutes)
+{
+    size_t i, j;
+
+    for (i = 0; i < nroutes; i++) {
+        for (j = 0; j < i; j++) {
+            if (routes[j].family == routes[i].family && routes[j].prefixlen == routes[i].prefixlen &&
+                memcmp(routes[j].dst, routes[i].dst, 16) == 0) {
+                routes[i].prefixlen = 0;
+                routes[i].family = 0;
+                break;
+            }
+        }
+    }
+}
+
+static void
+check_family(int family, size_t nroutes, size_t nlookups)
+{
+    struct route_entry *routes = calloc(nroutes, sizeof(*routes));
+    uint8_t (*addrs)[16] = calloc(nlookups, sizeof(*addrs));
+    struct route_lpm lpm;
+    size_t i, j, hits;
+    double start, elapsed;
+    volatile uintptr_t sink = 0;
+
+    for (i = 0; i < nroutes; i++) {
+        random_route(&routes[i], family, (int)i);
+    }
+    drop_duplicates(routes, nroutes);
+    random_addresses(addrs, nlookups, family, routes, nroutes);
+
+    CHECK(route_lpm_build(&lpm, routes, nroutes) == 0);
+    // The linear scan is slow: compare a tenth of the lookups
+    hits = verify(&lpm, routes, nroutes, family, addrs, nlookups / 10);
+
+    start = now_ns();
+    for (j = 0; j < 100; j++) {
+        for (i = 0; i < nlookups; i++) {
+            sink += (uintptr_t)route_lpm_lookup(&lpm, family, addrs[i]);
+        }
+    }
+    elapsed = now_ns() - start;
+    printf("%s: %lu routes, %lu/%lu lookups matched, %.1f ns/lookup\n",
+           family == AF_INET ? "IPv4" : "IPv6", (unsigned long)nroutes, (unsigned long)hits,
+           (unsigned long)(nlookups / 10), elapsed / (double)(nlookups * 100));
+
+    route_lpm_free(&lpm);
+    free(addrs);
+    free(routes);
+}
+
+static void
+check_defaults(void)
+{
+    struct route_entry routes[3];
+    struct route_lpm lpm;
+    const struct route_nexthop *nh;
+    uint32_t addr = 0x01020304;
+
+    memset(routes, 0, sizeof(routes));
+    // A scoped default and the primary default: the primary must win
+    routes[0].family = AF_INET;
+    routes[0].flags = ROUTE_F_UP | ROUTE_F_GATEWAY | ROUTE_F_IFSCOPE;
+    routes[0].ifindex = 4;
+    routes[1].family = AF_INET;
+    routes[1].flags = ROUTE_F_UP | ROUTE_F_GATEWAY;
+    routes[1].ifindex = 8;
+    // Linux style metrics: lower priority wins
+    routes[2].family = AF_INET6;
+    routes[2].flags = ROUTE_F_UP | ROUTE_F_GATEWAY;
+    routes[2].priority = 600;
+    routes[2].ifindex = 3;
+
+    CHECK(route_lpm_build(&lpm, routes, 3) == 0);
+    nh = route_lpm_lookup4(&lpm, addr);
+    CHECK(nh && nh->ifindex == 8);
+    nh = route_lpm_lookup6(&lpm, (const uint8_t *)"\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\1");
+    CHECK(nh && nh->ifindex == 3);
+    route_lpm_free(&lpm);
+}
+
+/* A reject route inside an ordinary one still hides it, and says so */
+static void
+check_reject(void)
+{
+    struct route_entry routes[2];
+    struct route_lpm lpm;
+    const struct route_nexthop *nh;
+
+    memset(routes, 0, sizeof(routes));
+    routes[0].family = AF_INET;
+    routes[0].prefixlen = 16;
+    routes[0].dst[0] = 10;
+    routes[0].dst[1] = 1;
+    routes[0].flags = ROUTE_F_UP;
+    routes[0].ifindex = 4;
+    routes[1] = routes[0];
+    routes[1].prefixlen = 24;
+    routes[1].dst[2] = 2;
+    routes[1].flags = ROUTE_F_UP | ROUTE_F_REJECT;
+
+    CHECK(route_lpm_build(&lpm, routes, 2) == 0);
+    nh = route_lpm_lookup4(&lpm, htonl(0x0a010203));
+    CHECK(nh && nh->ifindex == 4 && nh->reject);
+    nh = route_lpm_lookup4(&lpm, htonl(0x0a010303));
+    CHECK(nh && nh->ifindex == 4 && !nh->reject);
+    route_lpm_free(&lpm);
+}
+
+/*
+ * Updates an index after changing some of its routes, checks it against
+ * the scan, and that the original is untouched and shares what did not
+ * change. `extra` host routes each move to a gateway of their own, which
+ * runs out of IPv4 next hop indexes when large enough.
+ */
+static void
+check_update(size_t nroutes, size_t extra)
+{
+    // The scan is linear in the routes
+    const size_t total = nroutes + 1 + extra, nlookups = extra ? 400 : 4000;
+    struct route_entry *before = calloc(total, sizeof(*before));
+    struct route_entry *after = calloc(total, sizeof(*after));
+    uint8_t (*addrs)[16] = calloc(nlookups, sizeof(*addrs));
+    struct route_lpm lpm, updated, rebuilt;
+    size_t i, shared = 0;
+    double start, update_ns, build_ns;
+
+    for (i = 0; i < nroutes; i++) {
+        random_route(&before[i], AF_INET, (int)i);
+        // Within 10.0.0.0/14: bits past /16 are already clear
+        if (before[i].prefixlen < 16) {
+            before[i].prefixlen = 16;
+            before[i].dst[0] = 10;
+        }
+    }
+    // And a default route
+    before[nroutes].family = AF_INET;
+    before[nroutes].flags = ROUTE_F_UP | ROUTE_F_GATEWAY;
+    before[nroutes].ifindex = 9;
+    drop_duplicates(before, nroutes + 1);
+    memcpy(after, before, total * sizeof(*after));
+
+    // Remove, add and move to another gateway a route in ten each, longer
+    // than /24 included; the default route stays
+    for (i = 0; i < nroutes; i += 10) {
+        after[i].family = 0;
+        if (i + 1 < nroutes) {
+            random_route(&after[i + 1], AF_INET, (int)(nroutes + 2 * extra + i));
+            if (after[i + 1].prefixlen < 16) {
+                after[i + 1].prefixlen = 16;
+                after[i + 1].dst[0] = 10;
+            }
+        }
+        if (i + 2 < nroutes) {
+            after[i + 2].gateway[0] = 172;
+        }
+    }
+    drop_duplicates(after, nroutes + 1);
+    // The same host routes in 11.0.0.0/8 before and after, each through
+    // a gateway of its own that changes
+    for (i = 0; i < extra; i++) {
+        random_route(&before[nroutes + 1 + i], AF_INET, (int)(nroutes + i));
+        random_route(&after[nroutes + 1 + i], AF_INET, (int)(nroutes + extra + i));
+        after[nroutes + 1 + i].prefixlen = before[nroutes + 1 + i].prefixlen = 32;
+        after[nroutes + 1 + i].dst[0] = before[nroutes + 1 + i].dst[0] = 11;
+        after[nroutes + 1 + i].dst[1] = before[nroutes + 1 + i].dst[1] = (uint8_t)(i >> 16);
+        after[nroutes + 1 + i].dst[2] = before[nroutes + 1 + i].dst[2] = (uint8_t)(i >> 8);
+        after[nroutes + 1 + i].dst[3] = before[nroutes + 1 + i].dst[3] = (uint8_t)i;
+    }
+    random_addresses(addrs, nlookups, AF_INET, after, total);
+    for (i = 0; i < nlookups; i += 8) {
+        // And addresses covered by the default route only
+        addrs[i][0] = (uint8_t)(i >> 3);
+    }
+
+    start = now_ns();
+    CHECK(route_lpm_build(&lpm, before, total) == 0);
+    build_ns = now_ns() - start;
+    start = now_ns();
+    CHECK(route_lpm_update(&updated, &lpm, after, total) == 0);
+    update_ns = now_ns() - start;
+    verify(&updated, after, total, AF_INET, addrs, nlookups);
+    verify(&lpm, before, total, AF_INET, addrs, nlookups);
+
+    for (i = 0; i < ROUTE_LPM_CHUNKS; i++) {
+        shared += updated.tbl24[i] == lpm.tbl24[i];
+    }
+    if (extra == 0) {
+        // Only the chunk holding 10.0.0.0/14 changed
+        CHECK(shared == ROUTE_LPM_CHUNKS - 1);
+        // Updating from an identical table changes nothing
+        CHECK(route_lpm_update(&rebuilt, &updated, after, total) == 0);
+        for (i = 0; i < ROUTE_LPM_CHUNKS; i++) {
+            CHECK(rebuilt.tbl24[i] == updated.tbl24[i]);
+        }
+        CHECK(rebuilt.nnexthops4 == updated.nnexthops4);
+        route_lpm_free(&rebuilt);
+    } else {
+        // Out of next hop indexes: started over without the unused ones
+        CHECK(updated.nnexthops4 < lpm.nnexthops4 + extra);
+
+    }
+    printf("IPv4 update: %lu routes, %lu moved: %lu of %u chunks shared, "
+           "%.2f ms vs %.2f ms to build\n", (unsigned long)nroutes, (unsigned long)extra,
+           (unsigned long)shared, ROUTE_LPM_CHUNKS, update_ns / 1e6, build_ns / 1e6);
+
+    // Either may be freed first
+    route_lpm_free(&lpm);
+    verify(&updated, after, total, AF_INET, addrs, nlookups / 10);
+    route_lpm_free(&updated);
+    free(addrs);
+    free(after);
+    free(before);
+}
+
+int
+main(void)
+{
+    check_defaults();
+    check_reject();
+    check_family(AF_INET, 2000, 200000);
+    check_family(AF_INET6, 2000, 200000);
+    check_update(2000, 0);
+    check_update(2000, 20000);
+    printf("route_lpm_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks that parallel decoding of NET_RT_DUMP2 and netlink dumps
+ * yields exactly the routes, in the same order, as decoding them on
+ * one thread, whatever the number of workers, and reports the time each
+ * phase takes for a million routes.
+ *
+ *  cc -O2 -Wall -o route_parallel_check route_parallel_check.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_parallel.c ../NetworkInterface/route_arena.c \
+ *      ../NetworkInterface/route_netlink.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/netif_stats.c -lpthread
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_netlink.h"
+#include "../NetworkInterface/route_parallel.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/rtnetlink.h>
+
+#define NROUTES     1000000
+
+static const unsigned thread_counts[] = { 1, 2, 3, 4, 8 };
+
+static int
+keep_hosts(const struct route_entry *e, void *ctx)
+{
+    (void)ctx;
+    return e->prefixlen == 32;
+}
+
+static int
+same_routes(const struct route_parallel_result *r, const struct route_entry *expected, size_t count)
+{
+    return r->count == count &&
+           memcmp(r->entries, expected, count * sizeof(*expected)) == 0;
+}
+
+/* Offset of message `n` of a NET_RT_DUMP2 buffer, walking rtm_msglen */
+static size_t
+message_offset(const struct rtdump_builder *b, size_t n)
+{
+    size_t off = 0;
+    uint16_t msglen;
+
+    while (n-- > 0) {
+        memcpy(&msglen, b->buf + off, sizeof(msglen));
+        off += msglen;
+    }
+    return off;
+}
+
+/* Every NET_RT_DUMP2 route, decoded one at a time */
+static struct route_entry *
+decode_serial(const struct rtdump_builder *b, size_t *count)
+{
+    struct route_parallel_result r;
+    struct route_entry *entries;
+
+    // A single worker decodes the batches in order on this thread
+    if (route_parallel_decode(b->buf, b->len, ROUTE_PARALLEL_BSD_DUMP, 1, NULL, NULL, &r) != 0) {
+        err(1, "route_parallel_decode");
+    }
+    CHECK(r.threads == 1 && r.steals == 0);
+    entries = r.entries;
+    *count = r.count;
+    return entries;
+}
+
+static void
+check_bsd(void)
+{
+    struct rtdump_builder b;
+    struct route_parallel_result r;
+    struct route_table table;
+    struct route_entry *expected;
+    size_t count, hosts, i;
+    unsigned t;
+    char *corrupt;
+
+    rtdump_builder_init(&b);
+    rtdump_builder_synthesize(&b, NROUTES, 8);
+    expected = decode_serial(&b, &count);
+    CHECK(count == NROUTES);
+
+    // The serial reference agrees with loading the table
+    route_table_init(&table);
+    CHECK(route_table_load_dump(&table, b.buf, b.len) == NROUTES);
+    for (i = 0; i < count; i += 997) {
+        const struct route_entry *found = route_table_find(&table, &expected[i]);
+        CHECK(found && route_entry_equal(found, &expected[i]));
+    }
+    route_table_free(&table);
+
+    for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        CHECK(route_parallel_decode(b.buf, b.len, ROUTE_PARALLEL_BSD_DUMP, thread_counts[t],
+                                    NULL, NULL, &r) == 0);
+        CHECK(r.messages == NROUTES && r.threads == thread_counts[t]);
+        CHECK(same_routes(&r, expected, count));
+        printf("bsd %u threads: index %.1f ms, decode %.1f ms, merge %.1f ms, %llu steals\n",
+               r.threads, r.index_ns / 1e6, r.decode_ns / 1e6, r.merge_ns / 1e6,
+               (unsigned long long)r.steals);
+        route_parallel_result_free(&r);
+    }
+
+    // Filtered, in order
+    CHECK(route_parallel_decode(b.buf, b.len, ROUTE_PARALLEL_BSD_DUMP, 4, keep_hosts, NULL, &r) == 0);
+    for (i = 0, hosts = 0; i < count; i++) {
+        if (expected[i].prefixlen == 32) {
+            CHECK(hosts < r.count && memcmp(&r.entries[hosts], &expected[i], sizeof(expected[i])) == 0);
+            hosts++;
+        }
+    }
+    CHECK(r.count == hosts && hosts == NROUTES / 4 - 1);
+    route_parallel_result_free(&r);
+
+    // Fewer routes than workers, and an empty dump
+    CHECK(route_parallel_decode(b.buf, message_offset(&b, 1000), ROUTE_PARALLEL_BSD_DUMP, 8,
+                                NULL, NULL, &r) == 0);
+    CHECK(r.threads == 1 && same_routes(&r, expected, 1000));
+    route_parallel_result_free(&r);
+    CHECK(route_parallel_decode(b.buf, 0, ROUTE_PARALLEL_BSD_DUMP, 8, NULL, NULL, &r) == 0);
+    CHECK(r.count == 0 && r.messages == 0);
+    route_parallel_result_free(&r);
+
+    // A message cut short is found by the index phase
+    CHECK(route_parallel_decode(b.buf, b.len - 1, ROUTE_PARALLEL_BSD_DUMP, 4, NULL, NULL, &r) == -1);
+    CHECK(errno == EBADMSG && r.entries == NULL);
+    // A sockaddr overrunning its message is found by a worker (the
+    // first sockaddr follows the 92-byte rt_msghdr2)
+    if ((corrupt = malloc(b.len)) == NULL) {
+        err(1, "malloc");
+    }
+    memcpy(corrupt, b.buf, b.len);
+    corrupt[message_offset(&b, NROUTES / 2) + 92] = (char)0xfc;
+    CHECK(route_parallel_decode(corrupt, b.len, ROUTE_PARALLEL_BSD_DUMP, 4, NULL, NULL, &r) == -1);
+    CHECK(errno == EBADMSG);
+    free(corrupt);
+
+    free(expected);
+    rtdump_builder_free(&b);
+}
+
+static void
+add_attr(char *msg, unsigned short type, const void *data, size_t len)
+{
+    struct nlmsghdr *nlh = (struct nlmsghdr *)msg;
+    struct rtattr *rta = (struct rtattr *)(msg + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = (unsigned short)RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* RTM_NEWROUTE messages of a dump, as in a ROUTE_CAPTURE_NETLINK section */
+static char *
+build_netlink(size_t count, size_t *len)
+{
+    size_t cap = count * 128 + 64, off = 0, i;
+    struct nlmsghdr *nlh;
+    struct rtmsg *rtm;
+    char *buf;
+
+    if ((buf = calloc(1, cap)) == NULL) {
+        err(1, "calloc");
+    }
+    for (i = 0; i < count; i++) {
+        uint32_t dst = htonl(0x0B000000u + ((uint32_t)i << 8)), gw = htonl(0x0A000001u);
+        uint32_t oif = 1 + i % 8, table = RT_TABLE_MAIN, priority = (uint32_t)(i % 3);
+
+        nlh = (struct nlmsghdr *)(buf + off);
+        nlh->nlmsg_len = NLMSG_LENGTH(sizeof(*rtm));
+        nlh->nlmsg_type = RTM_NEWROUTE;
+        nlh->nlmsg_flags = NLM_F_MULTI;
+        rtm = NLMSG_DATA(nlh);
+        rtm->rtm_family = i % 100 == 99 ? AF_BRIDGE : AF_INET;      // untracked
+        rtm->rtm_dst_len = 24;
+        rtm->rtm_table = RT_TABLE_MAIN;
+        rtm->rtm_protocol = RTPROT_STATIC;
+        rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+        rtm->rtm_type = RTN_UNICAST;
+        add_attr((char *)nlh, RTA_TABLE, &table, sizeof(table));
+        add_attr((char *)nlh, RTA_DST, &dst, sizeof(dst));
+        add_attr((char *)nlh, RTA_GATEWAY, &gw, sizeof(gw));
+        add_attr((char *)nlh, RTA_OIF, &oif, sizeof(oif));
+        add_attr((char *)nlh, RTA_PRIORITY, &priority, sizeof(priority));
+        off += NLMSG_ALIGN(nlh->nlmsg_len);
+    }
+    nlh = (struct nlmsghdr *)(buf + off);
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(int));
+    nlh->nlmsg_type = NLMSG_DONE;
+    *len = off + nlh->nlmsg_len;
+    return buf;
+}
+
+static void
+check_netlink(void)
+{
+    struct route_parallel_result r;
+    struct route_entry *expected;
+    const struct nlmsghdr *nlh;
+    size_t len, count = 0, rem;
+    unsigned t;
+    char *buf;
+
+    buf = build_netlink(NROUTES, &len);
+    if ((expected = malloc(NROUTES * sizeof(*expected))) == NULL) {
+        err(1, "malloc");
+    }
+    rem = len;
+    for (nlh = (const struct nlmsghdr *)buf; NLMSG_OK(nlh, rem); nlh = NLMSG_NEXT(nlh, rem)) {
+        if (nlh->nlmsg_type == RTM_NEWROUTE && route_netlink_parse_route(nlh, &expected[count]) == 0) {
+            count++;
+        }
+    }
+    CHECK(count == NROUTES - NROUTES / 100);
+
+    for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        CHECK(route_parallel_decode(buf, len, ROUTE_PARALLEL_NETLINK, thread_counts[t],
+                                    NULL, NULL, &r) == 0);
+        CHECK(r.messages == NROUTES + 1);
+        CHECK(same_routes(&r, expected, count));
+        printf("netlink %u threads: index %.1f ms, decode %.1f ms, merge %.1f ms, %llu steals\n",
+               r.threads, r.index_ns / 1e6, r.decode_ns / 1e6, r.merge_ns / 1e6,
+               (unsigned long long)r.steals);
+        route_parallel_result_free(&r);
+    }
+
+    // A prefix longer than the address
+    ((struct rtmsg *)NLMSG_DATA((struct nlmsghdr *)buf))->rtm_dst_len = 40;
+    CHECK(route_parallel_decode(buf, len, ROUTE_PARALLEL_NETLINK, 4, NULL, NULL, &r) == -1);
+    CHECK(errno == EBADMSG);
+
+    free(expected);
+    free(buf);
+}
+
+int
+main(void)
+{
+    printf("%ld online CPUs\n", sysconf(_SC_NPROCESSORS_ONLN));
+    check_bsd();
+    check_netlink();
+    printf("route_parallel_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Resolves a mix of destinations with route_resolve_batch() in a private
+ * network namespace (Linux, needs CAP_SYS_ADMIN and /dev/net/tun): via
+ * the default route, via a more specific route with its own MTU,
+ * on-link, loopback, and without any route. Pipelined and one-at-a-time
+ * lookups must agree; both are timed.
+ *
+ *  cc -O2 -Wall -o route_resolver_check route_resolver_check.c harness.c \
+ *      ../NetworkInterface/route_resolver.c ../NetworkInterface/route_netlink.c \
+ *      ../NetworkInterface/route_table.c ../NetworkInterface/route_dump.c \
+ *      ../NetworkInterface/netif_stats.c
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+
+#include "../NetworkInterface/route_resolver.h"
+#include "../NetworkInterface/netif_stats.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_tun.h>
+#include <linux/rtnetlink.h>
+
+#define DESTINATIONS    1000
+
+static int sock = -1;
+
+/*
+ * Adds a route to `dst`/`prefixlen` through `gateway` on `ifindex`, with
+ * `mtu` when not 0. Over netlink: SIOCADDRT turns RTF_MTU into an advmss.
+ */
+static int
+add_route(const char *dst, int prefixlen, const char *gateway, unsigned ifindex, uint32_t mtu)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct rtmsg rtm;
+        char attrs[128];
+    } req;
+    struct rtattr *rta, *metrics;
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    struct nlmsgerr *e;
+    char reply[256];
+    int fd, rc = -1;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm));
+    req.nlh.nlmsg_type = RTM_NEWROUTE;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL;
+    req.rtm.rtm_family = AF_INET;
+    req.rtm.rtm_dst_len = (unsigned char)prefixlen;
+    req.rtm.rtm_table = RT_TABLE_MAIN;
+    req.rtm.rtm_protocol = RTPROT_STATIC;
+    req.rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+    req.rtm.rtm_type = RTN_UNICAST;
+
+    rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nlh.nlmsg_len));
+    rta->rta_type = RTA_DST;
+    rta->rta_len = RTA_LENGTH(4);
+    inet_pton(AF_INET, dst, RTA_DATA(rta));
+    rta = (struct rtattr *)((char *)rta + RTA_ALIGN(rta->rta_len));
+    rta->rta_type = RTA_GATEWAY;
+    rta->rta_len = RTA_LENGTH(4);
+    inet_pton(AF_INET, gateway, RTA_DATA(rta));
+    rta = (struct rtattr *)((char *)rta + RTA_ALIGN(rta->rta_len));
+    rta->rta_type = RTA_OIF;
+    rta->rta_len = RTA_LENGTH(4);
+    memcpy(RTA_DATA(rta), &ifindex, 4);
+    rta = (struct rtattr *)((char *)rta + RTA_ALIGN(rta->rta_len));
+    if (mtu) {
+        metrics = rta;
+        metrics->rta_type = RTA_METRICS;
+        rta = RTA_DATA(metrics);
+        rta->rta_type = RTAX_MTU;
+        rta->rta_len = RTA_LENGTH(4);
+        memcpy(RTA_DATA(rta), &mtu, 4);
+        metrics->rta_len = RTA_LENGTH(RTA_ALIGN(rta->rta_len));
+        rta = (struct rtattr *)((char *)metrics + RTA_ALIGN(metrics->rta_len));
+    }
+    req.nlh.nlmsg_len = (uint32_t)((char *)rta - (char *)&req);
+
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        return -1;
+    }
+    if (sendto(fd, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) >= 0 &&
+        recv(fd, reply, sizeof(reply), 0) >= (ssize_t)NLMSG_LENGTH(sizeof(*e))) {
+        e = NLMSG_DATA((struct nlmsghdr *)reply);
+        if ((rc = e->error ? -1 : 0) != 0) {
+            errno = -e->error;
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+static void
+set_destination(struct sockaddr_storage *ss, int family, const char *addr)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->ss_family = (sa_family_t)family;
+    if (family == AF_INET) {
+        inet_pton(AF_INET, addr, &((struct sockaddr_in *)ss)->sin_addr);
+    } else if (family == AF_INET6) {
+        inet_pton(AF_INET6, addr, &((struct sockaddr_in6 *)ss)->sin6_addr);
+    }
+}
+
+/* The kinds of destination, by position */
+enum kind { VIA_DEFAULT, VIA_SPECIFIC, ON_LINK, LOOPBACK, UNREACHABLE, UNSUPPORTED, KINDS };
+
+static void
+build_destinations(struct sockaddr_storage *destinations, size_t count)
+{
+    char addr[64];
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        switch ((enum kind)(i % KINDS)) {
+        case VIA_DEFAULT:
+            snprintf(addr, sizeof(addr), "8.8.%zu.%zu", i / 256 % 256, i % 256);
+            set_destination(&destinations[i], AF_INET, addr);
+            break;
+        case VIA_SPECIFIC:
+            snprintf(addr, sizeof(addr), "10.20.%zu.%zu", i / 256 % 256, i % 256);
+            set_destination(&destinations[i], AF_INET, addr);
+            break;
+        case ON_LINK:
+            snprintf(addr, sizeof(addr), "10.9.0.%zu", 3 + i % 250);
+            set_destination(&destinations[i], AF_INET, addr);
+            break;
+        case LOOPBACK:
+            set_destination(&destinations[i], AF_INET, "127.0.0.1");
+            break;
+        case UNREACHABLE:
+            snprintf(addr, sizeof(addr), "2001:db8::%zx", i);
+            set_destination(&destinations[i], AF_INET6, addr);
+            break;
+        default:
+            set_destination(&destinations[i], AF_UNIX, NULL);
+            break;
+        }
+    }
+}
+
+static void
+check_results(const struct route_resolution *results, size_t count, unsigned tun0, int resolved)
+{
+    const uint8_t gateway_default[4] = { 10, 9, 0, 2 }, gateway_specific[4] = { 10, 9, 0, 3 };
+    const uint8_t source[4] = { 10, 9, 0, 1 }, loopback[4] = { 127, 0, 0, 1 };
+    size_t i, expected = 0;
+
+    for (i = 0; i < count; i++) {
+        const struct route_resolution *r = &results[i];
+        switch ((enum kind)(i % KINDS)) {
+        case VIA_DEFAULT:
+            CHECK(r->error == 0 && r->ifindex == tun0 && r->mtu == 1500 && r->family == AF_INET);
+            CHECK(r->gateway_family == AF_INET && memcmp(r->gateway, gateway_default, 4) == 0);
+            CHECK(r->source_family == AF_INET && memcmp(r->source, source, 4) == 0);
+            expected++;
+            break;
+        case VIA_SPECIFIC:
+            CHECK(r->error == 0 && r->ifindex == tun0 && r->mtu == 1400);
+            CHECK(r->gateway_family == AF_INET && memcmp(r->gateway, gateway_specific, 4) == 0);
+            expected++;
+            break;
+        case ON_LINK:
+            CHECK(r->error == 0 && r->ifindex == tun0 && r->mtu == 1500);
+            CHECK(r->gateway_family == AF_UNSPEC && memcmp(r->source, source, 4) == 0);
+            expected++;
+            break;
+        case LOOPBACK:
+            CHECK(r->error == 0 && r->ifindex == 1 && r->gateway_family == AF_UNSPEC);
+            CHECK(r->source_family == AF_INET && memcmp(r->source, loopback, 4) == 0);
+            expected++;
+            break;
+        case UNREACHABLE:
+            CHECK(r->error == ENETUNREACH && r->family == AF_INET6);
+            break;
+        default:
+            CHECK(r->error == EAFNOSUPPORT);
+            break;
+        }
+    }
+    CHECK(resolved == (int)expected);
+}
+
+/* Resolves `count` destinations `window` at a time; prints and returns the rounds taken */
+static uint64_t
+resolve(const char *name, const struct sockaddr_storage *destinations, size_t count, size_t window,
+        struct route_resolution *results, int *resolved)
+{
+    uint64_t rounds = netif_stats_counter(NETIF_RESOLVE_ROUNDS);
+    double start = now_ns();
+
+    if ((*resolved = route_resolve_batch(destinations, count, window, results)) < 0) {
+        warn("route_resolve_batch");
+        failures++;
+        return 0;
+    }
+    rounds = netif_stats_counter(NETIF_RESOLVE_ROUNDS) - rounds;
+    printf("%-10s %5zu destinations: %8.0f ns per destination, %4llu rounds\n", name, count,
+           (now_ns() - start) / (double)count, (unsigned long long)rounds);
+    return rounds;
+}
+
+int
+main(void)
+{
+    static struct sockaddr_storage destinations[DESTINATIONS];
+    static struct route_resolution pipelined[DESTINATIONS], sequential[DESTINATIONS], one;
+    unsigned tun0;
+    int tun0fd, resolved;
+    size_t i;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        warn("unshare(CLONE_NEWNET) (skipping)");
+        printf("route_resolver_check: OK\n");
+        return 0;
+    }
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 || set_flags("lo", IFF_UP, 0) != 0) {
+        err(1, "loopback");
+    }
+    if ((tun0fd = add_tun("tun0", "10.9.0.1")) < 0) {
+        warn("/dev/net/tun (skipping)");
+        printf("route_resolver_check: OK\n");
+        return 0;
+    }
+    tun0 = if_nametoindex("tun0");
+    if (add_route("0.0.0.0", 0, "10.9.0.2", tun0, 0) != 0 ||
+        add_route("10.20.0.0", 16, "10.9.0.3", tun0, 1400) != 0) {
+        err(1, "RTM_NEWROUTE");
+    }
+
+    build_destinations(destinations, DESTINATIONS);
+    CHECK(route_resolve_batch(destinations, 0, 0, pipelined) == 0);
+
+    // Everything in a few windows, then one window per destination
+    CHECK(resolve("pipelined", destinations, DESTINATIONS, 0, pipelined, &resolved) ==
+          (DESTINATIONS + ROUTE_RESOLVE_WINDOW - 1) / ROUTE_RESOLVE_WINDOW);
+    check_results(pipelined, DESTINATIONS, tun0, resolved);
+    resolve("sequential", destinations, DESTINATIONS, 1, sequential, &resolved);
+    check_results(sequential, DESTINATIONS, tun0, resolved);
+    CHECK(memcmp(pipelined, sequential, sizeof(pipelined)) == 0);
+
+    // A window larger than the batch, and a batch of one
+    CHECK(route_resolve_batch(destinations, 7, 1000, pipelined) == 5);
+    for (i = 0; i < 7; i++) {
+        CHECK(memcmp(&pipelined[i], &sequential[i], sizeof(one)) == 0);
+    }
+    CHECK(route_resolve_batch(&destinations[VIA_SPECIFIC], 1, 0, &one) == 1);
+    CHECK(memcmp(&one, &sequential[VIA_SPECIFIC], sizeof(one)) == 0);
+
+    close(tun0fd);
+    close(sock);
+    printf("route_resolver_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
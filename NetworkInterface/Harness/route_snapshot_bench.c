@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Measures read throughput of published route snapshots from 1 to N
+ * reader threads while an updater keeps publishing new snapshots.
+ *
+ *  cc -O2 -Wall -pthread -o route_snapshot_bench route_snapshot_bench.c harness.c \
+ *      ../NetworkInterface/route_snapshot.c ../NetworkInterface/route_lpm.c \
+ *      ../NetworkInterface/route_compact.c ../NetworkInterface/route_arena.c \
+ *      ../NetworkInterface/route_table.c ../NetworkInterface/route_dump.c \
+ *      ../NetworkInterface/netif_stats.c
+ *
+ * Usage: route_snapshot_bench [max_threads] [milliseconds_per_step]
+ */
+
+#include "harness.h"
+
+#include "../NetworkInterface/route_snapshot.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define ROUTES              10000
+#define PUBLISH_INTERVAL_US 20000
+
+static struct route_snapshot_domain domain;
+static atomic_int running;
+static struct route_entry *routes;
+
+struct reader_thread {
+    pthread_t thread;
+    uint64_t lookups;
+    uint64_t errors;
+    char pad[64];
+};
+
+static void
+make_routes(uint32_t salt)
+{
+    size_t i;
+
+    for (i = 0; i < ROUTES; i++) {
+        struct route_entry *e = &routes[i];
+        uint32_t net = 0x0A000000u + ((uint32_t)i << 8);
+        memset(e, 0, sizeof(*e));
+        e->family = AF_INET;
+        e->prefixlen = i == 0 ? 0 : 24;
+        e->flags = ROUTE_F_UP | (i == 0 ? ROUTE_F_GATEWAY : 0);
+        if (i > 0) {
+            e->dst[0] = (uint8_t)(net >> 24);
+            e->dst[1] = (uint8_t)(net >> 16);
+            e->dst[2] = (uint8_t)(net >> 8);
+        }
+        e->ifindex = 1 + (i + salt) % 8;
+    }
+}
+
+static void *
+reader_main(void *arg)
+{
+    struct reader_thread *t = arg;
+    struct route_snapshot_reader reader;
+    uint64_t last_version = 0;
+    uint32_t x = (uint32_t)(uintptr_t)t | 1;
+
+    route_snapshot_reader_register(&domain, &reader);
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        int i;
+        for (i = 0; i < 1024; i++) {
+            const struct route_snapshot *s = route_snapshot_read_begin(&domain, &reader);
+            uint32_t addr;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            addr = htonl(0x0A000000u | (x & 0x00ffffffu));
+            // Versions only move forward and a snapshot is never freed under us
+            if (s->version < last_version || s->routes.count4 != ROUTES ||
+                route_lpm_lookup4(&s->lpm, addr) == NULL) {
+                t->errors++;
+            }
+            last_version = s->version;
+            route_snapshot_read_end(&reader);
+        }
+        t->lookups += 1024;
+    }
+    route_snapshot_reader_unregister(&domain, &reader);
+    return NULL;
+}
+
+static void *
+updater_main(void *arg)
+{
+    uint64_t *published = arg;
+    uint32_t salt = 1;
+
+    while (atomic_load(&running)) {
+        struct route_snapshot *s;
+        make_routes(salt++);
+        if ((s = route_snapshot_create(atomic_load(&domain.current), routes, ROUTES)) == NULL) {
+            errx(1, "route_snapshot_create");
+        }
+        route_snapshot_publish(&domain, s);
+        (*published)++;
+        usleep(PUBLISH_INTERVAL_US);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    long max_threads = argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    long step_ms = argc > 2 ? atol(argv[2]) : 500;
+    struct reader_thread *threads;
+    double single = 0;
+    long n, i;
+    int failed = 0;
+
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+    if ((routes = calloc(ROUTES, sizeof(*routes))) == NULL ||
+        (threads = calloc((size_t)max_threads, sizeof(*threads))) == NULL) {
+        err(1, "calloc");
+    }
+    route_snapshot_domain_init(&domain);
+    make_routes(0);
+    route_snapshot_publish(&domain, route_snapshot_create(NULL, routes, ROUTES));
+
+    printf("%8s %14s %14s %10s %10s\n", "threads", "lookups/s", "per thread/s", "scaling", "published");
+    for (n = 1; n <= max_threads; n++) {
+        pthread_t updater;
+        uint64_t total = 0, errors = 0, published = 0;
+        double start, elapsed;
+
+        memset(threads, 0, (size_t)max_threads * sizeof(*threads));
+        atomic_store(&running, 1);
+        pthread_create(&updater, NULL, updater_main, &published);
+        start = now_ns();
+        for (i = 0; i < n; i++) {
+            pthread_create(&threads[i].thread, NULL, reader_main, &threads[i]);
+        }
+        usleep((useconds_t)step_ms * 1000);
+        atomic_store(&running, 0);
+        for (i = 0; i < n; i++) {
+            pthread_join(threads[i].thread, NULL);
+            total += threads[i].lookups;
+            errors += threads[i].errors;
+        }
+        elapsed = now_ns() - start;
+        pthread_join(updater, NULL);
+
+        {
+            double rate = (double)total * 1e9 / elapsed;
+            if (n == 1) {
+                single = rate;
+            }
+            printf("%8ld %14.0f %14.0f %9.2fx %10lu\n", n, rate, rate / (double)n,
+                   rate / single, (unsigned long)published);
+        }
+        if (errors) {
+            warnx("%lu inconsistent reads with %ld threads", (unsigned long)errors, n);
+            failed = 1;
+        }
+    }
+
+    route_snapshot_reclaim(&domain);
+    route_snapshot_domain_destroy(&domain);
+    free(threads);
+    free(routes);
+    return failed;
+}
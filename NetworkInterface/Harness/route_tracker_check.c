@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the incremental route tracker: PF_ROUTE change messages are
+ * applied to a table loaded from a dump, and on Linux the live netlink
+ * tracker is opened against the host's table.
+ *
+ *  cc -O2 -Wall -o route_tracker_check route_tracker_check.c harness.c rtdump_builder.c \
+ *      ../NetworkInterface/route_dump.c ../NetworkInterface/route_table.c \
+ *      ../NetworkInterface/route_tracker.c ../NetworkInterface/route_netlink.c \
+ *      ../NetworkInterface/netif_stats.c
+ */
+
+#include "harness.h"
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_dump.h"
+#include "../NetworkInterface/route_tracker.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t
+count_defaults(const struct route_table *table)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < table->count; i++) {
+        n += route_entry_is_default(&table->entries[i]);
+    }
+    return n;
+}
+
+/* Applies a single PF_ROUTE message built from the arguments */
+static int
+apply(struct route_table *table, int type, const void *dst, int prefixlen,
+      const void *gateway, unsigned short ifindex, int flags, uint32_t mtu)
+{
+    struct rtdump_builder b;
+    int rc;
+
+    rtdump_builder_init(&b);
+    rtdump_builder_add_msg(&b, type, AF_INET, dst, prefixlen, gateway, ifindex, flags, mtu, 0);
+    rc = route_tracker_apply_msg(table, b.buf, b.len);
+    rtdump_builder_free(&b);
+    return rc;
+}
+
+static void
+check_messages(void)
+{
+    static const uint8_t any[4] = { 0 };
+    static const uint8_t gw_en8[4] = { 192, 168, 1, 5 };
+    static const uint8_t gw_en0[4] = { 192, 168, 9, 1 };
+    static const uint8_t net[4] = { 10, 8, 0, 0 };
+    struct route_table table;
+    struct rtdump_builder b;
+
+    route_table_init(&table);
+    rtdump_builder_init(&b);
+    rtdump_builder_add(&b, AF_INET, any, 0, gw_en8, 8, RTF_STATIC, 1500, 0);
+    rtdump_builder_add(&b, AF_INET, any, 0, gw_en0, 4, RTF_STATIC | RTF_IFSCOPE, 1500, 0);
+    CHECK(route_table_load_dump(&table, b.buf, b.len) == 2);
+    CHECK(count_defaults(&table) == 2);
+
+    // Re-adding an identical route is not a change
+    CHECK(apply(&table, RTM_ADD, any, 0, gw_en8, 8, RTF_STATIC, 1500) == 0);
+    // Metrics changes are
+    CHECK(apply(&table, RTM_CHANGE, any, 0, gw_en8, 8, RTF_STATIC, 1400) == 1);
+    CHECK(table.count == 2);
+    // The scoped default is a distinct route
+    CHECK(apply(&table, RTM_DELETE, any, 0, gw_en8, 8, RTF_STATIC, 1400) == 1);
+    CHECK(table.count == 1 && count_defaults(&table) == 1);
+    CHECK(table.entries[0].ifindex == 4);
+    CHECK(apply(&table, RTM_ADD, net, 16, NULL, 4, RTF_STATIC, 1500) == 1);
+    CHECK(table.count == 2);
+    // Replies to RTM_GET requests are broadcast to every routing socket
+    CHECK(apply(&table, RTM_GET, net, 16, NULL, 4, 0, 1500) == 0);
+    CHECK(apply(&table, RTM_DELETE, net, 16, NULL, 4, RTF_STATIC, 1500) == 1);
+    CHECK(apply(&table, RTM_DELETE, net, 16, NULL, 4, RTF_STATIC, 1500) == 0);
+    CHECK(table.count == 1);
+
+    rtdump_builder_free(&b);
+    route_table_free(&table);
+}
+
+static void
+check_table(void)
+{
+    struct route_table table;
+    struct rtdump_builder b;
+    struct route_dump_iter iter;
+    struct route_view view;
+    struct route_entry e;
+    size_t i = 0, found = 0;
+
+    route_table_init(&table);
+    rtdump_builder_init(&b);
+    rtdump_builder_synthesize(&b, 20000, 16);
+    CHECK(route_table_load_dump(&table, b.buf, b.len) == 20000);
+
+    // Remove every other route, then make sure the rest are all found
+    route_dump_iter_init(&iter, b.buf, b.len);
+    while (route_dump_iter_next(&iter, &view) == 1) {
+        route_entry_from_view(&e, &view);
+        if (i++ % 2 == 0) {
+            CHECK(route_table_remove(&table, &e) == 1);
+        }
+    }
+    CHECK(table.count == 10000);
+    i = 0;
+    route_dump_iter_init(&iter, b.buf, b.len);
+    while (route_dump_iter_next(&iter, &view) == 1) {
+        const struct route_entry *hit;
+        route_entry_from_view(&e, &view);
+        hit = route_table_find(&table, &e);
+        if (i++ % 2 == 0) {
+            CHECK(hit == NULL);
+        } else if (hit && route_entry_equal(hit, &e)) {
+            found++;
+        }
+    }
+    CHECK(found == 10000);
+
+    rtdump_builder_free(&b);
+    route_table_free(&table);
+}
+
+static void
+check_live(void)
+{
+    struct route_tracker tracker;
+
+    if (route_tracker_open(&tracker) != 0) {
+        warn("route_tracker_open (skipping live check)");
+        return;
+    }
+    printf("live table: %lu routes, %lu default\n", (unsigned long)tracker.table.count,
+           (unsigned long)count_defaults(&tracker.table));
+    CHECK(route_tracker_process(&tracker) >= 0);
+    route_tracker_close(&tracker);
+}
+
+int
+main(void)
+{
+    check_messages();
+    check_table();
+    check_live();
+    printf("route_tracker_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "rtdump_builder.h"
+
+#include "../NetworkInterface/route_dump.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define SDL_LEN 20  /* sizeof(struct sockaddr_dl) on Darwin */
+
+void
+rtdump_builder_init(struct rtdump_builder *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+void
+rtdump_builder_free(struct rtdump_builder *b)
+{
+    free(b->buf);
+    memset(b, 0, sizeof(*b));
+}
+
+static char *
+reserve(struct rtdump_builder *b, size_t len)
+{
+    char *p;
+
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        if ((b->buf = realloc(b->buf, cap)) == NULL) {
+            err(1, "(rtdump_builder.c) realloc(%lu)", (unsigned long)cap);
+        }
+        b->cap = cap;
+    }
+    p = b->buf + b->len;
+    memset(p, 0, len);
+    b->len += len;
+    return p;
+}
+
+/* Writes a sockaddr_in or sockaddr_in6 holding `addr`, truncated to `sa_len` */
+static size_t
+put_inet(char *p, int family, const void *addr, size_t sa_len)
+{
+    size_t full = family == AF_INET ? 16 : 28;
+    size_t offset = family == AF_INET ? 4 : 8;
+    size_t size = family == AF_INET ? 4 : 16;
+    char tmp[28];
+
+    memset(tmp, 0, sizeof(tmp));
+    tmp[0] = (char)(sa_len ? sa_len : full);
+    tmp[1] = family == AF_INET ? RT_BSD_AF_INET : RT_BSD_AF_INET6;
+    memcpy(tmp + offset, addr, size);
+    memcpy(p, tmp, sa_len ? sa_len : full);
+    return sa_len ? sa_len : full;
+}
+
+void
+rtdump_builder_add(struct rtdump_builder *b, int family, const void *dst, int prefixlen,
+                   const void *gateway, unsigned short ifindex, int flags,
+                   uint32_t mtu, uint32_t rtt)
+{
+    rtdump_builder_add_msg(b, RTM_GET2, family, dst, prefixlen, gateway, ifindex, flags, mtu, rtt);
+}
+
+void
+rtdump_builder_add_msg(struct rtdump_builder *b, int type, int family, const void *dst,
+                       int prefixlen, const void *gateway, unsigned short ifindex, int flags,
+                       uint32_t mtu, uint32_t rtt)
+{
+    size_t offset = family == AF_INET ? 4 : 8;
+    size_t size = family == AF_INET ? 4 : 16;
+    size_t full = family == AF_INET ? 16 : 28;
+    uint8_t mask[16];
+    size_t mask_len, msglen;
+    struct rt_msghdr2 *rtm; /* same layout as rt_msghdr up to rtm_rmx */
+    char *p;
+    int addrs = RTA_DST | RTA_GATEWAY;
+    int host = prefixlen == (int)size * 8;
+    int i;
+
+    memset(mask, 0, sizeof(mask));
+    for (i = 0; i < prefixlen; i++) {
+        mask[i / 8] |= (uint8_t)(0x80 >> (i % 8));
+    }
+    /* The kernel trims trailing zero bytes from netmasks */
+    mask_len = size;
+    while (mask_len > 0 && mask[mask_len - 1] == 0) {
+        mask_len--;
+    }
+    mask_len = mask_len ? offset + mask_len : 0;
+    if (!host) {
+        addrs |= RTA_NETMASK;
+    } else {
+        flags |= RTF_HOST;
+    }
+
+    msglen = sizeof(*rtm) + ROUNDUP(full) + ROUNDUP(gateway ? full : SDL_LEN);
+    if (addrs & RTA_NETMASK) {
+        msglen += ROUNDUP(mask_len);
+    }
+
+    p = reserve(b, msglen);
+    rtm = (struct rt_msghdr2 *)p;
+    rtm->rtm_msglen = (u_short)msglen;
+    rtm->rtm_version = RTM_VERSION;
+    rtm->rtm_type = (u_char)type;
+    rtm->rtm_index = ifindex;
+    rtm->rtm_flags = flags | RTF_UP | (gateway ? RTF_GATEWAY : 0);
+    rtm->rtm_addrs = addrs;
+    rtm->rtm_rmx.rmx_mtu = mtu;
+    rtm->rtm_rmx.rmx_rtt = rtt;
+
+    p += sizeof(*rtm);
+    p += ROUNDUP(put_inet(p, family, dst, 0));
+    if (gateway) {
+        p += ROUNDUP(put_inet(p, family, gateway, 0));
+    } else {
+        p[0] = SDL_LEN;
+        p[1] = RT_BSD_AF_LINK;
+        memcpy(p + 2, &ifindex, sizeof(ifindex));
+        p += ROUNDUP(SDL_LEN);
+    }
+    if (addrs & RTA_NETMASK) {
+        if (mask_len) {
+            put_inet(p, family, mask, mask_len);
+            p[1] = 0; /* netmasks carry no family */
+        }
+        p += ROUNDUP(mask_len);
+    }
+}
+
+void
+rtdump_builder_synthesize(struct rtdump_builder *b, size_t count, unsigned ifcount)
+{
+    static const uint8_t any[4] = { 0, 0, 0, 0 };
+    static const uint8_t router[4] = { 10, 0, 0, 1 };
+    size_t i;
+
+    if (count == 0) {
+        return;
+    }
+    if (ifcount == 0) {
+        ifcount = 1;
+    }
+    rtdump_builder_add(b, AF_INET, any, 0, router, 1, RTF_STATIC, 1500, 20000);
+
+    for (i = 1; i < count; i++) {
+        uint32_t net = 0x0B000000u + ((uint32_t)i << 8);
+        unsigned short ifindex = (unsigned short)(1 + i % ifcount);
+        uint8_t dst[4], gw[4];
+        int prefixlen = (i % 4 == 0) ? 32 : 24;
+
+        if (prefixlen == 32) {
+            net |= 1;
+        }
+        dst[0] = (uint8_t)(net >> 24);
+        dst[1] = (uint8_t)(net >> 16);
+        dst[2] = (uint8_t)(net >> 8);
+        dst[3] = (uint8_t)net;
+        gw[0] = 10;
+        gw[1] = 0;
+        gw[2] = (uint8_t)(ifindex & 0xff);
+        gw[3] = 1;
+        rtdump_builder_add(b, AF_INET, dst, prefixlen, (i % 2) ? gw : NULL, ifindex,
+                           RTF_STATIC, 1500, 0);
+    }
+}
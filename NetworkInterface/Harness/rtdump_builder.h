@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Builds `NET_RT_DUMP2` formatted buffers, byte for byte as the Darwin
+ * kernel lays them out, so the decoders can be exercised on Linux.
+ */
+
+#ifndef rtdump_builder_h
+#define rtdump_builder_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct rtdump_builder {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+void
+rtdump_builder_init(struct rtdump_builder *b);
+
+void
+rtdump_builder_free(struct rtdump_builder *b);
+
+/*
+ * Appends a route. `family` is the host AF_INET or AF_INET6; `dst` and
+ * `gateway` are raw address bytes of that family. When `gateway` is NULL
+ * an AF_LINK gateway for `ifindex` is written instead, as the kernel
+ * does for interface routes. `flags` are RTF_* values.
+ */
+void
+rtdump_builder_add(struct rtdump_builder *b, int family, const void *dst, int prefixlen,
+                   const void *gateway, unsigned short ifindex, int flags,
+                   uint32_t mtu, uint32_t rtt);
+
+/*
+ * Appends a PF_ROUTE socket message of `type` (RTM_ADD, RTM_DELETE,
+ * ...) describing the route, as received by a routing socket.
+ */
+void
+rtdump_builder_add_msg(struct rtdump_builder *b, int type, int family, const void *dst,
+                       int prefixlen, const void *gateway, unsigned short ifindex, int flags,
+                       uint32_t mtu, uint32_t rtt);
+
+/*
+ * Appends `count` synthetic IPv4 routes (a default route first, then
+ * distinct /24 and /32 routes spread over `ifcount` interfaces).
+ */
+void
+rtdump_builder_synthesize(struct rtdump_builder *b, size_t count, unsigned ifcount);
+
+#endif /* rtdump_builder_h */
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the socket pool in a private network namespace (Linux, needs
+ * CAP_SYS_ADMIN and /dev/net/tun) with two interfaces, lo and a tun
+ * device: pooled sockets are bound to the selected one and connect to a
+ * local listener, an interface change retires them all, and takes and
+ * refills racing with changes never hand out a socket bound to the
+ * wrong interface or leak one. Reports the cost of a take from the pool
+ * against creating and binding a socket on the spot.
+ *
+ *  cc -O2 -Wall -o socket_pool_check socket_pool_check.c harness.c \
+ *      ../NetworkInterface/socket_pool.c -lpthread
+ */
+
+#define _GNU_SOURCE
+
+#include "harness.h"
+
+#include "../NetworkInterface/socket_pool.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <linux/if_tun.h>
+
+#define TARGET 8
+#define TAKERS 4
+#define SWITCHES 200
+
+static unsigned lo_index, tun_index;
+
+static int
+open_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int n = 0;
+
+    while (dir && readdir(dir)) {
+        n++;
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return n;
+}
+
+static unsigned
+bound_index(int fd)
+{
+    int index = 0;
+    socklen_t len = sizeof(index);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_BINDTOIFINDEX, &index, &len) != 0) {
+        return (unsigned)-1;
+    }
+    return (unsigned)index;
+}
+
+/* Brings up lo and a tun device with 10.9.0.1/24; returns the tun fd */
+static int
+setup_interfaces(void)
+{
+    struct ifreq ifr;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ifr.ifr_addr;
+    int tun, sock;
+
+    if (unshare(CLONE_NEWNET) != 0) {
+        err(1, "unshare(CLONE_NEWNET)");
+    }
+    if ((tun = open("/dev/net/tun", O_RDWR)) < 0) {
+        err(1, "/dev/net/tun");
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strcpy(ifr.ifr_name, "pool0");
+    if (ioctl(tun, TUNSETIFF, &ifr) != 0) {
+        err(1, "TUNSETIFF");
+    }
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, "pool0");
+    sin->sin_family = AF_INET;
+    inet_pton(AF_INET, "10.9.0.1", &sin->sin_addr);
+    if (ioctl(sock, SIOCSIFADDR, &ifr) != 0) {
+        err(1, "SIOCSIFADDR");
+    }
+    inet_pton(AF_INET, "255.255.255.0", &sin->sin_addr);
+    if (ioctl(sock, SIOCSIFNETMASK, &ifr) != 0) {
+        err(1, "SIOCSIFNETMASK");
+    }
+    for (int i = 0; i < 2; i++) {
+        memset(&ifr, 0, sizeof(ifr));
+        strcpy(ifr.ifr_name, i == 0 ? "lo" : "pool0");
+        if (ioctl(sock, SIOCGIFFLAGS, &ifr) != 0) {
+            err(1, "SIOCGIFFLAGS");
+        }
+        ifr.ifr_flags |= IFF_UP;
+        if (ioctl(sock, SIOCSIFFLAGS, &ifr) != 0) {
+            err(1, "SIOCSIFFLAGS");
+        }
+    }
+    close(sock);
+    lo_index = if_nametoindex("lo");
+    tun_index = if_nametoindex("pool0");
+    return tun;
+}
+
+static int
+listener(struct sockaddr_in *addr)
+{
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)addr, len) != 0 || listen(fd, 64) != 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &len) != 0) {
+        err(1, "listener");
+    }
+    return fd;
+}
+
+/* Non-blocking connect; returns 0 or the error it failed with */
+static int
+connect_wait(int fd, const struct sockaddr_in *addr)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0) {
+        return 0;
+    }
+    if (errno != EINPROGRESS) {
+        return errno;
+    }
+    if (poll(&pfd, 1, 2000) != 1) {
+        return ETIMEDOUT;
+    }
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    return error;
+}
+
+static void
+check_follow(void)
+{
+    struct socket_pool pool;
+    struct sockaddr_in addr;
+    uint64_t generation;
+    int lfd, fd, conn, fds = open_fds();
+
+    lfd = listener(&addr);
+    CHECK(socket_pool_init(&pool, AF_INET, SOCK_STREAM, TARGET) == 0);
+
+    // Unbound until an interface is selected
+    CHECK(socket_pool_refill(&pool) == TARGET);
+    fd = socket_pool_take(&pool, &generation);
+    CHECK(fd >= 0 && generation == 0 && bound_index(fd) == 0);
+    CHECK((fcntl(fd, F_GETFL) & O_NONBLOCK) && (fcntl(fd, F_GETFD) & FD_CLOEXEC));
+    close(fd);
+
+    CHECK(socket_pool_set_interface(&pool, lo_index) == TARGET - 1);
+    CHECK(pool.count == 0 && pool.generation == 1 && pool.retired == TARGET - 1);
+    CHECK(socket_pool_refill(&pool) == TARGET);
+    CHECK(socket_pool_set_interface(&pool, lo_index) == 0);    // same interface
+    CHECK(pool.count == TARGET);
+
+    fd = socket_pool_take(&pool, &generation);
+    CHECK(fd >= 0 && generation == 1 && bound_index(fd) == lo_index);
+    CHECK(connect_wait(fd, &addr) == 0);
+    conn = accept(lfd, NULL, NULL);
+    CHECK(conn >= 0);
+    close(conn);
+    close(fd);
+
+    // Switching retires every ready socket; new ones are bound to the tun
+    // device, where the loopback listener is unreachable
+    CHECK(socket_pool_set_interface(&pool, tun_index) == TARGET - 1);
+    CHECK(pool.count == 0 && pool.generation == 2);
+    CHECK(socket_pool_refill(&pool) == TARGET);
+    fd = socket_pool_take(&pool, &generation);
+    CHECK(fd >= 0 && generation == 2 && bound_index(fd) == tun_index);
+    CHECK(connect_wait(fd, &addr) != 0);
+    close(fd);
+
+    // An empty pool still hands out bound sockets
+    while (pool.count > 0) {
+        close(socket_pool_take(&pool, NULL));
+    }
+    fd = socket_pool_take(&pool, NULL);
+    CHECK(fd >= 0 && bound_index(fd) == tun_index && pool.misses == 1);
+    close(fd);
+
+    // No interface: back to unbound sockets
+    CHECK(socket_pool_refill(&pool) == TARGET);
+    CHECK(socket_pool_set_interface(&pool, 0) == TARGET);
+    fd = socket_pool_take(&pool, &generation);
+    CHECK(fd >= 0 && generation == 3 && bound_index(fd) == 0);
+    CHECK(connect_wait(fd, &addr) == 0);
+    close(fd);
+    socket_pool_destroy(&pool);
+    close(lfd);
+    CHECK(open_fds() == fds);
+}
+
+struct race {
+    struct socket_pool pool;
+    atomic_int done;
+    atomic_int wrong;
+    atomic_int taken;
+};
+
+/* Odd generations select lo and even ones the tun device */
+static unsigned
+index_for(uint64_t generation)
+{
+    return generation & 1 ? lo_index : tun_index;
+}
+
+static void *
+taker(void *arg)
+{
+    struct race *race = arg;
+    uint64_t generation;
+    int fd;
+
+    while (!atomic_load(&race->done)) {
+        socket_pool_refill(&race->pool);
+        if ((fd = socket_pool_take(&race->pool, &generation)) < 0) {
+            continue;
+        }
+        if (generation > 0 && bound_index(fd) != index_for(generation)) {
+            atomic_fetch_add(&race->wrong, 1);
+        }
+        atomic_fetch_add(&race->taken, 1);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void
+check_race(void)
+{
+    struct race race;
+    pthread_t threads[TAKERS];
+    uint64_t g;
+    int i, fds = open_fds();
+
+    memset(&race, 0, sizeof(race));
+    CHECK(socket_pool_init(&race.pool, AF_INET, SOCK_STREAM, TARGET) == 0);
+    for (i = 0; i < TAKERS; i++) {
+        pthread_create(&threads[i], NULL, taker, &race);
+    }
+    for (g = 1; g <= SWITCHES; g++) {
+        CHECK(socket_pool_set_interface(&race.pool, index_for(g)) >= 0);
+        usleep(200);
+    }
+    atomic_store(&race.done, 1);
+    for (i = 0; i < TAKERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("%d sockets taken across %d interface changes: %llu from the pool, "
+           "%llu created on the spot, %llu retired\n",
+           atomic_load(&race.taken), SWITCHES, (unsigned long long)race.pool.hits,
+           (unsigned long long)race.pool.misses, (unsigned long long)race.pool.retired);
+    CHECK(atomic_load(&race.wrong) == 0);
+    CHECK(race.pool.generation == SWITCHES);
+    for (i = 0; i < (int)race.pool.count; i++) {
+        CHECK(bound_index(race.pool.ready[i]) == index_for(SWITCHES));
+    }
+    socket_pool_destroy(&race.pool);
+    CHECK(open_fds() == fds);
+}
+
+static void
+report_latency(void)
+{
+    struct socket_pool pool;
+    double t0, hit_ns = 0, miss_ns = 0;
+    int i, fd, rounds = 2000;
+
+    socket_pool_init(&pool, AF_INET, SOCK_STREAM, 1);
+    socket_pool_set_interface(&pool, tun_index);
+    for (i = 0; i < rounds; i++) {
+        socket_pool_refill(&pool);
+        t0 = now_ns();
+        fd = socket_pool_take(&pool, NULL);
+        hit_ns += now_ns() - t0;
+        close(fd);
+        t0 = now_ns();
+        fd = socket_pool_take(&pool, NULL);
+        miss_ns += now_ns() - t0;
+        close(fd);
+    }
+    CHECK(pool.hits == (uint64_t)rounds && pool.misses == (uint64_t)rounds);
+    printf("take: %.0f ns from the pool, %.0f ns creating and binding\n",
+           hit_ns / rounds, miss_ns / rounds);
+    socket_pool_destroy(&pool);
+}
+
+int
+main(void)
+{
+    int tun = setup_interfaces();
+
+    check_follow();
+    check_race();
+    report_latency();
+    close(tun);
+    printf("socket_pool_check: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -70,6 +70,13 @@ func displayNetworkInterfaceInfo(viewModelState: NetworkInterfaceViewModel.Netwo
 
 class NetworkInterfaceViewModel: ObservableObject {
     @Published var state: NetworkInterfaceViewModelState = .nwpathSupportUnknown
+
+    // TCP sockets pre-bound to the active interface; never freed
+    static let socketPool: UnsafeMutablePointer<socket_pool> = {
+        let pool = UnsafeMutablePointer<socket_pool>.allocate(capacity: 1)
+        socket_pool_init(pool, AF_INET, SOCK_STREAM, 4)
+        return pool
+    }()
     
     public enum NetworkInterfaceViewModelState {
         case nwpathSupportUnknown
@@ -84,14 +91,14 @@ class NetworkInterfaceViewModel: ObservableObject {
     }
     
     init() {
+        // The last network state transitions go to stderr on a crash
+        flight_recorder_install_crash_handler(STDERR_FILENO)
+
         // Update the UI with the Swift implementation
         let supported =
             monitorNetworkPathState { (pathState) in
                 print("NetworkPathState:\(pathState), activeInterfaceType: \(String(describing: pathState.activeInterface?.type))")
 
-                // Print the default gateway according to the modified netstat code
-                print_default_gateway()
-
                 DispatchQueue.main.async {
                     switch self.state {
                     case .nwpathQueryResult(let state):
@@ -109,10 +116,21 @@ class NetworkInterfaceViewModel: ObservableObject {
             self.state = .nwpathUnsupported
         }
         
+        // The process-wide monitor hub queries the kernel once per change,
+        // whatever the number of subscribers. Its updates carry the routing
+        // table, so the default gateway changes and the preferred egress are
+        // printed from them.
+        NetworkInterfaceMonitor.subscribe(toMonitorHub: { (update) in
+            print_monitor_update(update)
+        }, queue: DispatchQueue(label: "monitorhub.queue"))
+
         // Simply log the Objective-C implementation
         // Note: only need active interface to cross reference against Swift implementation
+        // The sample socket pool follows the active interface it reports
         NetworkInterfaceMonitor.monitorNetworkPathState { (state) in
             print("NetworkPathStateObjC(\"activeInterface\":\(String(describing: state.activeInterface)))")
+            let retired = NetworkInterfaceMonitor.followActiveInterface(state, socketPool: NetworkInterfaceViewModel.socketPool)
+            print("Socket pool: retired \(retired) sockets")
         }
     }
 }
@@ -3,6 +3,12 @@
 //
 
 #import "NetworkInterfaceMonitor.h"
+#import "connection_racer.h"
 #import "default_gateway.h"
+#import "flight_recorder.h"
 #import "interfaces_ioctl.h"
+#import "monitor_hub.h"
+#import "netif_stats.h"
+#import "path_coalescer.h"
+#import "socket_pool.h"
 
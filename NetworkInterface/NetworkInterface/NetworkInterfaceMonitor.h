@@ -21,6 +21,10 @@
 #import <Network/path.h>
 #import <Network/path_monitor.h>
 
+#include "connection_racer.h"
+#include "monitor_hub.h"
+#include "socket_pool.h"
+
 
 NS_ASSUME_NONNULL_BEGIN
 
@@ -52,18 +56,51 @@ typedef enum {
 
 @property (nonatomic, nullable) nw_interface_t activeInterface;
 
+// Interfaces usable by the path, in its order of preference.
 @property (nonatomic) NSArray<nw_interface_t> *interfaces;
 
 @end
 
 typedef void (^NetworkPathStateUpdateHandler) (NetworkPathStateObjC *pathState);
 
+// Path updates are coalesced until the path has been quiet for the
+// debounce window, or for at most NETWORK_PATH_DEBOUNCE_MAX_WINDOWS
+// windows after the first update of a burst.
+#define NETWORK_PATH_DEBOUNCE_WINDOW_MS     250
+#define NETWORK_PATH_DEBOUNCE_MAX_WINDOWS   4
+
 /// Objective-C implementation of network interface discovery code
 /// with nw_path.
 @interface NetworkInterfaceMonitor : NSObject
 
+/// Calls `updateHandler` once per burst of path updates, with the state
+/// of the latest path, after NETWORK_PATH_DEBOUNCE_WINDOW_MS.
 + (monitor_network_path_state_support_t)monitorNetworkPathState:(NetworkPathStateUpdateHandler)updateHandler;
 
+/// Same as monitorNetworkPathState: with a debounce window in milliseconds.
++ (monitor_network_path_state_support_t)monitorNetworkPathState:(NetworkPathStateUpdateHandler)updateHandler
+                                                 debounceWindow:(int64_t)debounceWindowMs;
+
+/// Calls `handler` on `queue` with every update of the process-wide monitor
+/// hub (see monitor_hub.h), starting with the latest. The update is released
+/// when the handler returns. Returns NO if the hub could not be started.
++ (BOOL)subscribeToMonitorHub:(void (^)(const struct monitor_update *update))handler
+                        queue:(dispatch_queue_t)queue;
+
+/// Races TCP connects to `addresses` over the first interfaces of `pathState`
+/// (see connection_racer.h). Returns the connected socket, or -1 with errno set.
++ (int)raceConnect:(const struct sockaddr_storage *)addresses
+             count:(size_t)count
+    overInterfaces:(NetworkPathStateObjC *)pathState
+             racer:(struct connection_racer *)racer
+           timeout:(int)timeoutMs
+            result:(struct race_result *_Nullable)result;
+
+/// Binds the sockets of `pool` to the active interface of `pathState`, or
+/// leaves them unbound when there is none, retiring the ready sockets bound
+/// to the previous one, then refills the pool. Returns the number retired.
++ (int)followActiveInterface:(NetworkPathStateObjC *)pathState socketPool:(struct socket_pool *)pool;
+
 @end
 
 NS_ASSUME_NONNULL_END
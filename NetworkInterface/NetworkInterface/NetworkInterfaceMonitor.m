@@ -18,113 +18,173 @@
  */
 
 #import "NetworkInterfaceMonitor.h"
+#import "flight_recorder.h"
+#import "interface_registry.h"
+#import "netif_stats.h"
+#import "path_coalescer.h"
 
 #import <Network/path.h>
 #import <Network/path_monitor.h>
-#import <arpa/inet.h>
-#import <net/if.h>
-#import <ifaddrs.h>
 
 @implementation NetworkPathStateObjC
 
 @end
 
+// NOTE: backed by the process-wide interface registry, which is only
+// refreshed on link and address change events instead of calling
+// getifaddrs() for every interface the path monitor enumerates.
 bool interfaceIsActiveAndNotLoopback(const char* interfaceName) {
+    return interface_is_active_and_not_loopback(interfaceName) ? TRUE : FALSE;
+}
 
-    struct ifaddrs *interfaces;
-    if (getifaddrs(&interfaces) != 0) {
-        return nil;
+// NOTE: the compact form kept by the flight recorder.
+static void recordPathState(NetworkPathStateObjC *state, uint64_t latencyNs) {
+    struct flight_path_state record = {0};
+    record.status = (uint8_t)state.status;
+    record.flags = (state.isExpensive ? FLIGHT_PATH_EXPENSIVE : 0) |
+                   (state.isConstrained ? FLIGHT_PATH_CONSTRAINED : 0) |
+                   (state.supportsDNS ? FLIGHT_PATH_DNS : 0) |
+                   (state.supportsIPv4 ? FLIGHT_PATH_IPV4 : 0) |
+                   (state.supportsIPv6 ? FLIGHT_PATH_IPV6 : 0);
+    record.unsatisfied_reason = (uint8_t)state.unsatisfiedReason;
+    record.interfaces = (uint16_t)MIN(state.interfaces.count, (NSUInteger)UINT16_MAX);
+    record.update_count = (uint32_t)state.updateCount;
+    if (state.activeInterface != nil) {
+        record.interface_type = (uint8_t)nw_interface_get_type(state.activeInterface);
+        record.ifindex = nw_interface_get_index(state.activeInterface);
     }
+    flight_recorder_path_update(&record, latencyNs);
+}
 
-    struct ifaddrs *interface;
-    for (interface=interfaces; interface; interface=interface->ifa_next) {
-        // Only IFF_UP interfaces. Loopback is ignored.
-        if (interface->ifa_flags & IFF_UP && !(interface->ifa_flags & IFF_LOOPBACK)) {
+@implementation NetworkInterfaceMonitor
 
-            if (interface->ifa_addr && (interface->ifa_addr->sa_family==AF_INET || interface->ifa_addr->sa_family==AF_INET6)) {
++ (monitor_network_path_state_support_t)monitorNetworkPathState:(NetworkPathStateUpdateHandler)updateHandler {
+    return [NetworkInterfaceMonitor monitorNetworkPathState:updateHandler
+                                             debounceWindow:NETWORK_PATH_DEBOUNCE_WINDOW_MS];
+}
 
-                // ifa_name could be NULL
-                // https://sourceware.org/bugzilla/show_bug.cgi?id=21812
-                if (interface->ifa_name != NULL) {
-                    if (strcmp(interfaceName, interface->ifa_name) == 0) {
-                        return TRUE;
-                    }
-                }
-            }
-        }
++ (NetworkPathStateObjC *)pathState:(nw_path_t)path updateCount:(int)updateCount API_AVAILABLE(ios(12.0)) {
+
+    NetworkPathStateObjC *state = [[NetworkPathStateObjC alloc] init];
+    state.updateCount = updateCount;
+    state.status = nw_path_get_status(path);
+    if (@available(iOS 14.2, *)) {
+        state.unsatisfiedReason = nw_path_get_unsatisfied_reason(path);
+    } else {
+        // Fallback on earlier versions
+        state.unsatisfiedReason = 0;
     }
+    state.isExpensive = nw_path_is_expensive(path);
+    state.isConstrained = nw_path_is_constrained(path);
+    state.supportsDNS = nw_path_has_dns(path);
+    state.supportsIPv4 = nw_path_has_ipv4(path);
+    state.supportsIPv6 = nw_path_has_ipv6(path);
 
-    // Free getifaddrs data
-    freeifaddrs(interfaces);
+    // Discover the active interface type
 
-    return FALSE;
-}
+    nw_interface_type_t active_interface_type = nw_interface_type_other;
 
-@implementation NetworkInterfaceMonitor
+    if (nw_path_uses_interface_type(path, nw_interface_type_wifi)) {
+        active_interface_type = nw_interface_type_wifi;
+    } else if (nw_path_uses_interface_type(path, nw_interface_type_cellular)) {
+        active_interface_type = nw_interface_type_cellular;
+    } else if (nw_path_uses_interface_type(path, nw_interface_type_wired)) {
+        active_interface_type = nw_interface_type_wired;
+    } else if (nw_path_uses_interface_type(path, nw_interface_type_loopback)) {
+        active_interface_type = nw_interface_type_loopback;
+    } else {
+        active_interface_type = nw_interface_type_other;
+    }
 
-+ (monitor_network_path_state_support_t)monitorNetworkPathState:(NetworkPathStateUpdateHandler)updateHandler {
+    // Map the active interface type to the interface itself, and collect
+    // every usable interface as candidates for connection racing.
+    // Note: enumerates the list of all interfaces available to the path, in order of preference.
+    NSMutableArray<nw_interface_t> *interfaces = [NSMutableArray array];
+    nw_path_enumerate_interfaces(path, ^bool(nw_interface_t  _Nonnull interface) {
+        if (!interfaceIsActiveAndNotLoopback(nw_interface_get_name(interface))) {
+            // TODO: log the rejected interface
+            return true;
+        }
+        [interfaces addObject:interface];
+        if (state.activeInterface == nil && nw_interface_get_type(interface) == active_interface_type) {
+            state.activeInterface = interface;
+        }
+        // Continue searching
+        return true;
+    });
+    state.interfaces = interfaces;
+    return state;
+}
+
++ (monitor_network_path_state_support_t)monitorNetworkPathState:(NetworkPathStateUpdateHandler)updateHandler
+                                                 debounceWindow:(int64_t)debounceWindowMs {
 
     static int callCount = 1;
 
     if (@available(iOS 12.0, *)) {
         nw_path_monitor_t monitor = nw_path_monitor_create();
+        dispatch_queue_t queue = dispatch_queue_create("nwpathmonitor.queue", DISPATCH_QUEUE_SERIAL);
+
+        // NOTE: a handoff delivers a burst of path updates within a few
+        // hundred milliseconds. They are coalesced so that the state is
+        // only recomputed, and the handler only called, once the path
+        // has been quiet for the debounce window, from the latest path.
+        // The monitor is never cancelled so the coalescer is not freed.
+        struct path_coalescer *coalescer = malloc(sizeof(*coalescer));
+        path_coalescer_init(coalescer,
+                            (uint64_t)debounceWindowMs * NSEC_PER_MSEC,
+                            (uint64_t)debounceWindowMs * NSEC_PER_MSEC * NETWORK_PATH_DEBOUNCE_MAX_WINDOWS);
+        __block nw_path_t latestPath = nil;
+        __block uint64_t burstStart = 0;
+        __block void (^schedule)(void);
+        __block void (^recompute)(void);
+
+        recompute = ^{
+            uint64_t generation;
+            if (!path_coalescer_begin(coalescer, path_coalescer_now(), &generation)) {
+                // The window was extended by a later update
+                if (path_coalescer_deadline(coalescer) != PATH_COALESCER_NO_DEADLINE) {
+                    schedule();
+                }
+                return;
+            }
+            NetworkPathStateObjC *state = [NetworkInterfaceMonitor pathState:latestPath
+                                                                 updateCount:callCount + 1];
+            if (!path_coalescer_finish(coalescer, generation)) {
+                // Superseded by an update that arrived while recomputing,
+                // which has scheduled the next recompute.
+                netif_stats_add(NETIF_PATH_RESULTS_STALE, 1);
+                return;
+            }
+            callCount++;
+            recordPathState(state, path_coalescer_now() - burstStart);
+            updateHandler(state);
+            // From the first update of the burst to the handler returning
+            netif_stats_record_since(NETIF_PATH_UPDATE_NS, burstStart);
+        };
+        schedule = ^{
+            uint64_t now = path_coalescer_now();
+            uint64_t deadline = path_coalescer_deadline(coalescer);
+            int64_t delay = deadline > now ? (int64_t)(deadline - now) : 0;
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay), queue, recompute);
+        };
 
         // nw_path_t:
         // An object that contains information about the properties of the network that a connection
         // uses, or that are available to your app.
         nw_path_monitor_set_update_handler(monitor, ^(nw_path_t  _Nonnull path) {
-
-            callCount++;
-
-            NetworkPathStateObjC *state = [[NetworkPathStateObjC alloc] init];
-            state.updateCount = callCount;
-            state.status = nw_path_get_status(path);
-            if (@available(iOS 14.2, *)) {
-                state.unsatisfiedReason = nw_path_get_unsatisfied_reason(path);
+            uint64_t now = path_coalescer_now();
+            latestPath = path;
+            netif_stats_add(NETIF_PATH_UPDATES, 1);
+            if (path_coalescer_event(coalescer, now)) {
+                burstStart = now;
+                schedule();
             } else {
-                // Fallback on earlier versions
-                state.unsatisfiedReason = 0;
+                netif_stats_add(NETIF_PATH_UPDATES_COALESCED, 1);
             }
-            state.isExpensive = nw_path_is_expensive(path);
-            state.isConstrained = nw_path_is_constrained(path);
-            state.supportsDNS = nw_path_has_dns(path);
-            state.supportsIPv4 = nw_path_has_ipv4(path);
-            state.supportsIPv6 = nw_path_has_ipv6(path);
-
-            // Discover the active interface type
-
-            nw_interface_type_t active_interface_type = nw_interface_type_other;
-
-            if (nw_path_uses_interface_type(path, nw_interface_type_wifi)) {
-                active_interface_type = nw_interface_type_wifi;
-            } else if (nw_path_uses_interface_type(path, nw_interface_type_cellular)) {
-                active_interface_type = nw_interface_type_cellular;
-            } else if (nw_path_uses_interface_type(path, nw_interface_type_wired)) {
-                active_interface_type = nw_interface_type_wired;
-            } else if (nw_path_uses_interface_type(path, nw_interface_type_loopback)) {
-                active_interface_type = nw_interface_type_loopback;
-            } else {
-                active_interface_type = nw_interface_type_other;
-            }
-
-            // Map the active interface type to the interface itself
-            // Note: enumerates the list of all interfaces available to the path, in order of preference.
-            nw_path_enumerate_interfaces(path, ^bool(nw_interface_t  _Nonnull interface) {
-                if (nw_interface_get_type(interface) == active_interface_type) {
-                    if (interfaceIsActiveAndNotLoopback(nw_interface_get_name(interface))) {
-                        state.activeInterface = interface;
-                        return false;
-                    }
-                    // TODO: log the rejected interface
-                    return true;
-                }
-                // Continue searching
-                return true;
-            });
-            updateHandler(state);
         });
 
-        nw_path_monitor_set_queue(monitor, dispatch_queue_create("nwpathmonitor.queue", DISPATCH_QUEUE_SERIAL));
+        nw_path_monitor_set_queue(monitor, queue);
         nw_path_monitor_start(monitor);
 
         return monitor_network_path_state_supported;
@@ -134,4 +194,85 @@ bool interfaceIsActiveAndNotLoopback(const char* interfaceName) {
     return monitor_network_path_state_unsupported;
 }
 
++ (BOOL)subscribeToMonitorHub:(void (^)(const struct monitor_update *update))handler
+                        queue:(dispatch_queue_t)queue {
+    // Dispatch sources must be kept alive by their owner. Subscriptions
+    // last as long as the process: never cancelled, `sub` never freed.
+    static NSMutableArray<dispatch_source_t> *sources;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sources = [NSMutableArray array];
+    });
+
+    struct monitor_hub *hub = monitor_hub_shared();
+    if (hub == NULL) {
+        return NO;
+    }
+    struct monitor_subscriber *sub = monitor_hub_subscribe(hub, 8);
+    if (sub == NULL) {
+        return NO;
+    }
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ,
+                                                      (uintptr_t)sub->fd, 0, queue);
+    dispatch_source_set_event_handler(source, ^{
+        struct monitor_update *update;
+        while ((update = monitor_subscriber_next(sub)) != NULL) {
+            handler(update);
+            monitor_update_release(update);
+        }
+    });
+    @synchronized (sources) {
+        [sources addObject:source];
+    }
+    dispatch_resume(source);
+    return YES;
+}
+
++ (int)raceConnect:(const struct sockaddr_storage *)addresses
+             count:(size_t)count
+    overInterfaces:(NetworkPathStateObjC *)pathState
+             racer:(struct connection_racer *)racer
+           timeout:(int)timeoutMs
+            result:(struct race_result *)result {
+    // Every address over each of the first interfaces, in path order; the
+    // racer reorders them by what it has learned.
+    size_t ninterfaces = MIN(pathState.interfaces.count, (NSUInteger)racer->max_attempts);
+    if (ninterfaces == 0 || count == 0) {
+        errno = ENETUNREACH;
+        return -1;
+    }
+    struct race_candidate *candidates = calloc(ninterfaces * count, sizeof(*candidates));
+    if (candidates == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < ninterfaces; i++) {
+        unsigned ifindex = (unsigned)nw_interface_get_index(pathState.interfaces[i]);
+        for (size_t j = 0; j < count; j++) {
+            candidates[n].ifindex = ifindex;
+            candidates[n].addr = addresses[j];
+            candidates[n].addrlen = addresses[j].ss_family == AF_INET6 ?
+                                    sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+            n++;
+        }
+    }
+    int fd = connection_racer_connect(racer, candidates, n, timeoutMs, result);
+    int saved = errno;
+    free(candidates);
+    errno = saved;
+    return fd;
+}
+
++ (int)followActiveInterface:(NetworkPathStateObjC *)pathState socketPool:(struct socket_pool *)pool {
+    unsigned ifindex = 0;
+    if (pathState.activeInterface != nil) {
+        ifindex = (unsigned)nw_interface_get_index(pathState.activeInterface);
+    }
+    int retired = socket_pool_set_interface(pool, ifindex);
+    // NOTE: refilled on the path monitor's queue, off the critical path
+    // of the connections that take from the pool.
+    socket_pool_refill(pool);
+    return retired;
+}
+
 @end
@@ -43,40 +43,70 @@ public enum MonitorNetworkPathStateSupport {
     case supported
 }
 
-public func monitorNetworkPathState(handler: @escaping (NetworkPathState) -> Void) -> MonitorNetworkPathStateSupport {
+public func monitorNetworkPathState(debounceWindow: Int = Int(NETWORK_PATH_DEBOUNCE_WINDOW_MS),
+                                    handler: @escaping (NetworkPathState) -> Void) -> MonitorNetworkPathStateSupport {
     if #available(iOS 12.0, *) {
         let monitor = NWPathMonitor()
-        monitor.pathUpdateHandler = { path in
-            var activeInterface: NWInterface?
+        let queue = DispatchQueue(label: "nwpathmonitor.queue")
+
+        // Path updates are coalesced like in NetworkInterfaceMonitor.m:
+        // the state is computed once per burst, from the latest path.
+        // The monitor is never cancelled so the coalescer is not freed.
+        let windowNs = UInt64(debounceWindow) * NSEC_PER_MSEC
+        let coalescer = UnsafeMutablePointer<path_coalescer>.allocate(capacity: 1)
+        path_coalescer_init(coalescer, windowNs, windowNs * UInt64(NETWORK_PATH_DEBOUNCE_MAX_WINDOWS))
+        var latestPath: NWPath?
+        var burstStart: UInt64 = 0
+        var updateCount: UInt32 = 0
 
-            for interface in path.availableInterfaces {
-                // Select the first interface that matches the
-                // active interface type.
-                if path.usesInterfaceType(interface.type) {
-                    if (interfaceIsActiveAndNotLoopback(interface.name)) {
-                        activeInterface = interface
-                    }
-                } else {
-                    // TODO: log the interface
+        func schedule() {
+            let now = path_coalescer_now()
+            let deadline = path_coalescer_deadline(coalescer)
+            let delay = deadline > now ? Int(deadline - now) : 0
+            queue.asyncAfter(deadline: .now() + .nanoseconds(delay)) {
+                recompute()
+            }
+        }
+
+        func recompute() {
+            var generation: UInt64 = 0
+            guard path_coalescer_begin(coalescer, path_coalescer_now(), &generation) != 0 else {
+                // The window was extended by a later update
+                if path_coalescer_deadline(coalescer) != UInt64.max { // PATH_COALESCER_NO_DEADLINE
+                    schedule()
                 }
+                return
+            }
+            guard let path = latestPath else {
+                return
+            }
+            let state = networkPathState(path)
+            guard path_coalescer_finish(coalescer, generation) != 0 else {
+                // Superseded by an update that arrived while recomputing,
+                // which has scheduled the next recompute.
+                netif_stats_add(NETIF_PATH_RESULTS_STALE, 1)
+                return
             }
+            updateCount += 1
+            recordPathState(state, updateCount: updateCount,
+                            latencyNs: path_coalescer_now() - burstStart)
+            handler(state)
+            // From the first update of the burst to the handler returning
+            netif_stats_record_since(NETIF_PATH_UPDATE_NS, burstStart)
+        }
 
-            var state = NetworkPathState(status: path.status,
-                                         isExpensive: path.isExpensive,
-                                         isConstrained: path.isConstrained,
-                                         supportsDNS: path.supportsDNS,
-                                         supportsIPv4: path.supportsIPv4,
-                                         supportsIPv6: path.supportsIPv6,
-                                         activeInterface: activeInterface,
-                                         interfaces: path.availableInterfaces)
-            if #available(iOS 14.2, *) {
-                state.unsatisfiedReason = path.unsatisfiedReason
+        monitor.pathUpdateHandler = { path in
+            let now = path_coalescer_now()
+            latestPath = path
+            netif_stats_add(NETIF_PATH_UPDATES, 1)
+            if path_coalescer_event(coalescer, now) != 0 {
+                burstStart = now
+                schedule()
             } else {
-                // Fallback on earlier versions
+                netif_stats_add(NETIF_PATH_UPDATES_COALESCED, 1)
             }
-            handler(state)
         }
-        monitor.start(queue: DispatchQueue(label: "nwpathmonitor.queue"))
+        monitor.start(queue: queue)
 
         return .supported
     } else {
@@ -84,3 +114,75 @@ public func monitorNetworkPathState(handler: @escaping (NetworkPathState) -> Voi
         return .unsupported
     }
 }
+
+@available(iOS 12.0, *)
+private func networkPathState(_ path: NWPath) -> NetworkPathState {
+    var activeInterface: NWInterface?
+
+    for interface in path.availableInterfaces {
+        // Select the first interface that matches the
+        // active interface type.
+        if path.usesInterfaceType(interface.type) {
+            if (interfaceIsActiveAndNotLoopback(interface.name)) {
+                activeInterface = interface
+            }
+        } else {
+            // TODO: log the interface
+        }
+    }
+
+    var state = NetworkPathState(status: path.status,
+                                 isExpensive: path.isExpensive,
+                                 isConstrained: path.isConstrained,
+                                 supportsDNS: path.supportsDNS,
+                                 supportsIPv4: path.supportsIPv4,
+                                 supportsIPv6: path.supportsIPv6,
+                                 activeInterface: activeInterface,
+                                 interfaces: path.availableInterfaces)
+    if #available(iOS 14.2, *) {
+        state.unsatisfiedReason = path.unsatisfiedReason
+    } else {
+        // Fallback on earlier versions
+    }
+    return state
+}
+
+/// Records the compact form of `state` in the flight recorder, with the
+/// Network framework C values NetworkInterfaceMonitor.m records.
+@available(iOS 12.0, *)
+private func recordPathState(_ state: NetworkPathState, updateCount: UInt32, latencyNs: UInt64) {
+    var record = flight_path_state()
+    switch state.status {
+    case .satisfied: record.status = 1
+    case .unsatisfied: record.status = 2
+    case .requiresConnection: record.status = 3
+    @unknown default: record.status = 0
+    }
+    record.flags = UInt8((state.isExpensive ? FLIGHT_PATH_EXPENSIVE : 0) |
+                         (state.isConstrained ? FLIGHT_PATH_CONSTRAINED : 0) |
+                         (state.supportsDNS ? FLIGHT_PATH_DNS : 0) |
+                         (state.supportsIPv4 ? FLIGHT_PATH_IPV4 : 0) |
+                         (state.supportsIPv6 ? FLIGHT_PATH_IPV6 : 0))
+    record.interfaces = UInt16(min(state.interfaces.count, Int(UInt16.max)))
+    record.update_count = updateCount
+    if let interface = state.activeInterface {
+        switch interface.type {
+        case .wifi: record.interface_type = 1
+        case .cellular: record.interface_type = 2
+        case .wiredEthernet: record.interface_type = 3
+        case .loopback: record.interface_type = 4
+        default: record.interface_type = 0
+        }
+        record.ifindex = UInt32(interface.index)
+    }
+    if #available(iOS 14.2, *) {
+        var reasonState = state
+        switch reasonState.unsatisfiedReason {
+        case .cellularDenied: record.unsatisfied_reason = 1
+        case .wifiDenied: record.unsatisfied_reason = 2
+        case .localNetworkDenied: record.unsatisfied_reason = 3
+        default: record.unsatisfied_reason = 0
+        }
+    }
+    flight_recorder_path_update(&record, latencyNs)
+}
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in connection_racer.h
+ */
+
+#include "connection_racer.h"
+#include "netif_stats.h"
+#include "socket_pool.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* A connect started by a race */
+struct attempt {
+    size_t candidate;
+    uint64_t start_ns;
+    int fd;                         /* -1 once finished */
+    int failed;
+};
+
+/* Candidate with its sort key, for connection_racer_order() */
+struct ranked {
+    size_t index;
+    uint64_t expected_ns;
+};
+
+int
+connection_racer_init(struct connection_racer *racer, int attempt_delay_ms, size_t max_attempts)
+{
+    int rc;
+
+    memset(racer, 0, sizeof(*racer));
+    if ((rc = pthread_mutex_init(&racer->lock, NULL)) != 0) {
+        errno = rc;
+        return -1;
+    }
+    if (attempt_delay_ms == 0) {
+        attempt_delay_ms = RACER_ATTEMPT_DELAY_MS;
+    }
+    racer->attempt_delay_ms = attempt_delay_ms < RACER_MIN_ATTEMPT_DELAY_MS ?
+                              RACER_MIN_ATTEMPT_DELAY_MS : attempt_delay_ms;
+    racer->max_attempts = max_attempts == 0 || max_attempts > RACER_MAX_ATTEMPTS ?
+                          RACER_MAX_ATTEMPTS : max_attempts;
+    return 0;
+}
+
+void
+connection_racer_destroy(struct connection_racer *racer)
+{
+    pthread_mutex_destroy(&racer->lock);
+}
+
+/* Caller holds the lock */
+static struct racer_interface *
+find_interface(struct connection_racer *racer, unsigned ifindex)
+{
+    size_t i;
+
+    for (i = 0; i < racer->ninterfaces; i++) {
+        if (racer->interfaces[i].ifindex == ifindex) {
+            return &racer->interfaces[i];
+        }
+    }
+    return NULL;
+}
+
+/* Caller holds the lock. Evicts the least tried interface when full. */
+static struct racer_interface *
+add_interface(struct connection_racer *racer, unsigned ifindex)
+{
+    struct racer_interface *s = find_interface(racer, ifindex);
+    size_t i;
+
+    if (s) {
+        return s;
+    }
+    if (racer->ninterfaces < RACER_MAX_INTERFACES) {
+        s = &racer->interfaces[racer->ninterfaces++];
+    } else {
+        s = &racer->interfaces[0];
+        for (i = 1; i < RACER_MAX_INTERFACES; i++) {
+            if (racer->interfaces[i].attempts < s->attempts) {
+                s = &racer->interfaces[i];
+            }
+        }
+    }
+    memset(s, 0, sizeof(*s));
+    s->ifindex = ifindex;
+    return s;
+}
+
+/* Caller holds the lock */
+static uint64_t
+expected_ns(struct connection_racer *racer, unsigned ifindex)
+{
+    const struct racer_interface *s = find_interface(racer, ifindex);
+
+    if (s == NULL || s->attempts == 0) {
+        return 0;
+    }
+    if (s->wins == 0) {
+        return UINT64_MAX;
+    }
+    if (s->srtt_ns > UINT64_MAX / s->attempts) {
+        return UINT64_MAX - 1;
+    }
+    return s->srtt_ns * s->attempts / s->wins;
+}
+
+static int
+compare_ranked(const void *a, const void *b)
+{
+    const struct ranked *x = a, *y = b;
+
+    if (x->expected_ns != y->expected_ns) {
+        return x->expected_ns < y->expected_ns ? -1 : 1;
+    }
+    // Stable: the caller's order among equals
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+size_t
+connection_racer_order(struct connection_racer *racer, const struct race_candidate *candidates,
+                       size_t count, size_t *order)
+{
+    struct ranked *ranked;
+    size_t i, first = 0, other = 0, n = 0;
+    sa_family_t family;
+
+    if (count == 0) {
+        return 0;
+    }
+    if ((ranked = malloc(count * sizeof(*ranked))) == NULL) {
+        // Unranked: the caller's order
+        for (i = 0; i < count; i++) {
+            order[i] = i;
+        }
+        return count < racer->max_attempts ? count : racer->max_attempts;
+    }
+    pthread_mutex_lock(&racer->lock);
+    for (i = 0; i < count; i++) {
+        ranked[i].index = i;
+        ranked[i].expected_ns = expected_ns(racer, candidates[i].ifindex);
+    }
+    pthread_mutex_unlock(&racer->lock);
+    qsort(ranked, count, sizeof(*ranked), compare_ranked);
+
+    // Interleave the families, starting with the best candidate's. `first`
+    // and `other` scan for the next candidate of each.
+    family = candidates[ranked[0].index].addr.ss_family;
+    while (n < count) {
+        while (first < count && candidates[ranked[first].index].addr.ss_family != family) {
+            first++;
+        }
+        if (first < count) {
+            order[n++] = ranked[first++].index;
+        }
+        while (other < count && candidates[ranked[other].index].addr.ss_family == family) {
+            other++;
+        }
+        if (other < count) {
+            order[n++] = ranked[other++].index;
+        }
+    }
+    free(ranked);
+    return count < racer->max_attempts ? count : racer->max_attempts;
+}
+
+int
+connection_racer_interface(struct connection_racer *racer, unsigned ifindex,
+                           struct racer_interface *stats)
+{
+    const struct racer_interface *s;
+    int rc = -1;
+
+    pthread_mutex_lock(&racer->lock);
+    if ((s = find_interface(racer, ifindex)) != NULL) {
+        *stats = *s;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&racer->lock);
+    return rc;
+}
+
+/* Folds the outcome of a race into the interface statistics */
+static void
+learn(struct connection_racer *racer, const struct race_candidate *candidates,
+      const struct attempt *attempts, size_t started, const struct attempt *winner, uint64_t end_ns)
+{
+    size_t i;
+
+    pthread_mutex_lock(&racer->lock);
+    for (i = 0; i < started; i++) {
+        const struct attempt *a = &attempts[i];
+        struct racer_interface *s = add_interface(racer, candidates[a->candidate].ifindex);
+        s->attempts++;
+        s->failures += a->failed;
+        if (a == winner) {
+            int64_t sample = (int64_t)(end_ns - a->start_ns);
+            s->wins++;
+            if (s->srtt_ns == 0) {
+                s->srtt_ns = (uint64_t)sample;
+            } else {
+                s->srtt_ns = (uint64_t)((int64_t)s->srtt_ns + (sample - (int64_t)s->srtt_ns) / 8);
+            }
+        }
+        if (s->attempts >= RACER_DECAY_ATTEMPTS) {
+            // Rounded up, so an interface that has won keeps a win
+            s->attempts = (s->attempts + 1) / 2;
+            s->wins = (s->wins + 1) / 2;
+            s->failures = (s->failures + 1) / 2;
+        }
+    }
+    pthread_mutex_unlock(&racer->lock);
+}
+
+/* Starts a connect; returns 1 if it completed at once, 0 if in progress, -1 */
+static int
+start_attempt(const struct race_candidate *c, struct attempt *a)
+{
+    int saved;
+
+    a->fd = socket_pool_create_bound(c->addr.ss_family, SOCK_STREAM, c->ifindex);
+    if (a->fd < 0) {
+        return -1;
+    }
+    if (connect(a->fd, (const struct sockaddr *)&c->addr, c->addrlen) == 0) {
+        return 1;
+    }
+    if (errno == EINPROGRESS) {
+        return 0;
+    }
+    saved = errno;
+    close(a->fd);
+    a->fd = -1;
+    errno = saved;
+    return -1;
+}
+
+int
+connection_racer_connect(struct connection_racer *racer, const struct race_candidate *candidates,
+                         size_t count, int timeout_ms, struct race_result *result)
+{
+    struct attempt attempts[RACER_MAX_ATTEMPTS];
+    struct pollfd pfds[RACER_MAX_ATTEMPTS];
+    size_t map[RACER_MAX_ATTEMPTS];         // pfds[i] is attempts[map[i]]
+    struct attempt *winner = NULL;
+    size_t *order, planned, started = 0, failed = 0, i, n;
+    uint64_t start, now, deadline, next_ns, wait, wait_ms;
+    int last_error = ETIMEDOUT, fd = -1;
+
+    if (count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((order = malloc(count * sizeof(*order))) == NULL) {
+        return -1;
+    }
+    planned = connection_racer_order(racer, candidates, count, order);
+    start = netif_stats_now();
+    deadline = timeout_ms < 0 ? UINT64_MAX : start + (uint64_t)timeout_ms * 1000000;
+    next_ns = start;
+
+    for (;;) {
+        now = netif_stats_now();
+        // The next attempt starts when its delay has elapsed, or at once
+        // when nothing is in flight because the previous ones failed
+        for (;;) {
+            size_t inflight = 0;
+            struct attempt *a;
+            int rc;
+
+            for (i = 0; i < started; i++) {
+                inflight += attempts[i].fd >= 0;
+            }
+            if (started == planned || (now < next_ns && inflight > 0)) {
+                break;
+            }
+            a = &attempts[started++];
+            a->candidate = order[started - 1];
+            a->start_ns = now;
+            a->failed = 0;
+            netif_stats_add(NETIF_RACE_ATTEMPTS, 1);
+            rc = start_attempt(&candidates[a->candidate], a);
+            if (rc == 1) {
+                winner = a;
+                goto done;
+            }
+            if (rc == 0) {
+                next_ns = now + (uint64_t)racer->attempt_delay_ms * 1000000;
+                break;
+            }
+            last_error = errno;
+            a->failed = 1;
+            failed++;
+        }
+
+        for (i = n = 0; i < started; i++) {
+            if (attempts[i].fd >= 0) {
+                pfds[n].fd = attempts[i].fd;
+                pfds[n].events = POLLOUT;
+                pfds[n].revents = 0;
+                map[n++] = i;
+            }
+        }
+        if (n == 0) {
+            // Every attempt failed
+            goto done;
+        }
+        if (now >= deadline) {
+            last_error = ETIMEDOUT;
+            goto done;
+        }
+        wait = deadline - now;
+        if (started < planned && next_ns > now && next_ns - now < wait) {
+            wait = next_ns - now;
+        }
+        // Rounded up: waking before the deadline would only spin
+        wait_ms = (wait + 999999) / 1000000;
+        if (poll(pfds, (nfds_t)n, wait_ms > INT_MAX ? INT_MAX : (int)wait_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            last_error = errno;
+            goto done;
+        }
+        now = netif_stats_now();
+        for (i = 0; i < n; i++) {
+            struct attempt *a = &attempts[map[i]];
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+            if (getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+                error = errno;
+            }
+            if (error == 0) {
+                // Attempts are in start order: the earliest of those ready
+                winner = a;
+                goto done;
+            }
+            close(a->fd);
+            a->fd = -1;
+            a->failed = 1;
+            failed++;
+            last_error = error;
+            next_ns = now;
+        }
+    }
+
+done:
+    now = netif_stats_now();
+    for (i = 0; i < started; i++) {
+        if (&attempts[i] != winner && attempts[i].fd >= 0) {
+            close(attempts[i].fd);
+            attempts[i].fd = -1;
+            netif_stats_add(NETIF_RACE_ATTEMPTS_CANCELLED, 1);
+        }
+    }
+    learn(racer, candidates, attempts, started, winner, now);
+    free(order);
+    if (winner == NULL) {
+        errno = last_error;
+        return -1;
+    }
+    netif_stats_record(NETIF_RACE_CONNECT_NS, now - start);
+    fd = winner->fd;
+    if (result) {
+        result->candidate = winner->candidate;
+        result->ifindex = candidates[winner->candidate].ifindex;
+        result->connect_ns = now - start;
+        result->started = started;
+        result->failed = failed;
+    }
+    return fd;
+}
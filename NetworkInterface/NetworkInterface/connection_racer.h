@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Races TCP connects over several (interface, address) candidates in the
+ * style of Happy Eyeballs (RFC 8305), so that one slow or lossy interface
+ * does not set the connect latency:
+ *
+ *  1. candidates are ordered by what past races learned about their
+ *     interface (see below), keeping the caller's order otherwise, and
+ *     address families are interleaved starting with the first one's;
+ *  2. connects start one at a time, each `attempt_delay_ms` after the
+ *     previous one or as soon as it fails, up to `max_attempts`;
+ *  3. the first to complete wins and every other attempt is cancelled.
+ *
+ * Per-interface statistics are kept across races: attempts, wins,
+ * failures and a smoothed connect time of the wins (gain 1/8, as TCP's
+ * SRTT). An interface's expected connect time is its smoothed time
+ * divided by its win rate; interfaces never tried come first, so each
+ * gets measured, and interfaces tried but never a winner come last.
+ * Counts are halved every RACER_DECAY_ATTEMPTS attempts so the order
+ * follows changes in conditions.
+ *
+ * A race blocks the calling thread in poll(). The racer is thread safe;
+ * concurrent races share the statistics.
+ */
+
+#ifndef connection_racer_h
+#define connection_racer_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RACER_ATTEMPT_DELAY_MS      250     /* RFC 8305 recommended default */
+#define RACER_MIN_ATTEMPT_DELAY_MS  10
+#define RACER_MAX_ATTEMPTS          16
+#define RACER_MAX_INTERFACES        32
+#define RACER_DECAY_ATTEMPTS        64
+
+struct race_candidate {
+    unsigned ifindex;               /* 0: not bound to an interface */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+struct racer_interface {
+    unsigned ifindex;
+    uint64_t attempts;
+    uint64_t wins;
+    uint64_t failures;
+    uint64_t srtt_ns;               /* smoothed connect time of the wins */
+};
+
+struct race_result {
+    size_t candidate;               /* index of the winner in `candidates` */
+    unsigned ifindex;
+    uint64_t connect_ns;            /* from the start of the race */
+    size_t started;                 /* connects started */
+    size_t failed;
+};
+
+struct connection_racer {
+    pthread_mutex_t lock;
+    int attempt_delay_ms;
+    size_t max_attempts;
+    struct racer_interface interfaces[RACER_MAX_INTERFACES];
+    size_t ninterfaces;
+};
+
+/*
+ * `attempt_delay_ms` of 0 selects RACER_ATTEMPT_DELAY_MS and is raised
+ * to RACER_MIN_ATTEMPT_DELAY_MS; `max_attempts` is capped at
+ * RACER_MAX_ATTEMPTS. Returns 0 or -1 with errno set.
+ */
+int
+connection_racer_init(struct connection_racer *racer, int attempt_delay_ms, size_t max_attempts);
+
+void
+connection_racer_destroy(struct connection_racer *racer);
+
+/*
+ * Races `count` candidates for at most `timeout_ms` (negative: no
+ * limit). Returns the connected socket, non-blocking, and fills
+ * `result` if not NULL; or returns -1 with errno set to ETIMEDOUT, or to
+ * the error of the last attempt when all failed.
+ */
+int
+connection_racer_connect(struct connection_racer *racer, const struct race_candidate *candidates,
+                         size_t count, int timeout_ms, struct race_result *result);
+
+/*
+ * Writes the order connection_racer_connect() would try `candidates` in
+ * as indexes into `order`, which must hold `count`. Returns how many of
+ * them it would start at most.
+ */
+size_t
+connection_racer_order(struct connection_racer *racer, const struct race_candidate *candidates,
+                       size_t count, size_t *order);
+
+/* Copies the statistics of `ifindex`; returns -1 if it has none */
+int
+connection_racer_interface(struct connection_racer *racer, unsigned ifindex,
+                           struct racer_interface *stats);
+
+#endif /* connection_racer_h */
@@ -100,13 +100,28 @@
  * routing information database (see: http://www.qnx.com/developers/docs/6.5.0/index.jsp?topic=%2Fcom.qnx.doc.neutrino_lib_ref%2Fr%2Froute_proto.html,
  * and Apple's Open Source route.c implementation https://opensource.apple.com/source/network_cmds/network_cmds-606.40.2/route.tproj/route.c.auto.html)
  *
- * WARNING: some of the datastructures contained within <net/route.h>
- * have been duplicated here because that header is not exposed on iOS.
+ * The routing table is dumped once and then kept current from routing
+ * socket change messages by the tracker in route_tracker.h, so repeated
+ * calls only pay for the changes since the previous call.
+ *
+ * NOTE: on Linux the default gateway is printed from a netlink query
+ * that asks the kernel for the default routes only (see
+ * route_netlink_get_defaults), instead of the sysctl dump. The tracker
+ * is still used for the snapshots behind lookup_egress().
  */
 
 #include "default_gateway.h"
 
-#define IOS_PLATFORM 1
+#include "egress_selector.h"
+#include "interface_registry.h"
+#include "monitor_hub.h"
+#include "netif_stats.h"
+#include "route_diff.h"
+#include "route_dump.h"
+#include "route_lpm.h"
+#include "route_netlink.h"
+#include "route_snapshot.h"
+#include "route_tracker.h"
 
 #include <err.h>
 #include <errno.h>
@@ -116,237 +131,344 @@
 #include <unistd.h>
 #include <net/if.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
-#include <sys/sysctl.h>
 #include <sys/types.h>
-#ifndef IOS_PLATFORM
-#include <net/route.h>
-#endif
 
-#ifdef IOS_PLATFORM
-// Redefine required <net/route.h> code
-
-#define RTA_DST         0x1
-#define RTA_NETMASK     0x4
-#define RTAX_DST        0
-#define RTAX_NETMASK    2
-#define RTAX_MAX        8
-
-#define RTF_UP          0x1             /* route usable */
-#define RTF_GATEWAY     0x2             /* destination is a gateway */
-#define RTF_HOST        0x4             /* host entry (net otherwise) */
-#define RTF_REJECT      0x8             /* host or net unreachable */
-#define RTF_DYNAMIC     0x10            /* created dynamically (by redirect) */
-#define RTF_MODIFIED    0x20            /* modified dynamically (by redirect) */
-#define RTF_DONE        0x40            /* message confirmed */
-#define RTF_DELCLONE    0x80            /* delete cloned route */
-#define RTF_CLONING     0x100           /* generate new routes on use */
-#define RTF_XRESOLVE    0x200           /* external daemon resolves name */
-#define RTF_LLINFO      0x400           /* DEPRECATED - exists ONLY for backward
-*  compatibility */
-#define RTF_LLDATA      0x400           /* used by apps to add/del L2 entries */
-#define RTF_STATIC      0x800           /* manually added */
-#define RTF_BLACKHOLE   0x1000          /* just discard pkts (during updates) */
-#define RTF_NOIFREF     0x2000          /* not eligible for RTF_IFREF */
-#define RTF_PROTO2      0x4000          /* protocol specific routing flag */
-#define RTF_PROTO1      0x8000          /* protocol specific routing flag */
-
-#define RTF_PRCLONING   0x10000         /* protocol requires cloning */
-#define RTF_WASCLONED   0x20000         /* route generated through cloning */
-#define RTF_PROTO3      0x40000         /* protocol specific routing flag */
-/* 0x80000 unused */
-#define RTF_PINNED      0x100000        /* future use */
-#define RTF_LOCAL       0x200000        /* route represents a local address */
-#define RTF_BROADCAST   0x400000        /* route represents a bcast address */
-#define RTF_MULTICAST   0x800000        /* route represents a mcast address */
-#define RTF_IFSCOPE     0x1000000       /* has valid interface scope */
-#define RTF_CONDEMNED   0x2000000       /* defunct; no longer modifiable */
-#define RTF_IFREF       0x4000000       /* route holds a ref to interface */
-#define RTF_PROXY       0x8000000       /* proxying, no interface scope */
-#define RTF_ROUTER      0x10000000      /* host is a router */
-#define RTF_DEAD        0x20000000      /* Route entry is being freed */
-/* 0x40000000 and up unassigned */
+// Copied from Apple netstat source
+#define    WID_IF(af)    ((af) == AF_INET6 ? 8 : 7)
 
-/*
- * These numbers are used by reliable protocols for determining
- * retransmission behavior and are included in the routing structure.
- */
-struct rt_metrics {
-    u_int32_t       rmx_locks;      /* Kernel leaves these values alone */
-    u_int32_t       rmx_mtu;        /* MTU for this path */
-    u_int32_t       rmx_hopcount;   /* max hops expected */
-    int32_t         rmx_expire;     /* lifetime for route, e.g. redirect */
-    u_int32_t       rmx_recvpipe;   /* inbound delay-bandwidth product */
-    u_int32_t       rmx_sendpipe;   /* outbound delay-bandwidth product */
-    u_int32_t       rmx_ssthresh;   /* outbound gateway buffer limit */
-    u_int32_t       rmx_rtt;        /* estimated round trip time */
-    u_int32_t       rmx_rttvar;     /* estimated rtt variance */
-    u_int32_t       rmx_pksent;     /* packets sent using this route */
-    u_int32_t       rmx_state;      /* route state */
-    u_int32_t       rmx_filler[3];  /* will be used for T/TCP later */
-};
-
-// NOTE: copied from <net/route.h>
-struct rt_msghdr2 {
-    u_short rtm_msglen;     /* to skip over non-understood messages */
-    u_char  rtm_version;    /* future binary compatibility */
-    u_char  rtm_type;       /* message type */
-    u_short rtm_index;      /* index for associated ifp */
-    int     rtm_flags;      /* flags, incl. kern & message, e.g. DONE */
-    int     rtm_addrs;      /* bitmask identifying sockaddrs in msg */
-    int32_t rtm_refcnt;     /* reference count */
-    int     rtm_parentflags; /* flags of the parent route */
-    int     rtm_reserved;   /* reserved field set to 0 */
-    int     rtm_use;        /* from rtentry */
-    u_int32_t rtm_inits;    /* which metrics we are initializing */
-    struct rt_metrics rtm_rmx; /* metrics themselves */
-};
+static pthread_mutex_t tracker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct route_tracker tracker = { .fd = -1 };
+static uint64_t published_generation;
 
-#endif
+static pthread_mutex_t defaults_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct route_table reported_defaults;
+static int have_preferred;
+static struct route_entry preferred;
 
-int lflag = 1; /* show routing table with use and ref */
+static pthread_once_t snapshots_once = PTHREAD_ONCE_INIT;
+static struct route_snapshot_domain snapshots;
+static pthread_key_t reader_key;
 
-// NOTE: copied from Apple netstat source
-typedef union {
-    uint32_t dummy;        /* Helps align structure. */
-    struct    sockaddr u_sa;
-    u_short    u_data[128];
-} sa_u;
+/* Brings the tracked table up to date. Called with tracker_mutex held. */
+static void
+sync_tracker(void)
+{
+    if (tracker.fd < 0) {
+        if (route_tracker_open(&tracker) != 0) {
+            err(1, "(default_gateway.c) route tracker: net.route.0.0.dump");
+        }
+    } else if (route_tracker_process(&tracker) < 0) {
+        err(1, "(default_gateway.c) route tracker: routing socket");
+    }
+}
 
-// Copied from Apple netstat source
-// TODO: hard coded ipv4
-#define    WID_DST(af) \
-((af) == AF_INET6 ? (lflag ? 39 : (nflag ? 39: 18)) : 18)
-#define    WID_GW(af) \
-((af) == AF_INET6 ? (lflag ? 31 : (nflag ? 31 : 18)) : 18)
-#define    WID_RT_IFA(af) \
-((af) == AF_INET6 ? (lflag ? 39 : (nflag ? 39 : 18)) : 18)
-#define    WID_IF(af)    ((af) == AF_INET6 ? 8 : 7)
+// NOTE: adapted from np_rtentry in Apple netstat source
+static void
+np_rtentry(const struct route_entry *e)
+{
+    char ifname[IFNAMSIZ] = "";
+
+    // TODO: hard coded ipv4
+    if (e->family == AF_INET && route_entry_is_default(e) == 1)
+    {
+        // Resolved from the cached registry rather than an ioctl per route
+        interface_name_for_index(e->ifindex, ifname);
 
-// NOTE: copied from Apple netstat source
-#define ROUNDUP(a) \
-((a) > 0 ? (1 + (((a) - 1) | (sizeof(uint32_t) - 1))) : sizeof(uint32_t))
+        printf("(default_gateway.c) Default gateway: %*.*s", WID_IF(e->family),
+               WID_IF(e->family), ifname);
+
+        putchar('\n');
+    }
+}
 
-// NOTE: adapted from p_sockaddr in Apple netstat source
-static int
-is_default_route(struct sockaddr *sa, struct sockaddr *mask, int flags)
+/*
+ * Print routing tables.
+ * NOTE: `routepr` modified to print the interface associated with the default gateway.
+ */
+void
+print_default_gateway(void)
 {
-    if (sa->sa_family == AF_INET) {
-        struct sockaddr_in *sin = (struct sockaddr_in *)sa;
-
-        if ((sin->sin_addr.s_addr == INADDR_ANY) &&
-            mask &&
-            (ntohl(((struct sockaddr_in *)mask)->sin_addr.s_addr) == 0L || mask->sa_len == 0) &&
-            flags & RTF_GATEWAY) {
-            return 1;
-        }
+    uint64_t start = netif_stats_now();
+    size_t i;
+#ifdef __linux__
+    struct route_entry defaults[16];
+    int n;
+
+    n = route_netlink_get_defaults(AF_INET, defaults, sizeof(defaults) / sizeof(defaults[0]));
+    if (n < 0) {
+        err(1, "(default_gateway.c) netlink: RTM_GETROUTE");
     }
+    for (i = 0; i < (size_t)n && i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+        np_rtentry(&defaults[i]);
+    }
+#else
+    update_route_snapshot();
 
-    return 0;
+    pthread_mutex_lock(&tracker_mutex);
+    for (i = 0; i < tracker.table.count; i++) {
+        np_rtentry(&tracker.table.entries[i]);
+    }
+    pthread_mutex_unlock(&tracker_mutex);
+#endif
+    netif_stats_record_since(NETIF_DEFAULT_GATEWAY_NS, start);
 }
 
-// NOTE: copied from Apple netstat source
+/* Replaces `defaults` with the current IPv4 default routes */
 static void
-get_rtaddrs(int addrs, struct sockaddr *sa, struct sockaddr **rti_info)
+load_defaults(struct route_table *defaults)
 {
-    int i;
+    size_t i;
+#ifdef __linux__
+    struct route_entry found[16];
+    int n;
 
-    for (i = 0; i < RTAX_MAX; i++)
-    {
-        if (addrs & (1 << i))
-        {
-            rti_info[i] = sa;
-            sa = (struct sockaddr *)(ROUNDUP(sa->sa_len) + (char *)sa);
+    n = route_netlink_get_defaults(AF_INET, found, sizeof(found) / sizeof(found[0]));
+    if (n < 0) {
+        err(1, "(default_gateway.c) netlink: RTM_GETROUTE");
+    }
+    route_table_clear(defaults);
+    for (i = 0; i < (size_t)n && i < sizeof(found) / sizeof(found[0]); i++) {
+        if (route_entry_is_default(&found[i]) && route_table_upsert(defaults, &found[i]) < 0) {
+            err(1, "(default_gateway.c) route_table_upsert");
         }
-        else
-        {
-            rti_info[i] = NULL;
+    }
+#else
+    update_route_snapshot();
+
+    route_table_clear(defaults);
+    pthread_mutex_lock(&tracker_mutex);
+    for (i = 0; i < tracker.table.count; i++) {
+        const struct route_entry *e = &tracker.table.entries[i];
+        if (e->family == AF_INET && route_entry_is_default(e) &&
+            route_table_upsert(defaults, e) < 0) {
+            err(1, "(default_gateway.c) route_table_upsert");
         }
     }
+    pthread_mutex_unlock(&tracker_mutex);
+#endif
 }
 
-// NOTE: adapted from np_rtentry in Apple netstat source
 static void
-np_rtentry(struct rt_msghdr2 *rtm)
+print_change(const char *what, const struct route_entry *e)
 {
+    char ifname[IFNAMSIZ] = "";
 
-    struct sockaddr *sa = (struct sockaddr *)(rtm + 1);
-    struct sockaddr *rti_info[RTAX_MAX];
-    u_short lastindex = 0xffff;
-    static char ifname[IFNAMSIZ + 1];
-    sa_u addr, mask;
+    interface_name_for_index(e->ifindex, ifname);
+    printf("(default_gateway.c) Default gateway %s: %*.*s\n", what, WID_IF(e->family),
+           WID_IF(e->family), ifname);
+}
 
-    get_rtaddrs(rtm->rtm_addrs, sa, rti_info);
-    bzero(&addr, sizeof(addr));
+static void
+on_default_added(const struct route_entry *e, void *ctx)
+{
+    (void)ctx;
+    print_change("added", e);
+}
 
-    if ((rtm->rtm_addrs & RTA_DST))
-        bcopy(rti_info[RTAX_DST], &addr, rti_info[RTAX_DST]->sa_len);
-    bzero(&mask, sizeof(mask));
-    if ((rtm->rtm_addrs & RTA_NETMASK))
-        bcopy(rti_info[RTAX_NETMASK], &mask, rti_info[RTAX_NETMASK]->sa_len);
+static void
+on_default_removed(const struct route_entry *e, void *ctx)
+{
+    (void)ctx;
+    print_change("removed", e);
+}
 
-    if (is_default_route(&addr.u_sa, &mask.u_sa, rtm->rtm_flags) == 1)
-    {
+static void
+on_default_changed(const struct route_entry *old, const struct route_entry *new, void *ctx)
+{
+    (void)ctx;
+    (void)old;
+    print_change("changed", new);
+}
 
-        if (rtm->rtm_index != lastindex)
-        {
-            if_indextoname(rtm->rtm_index, ifname);
-            lastindex = rtm->rtm_index;
-        }
+/* Prints how `current` differs from the defaults last reported, and takes it over */
+static void
+report_default_changes(struct route_table *current)
+{
+    static const struct route_diff_ops ops = {
+        .added = on_default_added,
+        .removed = on_default_removed,
+        .changed = on_default_changed,
+    };
 
-        printf("(default_gateway.c) Default gateway: %*.*s", WID_IF(addr.u_sa.sa_family),
-               WID_IF(addr.u_sa.sa_family), ifname);
+    pthread_mutex_lock(&defaults_mutex);
+    route_diff_tables(&reported_defaults, current, &ops, NULL, NULL);
+    route_table_free(&reported_defaults);
+    reported_defaults = *current;
+    pthread_mutex_unlock(&defaults_mutex);
+}
 
-        putchar('\n');
+void
+print_default_gateway_changes(void)
+{
+    struct route_table current;
+
+    route_table_init(&current);
+    load_defaults(&current);
+    report_default_changes(&current);
+}
+
+int
+preferred_egress(struct egress_choice *choice)
+{
+    struct route_table current;
+    int rc;
+
+    route_table_init(&current);
+    load_defaults(&current);
+
+    pthread_mutex_lock(&defaults_mutex);
+    rc = egress_select(current.entries, current.count, AF_INET,
+                       have_preferred ? &preferred : NULL, choice);
+    have_preferred = rc == 0;
+    if (rc == 0) {
+        preferred = choice->route;
     }
+    pthread_mutex_unlock(&defaults_mutex);
+
+    route_table_free(&current);
+    return rc;
+}
+
+/* Prints `choice`, or none when NULL */
+static void
+print_egress_choice(const struct egress_choice *choice)
+{
+    char ifname[IFNAMSIZ] = "", other[IFNAMSIZ] = "";
+
+    if (choice == NULL) {
+        printf("(default_gateway.c) Preferred egress: none\n");
+        return;
+    }
+    interface_name_for_index(choice->route.ifindex, ifname);
+    if (!choice->has_runner_up) {
+        printf("(default_gateway.c) Preferred egress: %s (%s)\n", ifname,
+               egress_reason_text(choice->reason));
+        return;
+    }
+    interface_name_for_index(choice->runner_up.ifindex, other);
+    printf("(default_gateway.c) Preferred egress: %s over %s (%s; rtt %u/%u, mtu %u/%u, "
+           "hops %u/%u)\n", ifname, other, egress_reason_text(choice->reason),
+           choice->route.rtt, choice->runner_up.rtt, choice->route.mtu, choice->runner_up.mtu,
+           choice->route.hopcount, choice->runner_up.hopcount);
 }
 
-/*
- * Print routing tables.
- * NOTE: `routepr` modified to print the interface associated with the default gateway.
- */
 void
-print_default_gateway(void)
+print_preferred_egress(void)
+{
+    struct egress_choice choice;
+
+    print_egress_choice(preferred_egress(&choice) == 0 ? &choice : NULL);
+}
+
+void
+print_monitor_update(const struct monitor_update *update)
 {
-    size_t extra_space;
-    size_t needed;
-    int mib[6];
-    char *buf, *next, *lim;
-    struct rt_msghdr2 *rtm = NULL;
-    int try = 1;
-
-again:
-    mib[0] = CTL_NET;
-    mib[1] = PF_ROUTE;
-    mib[2] = 0;
-    mib[3] = 0;
-    mib[4] = NET_RT_DUMP2;
-    mib[5] = 0;
-    if (sysctl(mib, 6, NULL, &needed, NULL, 0) < 0) {
-        err(1, "(default_gateway.c) sysctl: net.route.0.0.dump estimate");
+    struct route_table current;
+    struct route_entry e;
+    size_t i, active = 0;
+
+    for (i = 0; i < update->ninterfaces; i++) {
+        active += update->interfaces[i].active != 0;
     }
-    /* allocate extra space in case the table grows */
-    extra_space = needed / 2;
-    if (needed <= (SIZE_MAX - extra_space)) {
-        needed += extra_space;
+    printf("(default_gateway.c) Monitor update %llu: %zu IPv4 and %zu IPv6 routes, "
+           "%zu interfaces (%zu active)\n", (unsigned long long)update->version,
+           update->routes.count4, update->routes.count6, update->ninterfaces, active);
+
+    // The update already holds the routing table: the default gateways
+    // are diffed against it rather than against another kernel query
+    route_table_init(&current);
+    for (i = 0; i < update->routes.count4; i++) {
+        route_compact_get4(&update->routes, i, &e);
+        if (route_entry_is_default(&e) && route_table_upsert(&current, &e) < 0) {
+            err(1, "(default_gateway.c) route_table_upsert");
+        }
     }
-    if ((buf = malloc(needed)) == 0) {
-        err(2, "(default_gateway.c) malloc(%lu)", (unsigned long)needed);
+    report_default_changes(&current);
+
+    print_egress_choice(update->has_egress ? &update->egress : NULL);
+}
+
+static void
+release_reader(void *reader)
+{
+    route_snapshot_reader_unregister(&snapshots, reader);
+    free(reader);
+}
+
+static void
+init_snapshots(void)
+{
+    route_snapshot_domain_init(&snapshots);
+    if (pthread_key_create(&reader_key, release_reader) != 0) {
+        err(1, "(default_gateway.c) pthread_key_create");
+    }
+}
+
+/* Returns the calling thread's snapshot reader, registering it on first use */
+static struct route_snapshot_reader *
+thread_reader(void)
+{
+    struct route_snapshot_reader *reader = pthread_getspecific(reader_key);
+
+    if (reader == NULL) {
+        if ((reader = calloc(1, sizeof(*reader))) == NULL) {
+            err(1, "(default_gateway.c) calloc");
+        }
+        route_snapshot_reader_register(&snapshots, reader);
+        pthread_setspecific(reader_key, reader);
     }
-    if (sysctl(mib, 6, buf, &needed, NULL, 0) < 0) {
-#define MAX_TRIES    10
-        if (errno == ENOMEM && try < MAX_TRIES) {
-            /* the buffer we provided was too small, try again */
-            free(buf);
-            try++;
-            goto again;
+    return reader;
+}
+
+void
+update_route_snapshot(void)
+{
+    struct route_snapshot *snapshot;
+
+    pthread_once(&snapshots_once, init_snapshots);
+    pthread_mutex_lock(&tracker_mutex);
+    sync_tracker();
+    // Generation 0 is never current: the initial dump increments it
+    if (published_generation != tracker.table.generation) {
+        // Only this thread publishes, so the current snapshot outlives the
+        // build and the new index can share what did not change with it
+        snapshot = route_snapshot_create(atomic_load(&snapshots.current),
+                                         tracker.table.entries, tracker.table.count);
+        if (snapshot == NULL) {
+            err(1, "(default_gateway.c) route_snapshot_create");
         }
-        err(1, "(default_gateway.c) sysctl: net.route.0.0.dump");
+        route_snapshot_publish(&snapshots, snapshot);
+        published_generation = tracker.table.generation;
+    }
+    pthread_mutex_unlock(&tracker_mutex);
+}
+
+int
+lookup_egress(int family, const void *addr, struct route_nexthop *nexthop)
+{
+    struct route_snapshot_reader *reader;
+    const struct route_snapshot *snapshot;
+    const struct route_nexthop *nh = NULL;
+
+    pthread_once(&snapshots_once, init_snapshots);
+    if (atomic_load(&snapshots.current) == NULL) {
+        update_route_snapshot();
     }
-    lim  = buf + needed;
-    for (next = buf; next < lim; next += rtm->rtm_msglen) {
-        rtm = (struct rt_msghdr2 *)next;
-        np_rtentry(rtm);
+
+    reader = thread_reader();
+    snapshot = route_snapshot_read_begin(&snapshots, reader);
+    nh = route_lpm_lookup(&snapshot->lpm, family, addr);
+    if (nh) {
+        *nexthop = *nh;
+    }
+    route_snapshot_read_end(reader);
+    // The snapshot may be freed once read: only the copy is safe to use
+    if (nh == NULL || nexthop->reject) {
+        errno = ENETUNREACH;
+        return -1;
     }
+    return 0;
 }
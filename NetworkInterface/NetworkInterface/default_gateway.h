@@ -24,7 +24,62 @@
 #ifndef default_gateway_h
 #define default_gateway_h
 
+#include "egress_selector.h"
+#include "route_lpm.h"
+
 void
 print_default_gateway(void);
 
+/*
+ * Prints only the IPv4 default gateways added, removed or changed since
+ * the previous call (all of them on the first call), using route_diff.h.
+ */
+void
+print_default_gateway_changes(void);
+
+/*
+ * Chooses the preferred IPv4 egress among the current default routes
+ * with egress_select(), passing the previous choice so it is kept while
+ * the alternatives are only better within RTT noise. Returns 0, or -1
+ * when there is no usable default route.
+ */
+int
+preferred_egress(struct egress_choice *choice);
+
+/* Prints the preferred egress and why it was chosen over the runner-up */
+void
+print_preferred_egress(void);
+
+struct monitor_update;
+
+/*
+ * Prints a monitor hub update (see monitor_hub.h), the IPv4 default
+ * gateways it added, removed or changed and its preferred egress,
+ * without querying the kernel. The gateway changes are tracked together
+ * with print_default_gateway_changes(), so use one or the other.
+ */
+void
+print_monitor_update(const struct monitor_update *update);
+
+/*
+ * Applies pending routing table changes and, if the table changed,
+ * publishes a new immutable snapshot (see route_snapshot.h) for
+ * lookup_egress(), its index updated from the previous snapshot's.
+ * print_default_gateway() calls this as well, except on Linux where it
+ * queries the default routes directly.
+ */
+void
+update_route_snapshot(void);
+
+/*
+ * Finds the route that carries traffic to `addr` (an in_addr or
+ * in6_addr of `family`) in the most recently published snapshot using
+ * its longest-prefix-match index. Safe to call from any number of
+ * threads concurrently: lookups take no locks and make no system calls.
+ * Returns 0 and fills `nexthop`, or -1 with errno ENETUNREACH when there
+ * is no route or the matching route rejects the traffic.
+ */
+int
+lookup_egress(int family, const void *addr, struct route_nexthop *nexthop);
+
 #endif /* default_gateway_h */
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in egress_selector.h
+ */
+
+#include "egress_selector.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+static int
+usable(const struct route_entry *e)
+{
+    return (e->flags & ROUTE_F_UP) && !(e->flags & ROUTE_F_REJECT);
+}
+
+static int
+compare_u32(uint32_t a, uint32_t b)
+{
+    return (a > b) - (a < b);
+}
+
+/* Compares `a` and `b` when both are measured, i.e. non-zero */
+static int
+compare_measured(uint32_t a, uint32_t b)
+{
+    return a && b ? compare_u32(a, b) : 0;
+}
+
+int
+egress_compare(const struct route_entry *a, const struct route_entry *b, enum egress_reason *reason)
+{
+    enum egress_reason r;
+    int c;
+
+    if ((c = usable(b) - usable(a)) != 0) {
+        r = EGRESS_USABLE;
+    } else if ((c = !!(a->flags & ROUTE_F_IFSCOPE) - !!(b->flags & ROUTE_F_IFSCOPE)) != 0) {
+        r = EGRESS_UNSCOPED;
+    } else if ((c = compare_u32(a->priority, b->priority)) != 0) {
+        r = EGRESS_PRIORITY;
+    } else if ((c = compare_measured(a->rtt, b->rtt)) != 0) {
+        r = EGRESS_RTT;
+    } else if ((c = compare_measured(b->mtu, a->mtu)) != 0) {
+        r = EGRESS_MTU;
+    } else if ((c = compare_measured(a->hopcount, b->hopcount)) != 0) {
+        r = EGRESS_HOPCOUNT;
+    } else {
+        c = compare_u32(a->ifindex, b->ifindex);
+        r = EGRESS_TIE;
+    }
+    if (reason) {
+        *reason = r;
+    }
+    return c;
+}
+
+/*
+ * Returns 1 if `best` is ahead of `previous` only by an RTT difference
+ * within the larger of their RTT variances.
+ */
+static int
+within_noise(const struct route_entry *best, const struct route_entry *previous)
+{
+    uint32_t var = best->rttvar > previous->rttvar ? best->rttvar : previous->rttvar;
+    enum egress_reason reason;
+
+    if (egress_compare(best, previous, &reason) >= 0 || reason != EGRESS_RTT) {
+        return 0;
+    }
+    return previous->rtt - best->rtt <= var;
+}
+
+int
+egress_select(const struct route_entry *candidates, size_t count, int family,
+              const struct route_entry *previous, struct egress_choice *choice)
+{
+    const struct route_entry *best = NULL, *second = NULL, *kept = NULL;
+    size_t i;
+
+    memset(choice, 0, sizeof(*choice));
+    for (i = 0; i < count; i++) {
+        const struct route_entry *e = &candidates[i];
+        if (!route_entry_is_default(e) || (family != AF_UNSPEC && e->family != family)) {
+            continue;
+        }
+        choice->candidates++;
+        if (previous && usable(e) && route_entry_same_key(e, previous)) {
+            kept = e;
+        }
+        if (best == NULL || egress_compare(e, best, NULL) < 0) {
+            second = best;
+            best = e;
+        } else if (second == NULL || egress_compare(e, second, NULL) < 0) {
+            second = e;
+        }
+    }
+    if (best == NULL || !usable(best)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (kept && kept != best && within_noise(best, kept)) {
+        choice->route = *kept;
+        choice->runner_up = *best;
+        choice->has_runner_up = 1;
+        choice->reason = EGRESS_STICKY;
+        return 0;
+    }
+    choice->route = *best;
+    if (second) {
+        choice->runner_up = *second;
+        choice->has_runner_up = 1;
+        egress_compare(best, second, &choice->reason);
+    } else {
+        choice->reason = EGRESS_ONLY_CANDIDATE;
+    }
+    return 0;
+}
+
+int
+egress_update(const struct route_table *table, int family, int *has_egress,
+              struct egress_choice *egress)
+{
+    struct egress_choice choice;
+    int found;
+
+    found = egress_select(table->entries, table->count, family,
+                          *has_egress ? &egress->route : NULL, &choice) == 0;
+    if (found == *has_egress &&
+        (!found || route_entry_equal(&choice.route, &egress->route))) {
+        if (found) {
+            *egress = choice;               // runner-up and reason may still change
+        }
+        return 0;
+    }
+    *has_egress = found;
+    if (found) {
+        *egress = choice;
+    }
+    return 1;
+}
+
+const char *
+egress_reason_text(enum egress_reason reason)
+{
+    switch (reason) {
+        case EGRESS_ONLY_CANDIDATE: return "only default route";
+        case EGRESS_USABLE: return "other routes are down or reject";
+        case EGRESS_UNSCOPED: return "unscoped primary default";
+        case EGRESS_PRIORITY: return "lower route priority";
+        case EGRESS_RTT: return "lower RTT";
+        case EGRESS_MTU: return "larger MTU";
+        case EGRESS_HOPCOUNT: return "fewer hops";
+        case EGRESS_TIE: return "metrics tie, lower interface index";
+        case EGRESS_STICKY: return "kept, RTT difference within variance";
+    }
+    return "unknown";
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Picks one preferred egress among several default routes, e.g.:
+ *
+ *  default            192.168.1.5        UGSc           en8
+ *  default            192.168.9.1        UGScI          en0
+ *
+ * Candidates are ranked by, in order:
+ *
+ *  1. usability: up and not a reject route;
+ *  2. scope: the unscoped default (no `I` flag) is the system primary,
+ *     scoped defaults only carry traffic bound to their interface;
+ *  3. route priority, lower first (Linux metrics; 0 on Apple);
+ *  4. the kernel metrics, each only when both routes have it (a zero is
+ *     "not measured"): lower RTT, larger MTU, fewer hops;
+ *  5. interface index, so the choice is deterministic.
+ *
+ * The choice records what set it ahead of the runner-up. RTT and RTT
+ * variance are in the kernel's units (RTM_RTTUNIT on Apple), only ever
+ * compared with each other.
+ */
+
+#ifndef egress_selector_h
+#define egress_selector_h
+
+#include "route_table.h"
+
+#include <stddef.h>
+
+enum egress_reason {
+    EGRESS_ONLY_CANDIDATE,
+    EGRESS_USABLE,                  /* the runner-up is down or a reject route */
+    EGRESS_UNSCOPED,
+    EGRESS_PRIORITY,
+    EGRESS_RTT,
+    EGRESS_MTU,
+    EGRESS_HOPCOUNT,
+    EGRESS_TIE,                     /* metrics equal, lower interface index */
+    EGRESS_STICKY,                  /* kept `previous`, see egress_select() */
+};
+
+struct egress_choice {
+    struct route_entry route;
+    size_t candidates;              /* default routes considered */
+    int has_runner_up;
+    struct route_entry runner_up;
+    enum egress_reason reason;      /* what set `route` ahead of `runner_up` */
+};
+
+/*
+ * Orders two candidates: negative when `a` is preferred, positive when
+ * `b` is, 0 only for routes equal in every ranked field. Sets `reason`
+ * (if not NULL) to the criterion that decided.
+ */
+int
+egress_compare(const struct route_entry *a, const struct route_entry *b, enum egress_reason *reason);
+
+/*
+ * Chooses among the default routes of `family` (AF_UNSPEC for both) in
+ * `candidates`; other routes are ignored. When `previous` is the last
+ * choice and is still a usable candidate, it is kept if the best route
+ * only beats it on RTT by less than their RTT variance, so measurement
+ * noise does not flip the egress back and forth.
+ *
+ * Returns 0, or -1 with errno ENOENT when no candidate is usable.
+ */
+int
+egress_select(const struct route_entry *candidates, size_t count, int family,
+              const struct route_entry *previous, struct egress_choice *choice);
+
+/*
+ * Re-ranks the default routes of `family` in `table` against the last
+ * choice, `*egress` when `*has_egress` is set, and stores the new one.
+ * Returns 1 when the chosen route changed (including to or from none),
+ * 0 when only its runner-up or reason may have.
+ */
+int
+egress_update(const struct route_table *table, int family, int *has_egress,
+              struct egress_choice *egress);
+
+/* E.g. "lower RTT" */
+const char *
+egress_reason_text(enum egress_reason reason);
+
+#endif /* egress_selector_h */
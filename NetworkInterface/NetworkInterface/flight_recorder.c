@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in flight_recorder.h
+ */
+
+#include "flight_recorder.h"
+#include "netif_stats.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+_Static_assert(sizeof(struct flight_path_state) == 16, "a path state fills a record's data");
+
+#if (FLIGHT_RECORDER_CAPACITY & (FLIGHT_RECORDER_CAPACITY - 1)) != 0
+#error FLIGHT_RECORDER_CAPACITY must be a power of two
+#endif
+
+/*
+ * A record as stored, one cache line so that concurrent writers do not
+ * share lines. `seq` is 0 when never written, 2 * position + 1 while
+ * being written and 2 * position + 2 once complete. The other words
+ * are written and read with relaxed atomics, ordered by `seq`.
+ */
+struct slot {
+    _Atomic uint64_t seq;
+    _Atomic uint64_t time_ns;
+    _Atomic uint64_t latency_event;     /* latency_ns | event << 32 */
+    _Atomic uint64_t ifindex_aux;       /* ifindex | aux << 32 */
+    _Atomic uint64_t data[2];
+    uint64_t padding[2];
+};
+
+static struct slot ring[FLIGHT_RECORDER_CAPACITY];
+static _Atomic uint64_t head;           /* next position */
+
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction previous_actions[sizeof(crash_signals) / sizeof(crash_signals[0])];
+static int crash_fd = -1;
+// A stack overflow leaves no room to run the handler on the thread's
+// own stack
+static char crash_stack[65536];
+
+void
+flight_recorder_record(enum flight_event event, uint32_t ifindex, uint32_t aux,
+                       const void *data, size_t len, uint64_t latency_ns)
+{
+#ifndef FLIGHT_RECORDER_DISABLE
+    uint64_t pos, seq, words[2] = { 0, 0 };
+    struct slot *slot;
+
+    pos = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    slot = &ring[pos & (FLIGHT_RECORDER_CAPACITY - 1)];
+    seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    do {
+        // Held by a writer a lap away, or already overtaken
+        if ((seq & 1) || seq > 2 * pos) {
+            netif_stats_add(NETIF_FLIGHT_RECORDS_DROPPED, 1);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&slot->seq, &seq, 2 * pos + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    // Readers that see the new fields also see the odd sequence
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(words, data, len < sizeof(words) ? len : sizeof(words));
+    atomic_store_explicit(&slot->time_ns, netif_stats_now(), memory_order_relaxed);
+    atomic_store_explicit(&slot->latency_event,
+                          (latency_ns > UINT32_MAX ? UINT32_MAX : latency_ns) | (uint64_t)event << 32,
+                          memory_order_relaxed);
+    atomic_store_explicit(&slot->ifindex_aux, ifindex | (uint64_t)aux << 32, memory_order_relaxed);
+    atomic_store_explicit(&slot->data[0], words[0], memory_order_relaxed);
+    atomic_store_explicit(&slot->data[1], words[1], memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, 2 * pos + 2, memory_order_release);
+#else
+    (void)event;
+    (void)ifindex;
+    (void)aux;
+    (void)data;
+    (void)len;
+    (void)latency_ns;
+#endif
+}
+
+void
+flight_recorder_path_update(const struct flight_path_state *state, uint64_t latency_ns)
+{
+    uint8_t data[16];
+
+    // The active interface is the record's
+    memcpy(data, state, sizeof(data));
+    flight_recorder_record(FLIGHT_PATH_UPDATE, state->ifindex, state->update_count,
+                           data, sizeof(data), latency_ns);
+}
+
+/* Reads the record at `pos`. Returns 0 when it is not complete or was overwritten. */
+static int
+read_record(uint64_t pos, struct flight_record *record)
+{
+    const struct slot *slot = &ring[pos & (FLIGHT_RECORDER_CAPACITY - 1)];
+    uint64_t seq, latency_event, ifindex_aux, words[2];
+
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != 2 * pos + 2) {
+        return 0;
+    }
+    record->time_ns = atomic_load_explicit(&slot->time_ns, memory_order_relaxed);
+    latency_event = atomic_load_explicit(&slot->latency_event, memory_order_relaxed);
+    ifindex_aux = atomic_load_explicit(&slot->ifindex_aux, memory_order_relaxed);
+    words[0] = atomic_load_explicit(&slot->data[0], memory_order_relaxed);
+    words[1] = atomic_load_explicit(&slot->data[1], memory_order_relaxed);
+    // The fields were read before the sequence is checked again
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+        return 0;
+    }
+    record->seq = pos;
+    record->latency_ns = (uint32_t)latency_event;
+    record->event = (uint16_t)(latency_event >> 32);
+    record->reserved = 0;
+    record->ifindex = (uint32_t)ifindex_aux;
+    record->aux = (uint32_t)(ifindex_aux >> 32);
+    memcpy(record->data, words, sizeof(record->data));
+    return 1;
+}
+
+/* The positions that may still hold records: [*first, end) */
+static uint64_t
+window(uint64_t *first)
+{
+    uint64_t end = atomic_load_explicit(&head, memory_order_acquire);
+
+    *first = end > FLIGHT_RECORDER_CAPACITY ? end - FLIGHT_RECORDER_CAPACITY : 0;
+    return end;
+}
+
+size_t
+flight_recorder_snapshot(struct flight_record *records, size_t max)
+{
+    uint64_t pos, end;
+    size_t count = 0;
+
+    end = window(&pos);
+    // The latest `max`
+    if (end - pos > max) {
+        pos = end - max;
+    }
+    for (; pos < end; pos++) {
+        count += read_record(pos, &records[count]);
+    }
+    return count;
+}
+
+uint64_t
+flight_recorder_count(void)
+{
+    return atomic_load_explicit(&head, memory_order_relaxed);
+}
+
+void
+flight_recorder_reset(void)
+{
+    size_t i;
+
+    atomic_store_explicit(&head, 0, memory_order_relaxed);
+    for (i = 0; i < FLIGHT_RECORDER_CAPACITY; i++) {
+        atomic_store_explicit(&ring[i].seq, 0, memory_order_relaxed);
+    }
+}
+
+// Formatting without stdio, which is not async-signal-safe
+
+struct line {
+    char buf[192];
+    size_t len;
+};
+
+static void
+put_str(struct line *line, const char *s)
+{
+    while (*s && line->len < sizeof(line->buf)) {
+        line->buf[line->len++] = *s++;
+    }
+}
+
+static void
+put_uint(struct line *line, uint64_t v, unsigned base, int width)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
+    while (n < width) {
+        digits[n++] = '0';
+    }
+    while (n > 0 && line->len < sizeof(line->buf)) {
+        line->buf[line->len++] = digits[--n];
+    }
+}
+
+static void
+put_field(struct line *line, const char *name, uint64_t v)
+{
+    put_str(line, name);
+    put_uint(line, v, 10, 0);
+}
+
+static void
+put_address(struct line *line, unsigned family, const uint8_t *addr)
+{
+    int i;
+
+    if (family == AF_INET) {
+        for (i = 0; i < 4; i++) {
+            put_str(line, i ? "." : "");
+            put_uint(line, addr[i], 10, 0);
+        }
+    } else if (family == AF_INET6) {
+        // Uncompressed
+        for (i = 0; i < 16; i += 2) {
+            put_str(line, i ? ":" : "");
+            put_uint(line, (unsigned)addr[i] << 8 | addr[i + 1], 16, 0);
+        }
+    } else {
+        put_str(line, "none");
+    }
+}
+
+static void
+format_record(struct line *line, const struct flight_record *r)
+{
+    struct flight_path_state path;
+    char name[17];
+
+    line->len = 0;
+    put_uint(line, r->seq, 10, 0);
+    put_str(line, " ");
+    put_uint(line, r->time_ns / 1000000000u, 10, 0);
+    put_str(line, ".");
+    put_uint(line, r->time_ns % 1000000000u, 10, 9);
+    switch (r->event) {
+    case FLIGHT_PATH_UPDATE:
+        memcpy(&path, r->data, sizeof(path));
+        put_field(line, " path if=", r->ifindex);
+        put_field(line, " lat=", r->latency_ns);
+        put_field(line, " status=", path.status);
+        put_str(line, " flags=0x");
+        put_uint(line, path.flags, 16, 0);
+        put_field(line, " type=", path.interface_type);
+        put_field(line, " reason=", path.unsatisfied_reason);
+        put_field(line, " interfaces=", path.interfaces);
+        put_field(line, " count=", path.update_count);
+        break;
+    case FLIGHT_EGRESS:
+        put_field(line, " egress if=", r->ifindex);
+        put_field(line, " lat=", r->latency_ns);
+        put_str(line, " gateway=");
+        put_address(line, r->aux & 0xff, r->data);
+        put_field(line, " reason=", r->aux >> 8);
+        break;
+    case FLIGHT_INTERFACE:
+        memcpy(name, r->data, 16);
+        name[16] = '\0';
+        put_field(line, " interface if=", r->ifindex);
+        put_field(line, " lat=", r->latency_ns);
+        put_str(line, " name=");
+        put_str(line, name);
+        put_str(line, " flags=0x");
+        put_uint(line, r->aux, 16, 0);
+        break;
+    default:
+        put_field(line, " event=", r->event);
+        break;
+    }
+    // Truncated lines still end the line
+    if (line->len == sizeof(line->buf)) {
+        line->len--;
+    }
+    line->buf[line->len++] = '\n';
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int
+flight_recorder_dump(int fd)
+{
+    struct flight_record record;
+    struct line line;
+    uint64_t pos, end;
+    int count = 0;
+
+    end = window(&pos);
+    for (; pos < end; pos++) {
+        if (!read_record(pos, &record)) {
+            continue;
+        }
+        format_record(&line, &record);
+        if (write_all(fd, line.buf, line.len) != 0) {
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+static void
+crash_handler(int sig)
+{
+    int saved_errno = errno;
+    size_t i;
+
+    flight_recorder_dump(crash_fd);
+    for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++) {
+        if (crash_signals[i] == sig) {
+            sigaction(sig, &previous_actions[i], NULL);
+        }
+    }
+    // Blocked while the handler runs: delivered to the previous handler
+    // once it returns
+    raise(sig);
+    errno = saved_errno;
+}
+
+int
+flight_recorder_install_crash_handler(int fd)
+{
+    struct sigaction action;
+    stack_t stack;
+    size_t i;
+
+    // Installed again: the previous handlers would be this one
+    if (crash_fd >= 0) {
+        crash_fd = fd;
+        return 0;
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = crash_handler;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    // Keep a stack the thread already has, such as a sanitizer's
+    if (sigaltstack(NULL, &stack) != 0) {
+        return -1;
+    }
+    if (stack.ss_flags & SS_DISABLE) {
+        stack.ss_sp = crash_stack;
+        stack.ss_size = sizeof(crash_stack);
+        stack.ss_flags = 0;
+        if (sigaltstack(&stack, NULL) != 0) {
+            return -1;
+        }
+    }
+    crash_fd = fd;
+    for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++) {
+        if (sigaction(crash_signals[i], &action, &previous_actions[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Process-wide flight recorder of network state transitions: path
+ * updates, preferred egress (default gateway) changes and interface
+ * flaps, each with a CLOCK_MONOTONIC timestamp, a compact encoding of
+ * the new state and the time it took to process.
+ *
+ * The recorder is a fixed ring of FLIGHT_RECORDER_CAPACITY records in
+ * static storage; the oldest records are overwritten. Recording is lock
+ * free and allocation free from any number of threads: a relaxed
+ * fetch-and-add claims a position, and a per-record sequence number,
+ * written last, tells readers when the record is complete. Readers
+ * never block writers; a record being written while it is read is
+ * left out of the snapshot. A writer that finds its slot still held by
+ * a writer a full lap ahead or behind drops its record rather than
+ * wait (counted in the flight_records_dropped counter).
+ *
+ * flight_recorder_dump() formats the records without allocating or
+ * using stdio, so it can be called from a signal handler;
+ * flight_recorder_install_crash_handler() does that on SIGSEGV, SIGBUS,
+ * SIGILL, SIGFPE and SIGABRT. Building with FLIGHT_RECORDER_DISABLE
+ * turns recording into a no-op.
+ */
+
+#ifndef flight_recorder_h
+#define flight_recorder_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A power of two */
+#ifndef FLIGHT_RECORDER_CAPACITY
+#define FLIGHT_RECORDER_CAPACITY    1024
+#endif
+
+enum flight_event {
+    FLIGHT_PATH_UPDATE = 1,         /* data: struct flight_path_state */
+    FLIGHT_EGRESS,                  /* data: the gateway; aux: gateway family | egress reason << 8 */
+    FLIGHT_INTERFACE,               /* data: the name; aux: IFF_* flags, 0 once gone */
+};
+
+struct flight_record {
+    uint64_t seq;                   /* position in the recorder, from 0 */
+    uint64_t time_ns;               /* netif_stats_now() when recorded */
+    uint32_t latency_ns;            /* processing time, saturated at UINT32_MAX */
+    uint16_t event;                 /* FLIGHT_* */
+    uint16_t reserved;
+    uint32_t ifindex;
+    uint32_t aux;
+    uint8_t data[16];
+};
+
+/* Compact path state, as recorded for FLIGHT_PATH_UPDATE */
+struct flight_path_state {
+    uint8_t status;                 /* nw_path_status_t */
+    uint8_t flags;                  /* FLIGHT_PATH_* */
+    uint8_t interface_type;         /* nw_interface_type_t of the active interface */
+    uint8_t unsatisfied_reason;     /* nw_path_unsatisfied_reason_t */
+    uint16_t interfaces;            /* usable by the path */
+    uint16_t reserved;
+    uint32_t update_count;
+    uint32_t ifindex;               /* of the active interface, 0 when none */
+};
+
+#define FLIGHT_PATH_EXPENSIVE       0x01
+#define FLIGHT_PATH_CONSTRAINED     0x02
+#define FLIGHT_PATH_DNS             0x04
+#define FLIGHT_PATH_IPV4            0x08
+#define FLIGHT_PATH_IPV6            0x10
+
+/*
+ * Records an event. `len` bytes of `data` (at most 16, the rest zeroed)
+ * are copied into the record.
+ */
+void
+flight_recorder_record(enum flight_event event, uint32_t ifindex, uint32_t aux,
+                       const void *data, size_t len, uint64_t latency_ns);
+
+void
+flight_recorder_path_update(const struct flight_path_state *state, uint64_t latency_ns);
+
+/*
+ * Copies up to `max` of the latest complete records into `records`,
+ * oldest first, and returns how many. Concurrent writers may leave gaps
+ * in `seq`, and timestamps of records made by different threads may be
+ * slightly out of order.
+ */
+size_t
+flight_recorder_snapshot(struct flight_record *records, size_t max);
+
+/* Number of records made since start or the last reset, including overwritten ones */
+uint64_t
+flight_recorder_count(void);
+
+/*
+ * Writes the latest records to `fd`, oldest first, one line each, e.g.
+ *  17 1042.000250113 egress if=4 lat=31250 gateway=192.168.1.1 reason=3
+ * Async-signal-safe. Returns the number of records written or -1 with
+ * errno set.
+ */
+int
+flight_recorder_dump(int fd);
+
+/*
+ * Dumps the recorder to `fd` when the process crashes, then hands the
+ * signal to the handler installed before. The handler runs on an
+ * alternate signal stack so a stack overflow is dumped too; the calling
+ * thread gets a static one unless it already has its own, and other
+ * threads only overflow safely with their own sigaltstack(). Returns 0
+ * or -1 with errno set.
+ */
+int
+flight_recorder_install_crash_handler(int fd);
+
+/* Forgets every record. Records made concurrently may be lost. */
+void
+flight_recorder_reset(void);
+
+#endif /* flight_recorder_h */
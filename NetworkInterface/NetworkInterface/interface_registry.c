@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in interface_registry.h
+ */
+
+#include "interface_registry.h"
+#include "flight_recorder.h"
+
+#include "netif_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+// NOTE: route_dump.h must not be included here, its RTA_* macros
+// collide with <linux/rtnetlink.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netpacket/packet.h>
+#define EVENT_BUFSIZE   8192
+#else
+#include "route_dump.h"
+#include <net/if_dl.h>
+#define EVENT_BUFSIZE   2048
+#endif
+
+static uint32_t
+hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name) {
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    }
+    return h;
+}
+
+static void
+free_tables(struct interface_registry *registry)
+{
+    free(registry->interfaces);
+    free(registry->addresses);
+    free(registry->by_index);
+    free(registry->by_name);
+    registry->interfaces = NULL;
+    registry->addresses = NULL;
+    registry->by_index = NULL;
+    registry->by_name = NULL;
+    registry->count = registry->naddresses = 0;
+    registry->by_index_len = registry->nslots = 0;
+}
+
+static uint8_t
+mask_prefixlen(const struct sockaddr *mask, int family)
+{
+    const uint8_t *p;
+    size_t i, len;
+    uint8_t bits = 0;
+
+    if (mask == NULL) {
+        return family == AF_INET ? 32 : 128;
+    }
+    if (family == AF_INET) {
+        p = (const uint8_t *)&((const struct sockaddr_in *)mask)->sin_addr;
+        len = 4;
+    } else {
+        p = (const uint8_t *)&((const struct sockaddr_in6 *)mask)->sin6_addr;
+        len = 16;
+    }
+    for (i = 0; i < len && p[i] == 0xff; i++) {
+        bits += 8;
+    }
+    if (i < len) {
+        uint8_t b = p[i];
+        while (b & 0x80) {
+            bits++;
+            b <<= 1;
+        }
+    }
+    return bits;
+}
+
+/* Returns the position of `name` in the interface list, adding it if needed, or -1 */
+static long
+find_or_add(struct interface_registry *registry, size_t *cap, const char *name, unsigned flags)
+{
+    size_t i;
+
+    // getifaddrs() returns each interface's entries together, so the
+    // last interface added is almost always the match
+    for (i = registry->count; i > 0; i--) {
+        if (strncmp(registry->interfaces[i - 1].name, name, IFNAMSIZ) == 0) {
+            return (long)(i - 1);
+        }
+    }
+    if (registry->count == *cap) {
+        size_t n = *cap ? *cap * 2 : 16;
+        struct interface_info *interfaces = realloc(registry->interfaces, n * sizeof(*interfaces));
+        if (interfaces == NULL) {
+            return -1;
+        }
+        registry->interfaces = interfaces;
+        *cap = n;
+    }
+    memset(&registry->interfaces[registry->count], 0, sizeof(registry->interfaces[0]));
+    strncpy(registry->interfaces[registry->count].name, name, IFNAMSIZ - 1);
+    registry->interfaces[registry->count].flags = flags;
+    return (long)registry->count++;
+}
+
+/* Orders addresses by owning interface so each interface owns a contiguous range */
+static int
+compare_owner(const void *a, const void *b)
+{
+    const size_t *x = a, *y = b;
+    return *x < *y ? -1 : (*x > *y);
+}
+
+static int
+build_indexes(struct interface_registry *registry)
+{
+    size_t i, max_index = 0;
+
+    for (i = 0; i < registry->count; i++) {
+        if (registry->interfaces[i].index > max_index) {
+            max_index = registry->interfaces[i].index;
+        }
+    }
+    registry->by_index_len = max_index + 1;
+    registry->by_index = calloc(registry->by_index_len, sizeof(*registry->by_index));
+
+    registry->nslots = 16;
+    while (registry->nslots < registry->count * 2) {
+        registry->nslots *= 2;
+    }
+    registry->by_name = calloc(registry->nslots, sizeof(*registry->by_name));
+
+    if (registry->by_index == NULL || registry->by_name == NULL) {
+        return -1;
+    }
+    for (i = 0; i < registry->count; i++) {
+        const struct interface_info *info = &registry->interfaces[i];
+        size_t s = hash_name(info->name) & (registry->nslots - 1);
+
+        if (info->index) {
+            registry->by_index[info->index] = (uint32_t)(i + 1);
+        }
+        while (registry->by_name[s]) {
+            s = (s + 1) & (registry->nslots - 1);
+        }
+        registry->by_name[s] = (uint32_t)(i + 1);
+    }
+    return 0;
+}
+
+/*
+ * Records the interfaces of `fresh` that came, went, or went up or down
+ * or lost their carrier since `registry` was filled.
+ */
+static void
+record_flaps(const struct interface_registry *registry, const struct interface_registry *fresh,
+             uint64_t latency_ns)
+{
+    const unsigned watched = IFF_UP | IFF_RUNNING;
+    const struct interface_info *info, *old;
+    size_t i;
+
+    for (i = 0; i < fresh->count; i++) {
+        info = &fresh->interfaces[i];
+        old = interface_registry_by_index(registry, info->index);
+        if (old == NULL || ((old->flags ^ info->flags) & watched)) {
+            flight_recorder_record(FLIGHT_INTERFACE, info->index, info->flags,
+                                   info->name, strlen(info->name), latency_ns);
+        }
+    }
+    for (i = 0; i < registry->count; i++) {
+        old = &registry->interfaces[i];
+        if (interface_registry_by_index(fresh, old->index) == NULL) {
+            flight_recorder_record(FLIGHT_INTERFACE, old->index, 0,
+                                   old->name, strlen(old->name), latency_ns);
+        }
+    }
+}
+
+int
+interface_registry_refresh(struct interface_registry *registry)
+{
+    struct interface_registry fresh;
+    struct ifaddrs *ifaddrs, *ifa;
+    struct {
+        size_t owner;
+        struct interface_address address;
+    } *pending = NULL;
+    size_t cap = 0, npending = 0, pending_cap = 0, i;
+    uint64_t start;
+    int rc;
+
+    start = netif_stats_now();
+    rc = getifaddrs(&ifaddrs);
+    netif_stats_record_since(NETIF_GETIFADDRS_NS, start);
+    netif_stats_add(NETIF_GETIFADDRS_CALLS, 1);
+    if (rc != 0) {
+        return -1;
+    }
+    rc = -1;
+    netif_stats_add(NETIF_INTERFACE_REFRESHES, 1);
+    memset(&fresh, 0, sizeof(fresh));
+
+    for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+        struct interface_address *address;
+        long pos;
+
+        // ifa_name could be NULL
+        // https://sourceware.org/bugzilla/show_bug.cgi?id=21812
+        if (ifa->ifa_name == NULL) {
+            continue;
+        }
+        if ((pos = find_or_add(&fresh, &cap, ifa->ifa_name, ifa->ifa_flags)) < 0) {
+            goto done;
+        }
+        if (ifa->ifa_addr == NULL) {
+            continue;
+        }
+
+        switch (ifa->ifa_addr->sa_family) {
+#ifdef __linux__
+        case AF_PACKET:
+            fresh.interfaces[pos].index = (unsigned)((const struct sockaddr_ll *)ifa->ifa_addr)->sll_ifindex;
+            continue;
+#else
+        case AF_LINK:
+            fresh.interfaces[pos].index = ((const struct sockaddr_dl *)ifa->ifa_addr)->sdl_index;
+            continue;
+#endif
+        case AF_INET:
+        case AF_INET6:
+            break;
+        default:
+            continue;
+        }
+
+        if (npending == pending_cap) {
+            size_t n = pending_cap ? pending_cap * 2 : 32;
+            void *p = realloc(pending, n * sizeof(*pending));
+            if (p == NULL) {
+                goto done;
+            }
+            pending = p;
+            pending_cap = n;
+        }
+        pending[npending].owner = (size_t)pos;
+        address = &pending[npending].address;
+        memset(address, 0, sizeof(*address));
+        address->family = (uint8_t)ifa->ifa_addr->sa_family;
+        address->prefixlen = mask_prefixlen(ifa->ifa_netmask, address->family);
+        if (address->family == AF_INET) {
+            memcpy(address->addr, &((const struct sockaddr_in *)ifa->ifa_addr)->sin_addr, 4);
+        } else {
+            memcpy(address->addr, &((const struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr, 16);
+        }
+        npending++;
+    }
+
+    // Interfaces without a link-level entry: fall back to a lookup each
+    for (i = 0; i < fresh.count; i++) {
+        if (fresh.interfaces[i].index == 0) {
+            fresh.interfaces[i].index = if_nametoindex(fresh.interfaces[i].name);
+        }
+    }
+
+    if (npending) {
+        // The order of addresses within an interface is not significant
+        qsort(pending, npending, sizeof(*pending), compare_owner);
+        if ((fresh.addresses = malloc(npending * sizeof(*fresh.addresses))) == NULL) {
+            goto done;
+        }
+        for (i = 0; i < npending; i++) {
+            struct interface_info *info = &fresh.interfaces[pending[i].owner];
+            if (info->naddresses == 0) {
+                info->first_address = i;
+            }
+            info->naddresses++;
+            fresh.addresses[i] = pending[i].address;
+        }
+        fresh.naddresses = npending;
+    }
+
+    if (build_indexes(&fresh) == 0) {
+        if (registry->generation > 0) {
+            record_flaps(registry, &fresh, netif_stats_now() - start);
+        }
+        // Only replace the previous state once the new one is complete
+        free_tables(registry);
+        registry->interfaces = fresh.interfaces;
+        registry->count = fresh.count;
+        registry->addresses = fresh.addresses;
+        registry->naddresses = fresh.naddresses;
+        registry->by_index = fresh.by_index;
+        registry->by_index_len = fresh.by_index_len;
+        registry->by_name = fresh.by_name;
+        registry->nslots = fresh.nslots;
+        registry->stale = 0;
+        registry->generation++;
+        rc = 0;
+    }
+
+done:
+    if (rc != 0) {
+        int saved_errno = errno;
+        free_tables(&fresh);
+        errno = saved_errno;
+    }
+    free(pending);
+    freeifaddrs(ifaddrs);
+    return rc;
+}
+
+int
+interface_registry_open(struct interface_registry *registry)
+{
+    memset(registry, 0, sizeof(*registry));
+
+    // Subscribe before reading so no change between the two is missed
+#ifdef __linux__
+    {
+        struct sockaddr_nl sa;
+
+        registry->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+        if (registry->fd >= 0) {
+            memset(&sa, 0, sizeof(sa));
+            sa.nl_family = AF_NETLINK;
+            sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+            if (bind(registry->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+                close(registry->fd);
+                registry->fd = -1;
+            }
+        }
+    }
+#else
+    registry->fd = socket(PF_ROUTE, SOCK_RAW, AF_UNSPEC);
+    if (registry->fd >= 0 && fcntl(registry->fd, F_SETFL, fcntl(registry->fd, F_GETFL) | O_NONBLOCK) < 0) {
+        close(registry->fd);
+        registry->fd = -1;
+    }
+#endif
+    if (registry->fd < 0) {
+        return -1;
+    }
+    if (interface_registry_refresh(registry) != 0) {
+        int saved_errno = errno;
+        interface_registry_close(registry);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+void
+interface_registry_close(struct interface_registry *registry)
+{
+    if (registry->fd >= 0) {
+        close(registry->fd);
+    }
+    registry->fd = -1;
+    free_tables(registry);
+}
+
+/* Returns 1 if the message describes a link or address change */
+static int
+is_interface_event(const char *buf, size_t len)
+{
+#ifdef __linux__
+    const struct nlmsghdr *nlh;
+    int remaining = (int)len;
+
+    for (nlh = (const struct nlmsghdr *)buf; NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+        switch (nlh->nlmsg_type) {
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            return 1;
+        }
+    }
+    return 0;
+#else
+    const struct rt_msghdr *rtm = (const struct rt_msghdr *)buf;
+
+    // Every routing socket message starts with the rt_msghdr length, version and type
+    if (len < 4 || rtm->rtm_version != RTM_VERSION) {
+        return 0;
+    }
+    switch (rtm->rtm_type) {
+    case RTM_IFINFO:
+    case RTM_IFINFO2:
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+int
+interface_registry_process(struct interface_registry *registry)
+{
+    char buf[EVENT_BUFSIZE];
+
+    for (;;) {
+        ssize_t n = recv(registry->fd, buf, sizeof(buf), 0);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == ENOBUFS) {
+                // Events were dropped, any of them may have been relevant
+                registry->stale = 1;
+                continue;
+            }
+            return -1;
+        }
+        if (is_interface_event(buf, (size_t)n)) {
+            registry->stale = 1;
+        }
+    }
+
+    if (!registry->stale) {
+        return 0;
+    }
+    return interface_registry_refresh(registry) == 0 ? 1 : -1;
+}
+
+const struct interface_info *
+interface_registry_by_name(const struct interface_registry *registry, const char *name)
+{
+    size_t s;
+
+    if (registry->nslots == 0) {
+        return NULL;
+    }
+    for (s = hash_name(name) & (registry->nslots - 1); registry->by_name[s];
+         s = (s + 1) & (registry->nslots - 1)) {
+        const struct interface_info *info = &registry->interfaces[registry->by_name[s] - 1];
+        if (strncmp(info->name, name, IFNAMSIZ) == 0) {
+            return info;
+        }
+    }
+    return NULL;
+}
+
+const struct interface_info *
+interface_registry_by_index(const struct interface_registry *registry, unsigned index)
+{
+    if (index == 0 || index >= registry->by_index_len || registry->by_index[index] == 0) {
+        return NULL;
+    }
+    return &registry->interfaces[registry->by_index[index] - 1];
+}
+
+int
+interface_registry_is_active(const struct interface_registry *registry,
+                             const struct interface_info *info)
+{
+    (void)registry;
+
+    // Only IFF_UP interfaces. Loopback is ignored.
+    return (info->flags & IFF_UP) && !(info->flags & IFF_LOOPBACK) && info->naddresses > 0;
+}
+
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct interface_registry shared = { .fd = -1 };
+
+/* Returns the up to date process-wide registry, or NULL. Called with shared_mutex held. */
+static struct interface_registry *
+shared_registry(void)
+{
+    if (shared.fd < 0) {
+        if (interface_registry_open(&shared) != 0) {
+            return NULL;
+        }
+    } else if (interface_registry_process(&shared) < 0) {
+        // Keep serving the last good state; retry on the next call
+        shared.stale = 1;
+    }
+    return &shared;
+}
+
+int
+interface_is_active_and_not_loopback(const char *name)
+{
+    struct interface_registry *registry;
+    const struct interface_info *info;
+    int active = 0;
+
+    pthread_mutex_lock(&shared_mutex);
+    if ((registry = shared_registry()) != NULL &&
+        (info = interface_registry_by_name(registry, name)) != NULL) {
+        active = interface_registry_is_active(registry, info);
+    }
+    pthread_mutex_unlock(&shared_mutex);
+    return active;
+}
+
+int
+interface_name_for_index(unsigned index, char name[IFNAMSIZ])
+{
+    struct interface_registry *registry;
+    const struct interface_info *info;
+    int found = 0;
+
+    pthread_mutex_lock(&shared_mutex);
+    if ((registry = shared_registry()) != NULL &&
+        (info = interface_registry_by_index(registry, index)) != NULL) {
+        memcpy(name, info->name, IFNAMSIZ);
+        found = 1;
+    }
+    pthread_mutex_unlock(&shared_mutex);
+    return found;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Cached registry of network interfaces with O(1) lookup by name and
+ * by index, covering flags, addresses and up/loopback state.
+ *
+ * The registry is filled with a single getifaddrs() call and is only
+ * refreshed when a link or address change event arrives: PF_ROUTE
+ * RTM_IFINFO/RTM_NEWADDR/RTM_DELADDR on Apple, netlink link and
+ * address notifications on Linux. Lookups in between make no system
+ * calls.
+ */
+
+#ifndef interface_registry_h
+#define interface_registry_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+
+struct interface_address {
+    uint8_t family;             /* AF_INET or AF_INET6 */
+    uint8_t prefixlen;
+    uint8_t reserved[2];
+    uint8_t addr[16];
+};
+
+struct interface_info {
+    char name[IFNAMSIZ];
+    unsigned index;
+    unsigned flags;             /* IFF_* */
+    size_t first_address;       /* into interface_registry.addresses */
+    size_t naddresses;
+};
+
+struct interface_registry {
+    struct interface_info *interfaces;
+    size_t count;
+    struct interface_address *addresses;
+    size_t naddresses;
+    uint32_t *by_index;         /* ifindex -> position + 1, 0 when unknown */
+    size_t by_index_len;
+    uint32_t *by_name;          /* open addressing: position + 1, 0 when empty */
+    size_t nslots;
+    int fd;                     /* non-blocking link/address event socket */
+    int stale;                  /* an event arrived since the last refresh */
+    uint64_t generation;        /* incremented on every refresh */
+};
+
+/*
+ * Opens the event socket and fills the registry.
+ * Returns 0 or -1 with errno set.
+ */
+int
+interface_registry_open(struct interface_registry *registry);
+
+void
+interface_registry_close(struct interface_registry *registry);
+
+/* Re-reads all interfaces with getifaddrs(). Returns 0 or -1 with errno set. */
+int
+interface_registry_refresh(struct interface_registry *registry);
+
+/*
+ * Drains pending link and address events without blocking and
+ * refreshes the registry if any arrived. Returns 1 when refreshed, 0
+ * when nothing changed and -1 on error.
+ */
+int
+interface_registry_process(struct interface_registry *registry);
+
+const struct interface_info *
+interface_registry_by_name(const struct interface_registry *registry, const char *name);
+
+const struct interface_info *
+interface_registry_by_index(const struct interface_registry *registry, unsigned index);
+
+/* Returns 1 if the interface is up, not loopback and has an IPv4 or IPv6 address */
+int
+interface_registry_is_active(const struct interface_registry *registry,
+                             const struct interface_info *info);
+
+/*
+ * Process-wide registry shared by the monitors, opened on first use and
+ * serialized by an internal mutex. Each call first drains the pending
+ * events (see interface_registry_process()), reading the socket until
+ * it would block, which is a single recv() when nothing changed. Both
+ * return 0 when the registry is unavailable or the interface is unknown.
+ */
+int
+interface_is_active_and_not_loopback(const char *name);
+
+int
+interface_name_for_index(unsigned index, char name[IFNAMSIZ]);
+
+#endif /* interface_registry_h */
@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in interface_table.h
+ */
+
+#include "interface_table.h"
+
+#include "netif_stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include "route_netlink.h"
+#include <linux/rtnetlink.h>
+#else
+#include <ifaddrs.h>
+#include <net/if_dl.h>
+#include <net/if_var.h>
+#endif
+
+/* An address before it is grouped under its link */
+struct raw_address {
+    uint32_t ifindex;
+    uint8_t family;
+    uint8_t prefixlen;
+    uint8_t addr[16];
+    uint8_t broadcast[16];
+};
+
+struct loader {
+    struct interface_table *table;
+    struct raw_address *raw;
+    size_t nraw;
+    size_t raw_cap;
+    uint32_t *slots;                /* ifindex hash: link position + 1, 0 when empty */
+    size_t nslots;
+};
+
+static int
+grow(void *arrayp, size_t elem, size_t cap)
+{
+    void **p = arrayp;
+    void *q = realloc(*p, cap * elem);
+
+    if (q == NULL) {
+        return -1;
+    }
+    *p = q;
+    return 0;
+}
+
+static int
+reserve_links(struct interface_table *t, size_t n)
+{
+    size_t cap;
+
+    if (n <= t->cap) {
+        return 0;
+    }
+    cap = t->cap ? t->cap * 2 : 64;
+    while (cap < n) {
+        cap *= 2;
+    }
+    if (grow(&t->index, sizeof(*t->index), cap) != 0 ||
+        grow(&t->flags, sizeof(*t->flags), cap) != 0 ||
+        grow(&t->mtu, sizeof(*t->mtu), cap) != 0 ||
+        grow(&t->name, sizeof(*t->name), cap) != 0 ||
+        grow(&t->addr_first, sizeof(*t->addr_first), cap) != 0 ||
+        grow(&t->addr_count, sizeof(*t->addr_count), cap) != 0) {
+        return -1;
+    }
+    t->cap = cap;
+    return 0;
+}
+
+static int
+reserve_addrs(struct interface_table *t, size_t n)
+{
+    if (n <= t->addr_cap) {
+        return 0;
+    }
+    if (grow(&t->addr_link, sizeof(*t->addr_link), n) != 0 ||
+        grow(&t->addr_family, sizeof(*t->addr_family), n) != 0 ||
+        grow(&t->addr_prefixlen, sizeof(*t->addr_prefixlen), n) != 0 ||
+        grow(&t->addr, sizeof(*t->addr), n) != 0 ||
+        grow(&t->addr_broadcast, sizeof(*t->addr_broadcast), n) != 0) {
+        return -1;
+    }
+    t->addr_cap = n;
+    return 0;
+}
+
+static size_t
+hash_index(uint32_t index, size_t nslots)
+{
+    return (size_t)((index * 2654435761u) & (nslots - 1));
+}
+
+static long
+find_slot(const uint32_t *slots, size_t nslots, const struct interface_table *t, uint32_t index)
+{
+    size_t s;
+
+    if (nslots == 0) {
+        return -1;
+    }
+    for (s = hash_index(index, nslots); slots[s]; s = (s + 1) & (nslots - 1)) {
+        if (t->index[slots[s] - 1] == index) {
+            return (long)(slots[s] - 1);
+        }
+    }
+    return -1;
+}
+
+/* Returns the position of the link, adding it with `name` if needed, or -1 */
+static long
+add_link(struct loader *ld, uint32_t index, const char *name, uint32_t flags, uint32_t mtu)
+{
+    struct interface_table *t = ld->table;
+    long pos = find_slot(ld->slots, ld->nslots, t, index);
+    size_t s;
+
+    if (pos >= 0) {
+        return pos;
+    }
+    if ((t->count + 1) * 2 > ld->nslots) {
+        size_t nslots = ld->nslots ? ld->nslots * 2 : 128, i;
+        uint32_t *slots = calloc(nslots, sizeof(*slots));
+        if (slots == NULL) {
+            return -1;
+        }
+        for (i = 0; i < t->count; i++) {
+            s = hash_index(t->index[i], nslots);
+            while (slots[s]) {
+                s = (s + 1) & (nslots - 1);
+            }
+            slots[s] = (uint32_t)(i + 1);
+        }
+        free(ld->slots);
+        ld->slots = slots;
+        ld->nslots = nslots;
+    }
+    if (reserve_links(t, t->count + 1) != 0) {
+        return -1;
+    }
+    pos = (long)t->count++;
+    t->index[pos] = index;
+    t->flags[pos] = flags;
+    t->mtu[pos] = mtu;
+    memset(t->name[pos], 0, IFNAMSIZ);
+    strncpy(t->name[pos], name, IFNAMSIZ - 1);
+    t->addr_first[pos] = 0;
+    t->addr_count[pos] = 0;
+
+    s = hash_index(index, ld->nslots);
+    while (ld->slots[s]) {
+        s = (s + 1) & (ld->nslots - 1);
+    }
+    ld->slots[s] = (uint32_t)(pos + 1);
+    return pos;
+}
+
+static struct raw_address *
+add_raw(struct loader *ld)
+{
+    if (ld->nraw == ld->raw_cap) {
+        size_t cap = ld->raw_cap ? ld->raw_cap * 2 : 128;
+        if (grow(&ld->raw, sizeof(*ld->raw), cap) != 0) {
+            return NULL;
+        }
+        ld->raw_cap = cap;
+    }
+    memset(&ld->raw[ld->nraw], 0, sizeof(ld->raw[0]));
+    return &ld->raw[ld->nraw++];
+}
+
+/* Groups the collected addresses under their links with a counting sort */
+static int
+place_addresses(struct loader *ld)
+{
+    struct interface_table *t = ld->table;
+    size_t i, n = 0;
+    uint32_t next;
+
+    for (i = 0; i < ld->nraw; i++) {
+        long pos = find_slot(ld->slots, ld->nslots, t, ld->raw[i].ifindex);
+        // Addresses of links that vanished between the two dumps are dropped
+        ld->raw[i].ifindex = pos < 0 ? UINT32_MAX : (uint32_t)pos;
+        if (pos >= 0) {
+            t->addr_count[pos]++;
+            n++;
+        }
+    }
+    if (reserve_addrs(t, n ? n : 1) != 0) {
+        return -1;
+    }
+    for (i = 0, next = 0; i < t->count; i++) {
+        t->addr_first[i] = next;
+        next += t->addr_count[i];
+        t->addr_count[i] = 0;
+    }
+    for (i = 0; i < ld->nraw; i++) {
+        const struct raw_address *r = &ld->raw[i];
+        uint32_t a;
+        if (r->ifindex == UINT32_MAX) {
+            continue;
+        }
+        a = t->addr_first[r->ifindex] + t->addr_count[r->ifindex]++;
+        t->addr_link[a] = r->ifindex;
+        t->addr_family[a] = r->family;
+        t->addr_prefixlen[a] = r->prefixlen;
+        memcpy(t->addr[a], r->addr, 16);
+        memcpy(t->addr_broadcast[a], r->broadcast, 16);
+    }
+    t->naddrs = n;
+    return 0;
+}
+
+#ifdef __linux__
+
+static int
+request_dump(int fd, uint16_t type, uint32_t seq)
+{
+    struct {
+        struct nlmsghdr nlh;
+        union {
+            struct ifinfomsg ifi;
+            struct ifaddrmsg ifa;
+        } u;
+    } req;
+    struct sockaddr_nl kernel;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_type = type;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = seq;
+    if (type == RTM_GETLINK) {
+        req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.u.ifi));
+        req.u.ifi.ifi_family = AF_UNSPEC;
+    } else {
+        req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.u.ifa));
+        req.u.ifa.ifa_family = AF_UNSPEC;
+    }
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(fd, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+on_link(const struct nlmsghdr *nlh, void *ctx)
+{
+    const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    const struct rtattr *rta;
+    const char *name = "";
+    uint32_t mtu = 0;
+    int len;
+
+    if (nlh->nlmsg_type != RTM_NEWLINK || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi))) {
+        return 0;
+    }
+    len = (int)IFLA_PAYLOAD(nlh);
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME && RTA_PAYLOAD(rta) > 0 &&
+            ((const char *)RTA_DATA(rta))[RTA_PAYLOAD(rta) - 1] == '\0') {
+            name = RTA_DATA(rta);
+        } else if (rta->rta_type == IFLA_MTU && RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+            memcpy(&mtu, RTA_DATA(rta), sizeof(mtu));
+        }
+    }
+    if (add_link(ctx, (uint32_t)ifi->ifi_index, name, ifi->ifi_flags, mtu) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+on_addr(const struct nlmsghdr *nlh, void *ctx)
+{
+    const struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+    const struct rtattr *rta;
+    const void *address = NULL, *local = NULL, *broadcast = NULL;
+    struct raw_address *r;
+    size_t alen;
+    int len;
+
+    if (nlh->nlmsg_type != RTM_NEWADDR || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa))) {
+        return 0;
+    }
+    if (ifa->ifa_family == AF_INET) {
+        alen = 4;
+    } else if (ifa->ifa_family == AF_INET6) {
+        alen = 16;
+    } else {
+        return 0;
+    }
+    len = (int)IFA_PAYLOAD(nlh);
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (RTA_PAYLOAD(rta) < alen) {
+            continue;
+        }
+        switch (rta->rta_type) {
+        case IFA_ADDRESS:
+            address = RTA_DATA(rta);
+            break;
+        case IFA_LOCAL:
+            local = RTA_DATA(rta);
+            break;
+        case IFA_BROADCAST:
+            broadcast = RTA_DATA(rta);
+            break;
+        }
+    }
+    // NOTE: on point-to-point links IFA_ADDRESS is the peer and IFA_LOCAL
+    // the address of this host
+    if (local) {
+        address = local;
+    }
+    if (address == NULL) {
+        return 0;
+    }
+    if ((r = add_raw(ctx)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    r->ifindex = ifa->ifa_index;
+    r->family = ifa->ifa_family;
+    r->prefixlen = ifa->ifa_prefixlen;
+    memcpy(r->addr, address, alen);
+    if (broadcast) {
+        memcpy(r->broadcast, broadcast, alen);
+    }
+    return 0;
+}
+
+static int
+load(struct loader *ld)
+{
+    int fd, rc = -1;
+
+    if ((fd = route_netlink_open(0)) < 0) {
+        return -1;
+    }
+    // One dump at a time: the kernel rejects a second dump request on a
+    // socket while one is in progress
+    if (request_dump(fd, RTM_GETLINK, 1) == 0 &&
+        route_netlink_read_reply(fd, 1, on_link, ld) == 0 &&
+        request_dump(fd, RTM_GETADDR, 2) == 0 &&
+        route_netlink_read_reply(fd, 2, on_addr, ld) == 0) {
+        rc = 0;
+    }
+    if (rc != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+#else
+
+static int
+load(struct loader *ld)
+{
+    struct ifaddrs *ifaddrs, *ifa;
+    const char *link_name = NULL;
+    unsigned link_index = 0;
+    uint64_t start;
+    int rc;
+
+    start = netif_stats_now();
+    rc = getifaddrs(&ifaddrs);
+    netif_stats_record_since(NETIF_GETIFADDRS_NS, start);
+    netif_stats_add(NETIF_GETIFADDRS_CALLS, 1);
+    if (rc != 0) {
+        return -1;
+    }
+    for (ifa = ifaddrs; ifa && rc == 0; ifa = ifa->ifa_next) {
+        struct raw_address *r;
+        unsigned index;
+
+        // ifa_name could be NULL
+        // https://sourceware.org/bugzilla/show_bug.cgi?id=21812
+        if (ifa->ifa_name == NULL || ifa->ifa_addr == NULL) {
+            continue;
+        }
+        // The link-level entry leads each interface's entries and carries
+        // its index and MTU, as in interface_registry.c
+        if (ifa->ifa_addr->sa_family == AF_LINK) {
+            const struct if_data *data = ifa->ifa_data;
+
+            link_name = ifa->ifa_name;
+            link_index = ((const struct sockaddr_dl *)ifa->ifa_addr)->sdl_index;
+            if (add_link(ld, link_index, link_name, ifa->ifa_flags, data ? data->ifi_mtu : 0) < 0) {
+                rc = -1;
+            }
+            continue;
+        }
+        if (ifa->ifa_addr->sa_family != AF_INET && ifa->ifa_addr->sa_family != AF_INET6) {
+            continue;
+        }
+        if (link_name && strcmp(ifa->ifa_name, link_name) == 0) {
+            index = link_index;
+        } else {
+            // Interfaces without a link-level entry: fall back to a lookup
+            if ((index = if_nametoindex(ifa->ifa_name)) == 0) {
+                continue;
+            }
+            if (add_link(ld, index, ifa->ifa_name, ifa->ifa_flags, 0) < 0) {
+                rc = -1;
+                break;
+            }
+        }
+        if ((r = add_raw(ld)) == NULL) {
+            rc = -1;
+            break;
+        }
+        r->ifindex = index;
+        r->family = (uint8_t)ifa->ifa_addr->sa_family;
+        if (r->family == AF_INET) {
+            memcpy(r->addr, &((const struct sockaddr_in *)ifa->ifa_addr)->sin_addr, 4);
+            if ((ifa->ifa_flags & IFF_BROADCAST) && ifa->ifa_broadaddr) {
+                memcpy(r->broadcast, &((const struct sockaddr_in *)ifa->ifa_broadaddr)->sin_addr, 4);
+            }
+        } else {
+            memcpy(r->addr, &((const struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr, 16);
+        }
+        if (ifa->ifa_netmask) {
+            const uint8_t *m = r->family == AF_INET
+                ? (const uint8_t *)&((const struct sockaddr_in *)ifa->ifa_netmask)->sin_addr
+                : (const uint8_t *)&((const struct sockaddr_in6 *)ifa->ifa_netmask)->sin6_addr;
+            size_t i, mlen = r->family == AF_INET ? 4 : 16;
+            for (i = 0; i < mlen; i++) {
+                uint8_t b = m[i];
+                while (b & 0x80) {
+                    r->prefixlen++;
+                    b <<= 1;
+                }
+            }
+        }
+    }
+    if (rc != 0) {
+        errno = ENOMEM;
+    }
+    freeifaddrs(ifaddrs);
+    return rc;
+}
+
+#endif
+
+void
+interface_table_init(struct interface_table *table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+void
+interface_table_free(struct interface_table *table)
+{
+    free(table->index);
+    free(table->flags);
+    free(table->mtu);
+    free(table->name);
+    free(table->addr_first);
+    free(table->addr_count);
+    free(table->addr_link);
+    free(table->addr_family);
+    free(table->addr_prefixlen);
+    free(table->addr);
+    free(table->addr_broadcast);
+    interface_table_init(table);
+}
+
+long
+interface_table_load(struct interface_table *table)
+{
+    struct loader ld;
+    size_t i;
+    int rc;
+
+    // Storage is kept across loads so a rescan does not reallocate
+    table->count = 0;
+    table->naddrs = 0;
+    memset(&ld, 0, sizeof(ld));
+    ld.table = table;
+
+    rc = load(&ld);
+    if (rc == 0) {
+        rc = place_addresses(&ld);
+    }
+    table->sorted = 1;
+    for (i = 1; i < table->count; i++) {
+        if (table->index[i - 1] >= table->index[i]) {
+            table->sorted = 0;
+            break;
+        }
+    }
+    free(ld.raw);
+    free(ld.slots);
+    if (rc != 0) {
+        int saved_errno = errno;
+        table->count = 0;
+        table->naddrs = 0;
+        errno = saved_errno;
+        return -1;
+    }
+    return (long)table->count;
+}
+
+long
+interface_table_find(const struct interface_table *table, uint32_t index)
+{
+    size_t lo = 0, hi = table->count, i;
+
+    if (!table->sorted) {
+        for (i = 0; i < table->count; i++) {
+            if (table->index[i] == index) {
+                return (long)i;
+            }
+        }
+        return -1;
+    }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->index[mid] < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < table->count && table->index[lo] == index ? (long)lo : -1;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Flat, struct-of-arrays table of all links and their IPv4 and IPv6
+ * addresses, filled in a single batched pass with no size limit.
+ *
+ * On Linux one NETLINK_ROUTE socket carries a RTM_GETLINK dump followed
+ * by a RTM_GETADDR dump, so the number of system calls depends on the
+ * size of the reply and not on the number of interfaces. Elsewhere the
+ * table is filled from one getifaddrs() call, which on Apple platforms
+ * is itself a single NET_RT_IFLIST2 sysctl; each link's index and MTU
+ * come from its AF_LINK entry.
+ *
+ * Link `i` is described by index[i], flags[i], mtu[i] and name[i]; its
+ * addresses are positions addr_first[i] .. addr_first[i] + addr_count[i]
+ * of the addr_* arrays.
+ */
+
+#ifndef interface_table_h
+#define interface_table_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+
+struct interface_table {
+    /* Links */
+    size_t count;
+    size_t cap;
+    uint32_t *index;
+    uint32_t *flags;                /* IFF_* */
+    uint32_t *mtu;                  /* 0 when unknown */
+    char (*name)[IFNAMSIZ];
+    uint32_t *addr_first;
+    uint32_t *addr_count;
+    int sorted;                     /* links are in interface index order */
+
+    /* Addresses, grouped by link */
+    size_t naddrs;
+    size_t addr_cap;
+    uint32_t *addr_link;            /* position of the owning link */
+    uint8_t *addr_family;           /* AF_INET or AF_INET6 */
+    uint8_t *addr_prefixlen;
+    uint8_t (*addr)[16];
+    uint8_t (*addr_broadcast)[16];  /* IPv4 broadcast address, zero when none */
+};
+
+void
+interface_table_init(struct interface_table *table);
+
+void
+interface_table_free(struct interface_table *table);
+
+/*
+ * Replaces the contents of `table` with all links and their IPv4 and
+ * IPv6 addresses. Returns the number of links or -1 with errno set.
+ */
+long
+interface_table_load(struct interface_table *table);
+
+/*
+ * Returns the position of the link with interface index `index`, or -1.
+ * O(log n) when the links are sorted, which netlink dumps are.
+ */
+long
+interface_table_find(const struct interface_table *table, uint32_t index);
+
+#endif /* interface_table_h */
@@ -18,8 +18,13 @@
  */
 
 /*
- * WARNING: this code is incomplete and unused, but it provides an example of how to use ioctl
- * to retrieve interface information.
+ * WARNING: this code is unused, but it provides an example of how to retrieve
+ * interface information.
+ *
+ * NOTE: interfaces used to be listed with SIOCGIFCONF into a fixed 16 KB
+ * buffer, which silently truncated on hosts with many interfaces, followed
+ * by three more ioctls per interface. They are now read in one batched pass
+ * into the table in interface_table.h.
  */
 
 #ifndef interfaces_ioctl_h
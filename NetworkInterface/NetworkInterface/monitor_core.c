@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in monitor_core.h
+ */
+
+#include "monitor_core.h"
+#include "flight_recorder.h"
+#include "netif_stats.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+// Identifies the source in the readiness events
+enum {
+    SOURCE_ROUTES,
+    SOURCE_INTERFACES,
+};
+
+static int
+watch(int fd, int source_fd, int source)
+{
+#ifdef __linux__
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;            // level-triggered: ready until drained
+    ev.data.u32 = (uint32_t)source;
+    return epoll_ctl(fd, EPOLL_CTL_ADD, source_fd, &ev);
+#else
+    struct kevent ev;
+
+    EV_SET(&ev, source_fd, EVFILT_READ, EV_ADD, 0, 0, (void *)(intptr_t)source);
+    return kevent(fd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+/* Fills `ready` with the sources that have pending events, without blocking */
+static int
+ready_sources(int fd, int ready[2])
+{
+    int i, n;
+#ifdef __linux__
+    struct epoll_event evs[2];
+
+    do {
+        n = epoll_wait(fd, evs, 2, 0);
+    } while (n < 0 && errno == EINTR);
+    for (i = 0; i < n; i++) {
+        ready[evs[i].data.u32] = 1;
+    }
+#else
+    static const struct timespec zero = { 0, 0 };
+    struct kevent evs[2];
+
+    do {
+        n = kevent(fd, NULL, 0, evs, 2, &zero);
+    } while (n < 0 && errno == EINTR);
+    for (i = 0; i < n; i++) {
+        ready[(intptr_t)evs[i].udata] = 1;
+    }
+#endif
+    return n < 0 ? -1 : 0;
+}
+
+int
+monitor_core_open(struct monitor_core *core, int family)
+{
+    int saved_errno;
+
+    memset(core, 0, sizeof(*core));
+    core->family = family;
+    core->routes.fd = -1;
+    core->interfaces.fd = -1;
+#ifdef __linux__
+    core->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    core->fd = kqueue();
+#endif
+    if (core->fd < 0) {
+        return -1;
+    }
+    if (route_tracker_open(&core->routes) != 0 ||
+        interface_registry_open(&core->interfaces) != 0 ||
+        watch(core->fd, core->routes.fd, SOURCE_ROUTES) != 0 ||
+        watch(core->fd, core->interfaces.fd, SOURCE_INTERFACES) != 0) {
+        saved_errno = errno;
+        monitor_core_close(core);
+        errno = saved_errno;
+        return -1;
+    }
+    egress_update(&core->routes.table, core->family, &core->has_egress, &core->egress);
+    return 0;
+}
+
+void
+monitor_core_close(struct monitor_core *core)
+{
+    if (core->routes.fd >= 0) {
+        route_tracker_close(&core->routes);
+    }
+    if (core->interfaces.fd >= 0) {
+        interface_registry_close(&core->interfaces);
+    }
+    if (core->fd >= 0) {
+        close(core->fd);
+    }
+    core->fd = -1;
+    core->has_egress = 0;
+}
+
+/* Records the new egress, or that there is none */
+static void
+record_egress(const struct monitor_core *core, uint64_t start)
+{
+    const struct route_entry *route = &core->egress.route;
+
+    if (core->has_egress) {
+        flight_recorder_record(FLIGHT_EGRESS, route->ifindex,
+                               route->gateway_family | (uint32_t)core->egress.reason << 8,
+                               route->gateway, sizeof(route->gateway), netif_stats_now() - start);
+    } else {
+        flight_recorder_record(FLIGHT_EGRESS, 0, 0, NULL, 0, netif_stats_now() - start);
+    }
+}
+
+int
+monitor_core_process(struct monitor_core *core)
+{
+    int ready[2] = { 0, 0 }, changes = 0, rc;
+    uint64_t start = netif_stats_now();
+
+    if (ready_sources(core->fd, ready) != 0) {
+        return -1;
+    }
+    if (ready[SOURCE_ROUTES]) {
+        if ((rc = route_tracker_process(&core->routes)) < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            changes |= MONITOR_ROUTES;
+        }
+    }
+    if (ready[SOURCE_INTERFACES]) {
+        if ((rc = interface_registry_process(&core->interfaces)) < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            changes |= MONITOR_INTERFACES;
+        }
+    }
+    if ((changes & MONITOR_ROUTES) &&
+        egress_update(&core->routes.table, core->family, &core->has_egress, &core->egress)) {
+        changes |= MONITOR_EGRESS;
+        record_egress(core, start);
+    }
+    if (changes) {
+        core->wakeups++;
+    }
+    return changes;
+}
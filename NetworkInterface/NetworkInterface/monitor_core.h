@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Network monitor for callers that run their own event loop.
+ *
+ * The core combines the route tracker (route_tracker.h) and the
+ * interface registry (interface_registry.h) behind one non-blocking
+ * file descriptor: an epoll instance on Linux and a kqueue on Apple,
+ * watching both event sockets. Register `fd` for readability with the
+ * caller's epoll, kqueue, poll or select, and call
+ * monitor_core_process() when it fires:
+ *
+ *  monitor_core_open(&core, AF_INET);
+ *  ... add core.fd to the loop ...
+ *  on readable: changes = monitor_core_process(&core);
+ *      if (changes & MONITOR_EGRESS) ... use core.egress ...
+ *
+ * No threads or dispatch queues are involved and nothing blocks; all
+ * work happens inside monitor_core_process() on the caller's thread.
+ * The core is not thread safe: use it from the loop's thread only.
+ *
+ * NOTE: NWPathMonitor, used by NetworkInterfaceMonitor, only delivers
+ * on a dispatch queue, so the core watches the kernel sources it
+ * wraps instead.
+ */
+
+#ifndef monitor_core_h
+#define monitor_core_h
+
+#include "egress_selector.h"
+#include "interface_registry.h"
+#include "route_tracker.h"
+
+#include <stdint.h>
+
+/* Returned by monitor_core_process(), or-ed together */
+#define MONITOR_ROUTES      0x1     /* the routing table changed */
+#define MONITOR_INTERFACES  0x2     /* links or addresses changed */
+#define MONITOR_EGRESS      0x4     /* the preferred egress changed or went away */
+
+struct monitor_core {
+    int fd;                         /* readable while changes are pending */
+    int family;                     /* of the default routes ranked for egress */
+    struct route_tracker routes;
+    struct interface_registry interfaces;
+    int has_egress;
+    struct egress_choice egress;    /* valid when has_egress */
+    uint64_t wakeups;               /* process() calls that found changes */
+};
+
+/*
+ * Opens both event sockets, loads the routing table and interfaces,
+ * and chooses the preferred egress among the default routes of
+ * `family` (AF_INET, AF_INET6 or AF_UNSPEC). Returns 0 or -1 with errno
+ * set.
+ */
+int
+monitor_core_open(struct monitor_core *core, int family);
+
+void
+monitor_core_close(struct monitor_core *core);
+
+/*
+ * Applies all pending route, link and address changes without
+ * blocking and re-ranks the egress if routes changed. Returns the
+ * MONITOR_* changes (0 when there were none), or -1 with errno set.
+ */
+int
+monitor_core_process(struct monitor_core *core);
+
+#endif /* monitor_core_h */
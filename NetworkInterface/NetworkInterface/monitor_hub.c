@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in monitor_hub.h
+ */
+
+#include "monitor_hub.h"
+#include "netif_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+void
+monitor_update_retain(struct monitor_update *update)
+{
+    atomic_fetch_add_explicit(&update->refs, 1, memory_order_relaxed);
+}
+
+void
+monitor_update_release(struct monitor_update *update)
+{
+    if (update && atomic_fetch_sub_explicit(&update->refs, 1, memory_order_acq_rel) == 1) {
+        route_compact_free(&update->routes);
+        free(update);
+    }
+}
+
+/* Non-blocking, close-on-exec pipe */
+static int
+open_pipe(int fds[2])
+{
+    int i;
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    for (i = 0; i < 2; i++) {
+        if (fcntl(fds[i], F_SETFD, FD_CLOEXEC) != 0 ||
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK) != 0) {
+            int saved = errno;
+            close(fds[0]);
+            close(fds[1]);
+            errno = saved;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Snapshot of the core's current state, with one reference */
+static struct monitor_update *
+build_update(struct monitor_hub *hub, int changes)
+{
+    const struct interface_registry *registry = &hub->core.interfaces;
+    const struct route_table *table = &hub->core.routes.table;
+    struct monitor_update *u;
+    size_t i;
+
+    u = malloc(sizeof(*u) + registry->count * sizeof(u->interfaces[0]));
+    if (u == NULL) {
+        return NULL;
+    }
+    if (route_compact_build(&u->routes, table->entries, table->count) != 0) {
+        free(u);
+        return NULL;
+    }
+    atomic_init(&u->refs, 1);
+    u->version = ++hub->version;
+    u->changes = changes;
+    u->time_ns = netif_stats_now();
+    u->has_egress = hub->core.has_egress;
+    if (u->has_egress) {
+        u->egress = hub->core.egress;
+    } else {
+        memset(&u->egress, 0, sizeof(u->egress));
+    }
+    u->ninterfaces = registry->count;
+    for (i = 0; i < registry->count; i++) {
+        const struct interface_info *info = &registry->interfaces[i];
+        struct monitor_interface *mi = &u->interfaces[i];
+        memcpy(mi->name, info->name, sizeof(mi->name));
+        mi->index = info->index;
+        mi->flags = info->flags;
+        mi->active = interface_registry_is_active(registry, info);
+    }
+    return u;
+}
+
+/* Hub side of a subscriber ring */
+static void
+push(struct monitor_subscriber *sub, struct monitor_update *u)
+{
+    uint64_t head = atomic_load_explicit(&sub->head, memory_order_relaxed);
+    struct monitor_update *old;
+    char byte = 0;
+    ssize_t rc;
+
+    monitor_update_retain(u);
+    old = atomic_exchange_explicit(&sub->slots[head & sub->mask], u, memory_order_acq_rel);
+    atomic_store_explicit(&sub->head, head + 1, memory_order_release);
+    if (old) {
+        // The subscriber has not read it: full, drop the oldest
+        atomic_fetch_add_explicit(&sub->dropped, 1, memory_order_relaxed);
+        netif_stats_add(NETIF_HUB_UPDATES_DROPPED, 1);
+        monitor_update_release(old);
+    }
+    // NOTE: only fails with EAGAIN, when the pipe is full and so readable
+    rc = write(sub->wake, &byte, 1);
+    (void)rc;
+}
+
+/* Takes ownership of `u`'s reference */
+static void
+publish(struct monitor_hub *hub, struct monitor_update *u)
+{
+    struct monitor_subscriber *sub;
+    struct monitor_update *old;
+
+    pthread_mutex_lock(&hub->lock);
+    for (sub = hub->subscribers; sub; sub = sub->next) {
+        push(sub, u);
+    }
+    old = hub->latest;
+    hub->latest = u;
+    pthread_mutex_unlock(&hub->lock);
+    netif_stats_add(NETIF_HUB_UPDATES, 1);
+    monitor_update_release(old);
+}
+
+static void *
+hub_thread(void *arg)
+{
+    struct monitor_hub *hub = arg;
+    struct pollfd pfds[2];
+    struct monitor_update *u;
+    int changes;
+
+    pfds[0].fd = hub->core.fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = hub->stop[0];
+    pfds[1].events = POLLIN;
+    for (;;) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            hub->errors++;
+            break;
+        }
+        if (pfds[1].revents) {
+            break;
+        }
+        if (!pfds[0].revents) {
+            continue;
+        }
+        if ((changes = monitor_core_process(&hub->core)) < 0) {
+            hub->errors++;
+            continue;
+        }
+        if (changes == 0) {
+            continue;
+        }
+        if ((u = build_update(hub, changes)) == NULL) {
+            // Out of memory: subscribers get the next change's update
+            hub->errors++;
+            continue;
+        }
+        publish(hub, u);
+    }
+    return NULL;
+}
+
+int
+monitor_hub_start(struct monitor_hub *hub, int family)
+{
+    struct monitor_update *u;
+    int rc;
+
+    memset(hub, 0, sizeof(*hub));
+    if (monitor_core_open(&hub->core, family) != 0) {
+        return -1;
+    }
+    if (open_pipe(hub->stop) != 0) {
+        goto fail_core;
+    }
+    if ((rc = pthread_mutex_init(&hub->lock, NULL)) != 0) {
+        errno = rc;
+        goto fail_pipe;
+    }
+    if ((u = build_update(hub, MONITOR_ROUTES | MONITOR_INTERFACES | MONITOR_EGRESS)) == NULL) {
+        goto fail_lock;
+    }
+    publish(hub, u);
+    if ((rc = pthread_create(&hub->thread, NULL, hub_thread, hub)) != 0) {
+        errno = rc;
+        monitor_update_release(hub->latest);
+        goto fail_lock;
+    }
+    return 0;
+
+fail_lock:
+    pthread_mutex_destroy(&hub->lock);
+fail_pipe:
+    close(hub->stop[0]);
+    close(hub->stop[1]);
+fail_core:
+    rc = errno;
+    monitor_core_close(&hub->core);
+    errno = rc;
+    return -1;
+}
+
+void
+monitor_hub_stop(struct monitor_hub *hub)
+{
+    char byte = 0;
+
+    if (write(hub->stop[1], &byte, 1) != 1) {
+        // Cannot happen with an empty pipe; the join would hang
+        abort();
+    }
+    pthread_join(hub->thread, NULL);
+    close(hub->stop[0]);
+    close(hub->stop[1]);
+    monitor_update_release(hub->latest);
+    hub->latest = NULL;
+    pthread_mutex_destroy(&hub->lock);
+    monitor_core_close(&hub->core);
+}
+
+static pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+static struct monitor_hub shared;
+static int shared_started;
+
+static void
+start_shared(void)
+{
+    shared_started = monitor_hub_start(&shared, AF_INET) == 0;
+}
+
+struct monitor_hub *
+monitor_hub_shared(void)
+{
+    pthread_once(&shared_once, start_shared);
+    return shared_started ? &shared : NULL;
+}
+
+struct monitor_subscriber *
+monitor_hub_subscribe(struct monitor_hub *hub, size_t capacity)
+{
+    struct monitor_subscriber *sub;
+    size_t n = 2, i;
+    int fds[2];
+
+    while (n < capacity) {
+        n *= 2;
+    }
+    if ((sub = calloc(1, sizeof(*sub))) == NULL) {
+        return NULL;
+    }
+    if ((sub->slots = calloc(n, sizeof(*sub->slots))) == NULL) {
+        free(sub);
+        return NULL;
+    }
+    if (open_pipe(fds) != 0) {
+        free(sub->slots);
+        free(sub);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        atomic_init(&sub->slots[i], NULL);
+    }
+    sub->mask = n - 1;
+    sub->fd = fds[0];
+    sub->wake = fds[1];
+
+    pthread_mutex_lock(&hub->lock);
+    if (hub->latest) {
+        push(sub, hub->latest);
+    }
+    sub->next = hub->subscribers;
+    hub->subscribers = sub;
+    hub->nsubscribers++;
+    pthread_mutex_unlock(&hub->lock);
+    return sub;
+}
+
+void
+monitor_hub_unsubscribe(struct monitor_hub *hub, struct monitor_subscriber *sub)
+{
+    struct monitor_subscriber **p;
+    size_t i;
+
+    pthread_mutex_lock(&hub->lock);
+    for (p = &hub->subscribers; *p; p = &(*p)->next) {
+        if (*p == sub) {
+            *p = sub->next;
+            hub->nsubscribers--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    // The hub no longer pushes to it
+    for (i = 0; i <= sub->mask; i++) {
+        monitor_update_release(atomic_exchange(&sub->slots[i], NULL));
+    }
+    close(sub->fd);
+    close(sub->wake);
+    free(sub->slots);
+    free(sub);
+}
+
+struct monitor_update *
+monitor_hub_latest(struct monitor_hub *hub)
+{
+    struct monitor_update *u;
+
+    pthread_mutex_lock(&hub->lock);
+    if ((u = hub->latest) != NULL) {
+        monitor_update_retain(u);
+    }
+    pthread_mutex_unlock(&hub->lock);
+    return u;
+}
+
+static void
+drain(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+struct monitor_update *
+monitor_subscriber_next(struct monitor_subscriber *sub)
+{
+    struct monitor_update *u;
+    uint64_t head;
+
+    for (;;) {
+        head = atomic_load_explicit(&sub->head, memory_order_acquire);
+        if (sub->tail == head) {
+            // Drained before looking again, so a push after the second
+            // look leaves the fd readable
+            drain(sub->fd);
+            head = atomic_load_explicit(&sub->head, memory_order_acquire);
+            if (sub->tail == head) {
+                return NULL;
+            }
+        }
+        if (head - sub->tail > sub->mask + 1) {
+            // Lapped: everything before the last ring's worth was dropped
+            sub->tail = head - (sub->mask + 1);
+        }
+        u = atomic_exchange_explicit(&sub->slots[sub->tail & sub->mask], NULL,
+                                     memory_order_acq_rel);
+        sub->tail++;
+        if (u == NULL) {
+            continue;
+        }
+        if (u->version <= sub->last_version) {
+            // A newer update already taken from this slot's lap
+            monitor_update_release(u);
+            continue;
+        }
+        sub->last_version = u->version;
+        atomic_fetch_add_explicit(&sub->delivered, 1, memory_order_relaxed);
+        return u;
+    }
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * One monitor for the whole process, fanning its results out to any
+ * number of subscribers.
+ *
+ * The hub runs a monitor core (monitor_core.h) on its own thread, so
+ * the kernel work for a change happens once whatever the number of
+ * subscribers. Each change produces one immutable, reference counted
+ * struct monitor_update holding the routing table, the interfaces and
+ * the preferred egress, pushed to every subscriber's queue.
+ *
+ * A subscriber queue is a single-producer, single-consumer ring of
+ * update pointers: the hub pushes and the subscriber pops without
+ * locks. The hub never waits for a subscriber. When a ring is full the
+ * push overwrites the oldest update, which is counted in `dropped`;
+ * updates are complete states, so a slow subscriber only misses
+ * intermediate ones. A subscriber's `fd` is readable while updates are
+ * pending, for its own event loop.
+ *
+ *  sub = monitor_hub_subscribe(monitor_hub_shared(), 8);
+ *  ... add sub->fd to the loop ...
+ *  on readable: while ((u = monitor_subscriber_next(sub)) != NULL) {
+ *      ... use u ...
+ *      monitor_update_release(u);
+ *  }
+ */
+
+#ifndef monitor_hub_h
+#define monitor_hub_h
+
+#include "egress_selector.h"
+#include "monitor_core.h"
+#include "route_compact.h"
+
+#include <net/if.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct monitor_interface {
+    char name[IFNAMSIZ];
+    unsigned index;
+    unsigned flags;                 /* IFF_* */
+    int active;                     /* see interface_registry_is_active() */
+};
+
+struct monitor_update {
+    _Atomic unsigned refs;
+    uint64_t version;               /* increases with every update */
+    int changes;                    /* MONITOR_* since the previous update */
+    uint64_t time_ns;               /* netif_stats_now() when built */
+    int has_egress;
+    struct egress_choice egress;
+    struct route_compact routes;
+    size_t ninterfaces;
+    struct monitor_interface interfaces[];
+};
+
+struct monitor_subscriber {
+    int fd;                         /* readable while updates are pending */
+    /* Ring, written by the hub and read by the subscriber */
+    _Atomic(struct monitor_update *) *slots;
+    size_t mask;
+    _Atomic uint64_t head;          /* pushes so far */
+    uint64_t tail;                  /* consumer only */
+    uint64_t last_version;          /* consumer only */
+    int wake;                       /* write end of `fd`'s pipe */
+    _Atomic uint64_t dropped;       /* updates overwritten before being read */
+    _Atomic uint64_t delivered;
+    struct monitor_subscriber *next;
+};
+
+struct monitor_hub {
+    struct monitor_core core;
+    pthread_t thread;
+    int stop[2];                    /* pipe waking the thread to stop */
+    pthread_mutex_t lock;           /* subscribers and latest */
+    struct monitor_subscriber *subscribers;
+    size_t nsubscribers;
+    struct monitor_update *latest;
+    uint64_t version;
+    uint64_t errors;                /* monitor_core_process() failures */
+};
+
+/*
+ * Opens the monitor core for `family` (see monitor_core_open()), builds
+ * the first update and starts the hub thread. Returns 0 or -1 with
+ * errno set.
+ */
+int
+monitor_hub_start(struct monitor_hub *hub, int family);
+
+/* Stops the thread and closes the core. No subscriber may remain. */
+void
+monitor_hub_stop(struct monitor_hub *hub);
+
+/* Process-wide IPv4 hub, started on first use; NULL if it could not be */
+struct monitor_hub *
+monitor_hub_shared(void);
+
+/*
+ * Adds a subscriber whose ring holds `capacity` updates (rounded up to a
+ * power of two, at least 2). The latest update is queued at once.
+ * Returns NULL with errno set on failure.
+ */
+struct monitor_subscriber *
+monitor_hub_subscribe(struct monitor_hub *hub, size_t capacity);
+
+/* Removes and frees `sub`, releasing the updates it has not read */
+void
+monitor_hub_unsubscribe(struct monitor_hub *hub, struct monitor_subscriber *sub);
+
+/*
+ * Returns the latest update with a reference held by the caller, or
+ * NULL before the first.
+ */
+struct monitor_update *
+monitor_hub_latest(struct monitor_hub *hub);
+
+/*
+ * Pops the oldest pending update, newer than any returned before, or
+ * returns NULL when there is none. The caller owns one reference. Only
+ * one thread may consume a given subscriber.
+ */
+struct monitor_update *
+monitor_subscriber_next(struct monitor_subscriber *sub);
+
+void
+monitor_update_retain(struct monitor_update *update);
+
+void
+monitor_update_release(struct monitor_update *update);
+
+#endif /* monitor_hub_h */
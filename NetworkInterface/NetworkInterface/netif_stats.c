@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in netif_stats.h
+ */
+
+#include "netif_stats.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+_Atomic uint64_t netif_stats_counters[NETIF_COUNTER_COUNT];
+
+static struct netif_stats_histogram histograms[NETIF_HISTOGRAM_COUNT];
+
+static const char *const counter_names[NETIF_COUNTER_COUNT] = {
+    [NETIF_SYSCTL_RETRIES] = "sysctl_retries",
+    [NETIF_BYTES_DUMPED] = "bytes_dumped",
+    [NETIF_ROUTES_SCANNED] = "routes_scanned",
+    [NETIF_GETIFADDRS_CALLS] = "getifaddrs_calls",
+    [NETIF_NETLINK_DUMPS] = "netlink_dumps",
+    [NETIF_INTERFACE_REFRESHES] = "interface_refreshes",
+    [NETIF_PATH_UPDATES] = "path_updates",
+    [NETIF_PATH_UPDATES_COALESCED] = "path_updates_coalesced",
+    [NETIF_PATH_RESULTS_STALE] = "path_results_stale",
+    [NETIF_RACE_ATTEMPTS] = "race_attempts",
+    [NETIF_RACE_ATTEMPTS_CANCELLED] = "race_attempts_cancelled",
+    [NETIF_HUB_UPDATES] = "hub_updates",
+    [NETIF_HUB_UPDATES_DROPPED] = "hub_updates_dropped",
+    [NETIF_EXPORT_CHUNKS] = "export_chunks",
+    [NETIF_DECODE_STEALS] = "decode_steals",
+    [NETIF_NETNS_RESYNCS] = "netns_resyncs",
+    [NETIF_FLIGHT_RECORDS_DROPPED] = "flight_records_dropped",
+    [NETIF_RESOLVE_LOOKUPS] = "resolve_lookups",
+    [NETIF_RESOLVE_ROUNDS] = "resolve_rounds",
+};
+
+static const char *const histogram_names[NETIF_HISTOGRAM_COUNT] = {
+    [NETIF_SYSCTL_ESTIMATE_NS] = "sysctl_estimate_ns",
+    [NETIF_SYSCTL_DUMP_NS] = "sysctl_dump_ns",
+    [NETIF_NETLINK_DUMP_NS] = "netlink_dump_ns",
+    [NETIF_GETIFADDRS_NS] = "getifaddrs_ns",
+    [NETIF_DEFAULT_GATEWAY_NS] = "default_gateway_ns",
+    [NETIF_PATH_UPDATE_NS] = "path_update_ns",
+    [NETIF_RACE_CONNECT_NS] = "race_connect_ns",
+};
+
+uint64_t
+netif_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Values below 16 have a bucket each. Above, the position of the
+ * leading bit picks a power of two range and the next 4 bits one of its
+ * 16 buckets.
+ */
+static size_t
+bucket_of(uint64_t v)
+{
+    unsigned e;
+
+    if (v < NETIF_STATS_SUB_BUCKETS) {
+        return (size_t)v;
+    }
+    e = 63 - (unsigned)__builtin_clzll(v);
+    return (size_t)(e - 3) * NETIF_STATS_SUB_BUCKETS + ((v >> (e - 4)) & (NETIF_STATS_SUB_BUCKETS - 1));
+}
+
+/* Largest value that falls into `bucket` */
+static uint64_t
+bucket_upper(size_t bucket)
+{
+    unsigned e;
+    uint64_t sub;
+
+    if (bucket < NETIF_STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    e = (unsigned)(bucket / NETIF_STATS_SUB_BUCKETS) + 3;
+    sub = bucket % NETIF_STATS_SUB_BUCKETS;
+    return ((NETIF_STATS_SUB_BUCKETS + sub) << (e - 4)) + ((uint64_t)1 << (e - 4)) - 1;
+}
+
+static void
+atomic_max(_Atomic uint64_t *target, uint64_t v)
+{
+    uint64_t cur = atomic_load_explicit(target, memory_order_relaxed);
+
+    while (v > cur &&
+           !atomic_compare_exchange_weak_explicit(target, &cur, v, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+void
+netif_stats_record(enum netif_histogram histogram, uint64_t ns)
+{
+#ifndef NETIF_STATS_DISABLE
+    struct netif_stats_histogram *h = &histograms[histogram];
+
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+    atomic_max(&h->min_inverted, ~ns);
+    atomic_max(&h->max, ns);
+#else
+    (void)histogram;
+    (void)ns;
+#endif
+}
+
+uint64_t
+netif_stats_counter(enum netif_counter counter)
+{
+    return atomic_load_explicit(&netif_stats_counters[counter], memory_order_relaxed);
+}
+
+/* Fills `values` with the value at each of `percentiles`, in increasing order */
+static uint64_t
+percentiles_of(const struct netif_stats_histogram *h, const double *percentiles, uint64_t *values,
+               size_t n)
+{
+    uint64_t counts[NETIF_STATS_BUCKETS];
+    uint64_t total = 0, seen = 0, rank, max;
+    size_t i, b = 0;
+
+    // Ranks are taken over a copy so concurrent recording cannot skew them
+    for (i = 0; i < NETIF_STATS_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    for (i = 0; i < n; i++) {
+        if (total == 0) {
+            values[i] = 0;
+            continue;
+        }
+        rank = (uint64_t)(percentiles[i] / 100.0 * (double)total + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        if (rank > total) {
+            rank = total;
+        }
+        while (seen + counts[b] < rank) {
+            seen += counts[b++];
+        }
+        values[i] = bucket_upper(b) < max ? bucket_upper(b) : max;
+    }
+    return total;
+}
+
+uint64_t
+netif_stats_percentile(enum netif_histogram histogram, double percentile)
+{
+    uint64_t value;
+
+    percentiles_of(&histograms[histogram], &percentile, &value, 1);
+    return value;
+}
+
+void
+netif_stats_summary(enum netif_histogram histogram, struct netif_stats_summary *summary)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    const struct netif_stats_histogram *h = &histograms[histogram];
+    uint64_t values[4], sum;
+
+    memset(summary, 0, sizeof(*summary));
+    summary->count = percentiles_of(h, percentiles, values, 4);
+    if (summary->count == 0) {
+        return;
+    }
+    sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    summary->min = ~atomic_load_explicit(&h->min_inverted, memory_order_relaxed);
+    summary->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    summary->mean = sum / summary->count;
+    summary->p50 = values[0];
+    summary->p90 = values[1];
+    summary->p99 = values[2];
+    summary->p999 = values[3];
+}
+
+const char *
+netif_stats_counter_name(enum netif_counter counter)
+{
+    return counter_names[counter];
+}
+
+const char *
+netif_stats_histogram_name(enum netif_histogram histogram)
+{
+    return histogram_names[histogram];
+}
+
+struct output {
+    char *buf;
+    size_t len;
+    size_t used;                    /* what the full output needs so far */
+};
+
+static void
+append(struct output *out, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->used < out->len ? out->buf + out->used : NULL,
+                  out->used < out->len ? out->len - out->used : 0, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        out->used += (size_t)n;
+    }
+}
+
+size_t
+netif_stats_format(char *buf, size_t len, int format)
+{
+    struct output out = { buf, len, 0 };
+    struct netif_stats_summary s;
+    int json = format == NETIF_STATS_JSON;
+    int i;
+
+    if (len > 0) {
+        buf[0] = '\0';
+    }
+    append(&out, json ? "{\"counters\":{" : "counters:\n");
+    for (i = 0; i < NETIF_COUNTER_COUNT; i++) {
+        append(&out, json ? "%s\"%s\":%llu" : "%s  %-24s %llu\n", json && i ? "," : "",
+               counter_names[i], (unsigned long long)netif_stats_counter(i));
+    }
+    append(&out, json ? "},\"histograms\":{" : "histograms (ns):\n");
+    for (i = 0; i < NETIF_HISTOGRAM_COUNT; i++) {
+        netif_stats_summary(i, &s);
+        append(&out, json ?
+               "%s\"%s\":{\"count\":%llu,\"min\":%llu,\"mean\":%llu,\"p50\":%llu,"
+               "\"p90\":%llu,\"p99\":%llu,\"p99.9\":%llu,\"max\":%llu}" :
+               "%s  %-24s count %llu min %llu mean %llu p50 %llu p90 %llu p99 %llu "
+               "p99.9 %llu max %llu\n",
+               json && i ? "," : "", histogram_names[i],
+               (unsigned long long)s.count, (unsigned long long)s.min,
+               (unsigned long long)s.mean, (unsigned long long)s.p50,
+               (unsigned long long)s.p90, (unsigned long long)s.p99,
+               (unsigned long long)s.p999, (unsigned long long)s.max);
+    }
+    if (json) {
+        append(&out, "}}");
+    }
+    return out.used;
+}
+
+void
+netif_stats_reset(void)
+{
+    size_t i, b;
+
+    for (i = 0; i < NETIF_COUNTER_COUNT; i++) {
+        atomic_store_explicit(&netif_stats_counters[i], 0, memory_order_relaxed);
+    }
+    for (i = 0; i < NETIF_HISTOGRAM_COUNT; i++) {
+        for (b = 0; b < NETIF_STATS_BUCKETS; b++) {
+            atomic_store_explicit(&histograms[i].buckets[b], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&histograms[i].sum, 0, memory_order_relaxed);
+        atomic_store_explicit(&histograms[i].min_inverted, 0, memory_order_relaxed);
+        atomic_store_explicit(&histograms[i].max, 0, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Process-wide counters and latency histograms for gateway and
+ * interface discovery.
+ *
+ * Recording is a relaxed atomic add into static storage: no locks, no
+ * allocation, safe from any thread. Histograms are HDR-style log-linear:
+ * each power of two range is split into 16 buckets, so any recorded
+ * value is reported within 1/16 (6.25%) of its true value, from 1 ns up
+ * to the full 64-bit range, in a fixed 7.6 KB per histogram.
+ *
+ * Everything can be read in-process with netif_stats_counter() and
+ * netif_stats_summary(), or formatted as text or JSON with
+ * netif_stats_format(). Building with NETIF_STATS_DISABLE turns the
+ * recording functions into no-ops.
+ */
+
+#ifndef netif_stats_h
+#define netif_stats_h
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum netif_counter {
+    NETIF_SYSCTL_RETRIES,           /* NET_RT_DUMP2 retried after ENOMEM */
+    NETIF_BYTES_DUMPED,             /* dump bytes read from the kernel */
+    NETIF_ROUTES_SCANNED,           /* routes decoded from dumps */
+    NETIF_GETIFADDRS_CALLS,
+    NETIF_NETLINK_DUMPS,
+    NETIF_INTERFACE_REFRESHES,      /* interface registry rebuilds */
+    NETIF_PATH_UPDATES,             /* path updates received from the monitor */
+    NETIF_PATH_UPDATES_COALESCED,   /* updates folded into a pending recompute */
+    NETIF_PATH_RESULTS_STALE,       /* recomputed states dropped as stale */
+    NETIF_RACE_ATTEMPTS,            /* connects started by connection races */
+    NETIF_RACE_ATTEMPTS_CANCELLED,  /* connects closed after another won */
+    NETIF_HUB_UPDATES,              /* monitor hub updates published */
+    NETIF_HUB_UPDATES_DROPPED,      /* overwritten in a slow subscriber's queue */
+    NETIF_EXPORT_CHUNKS,            /* route export chunks written */
+    NETIF_DECODE_STEALS,            /* parallel decode batches stolen by idle workers */
+    NETIF_NETNS_RESYNCS,            /* namespaces dumped again after lost notifications */
+    NETIF_FLIGHT_RECORDS_DROPPED,   /* flight records whose slot was held a lap away */
+    NETIF_RESOLVE_LOOKUPS,          /* destinations given to route_resolve_batch() */
+    NETIF_RESOLVE_ROUNDS,           /* windows of lookups sent and waited for */
+    NETIF_COUNTER_COUNT
+};
+
+enum netif_histogram {
+    NETIF_SYSCTL_ESTIMATE_NS,       /* NET_RT_DUMP2 size estimate */
+    NETIF_SYSCTL_DUMP_NS,           /* NET_RT_DUMP2 dump */
+    NETIF_NETLINK_DUMP_NS,          /* netlink route dump or default route query */
+    NETIF_GETIFADDRS_NS,
+    NETIF_DEFAULT_GATEWAY_NS,       /* print_default_gateway() */
+    NETIF_PATH_UPDATE_NS,           /* path update to updateHandler(state) */
+    NETIF_RACE_CONNECT_NS,          /* start of a connection race to its winner */
+    NETIF_HISTOGRAM_COUNT
+};
+
+#define NETIF_STATS_SUB_BUCKETS     16
+#define NETIF_STATS_BUCKETS         ((64 - 3) * NETIF_STATS_SUB_BUCKETS)
+
+struct netif_stats_histogram {
+    _Atomic uint64_t buckets[NETIF_STATS_BUCKETS];
+    _Atomic uint64_t sum;
+    _Atomic uint64_t min_inverted;  /* ~min, so that zeroed storage means none */
+    _Atomic uint64_t max;
+};
+
+struct netif_stats_summary {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+extern _Atomic uint64_t netif_stats_counters[NETIF_COUNTER_COUNT];
+
+/* CLOCK_MONOTONIC in nanoseconds, for timing what is recorded */
+uint64_t
+netif_stats_now(void);
+
+static inline void
+netif_stats_add(enum netif_counter counter, uint64_t n)
+{
+#ifndef NETIF_STATS_DISABLE
+    atomic_fetch_add_explicit(&netif_stats_counters[counter], n, memory_order_relaxed);
+#else
+    (void)counter;
+    (void)n;
+#endif
+}
+
+/* Records a latency in nanoseconds */
+void
+netif_stats_record(enum netif_histogram histogram, uint64_t ns);
+
+/* Records the time elapsed since `start_ns`, a netif_stats_now() value */
+static inline void
+netif_stats_record_since(enum netif_histogram histogram, uint64_t start_ns)
+{
+#ifndef NETIF_STATS_DISABLE
+    netif_stats_record(histogram, netif_stats_now() - start_ns);
+#else
+    (void)histogram;
+    (void)start_ns;
+#endif
+}
+
+uint64_t
+netif_stats_counter(enum netif_counter counter);
+
+/*
+ * Summarizes a histogram. Percentiles are the upper bound of the bucket
+ * holding them, clamped to the largest value recorded.
+ */
+void
+netif_stats_summary(enum netif_histogram histogram, struct netif_stats_summary *summary);
+
+/* Returns the value at `percentile` (0..100) of a histogram, 0 when empty */
+uint64_t
+netif_stats_percentile(enum netif_histogram histogram, double percentile);
+
+const char *
+netif_stats_counter_name(enum netif_counter counter);
+
+const char *
+netif_stats_histogram_name(enum netif_histogram histogram);
+
+#define NETIF_STATS_TEXT    0
+#define NETIF_STATS_JSON    1
+
+/*
+ * Formats all counters and histogram summaries into `buf` like
+ * snprintf(): the result is always terminated and the return value is
+ * the length the full output needs.
+ */
+size_t
+netif_stats_format(char *buf, size_t len, int format);
+
+/* Zeroes everything. Values recorded concurrently may be lost. */
+void
+netif_stats_reset(void);
+
+#endif /* netif_stats_h */
@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in netns_monitor.h
+ */
+
+#ifdef __linux__
+
+#define _GNU_SOURCE
+
+#include "netns_monitor.h"
+#include "netif_stats.h"
+#include "route_netlink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/rtnetlink.h>
+
+#define EVENTS_PER_WAIT 256
+
+int
+netns_monitor_init(struct netns_monitor *mon, int family, netns_monitor_fn on_change, void *ctx)
+{
+    int saved_errno;
+
+    memset(mon, 0, sizeof(*mon));
+    mon->family = family;
+    mon->on_change = on_change;
+    mon->ctx = ctx;
+    mon->self = -1;
+    if ((mon->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if ((mon->self = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC)) < 0 ||
+        (mon->buf = malloc(ROUTE_NETLINK_BUFSIZE)) == NULL) {
+        saved_errno = errno;
+        netns_monitor_free(mon);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+free_state(struct netns_state *ns)
+{
+    if (ns->fd >= 0) {
+        close(ns->fd);
+    }
+    route_table_free(&ns->routes);
+    free(ns->links);
+    free(ns);
+}
+
+void
+netns_monitor_free(struct netns_monitor *mon)
+{
+    size_t i;
+
+    for (i = 0; i < mon->count; i++) {
+        free_state(mon->namespaces[i]);
+    }
+    free(mon->namespaces);
+    free(mon->buf);
+    if (mon->self >= 0) {
+        close(mon->self);
+    }
+    if (mon->fd >= 0) {
+        close(mon->fd);
+    }
+    memset(mon, 0, sizeof(*mon));
+    mon->fd = -1;
+    mon->self = -1;
+}
+
+/* Asks for a dump of `type` (RTM_GETLINK or RTM_GETROUTE) with a new sequence number */
+static int
+request_dump(struct netns_state *ns, int type)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct ifinfomsg ifi;
+    } req;
+    struct sockaddr_nl kernel;
+
+    ns->seq++;
+    ns->syncing = type;
+    if (type == RTM_GETROUTE) {
+        return route_netlink_request_dump(ns->fd, AF_UNSPEC, ns->seq);
+    }
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nlh.nlmsg_type = (uint16_t)type;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = ns->seq;
+    req.ifi.ifi_family = AF_UNSPEC;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    return sendto(ns->fd, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&kernel,
+                  sizeof(kernel)) < 0 ? -1 : 0;
+}
+
+/* Drops the snapshot and dumps it again; nothing is reported until done */
+static int
+start_sync(struct netns_state *ns)
+{
+    ns->live = 0;
+    ns->resync = 0;
+    ns->nlinks = 0;
+    route_table_clear(&ns->routes);
+    return request_dump(ns, RTM_GETLINK);
+}
+
+struct netns_state *
+netns_monitor_add(struct netns_monitor *mon, int nsfd, const char *name)
+{
+    struct netns_state *ns, **grown;
+    struct epoll_event ev;
+    int fd, saved_errno;
+
+    if (mon->count == mon->cap) {
+        size_t cap = mon->cap ? mon->cap * 2 : 16;
+        if ((grown = realloc(mon->namespaces, cap * sizeof(*grown))) == NULL) {
+            return NULL;
+        }
+        mon->namespaces = grown;
+        mon->cap = cap;
+    }
+    if ((ns = calloc(1, sizeof(*ns))) == NULL) {
+        return NULL;
+    }
+    ns->fd = -1;
+    strncpy(ns->name, name ? name : "", sizeof(ns->name) - 1);
+    route_table_init(&ns->routes);
+
+    if (setns(nsfd, CLONE_NEWNET) != 0) {
+        saved_errno = errno;
+        free_state(ns);
+        errno = saved_errno;
+        return NULL;
+    }
+    fd = route_netlink_open_route_events();
+    saved_errno = errno;
+    if (setns(mon->self, CLONE_NEWNET) != 0) {
+        // The thread would go on working in the wrong namespace
+        abort();
+    }
+    if ((ns->fd = fd) < 0) {
+        goto fail;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = ns;
+    if (epoll_ctl(mon->fd, EPOLL_CTL_ADD, fd, &ev) != 0 || start_sync(ns) != 0) {
+        saved_errno = errno;
+        goto fail;
+    }
+    ns->slot = mon->count;
+    mon->namespaces[mon->count++] = ns;
+    return ns;
+
+fail:
+    free_state(ns);
+    errno = saved_errno;
+    return NULL;
+}
+
+struct netns_state *
+netns_monitor_add_path(struct netns_monitor *mon, const char *path, const char *name)
+{
+    struct netns_state *ns;
+    int nsfd, saved_errno;
+
+    if ((nsfd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    ns = netns_monitor_add(mon, nsfd, name);
+    saved_errno = errno;
+    close(nsfd);
+    errno = saved_errno;
+    return ns;
+}
+
+void
+netns_monitor_remove(struct netns_monitor *mon, struct netns_state *ns)
+{
+    // The last namespace moves into the slot; closing the socket also
+    // removes it from the epoll set
+    mon->namespaces[ns->slot] = mon->namespaces[--mon->count];
+    mon->namespaces[ns->slot]->slot = ns->slot;
+    free_state(ns);
+}
+
+const struct netns_link *
+netns_state_link(const struct netns_state *ns, unsigned index)
+{
+    size_t i;
+
+    for (i = 0; i < ns->nlinks; i++) {
+        if (ns->links[i].index == index) {
+            return &ns->links[i];
+        }
+    }
+    return NULL;
+}
+
+/* Applies RTM_NEWLINK or RTM_DELLINK. Returns MONITOR_* changes or -1. */
+static int
+apply_link(struct netns_state *ns, const struct nlmsghdr *nlh)
+{
+    const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    struct netns_link *link, *grown;
+    const struct rtattr *rta;
+    const char *name = NULL;
+    unsigned flags;
+    int len, added = 0, changes = 0;
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi))) {
+        return -1;
+    }
+    len = (int)IFLA_PAYLOAD(nlh);
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME && RTA_PAYLOAD(rta) > 0 &&
+            ((const char *)RTA_DATA(rta))[RTA_PAYLOAD(rta) - 1] == '\0') {
+            name = RTA_DATA(rta);
+        }
+    }
+    link = (struct netns_link *)netns_state_link(ns, (unsigned)ifi->ifi_index);
+    flags = nlh->nlmsg_type == RTM_DELLINK ? 0 : ifi->ifi_flags;
+
+    if (link && (link->flags & IFF_UP) && !(flags & IFF_UP) &&
+        route_netlink_prune_link(&ns->routes, link->index) > 0) {
+        changes |= MONITOR_ROUTES;
+    }
+    if (nlh->nlmsg_type == RTM_DELLINK) {
+        if (link) {
+            *link = ns->links[--ns->nlinks];
+            changes |= MONITOR_INTERFACES;
+        }
+        return changes;
+    }
+    if (link == NULL) {
+        if (ns->nlinks == ns->links_cap) {
+            size_t cap = ns->links_cap ? ns->links_cap * 2 : 4;
+            if ((grown = realloc(ns->links, cap * sizeof(*grown))) == NULL) {
+                return -1;
+            }
+            ns->links = grown;
+            ns->links_cap = cap;
+        }
+        link = &ns->links[ns->nlinks++];
+        memset(link, 0, sizeof(*link));
+        link->index = (unsigned)ifi->ifi_index;
+        added = 1;
+    }
+    if (added || link->flags != flags || (name && strcmp(link->name, name) != 0)) {
+        link->flags = flags;
+        if (name) {
+            strncpy(link->name, name, sizeof(link->name) - 1);
+        }
+        changes |= MONITOR_INTERFACES;
+    }
+    return changes;
+}
+
+/* Handles the end of a dump: the next dump, a resync or going live */
+static int
+dump_done(struct netns_state *ns)
+{
+    if (ns->resync) {
+        ns->resyncs++;
+        netif_stats_add(NETIF_NETNS_RESYNCS, 1);
+        return start_sync(ns);
+    }
+    if (ns->syncing == RTM_GETLINK) {
+        return request_dump(ns, RTM_GETROUTE);
+    }
+    ns->syncing = 0;
+    ns->live = 1;
+    ns->pending |= MONITOR_ROUTES | MONITOR_INTERFACES;
+    return 0;
+}
+
+static void
+handle_message(struct netns_state *ns, const struct nlmsghdr *nlh)
+{
+    const int reply = ns->syncing && nlh->nlmsg_seq == ns->seq;
+    int rc;
+
+    if (reply && (nlh->nlmsg_flags & NLM_F_DUMP_INTR)) {
+        // The table changed under the dump: it may have missed entries
+        ns->resync = 1;
+    }
+    switch (nlh->nlmsg_type) {
+    case NLMSG_DONE:
+        if (reply && dump_done(ns) != 0) {
+            ns->errors++;
+        }
+        return;
+    case NLMSG_ERROR:
+        if (reply) {
+            // The dump request failed: try again from scratch
+            ns->errors++;
+            ns->resync = 1;
+            if (dump_done(ns) != 0) {
+                ns->errors++;
+            }
+        }
+        return;
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        rc = apply_link(ns, nlh);
+        break;
+    case RTM_NEWROUTE:
+    case RTM_DELROUTE:
+        rc = route_netlink_apply(&ns->routes, nlh);
+        rc = rc > 0 ? MONITOR_ROUTES : rc;
+        break;
+    default:
+        return;
+    }
+    if (rc < 0) {
+        ns->errors++;
+    } else {
+        ns->pending |= rc;
+    }
+}
+
+/* Reads everything pending on `ns`. Returns 1 if on_change was called. */
+static int
+read_namespace(struct netns_monitor *mon, struct netns_state *ns)
+{
+    const struct nlmsghdr *nlh;
+    ssize_t n;
+    size_t len;
+    int changes;
+
+    for (;;) {
+        if ((n = recv(ns->fd, mon->buf, ROUTE_NETLINK_BUFSIZE, MSG_DONTWAIT)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                // Notifications were lost: dump again
+                ns->resync = 1;
+                if (!ns->syncing && dump_done(ns) != 0) {
+                    ns->errors++;
+                }
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ns->errors++;
+            }
+            break;
+        }
+        len = (size_t)n;
+        for (nlh = (const struct nlmsghdr *)mon->buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            mon->messages++;
+            handle_message(ns, nlh);
+        }
+    }
+
+    if (!ns->live || !ns->pending) {
+        return 0;
+    }
+    changes = ns->pending;
+    ns->pending = 0;
+    if ((changes & MONITOR_ROUTES) &&
+        egress_update(&ns->routes, mon->family, &ns->has_egress, &ns->egress)) {
+        changes |= MONITOR_EGRESS;
+    }
+    ns->updates++;
+    if (mon->on_change) {
+        mon->on_change(mon, ns, changes, mon->ctx);
+    }
+    return 1;
+}
+
+int
+netns_monitor_process(struct netns_monitor *mon)
+{
+    struct epoll_event events[EVENTS_PER_WAIT];
+    int n, i, calls = 0;
+
+    for (;;) {
+        if ((n = epoll_wait(mon->fd, events, EVENTS_PER_WAIT, 0)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            calls += read_namespace(mon, events[i].data.ptr);
+        }
+        if (n < EVENTS_PER_WAIT) {
+            return calls;
+        }
+    }
+}
+
+#endif /* __linux__ */
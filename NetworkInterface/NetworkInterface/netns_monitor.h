@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Gateway and interface monitoring of many Linux network namespaces
+ * from one thread. Only built on Linux.
+ *
+ * A netlink socket belongs to the namespace it was created in, so each
+ * namespace gets one NETLINK_ROUTE socket, created after a setns() into
+ * it, subscribed to link and route changes. The thread returns to its
+ * own namespace straight away; everything afterwards happens over the
+ * sockets, which all sit in one epoll instance:
+ *
+ *  netns_monitor_init(&mon, AF_INET, on_change, ctx);
+ *  netns_monitor_add_path(&mon, "/var/run/netns/blue", "blue");
+ *  ... add mon.fd to the loop ...
+ *  on readable: netns_monitor_process(&mon);
+ *
+ * Each namespace keeps its own snapshot: its links, its routing table
+ * and the preferred egress among its default routes (see
+ * egress_selector.h). A namespace is synchronised with a link dump and
+ * a route dump read from the same socket as its notifications, without
+ * blocking, so adding thousands of namespaces costs one setns() pair and
+ * two requests each. `on_change` is first called for a namespace once
+ * both dumps are in, then whenever its snapshot changes, with the
+ * MONITOR_* changes of monitor_core.h. A namespace whose socket
+ * overflows (ENOBUFS) or whose dump is interrupted is dumped again.
+ *
+ * setns() needs CAP_SYS_ADMIN. The monitor is not thread safe: use it
+ * from the loop's thread only.
+ */
+
+#ifndef netns_monitor_h
+#define netns_monitor_h
+
+#ifdef __linux__
+
+#include "egress_selector.h"
+#include "monitor_core.h"
+#include "route_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+
+#define NETNS_NAME_MAX  64
+
+struct netns_link {
+    char name[IFNAMSIZ];
+    unsigned index;
+    unsigned flags;                 /* IFF_* */
+};
+
+struct netns_state {
+    char name[NETNS_NAME_MAX];
+    int fd;                         /* NETLINK_ROUTE socket in the namespace */
+    int live;                       /* both dumps are in */
+    /* Snapshot */
+    struct netns_link *links;       /* few per namespace: searched linearly */
+    size_t nlinks;
+    size_t links_cap;
+    struct route_table routes;
+    int has_egress;
+    struct egress_choice egress;    /* valid when has_egress */
+    uint64_t updates;               /* on_change calls */
+    /* Synchronisation */
+    int syncing;                    /* 0, or the RTM_GET* dump in progress */
+    uint32_t seq;
+    int resync;                     /* dump again once the current one ends */
+    int pending;                    /* MONITOR_* not yet reported */
+    uint64_t resyncs;
+    uint64_t errors;                /* malformed messages and failed requests */
+    size_t slot;                    /* position in netns_monitor.namespaces */
+};
+
+struct netns_monitor;
+
+typedef void (*netns_monitor_fn)(struct netns_monitor *mon, struct netns_state *ns,
+                                 int changes, void *ctx);
+
+struct netns_monitor {
+    int fd;                         /* epoll, readable while any namespace has news */
+    int self;                       /* the thread's own namespace */
+    int family;                     /* of the default routes ranked for egress */
+    netns_monitor_fn on_change;
+    void *ctx;
+    char *buf;                      /* receive buffer shared by every namespace */
+    struct netns_state **namespaces;
+    size_t count;
+    size_t cap;
+    uint64_t messages;
+};
+
+/*
+ * `family` is AF_INET, AF_INET6 or AF_UNSPEC, as for monitor_core_open().
+ * Returns 0 or -1 with errno set.
+ */
+int
+netns_monitor_init(struct netns_monitor *mon, int family, netns_monitor_fn on_change, void *ctx);
+
+/* Closes every namespace's socket and frees the snapshots */
+void
+netns_monitor_free(struct netns_monitor *mon);
+
+/*
+ * Starts monitoring the namespace `nsfd` refers to (an open
+ * /proc/PID/ns/net or /var/run/netns/NAME, which the caller may close
+ * afterwards). Returns the new state or NULL with errno set.
+ */
+struct netns_state *
+netns_monitor_add(struct netns_monitor *mon, int nsfd, const char *name);
+
+/* As netns_monitor_add(), opening `path` */
+struct netns_state *
+netns_monitor_add_path(struct netns_monitor *mon, const char *path, const char *name);
+
+/* Stops monitoring `ns` and frees it */
+void
+netns_monitor_remove(struct netns_monitor *mon, struct netns_state *ns);
+
+/*
+ * Reads every namespace with pending messages without blocking and calls
+ * `on_change` for those whose snapshot changed. `on_change` may remove
+ * the namespace it is called for, but no other. Returns the number of
+ * calls made or -1 with errno set.
+ */
+int
+netns_monitor_process(struct netns_monitor *mon);
+
+const struct netns_link *
+netns_state_link(const struct netns_state *ns, unsigned index);
+
+#endif /* __linux__ */
+
+#endif /* netns_monitor_h */
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in path_coalescer.h
+ */
+
+#include "path_coalescer.h"
+
+#include <string.h>
+#include <time.h>
+
+void
+path_coalescer_init(struct path_coalescer *coalescer, uint64_t window_ns, uint64_t max_delay_ns)
+{
+    memset(coalescer, 0, sizeof(*coalescer));
+    pthread_mutex_init(&coalescer->lock, NULL);
+    coalescer->window_ns = window_ns;
+    coalescer->max_delay_ns = max_delay_ns;
+}
+
+void
+path_coalescer_destroy(struct path_coalescer *coalescer)
+{
+    pthread_mutex_destroy(&coalescer->lock);
+}
+
+uint64_t
+path_coalescer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Called with the lock held */
+static uint64_t
+deadline_locked(const struct path_coalescer *c)
+{
+    uint64_t deadline;
+
+    if (!c->pending) {
+        return PATH_COALESCER_NO_DEADLINE;
+    }
+    deadline = c->last_event_ns + c->window_ns;
+    if (c->max_delay_ns && deadline > c->first_event_ns + c->max_delay_ns) {
+        deadline = c->first_event_ns + c->max_delay_ns;
+    }
+    return deadline;
+}
+
+int
+path_coalescer_event(struct path_coalescer *coalescer, uint64_t now_ns)
+{
+    int starts_burst;
+
+    pthread_mutex_lock(&coalescer->lock);
+    starts_burst = !coalescer->pending;
+    if (starts_burst) {
+        coalescer->pending = 1;
+        coalescer->first_event_ns = now_ns;
+    }
+    coalescer->last_event_ns = now_ns;
+    coalescer->generation++;
+    coalescer->events++;
+    pthread_mutex_unlock(&coalescer->lock);
+    return starts_burst;
+}
+
+uint64_t
+path_coalescer_deadline(struct path_coalescer *coalescer)
+{
+    uint64_t deadline;
+
+    pthread_mutex_lock(&coalescer->lock);
+    deadline = deadline_locked(coalescer);
+    pthread_mutex_unlock(&coalescer->lock);
+    return deadline;
+}
+
+int
+path_coalescer_begin(struct path_coalescer *coalescer, uint64_t now_ns, uint64_t *generation)
+{
+    int due;
+
+    pthread_mutex_lock(&coalescer->lock);
+    due = coalescer->pending && now_ns >= deadline_locked(coalescer);
+    if (due) {
+        // Events from here on start the next burst
+        coalescer->pending = 0;
+        coalescer->recomputes++;
+        *generation = coalescer->generation;
+    }
+    pthread_mutex_unlock(&coalescer->lock);
+    return due;
+}
+
+int
+path_coalescer_finish(struct path_coalescer *coalescer, uint64_t generation)
+{
+    int current;
+
+    pthread_mutex_lock(&coalescer->lock);
+    current = generation == coalescer->generation && generation > coalescer->delivered_generation;
+    if (current) {
+        coalescer->delivered_generation = generation;
+    } else {
+        coalescer->stale++;
+    }
+    pthread_mutex_unlock(&coalescer->lock);
+    return current;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Coalesces bursts of path update events so that one recompute covers
+ * a whole burst.
+ *
+ * Every event bumps a generation counter and (re)arms a debounce
+ * window: the recompute is due once no event has arrived for
+ * `window_ns`, or `max_delay_ns` after the first event of the burst so
+ * that a steady stream of events cannot postpone it forever. A
+ * recompute covers the generation current when it began, and its
+ * result is only deliverable if no event arrived while it ran, so stale
+ * results are never delivered; the newer event has already armed the
+ * next recompute.
+ *
+ * Time is always passed in by the caller (monotonic nanoseconds, see
+ * path_coalescer_now()), which keeps the coalescer free of timers and
+ * lets tests drive it with a fake clock. Scheduling the recompute at
+ * path_coalescer_deadline() is up to the caller, e.g. dispatch_after().
+ * All functions are thread safe.
+ */
+
+#ifndef path_coalescer_h
+#define path_coalescer_h
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define PATH_COALESCER_NO_DEADLINE  UINT64_MAX
+
+struct path_coalescer {
+    pthread_mutex_t lock;
+    uint64_t window_ns;
+    uint64_t max_delay_ns;          /* 0 for no bound */
+    uint64_t generation;            /* incremented by every event */
+    uint64_t delivered_generation;  /* generation of the last deliverable result */
+    uint64_t first_event_ns;        /* of the pending burst */
+    uint64_t last_event_ns;
+    int pending;                    /* events arrived since the last recompute began */
+    /* Statistics */
+    uint64_t events;
+    uint64_t recomputes;
+    uint64_t stale;                 /* results discarded because an event arrived */
+};
+
+void
+path_coalescer_init(struct path_coalescer *coalescer, uint64_t window_ns, uint64_t max_delay_ns);
+
+void
+path_coalescer_destroy(struct path_coalescer *coalescer);
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t
+path_coalescer_now(void);
+
+/*
+ * Records an event at `now_ns`. Returns 1 when it starts a new burst,
+ * meaning the caller must schedule a recompute at
+ * path_coalescer_deadline(), and 0 when one is already scheduled.
+ */
+int
+path_coalescer_event(struct path_coalescer *coalescer, uint64_t now_ns);
+
+/* Returns when the pending recompute is due, or PATH_COALESCER_NO_DEADLINE */
+uint64_t
+path_coalescer_deadline(struct path_coalescer *coalescer);
+
+/*
+ * Starts the pending recompute if it is due at `now_ns`. Returns 1 and
+ * stores the generation it covers, or 0 when nothing is pending or the
+ * window was extended; in that case reschedule at
+ * path_coalescer_deadline() if it is not PATH_COALESCER_NO_DEADLINE.
+ */
+int
+path_coalescer_begin(struct path_coalescer *coalescer, uint64_t now_ns, uint64_t *generation);
+
+/*
+ * Ends the recompute of `generation`. Returns 1 if its result is
+ * current and may be delivered, 0 if it is stale.
+ */
+int
+path_coalescer_finish(struct path_coalescer *coalescer, uint64_t generation);
+
+#endif /* path_coalescer_h */
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_arena.h
+ */
+
+#include "route_arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct route_arena_chunk {
+    struct route_arena_chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+void
+route_arena_init(struct route_arena *arena, size_t chunk_size)
+{
+    arena->head = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : ROUTE_ARENA_DEFAULT_CHUNK;
+    arena->allocated = 0;
+    arena->reserved = 0;
+}
+
+void *
+route_arena_alloc(struct route_arena *arena, size_t size, size_t align)
+{
+    struct route_arena_chunk *chunk = arena->head;
+    size_t offset = 0;
+
+    if (chunk) {
+        offset = (chunk->used + align - 1) & ~(align - 1);
+    }
+    if (chunk == NULL || offset > chunk->size || chunk->size - offset < size) {
+        size_t need = size > arena->chunk_size ? size : arena->chunk_size;
+        if (need > SIZE_MAX - sizeof(*chunk) ||
+            (chunk = malloc(sizeof(*chunk) + need)) == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->head;
+        chunk->size = need;
+        chunk->used = 0;
+        arena->head = chunk;
+        arena->reserved += need;
+        offset = 0;
+    }
+    arena->allocated += offset - chunk->used + size;
+    chunk->used = offset + size;
+    return (char *)chunk->data + offset;
+}
+
+void
+route_arena_free(struct route_arena *arena)
+{
+    struct route_arena_chunk *chunk, *next;
+
+    for (chunk = arena->head; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->head = NULL;
+    arena->allocated = 0;
+    arena->reserved = 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Bump allocator for data that is built once and freed all together,
+ * such as a routing table snapshot (see route_compact.h).
+ *
+ * Allocations are carved from large chunks; there is no per-allocation
+ * free. route_arena_free() releases every chunk at once, so freeing
+ * costs one free() per chunk however many objects were allocated. An
+ * arena sized up front for its contents holds them in a single chunk.
+ */
+
+#ifndef route_arena_h
+#define route_arena_h
+
+#include <stddef.h>
+
+#define ROUTE_ARENA_DEFAULT_CHUNK   (256 * 1024)
+
+struct route_arena_chunk;
+
+struct route_arena {
+    struct route_arena_chunk *head;     /* newest chunk, allocated from */
+    size_t chunk_size;
+    size_t allocated;                   /* bytes handed out, including padding */
+    size_t reserved;                    /* bytes held in chunks */
+};
+
+/* `chunk_size` 0 selects ROUTE_ARENA_DEFAULT_CHUNK. Allocates nothing yet. */
+void
+route_arena_init(struct route_arena *arena, size_t chunk_size);
+
+/*
+ * Returns `size` bytes aligned to `align` (a power of two no larger
+ * than the alignment of max_align_t), or NULL when out of memory.
+ * Requests larger than the chunk size get a chunk of their own.
+ */
+void *
+route_arena_alloc(struct route_arena *arena, size_t size, size_t align);
+
+/* Frees every allocation and chunk; the arena can be reused afterwards */
+void
+route_arena_free(struct route_arena *arena);
+
+#endif /* route_arena_h */
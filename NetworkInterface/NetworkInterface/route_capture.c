@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_capture.h
+ */
+
+#include "route_capture.h"
+
+#include "interface_table.h"
+#include "route_dump.h"
+#include "route_netlink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#define ALIGN8(n)   (((n) + 7) & ~(size_t)7)
+
+static int
+validate(struct route_capture *capture)
+{
+    const struct route_capture_header *h;
+    uint32_t i;
+
+    if (capture->size < sizeof(*h)) {
+        errno = EPROTO;
+        return -1;
+    }
+    h = (const struct route_capture_header *)capture->base;
+    if (memcmp(h->magic, ROUTE_CAPTURE_MAGIC, sizeof(h->magic)) != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (h->version != ROUTE_CAPTURE_VERSION ||
+        h->byte_order != ROUTE_CAPTURE_BYTE_ORDER ||
+        h->entry_size != sizeof(struct route_entry) ||
+        h->interface_size != sizeof(struct route_capture_interface) ||
+        h->address_size != sizeof(struct route_capture_address)) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+    if (h->nsections > (capture->size - sizeof(*h)) / sizeof(struct route_capture_section)) {
+        errno = EPROTO;
+        return -1;
+    }
+    capture->header = h;
+    capture->sections = (const struct route_capture_section *)(capture->base + sizeof(*h));
+
+    for (i = 0; i < h->nsections; i++) {
+        const struct route_capture_section *s = &capture->sections[i];
+        size_t record = 0;
+
+        if (s->offset % 8 != 0 || s->offset > capture->size || s->length > capture->size - s->offset) {
+            errno = EPROTO;
+            return -1;
+        }
+        switch (s->type) {
+        case ROUTE_CAPTURE_ENTRIES:
+            record = sizeof(struct route_entry);
+            break;
+        case ROUTE_CAPTURE_INTERFACES:
+            record = sizeof(struct route_capture_interface);
+            break;
+        case ROUTE_CAPTURE_ADDRESSES:
+            record = sizeof(struct route_capture_address);
+            break;
+        }
+        // Record arrays are used in place, so their size must be exact
+        if (record && (uint64_t)s->count * record != s->length) {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Maps one of the writer's address families to this host's */
+static uint8_t
+host_family(const struct route_capture_header *h, uint8_t family)
+{
+    if (family == AF_UNSPEC) {
+        return AF_UNSPEC;
+    }
+    if (family == h->af_inet) {
+        return AF_INET;
+    }
+    if (family == h->af_inet6) {
+        return AF_INET6;
+    }
+    return AF_UNSPEC;
+}
+
+/*
+ * Copies the entries and addresses of a capture written with other
+ * address family values, translated to this host's.
+ */
+static int
+translate_families(struct route_capture *capture)
+{
+    const struct route_capture_header *h = capture->header;
+    const struct route_entry *entries;
+    const struct route_capture_address *addresses;
+    size_t len, count, i;
+
+    if (h->af_inet == AF_INET && h->af_inet6 == AF_INET6) {
+        return 0;
+    }
+    if ((entries = route_capture_section(capture, ROUTE_CAPTURE_ENTRIES, &len, &count)) != NULL) {
+        if ((capture->entries = malloc(len)) == NULL) {
+            return -1;
+        }
+        memcpy(capture->entries, entries, len);
+        for (i = 0; i < count; i++) {
+            capture->entries[i].family = host_family(h, entries[i].family);
+            capture->entries[i].gateway_family = host_family(h, entries[i].gateway_family);
+        }
+    }
+    if ((addresses = route_capture_section(capture, ROUTE_CAPTURE_ADDRESSES, &len, &count)) != NULL) {
+        if ((capture->addresses = malloc(len)) == NULL) {
+            return -1;
+        }
+        memcpy(capture->addresses, addresses, len);
+        for (i = 0; i < count; i++) {
+            capture->addresses[i].family = host_family(h, addresses[i].family);
+        }
+    }
+    return 0;
+}
+
+int
+route_capture_open_buffer(struct route_capture *capture, const void *buf, size_t len)
+{
+    int saved_errno;
+
+    memset(capture, 0, sizeof(*capture));
+    capture->base = buf;
+    capture->size = len;
+    if (validate(capture) != 0 || translate_families(capture) != 0) {
+        saved_errno = errno;
+        route_capture_close(capture);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+int
+route_capture_open(struct route_capture *capture, const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd, saved_errno;
+
+    memset(capture, 0, sizeof(*capture));
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(struct route_capture_header)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    saved_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = saved_errno;
+        return -1;
+    }
+
+    capture->map = map;
+    capture->map_size = (size_t)st.st_size;
+    capture->base = map;
+    capture->size = (size_t)st.st_size;
+    if (validate(capture) != 0 || translate_families(capture) != 0) {
+        saved_errno = errno;
+        route_capture_close(capture);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+void
+route_capture_close(struct route_capture *capture)
+{
+    if (capture->map) {
+        munmap(capture->map, capture->map_size);
+    }
+    free(capture->entries);
+    free(capture->addresses);
+    memset(capture, 0, sizeof(*capture));
+}
+
+const void *
+route_capture_section(const struct route_capture *capture, uint32_t type,
+                      size_t *len, size_t *count)
+{
+    uint32_t i;
+
+    for (i = 0; capture->header && i < capture->header->nsections; i++) {
+        const struct route_capture_section *s = &capture->sections[i];
+        if (s->type == type) {
+            const void *data = capture->base + s->offset;
+            if (type == ROUTE_CAPTURE_ENTRIES && capture->entries) {
+                data = capture->entries;
+            } else if (type == ROUTE_CAPTURE_ADDRESSES && capture->addresses) {
+                data = capture->addresses;
+            }
+            if (len) {
+                *len = (size_t)s->length;
+            }
+            if (count) {
+                *count = s->count;
+            }
+            return data;
+        }
+    }
+    if (len) {
+        *len = 0;
+    }
+    if (count) {
+        *count = 0;
+    }
+    return NULL;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int
+route_capture_write(const char *path, const struct route_capture_source *source)
+{
+    static const uint8_t padding[8];
+    struct route_capture_header header;
+    struct route_capture_section sections[5];
+    const void *data[5];
+    char tmp[1024];
+    size_t offset, i, n = 0;
+    int fd, rc = 0, saved_errno;
+
+#define ADD_SECTION(t, p, l, c) \
+    do { \
+        if ((l) > 0) { \
+            memset(&sections[n], 0, sizeof(sections[n])); \
+            sections[n].type = (t); \
+            sections[n].count = (uint32_t)(c); \
+            sections[n].length = (l); \
+            data[n++] = (p); \
+        } \
+    } while (0)
+
+    ADD_SECTION(ROUTE_CAPTURE_BSD_DUMP, source->bsd_dump, source->bsd_dump_len, 0);
+    ADD_SECTION(ROUTE_CAPTURE_NETLINK, source->netlink, source->netlink_len, 0);
+    ADD_SECTION(ROUTE_CAPTURE_ENTRIES, source->entries,
+                source->nentries * sizeof(*source->entries), source->nentries);
+    ADD_SECTION(ROUTE_CAPTURE_INTERFACES, source->interfaces,
+                source->ninterfaces * sizeof(*source->interfaces), source->ninterfaces);
+    ADD_SECTION(ROUTE_CAPTURE_ADDRESSES, source->addresses,
+                source->naddresses * sizeof(*source->addresses), source->naddresses);
+#undef ADD_SECTION
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ROUTE_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = ROUTE_CAPTURE_VERSION;
+    header.byte_order = ROUTE_CAPTURE_BYTE_ORDER;
+    header.captured_at = (uint64_t)time(NULL);
+    header.nsections = (uint32_t)n;
+    header.entry_size = sizeof(struct route_entry);
+    header.interface_size = sizeof(struct route_capture_interface);
+    header.address_size = sizeof(struct route_capture_address);
+    header.af_inet = AF_INET;
+    header.af_inet6 = AF_INET6;
+
+    offset = ALIGN8(sizeof(header) + n * sizeof(sections[0]));
+    for (i = 0; i < n; i++) {
+        sections[i].offset = offset;
+        offset = ALIGN8(offset + (size_t)sections[i].length);
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    offset = sizeof(header) + n * sizeof(sections[0]);
+    rc = write_all(fd, &header, sizeof(header));
+    if (rc == 0) {
+        rc = write_all(fd, sections, n * sizeof(sections[0]));
+    }
+    for (i = 0; rc == 0 && i < n; i++) {
+        rc = write_all(fd, padding, ALIGN8(offset) - offset);
+        if (rc == 0) {
+            rc = write_all(fd, data[i], (size_t)sections[i].length);
+        }
+        offset = (size_t)sections[i].offset + (size_t)sections[i].length;
+    }
+    if (rc == 0) {
+        rc = fsync(fd);
+    }
+    saved_errno = errno;
+    if (close(fd) != 0 && rc == 0) {
+        saved_errno = errno;
+        rc = -1;
+    }
+    if (rc == 0 && rename(tmp, path) != 0) {
+        saved_errno = errno;
+        rc = -1;
+    }
+    if (rc != 0) {
+        unlink(tmp);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+
+struct raw_dump {
+    char *buf;
+    size_t len;
+    size_t cap;
+    struct route_table *table;
+};
+
+/* Keeps every route message verbatim and decodes it into the table */
+static int
+append_message(const struct nlmsghdr *nlh, void *ctx)
+{
+    struct raw_dump *d = ctx;
+    struct route_entry e;
+    size_t len = NLMSG_ALIGN(nlh->nlmsg_len);
+
+    if (d->len + len > d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : ROUTE_NETLINK_BUFSIZE;
+        char *buf;
+        while (cap < d->len + len) {
+            cap *= 2;
+        }
+        if ((buf = realloc(d->buf, cap)) == NULL) {
+            return -1;
+        }
+        d->buf = buf;
+        d->cap = cap;
+    }
+    memset(d->buf + d->len, 0, len);
+    memcpy(d->buf + d->len, nlh, nlh->nlmsg_len);
+    d->len += len;
+
+    if (route_netlink_parse_route(nlh, &e) == 0 && route_table_upsert(d->table, &e) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+capture_routes(struct route_capture_source *source, struct route_table *table, char **raw)
+{
+    struct raw_dump d;
+    int fd, rc;
+
+    memset(&d, 0, sizeof(d));
+    d.table = table;
+    if ((fd = route_netlink_open(0)) < 0) {
+        return -1;
+    }
+    rc = route_netlink_request_dump(fd, AF_UNSPEC, 1);
+    if (rc == 0) {
+        rc = route_netlink_read_reply(fd, 1, append_message, &d);
+    }
+    close(fd);
+    if (rc != 0) {
+        free(d.buf);
+        return -1;
+    }
+    *raw = d.buf;
+    source->netlink = d.buf;
+    source->netlink_len = d.len;
+    return 0;
+}
+
+#elif defined(__APPLE__)
+
+static int
+capture_routes(struct route_capture_source *source, struct route_table *table, char **raw)
+{
+    size_t len;
+
+    if (route_dump_fetch(raw, &len) != 0) {
+        return -1;
+    }
+    if (route_table_load_dump(table, *raw, len) < 0) {
+        free(*raw);
+        *raw = NULL;
+        errno = EBADMSG;
+        return -1;
+    }
+    source->bsd_dump = *raw;
+    source->bsd_dump_len = len;
+    return 0;
+}
+
+#else
+
+static int
+capture_routes(struct route_capture_source *source, struct route_table *table, char **raw)
+{
+    (void)source;
+    (void)table;
+    (void)raw;
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
+
+int
+route_capture_host(const char *path)
+{
+    struct route_capture_source source;
+    struct route_capture_interface *interfaces = NULL;
+    struct route_capture_address *addresses = NULL;
+    struct interface_table links;
+    struct route_table table;
+    char *raw = NULL;
+    size_t i;
+    int rc = -1, saved_errno;
+
+    memset(&source, 0, sizeof(source));
+    route_table_init(&table);
+    interface_table_init(&links);
+
+    if (capture_routes(&source, &table, &raw) != 0 || interface_table_load(&links) < 0) {
+        goto done;
+    }
+    interfaces = calloc(links.count ? links.count : 1, sizeof(*interfaces));
+    addresses = calloc(links.naddrs ? links.naddrs : 1, sizeof(*addresses));
+    if (interfaces == NULL || addresses == NULL) {
+        goto done;
+    }
+    for (i = 0; i < links.count; i++) {
+        interfaces[i].index = links.index[i];
+        interfaces[i].flags = links.flags[i];
+        interfaces[i].mtu = links.mtu[i];
+        interfaces[i].addr_first = links.addr_first[i];
+        interfaces[i].addr_count = links.addr_count[i];
+        memcpy(interfaces[i].name, links.name[i], sizeof(interfaces[i].name));
+    }
+    for (i = 0; i < links.naddrs; i++) {
+        addresses[i].link = links.addr_link[i];
+        addresses[i].family = links.addr_family[i];
+        addresses[i].prefixlen = links.addr_prefixlen[i];
+        memcpy(addresses[i].addr, links.addr[i], 16);
+        memcpy(addresses[i].broadcast, links.addr_broadcast[i], 16);
+    }
+
+    source.entries = table.entries;
+    source.nentries = table.count;
+    source.interfaces = interfaces;
+    source.ninterfaces = links.count;
+    source.addresses = addresses;
+    source.naddresses = links.naddrs;
+    rc = route_capture_write(path, &source);
+
+done:
+    saved_errno = errno;
+    free(interfaces);
+    free(addresses);
+    free(raw);
+    interface_table_free(&links);
+    route_table_free(&table);
+    errno = saved_errno;
+    return rc;
+}
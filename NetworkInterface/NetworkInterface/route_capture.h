@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Versioned on-disk captures of a host's routing table and interfaces,
+ * laid out to be mmap()ed and used in place.
+ *
+ * A capture is a header, a section table and 8-byte aligned sections:
+ *
+ *  ROUTE_CAPTURE_BSD_DUMP      raw NET_RT_DUMP2 buffer, for route_dump_iter
+ *  ROUTE_CAPTURE_NETLINK       raw RTM_NEWROUTE messages of a netlink dump
+ *  ROUTE_CAPTURE_ENTRIES       struct route_entry array, for route_lpm_build
+ *                              and route_snapshot_create
+ *  ROUTE_CAPTURE_INTERFACES    struct route_capture_interface array
+ *  ROUTE_CAPTURE_ADDRESSES     struct route_capture_address array
+ *
+ * Sections are stored exactly as the capturing host produced them, so
+ * nothing is copied or decoded into heap objects when a capture is
+ * opened; the accessors return pointers into the mapping. Captures are
+ * in the byte order of the host that wrote them and are rejected when
+ * opened on a host with another byte order or struct layout.
+ *
+ * Address families in the entries and addresses sections are the
+ * writer's AF_* values, which differ between platforms (AF_INET6 is 30
+ * on Apple and 10 on Linux). The header records them, and a capture
+ * written on another platform has those two sections translated into
+ * heap copies when it is opened; all other sections stay in place.
+ */
+
+#ifndef route_capture_h
+#define route_capture_h
+
+#include "route_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROUTE_CAPTURE_MAGIC         "NIRTCAP"   /* 8 bytes with the NUL */
+#define ROUTE_CAPTURE_VERSION       2
+#define ROUTE_CAPTURE_BYTE_ORDER    0x01020304u
+
+enum {
+    ROUTE_CAPTURE_BSD_DUMP = 1,
+    ROUTE_CAPTURE_NETLINK = 2,
+    ROUTE_CAPTURE_ENTRIES = 3,
+    ROUTE_CAPTURE_INTERFACES = 4,
+    ROUTE_CAPTURE_ADDRESSES = 5,
+};
+
+struct route_capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;            /* ROUTE_CAPTURE_BYTE_ORDER as written */
+    uint64_t captured_at;           /* seconds since the epoch */
+    uint32_t nsections;
+    uint32_t entry_size;            /* sizeof(struct route_entry) */
+    uint32_t interface_size;        /* sizeof(struct route_capture_interface) */
+    uint32_t address_size;          /* sizeof(struct route_capture_address) */
+    uint8_t af_inet;                /* the writer's AF_INET and AF_INET6 */
+    uint8_t af_inet6;
+    uint8_t reserved[22];
+};
+
+struct route_capture_section {
+    uint32_t type;
+    uint32_t count;                 /* records, or 0 for raw buffers */
+    uint64_t offset;                /* from the start of the file */
+    uint64_t length;                /* bytes */
+};
+
+struct route_capture_interface {
+    uint32_t index;
+    uint32_t flags;                 /* IFF_* */
+    uint32_t mtu;
+    uint32_t addr_first;            /* into the ROUTE_CAPTURE_ADDRESSES section */
+    uint32_t addr_count;
+    char name[16];
+};
+
+struct route_capture_address {
+    uint32_t link;                  /* position in the ROUTE_CAPTURE_INTERFACES section */
+    uint8_t family;                 /* AF_INET or AF_INET6 of the capturing host */
+    uint8_t prefixlen;
+    uint8_t reserved[2];
+    uint8_t addr[16];
+    uint8_t broadcast[16];
+};
+
+struct route_capture {
+    const uint8_t *base;
+    size_t size;
+    const struct route_capture_header *header;
+    const struct route_capture_section *sections;
+    void *map;                      /* mmap()ed region, NULL for buffers */
+    size_t map_size;
+    struct route_entry *entries;    /* translated copies when written on */
+    struct route_capture_address *addresses;  /* another platform, else NULL */
+};
+
+/* What route_capture_write() stores; empty members are left out */
+struct route_capture_source {
+    const void *bsd_dump;
+    size_t bsd_dump_len;
+    const void *netlink;
+    size_t netlink_len;
+    const struct route_entry *entries;
+    size_t nentries;
+    const struct route_capture_interface *interfaces;
+    size_t ninterfaces;
+    const struct route_capture_address *addresses;
+    size_t naddresses;
+};
+
+/*
+ * Maps the capture at `path` read-only and validates its header and
+ * section table. Returns 0 or -1 with errno set (EPROTO for a malformed
+ * file, EPROTONOSUPPORT for another version, byte order or layout).
+ */
+int
+route_capture_open(struct route_capture *capture, const char *path);
+
+/* Same as route_capture_open() for a capture already in memory */
+int
+route_capture_open_buffer(struct route_capture *capture, const void *buf, size_t len);
+
+void
+route_capture_close(struct route_capture *capture);
+
+/*
+ * Returns the first section of `type` and stores its length and record
+ * count, or NULL when the capture has none. Entries and addresses
+ * always carry this host's AF_* values.
+ */
+const void *
+route_capture_section(const struct route_capture *capture, uint32_t type,
+                      size_t *len, size_t *count);
+
+/*
+ * Writes `source` to `path`, through a temporary file renamed into
+ * place. Returns 0 or -1 with errno set.
+ */
+int
+route_capture_write(const char *path, const struct route_capture_source *source);
+
+/*
+ * Captures the running host: its raw route dump (NET_RT_DUMP2 on Apple,
+ * a netlink dump on Linux), the decoded route entries and all links
+ * with their addresses. Returns 0 or -1 with errno set.
+ */
+int
+route_capture_host(const char *path);
+
+#endif /* route_capture_h */
@@ -0,0 +1,826 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_columns.h
+ */
+
+#include "route_columns.h"
+
+#include "netif_stats.h"
+#include "route_dump.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Every operation is a comparison of (x & mask) with a value, possibly
+ * inverted: NE is an inverted EQ, LE an inverted GT, ALL is
+ * (x & v) == v, NONE (x & v) == 0 and ANY an inverted NONE.
+ */
+enum {
+    CMP_EQ,
+    CMP_GT,                         /* x > value */
+    CMP_LT,                         /* x < value */
+};
+
+struct filter {
+    int cmp;
+    int invert;
+    uint32_t mask;
+    uint32_t value;
+};
+
+/*
+ * Kernels fill one bitmap word per 64 rows, ANDing into the existing
+ * words when `refine` is set. They handle `n` rows; any tail shorter
+ * than a word is left to the scalar code.
+ */
+typedef void (*kernel_u32)(const uint32_t *col, size_t n, const struct filter *f,
+                           uint64_t *out, int refine);
+typedef void (*kernel_u8)(const uint8_t *col, size_t n, const struct filter *f,
+                          uint64_t *out, int refine);
+
+struct kernel {
+    const char *name;
+    kernel_u32 u32;
+    kernel_u8 u8;
+};
+
+static inline int
+match(uint32_t x, const struct filter *f)
+{
+    int m;
+
+    x &= f->mask;
+    switch (f->cmp) {
+        case CMP_EQ: m = x == f->value; break;
+        case CMP_GT: m = x > f->value; break;
+        default: m = x < f->value; break;
+    }
+    return m != f->invert;
+}
+
+static inline void
+store(uint64_t *out, size_t w, uint64_t bits, int refine)
+{
+    out[w] = refine ? out[w] & bits : bits;
+}
+
+/* Rows n - n % 64 .. n, for every kernel */
+#define FILTER_TAIL(col, n, f, out, refine)                                 \
+do {                                                                        \
+    size_t base_ = (n) & ~(size_t)63, i_;                                   \
+    uint64_t bits_ = 0;                                                     \
+    if (base_ == (n)) {                                                     \
+        break;                                                              \
+    }                                                                       \
+    for (i_ = base_; i_ < (n); i_++) {                                      \
+        bits_ |= (uint64_t)match((col)[i_], (f)) << (i_ - base_);           \
+    }                                                                       \
+    store((out), base_ / 64, bits_, (refine));                              \
+} while (0)
+
+static void
+scalar_u32(const uint32_t *col, size_t n, const struct filter *f, uint64_t *out, int refine)
+{
+    size_t w, i;
+
+    for (w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (i = 0; i < 64; i++) {
+            bits |= (uint64_t)match(col[w * 64 + i], f) << i;
+        }
+        store(out, w, bits, refine);
+    }
+    FILTER_TAIL(col, n, f, out, refine);
+}
+
+static void
+scalar_u8(const uint8_t *col, size_t n, const struct filter *f, uint64_t *out, int refine)
+{
+    size_t w, i;
+
+    for (w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (i = 0; i < 64; i++) {
+            bits |= (uint64_t)match(col[w * 64 + i], f) << i;
+        }
+        store(out, w, bits, refine);
+    }
+    FILTER_TAIL(col, n, f, out, refine);
+}
+
+#ifdef HAVE_X86
+
+/*
+ * SSE2 and AVX2 only compare signed integers, so unsigned comparisons
+ * flip the sign bit of both sides first. `cmp` is a constant at every
+ * call site, so each loop is specialized.
+ */
+
+static inline __m128i
+sse2_cmp32(__m128i x, __m128i v, __m128i bias, int cmp)
+{
+    switch (cmp) {
+        case CMP_EQ: return _mm_cmpeq_epi32(x, v);
+        case CMP_GT: return _mm_cmpgt_epi32(_mm_xor_si128(x, bias), v);
+        default: return _mm_cmpgt_epi32(v, _mm_xor_si128(x, bias));
+    }
+}
+
+static inline __m128i
+sse2_cmp8(__m128i x, __m128i v, __m128i bias, int cmp)
+{
+    switch (cmp) {
+        case CMP_EQ: return _mm_cmpeq_epi8(x, v);
+        case CMP_GT: return _mm_cmpgt_epi8(_mm_xor_si128(x, bias), v);
+        default: return _mm_cmpgt_epi8(v, _mm_xor_si128(x, bias));
+    }
+}
+
+static inline void
+sse2_u32_loop(const uint32_t *col, size_t n, const struct filter *f, uint64_t *out, int refine,
+              int cmp)
+{
+    const __m128i mask = _mm_set1_epi32((int)f->mask);
+    const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+    const __m128i v = cmp == CMP_EQ ? _mm_set1_epi32((int)f->value) :
+                      _mm_xor_si128(_mm_set1_epi32((int)f->value), bias);
+    const uint64_t invert = f->invert ? ~(uint64_t)0 : 0;
+    size_t w, k;
+
+    for (w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (k = 0; k < 16; k++) {
+            __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(col + w * 64 + k * 4)), mask);
+            bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(sse2_cmp32(x, v, bias, cmp))) << (k * 4);
+        }
+        store(out, w, bits ^ invert, refine);
+    }
+}
+
+static void
+sse2_u32(const uint32_t *col, size_t n, const struct filter *f, uint64_t *out, int refine)
+{
+    switch (f->cmp) {
+        case CMP_EQ: sse2_u32_loop(col, n, f, out, refine, CMP_EQ); break;
+        case CMP_GT: sse2_u32_loop(col, n, f, out, refine, CMP_GT); break;
+        default: sse2_u32_loop(col, n, f, out, refine, CMP_LT); break;
+    }
+    FILTER_TAIL(col, n, f, out, refine);
+}
+
+static inline void
+sse2_u8_loop(const uint8_t *col, size_t n, const struct filter *f, uint64_t *out, int refine,
+             int cmp)
+{
+    const __m128i mask = _mm_set1_epi8((char)f->mask);
+    const __m128i bias = _mm_set1_epi8((char)0x80);
+    const __m128i v = cmp == CMP_EQ ? _mm_set1_epi8((char)f->value) :
+                      _mm_xor_si128(_mm_set1_epi8((char)f->value), bias);
+    const uint64_t invert = f->invert ? ~(uint64_t)0 : 0;
+    size_t w, k;
+
+    for (w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (k = 0; k < 4; k++) {
+            __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(col + w * 64 + k * 16)), mask);
+            bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(sse2_cmp8(x, v, bias, cmp)) << (k * 16);
+        }
+        store(out, w, bits ^ invert, refine);
+    }
+}
+
+static void
+sse2_u8(const uint8_t *col, size_t n, const struct filter *f, uint64_t *out, int refine)
+{
+    switch (f->cmp) {
+        case CMP_EQ: sse2_u8_loop(col, n, f, out, refine, CMP_EQ); break;
+        case CMP_GT: sse2_u8_loop(col, n, f, out, refine, CMP_GT); break;
+        default: sse2_u8_loop(col, n, f, out, refine, CMP_LT); break;
+    }
+    FILTER_TAIL(col, n, f, out, refine);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i
+avx2_cmp32(__m256i x, __m256i v, __m256i bias, int cmp)
+{
+    switch (cmp) {
+        case CMP_EQ: return _mm256_cmpeq_epi32(x, v);
+        case CMP_GT: return _mm256_cmpgt_epi32(_mm256_xor_si256(x, bias), v);
+        default: return _mm256_cmpgt_epi32(v, _mm256_xor_si256(x, bias));
+    }
+}
+
+static inline AVX2 __m256i
+avx2_cmp8(__m256i x, __m256i v, __m256i bias, int cmp)
+{
+    switch (cmp) {
+        case CMP_EQ: return _mm256_cmpeq_epi8(x, v);
+        case CMP_GT: return _mm256_cmpgt_epi8(_mm256_xor_si256(x, bias), v);
+        default: return _mm256_cmpgt_epi8(v, _mm256_xor_si256(x, bias));
+    }
+}
+
+static inline AVX2 void
+avx2_u32_loop(const uint32_t *col, size_t n, const struct filter *f, uint64_t *out, int refine,
+              int cmp)
+{
+    const __m256i mask = _mm256_set1_epi32((int)f->mask);
+    const __m256i bias = _mm256_set1_epi32((int)0x80000000u);
+    const __m256i v = cmp == CMP_EQ ? _mm256_set1_epi32((int)f->value) :
+                      _mm256_xor_si256(_mm256_set1_epi32((int)f->value), bias);
+    const uint64_t invert = f->invert ? ~(uint64_t)0 : 0;
+    size_t w, k;
+
+    for (w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (k = 0; k < 8; k++) {
+            __m256i x = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(col + w * 64 + k * 8)), mask);
+            bits |= (uint64_t)(uint8_t)_mm256_movemask_ps(_mm256_castsi256_ps(avx2_cmp32(x, v, bias, cmp)))
+                    << (k * 8);
+        }
+        store(out, w, bits ^ invert, refine);
+    }
+}
+
+static AVX2 void
+avx2_u32(const uint32_t *col, size_t n, const struct filter *f, uint64_t *out, int refine)
+{
+    switch (f->cmp) {
+        case CMP_EQ: avx2_u32_loop(col, n, f, out, refine, CMP_EQ); break;
+        case CMP_GT: avx2_u32_loop(col, n, f, out, refine, CMP_GT); break;
+        default: avx2_u32_loop(col, n, f, out, refine, CMP_LT); break;
+    }
+    FILTER_TAIL(col, n, f, out, refine);
+}
+
+static inline AVX2 void
+avx2_u8_loop(const uint8_t *col, size_t n, const struct filter *f, uint64_t *out, int refine,
+             int cmp)
+{
+    const __m256i mask = _mm256_set1_epi8((char)f->mask);
+    const __m256i bias = _mm256_set1_epi8((char)0x80);
+    const __m256i v = cmp == CMP_EQ ? _mm256_set1_epi8((char)f->value) :
+                      _mm256_xor_si256(_mm256_set1_epi8((char)f->value), bias);
+    const uint64_t invert = f->invert ? ~(uint64_t)0 : 0;
+    size_t w, k;
+
+    for (w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (k = 0; k < 2; k++) {
+            __m256i x = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(col + w * 64 + k * 32)), mask);
+            bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(avx2_cmp8(x, v, bias, cmp)) << (k * 32);
+        }
+        store(out, w, bits ^ invert, refine);
+    }
+}
+
+static AVX2 void
+avx2_u8(const uint8_t *col, size_t n, const struct filter *f, uint64_t *out, int refine)
+{
+    switch (f->cmp) {
+        case CMP_EQ: avx2_u8_loop(col, n, f, out, refine, CMP_EQ); break;
+        case CMP_GT: avx2_u8_loop(col, n, f, out, refine, CMP_GT); break;
+        default: avx2_u8_loop(col, n, f, out, refine, CMP_LT); break;
+    }
+    FILTER_TAIL(col, n, f, out, refine);
+}
+
+#endif /* HAVE_X86 */
+
+#ifdef HAVE_NEON
+
+/* NEON compares unsigned lanes directly; lane masks are folded into bits by weight */
+
+static inline uint32x4_t
+neon_cmp32(uint32x4_t x, uint32x4_t v, int cmp)
+{
+    switch (cmp) {
+        case CMP_EQ: return vceqq_u32(x, v);
+        case CMP_GT: return vcgtq_u32(x, v);
+        default: return vcltq_u32(x, v);
+    }
+}
+
+static inline uint8x16_t
+neon_cmp8(uint8x16_t x, uint8x16_t v, int cmp)
+{
+    switch (cmp) {
+        case CMP_EQ: return vceqq_u8(x, v);
+        case CMP_GT: return vcgtq_u8(x, v);
+        default: return vcltq_u8(x, v);
+    }
+}
+
+static inline void
+neon_u32_loop(const uint32_t *col, size_t n, const struct filter *f, uint64_t *out, int refine,
+              int cmp)
+{
+    static const uint32_t weights[4] = { 1, 2, 4, 8 };
+    const uint32x4_t weight = vld1q_u32(weights);
+    const uint32x4_t mask = vdupq_n_u32(f->mask);
+    const uint32x4_t v = vdupq_n_u32(f->value);
+    const uint64_t invert = f->invert ? ~(uint64_t)0 : 0;
+    size_t w, k;
+
+    for (w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (k = 0; k < 16; k++) {
+            uint32x4_t x = vandq_u32(vld1q_u32(col + w * 64 + k * 4), mask);
+            bits |= (uint64_t)vaddvq_u32(vandq_u32(neon_cmp32(x, v, cmp), weight)) << (k * 4);
+        }
+        store(out, w, bits ^ invert, refine);
+    }
+}
+
+static void
+neon_u32(const uint32_t *col, size_t n, const struct filter *f, uint64_t *out, int refine)
+{
+    switch (f->cmp) {
+        case CMP_EQ: neon_u32_loop(col, n, f, out, refine, CMP_EQ); break;
+        case CMP_GT: neon_u32_loop(col, n, f, out, refine, CMP_GT); break;
+        default: neon_u32_loop(col, n, f, out, refine, CMP_LT); break;
+    }
+    FILTER_TAIL(col, n, f, out, refine);
+}
+
+static inline void
+neon_u8_loop(const uint8_t *col, size_t n, const struct filter *f, uint64_t *out, int refine,
+             int cmp)
+{
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t weight = vld1q_u8(weights);
+    const uint8x16_t mask = vdupq_n_u8((uint8_t)f->mask);
+    const uint8x16_t v = vdupq_n_u8((uint8_t)f->value);
+    const uint64_t invert = f->invert ? ~(uint64_t)0 : 0;
+    size_t w, k;
+
+    for (w = 0; w < n / 64; w++) {
+        uint64_t bits = 0;
+        for (k = 0; k < 4; k++) {
+            uint8x16_t x = vandq_u8(vld1q_u8(col + w * 64 + k * 16), mask);
+            uint8x16_t m = vandq_u8(neon_cmp8(x, v, cmp), weight);
+            uint64_t lanes = (uint64_t)vaddv_u8(vget_low_u8(m)) |
+                             (uint64_t)vaddv_u8(vget_high_u8(m)) << 8;
+            bits |= lanes << (k * 16);
+        }
+        store(out, w, bits ^ invert, refine);
+    }
+}
+
+static void
+neon_u8(const uint8_t *col, size_t n, const struct filter *f, uint64_t *out, int refine)
+{
+    switch (f->cmp) {
+        case CMP_EQ: neon_u8_loop(col, n, f, out, refine, CMP_EQ); break;
+        case CMP_GT: neon_u8_loop(col, n, f, out, refine, CMP_GT); break;
+        default: neon_u8_loop(col, n, f, out, refine, CMP_LT); break;
+    }
+    FILTER_TAIL(col, n, f, out, refine);
+}
+
+#endif /* HAVE_NEON */
+
+static const struct kernel kernels[] = {
+#ifdef HAVE_X86
+    { "avx2", avx2_u32, avx2_u8 },
+    { "sse2", sse2_u32, sse2_u8 },
+#endif
+#ifdef HAVE_NEON
+    { "neon", neon_u32, neon_u8 },
+#endif
+    { "scalar", scalar_u32, scalar_u8 },
+};
+
+static const struct kernel *active_kernel;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static int
+kernel_available(const struct kernel *k)
+{
+#ifdef HAVE_X86
+    if (strcmp(k->name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+#ifndef __x86_64__
+    if (strcmp(k->name, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+#endif
+    (void)k;
+    return 1;
+}
+
+static void
+choose_kernel(void)
+{
+    size_t i;
+
+    // Kernels are listed fastest first
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernel_available(&kernels[i])) {
+            active_kernel = &kernels[i];
+            return;
+        }
+    }
+}
+
+static const struct kernel *
+kernel(void)
+{
+    pthread_once(&kernel_once, choose_kernel);
+    return active_kernel;
+}
+
+const char *
+route_columns_kernel(void)
+{
+    return kernel()->name;
+}
+
+int
+route_columns_use_kernel(const char *name)
+{
+    size_t i;
+
+    pthread_once(&kernel_once, choose_kernel);
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(kernels[i].name, name) == 0 && kernel_available(&kernels[i])) {
+            active_kernel = &kernels[i];
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+void
+route_columns_init(struct route_columns *columns)
+{
+    memset(columns, 0, sizeof(*columns));
+}
+
+void
+route_columns_free(struct route_columns *columns)
+{
+    free(columns->flags);
+    free(columns->kernel_flags);
+    free(columns->ifindex);
+    free(columns->priority);
+    free(columns->mtu);
+    free(columns->rtt);
+    free(columns->rttvar);
+    free(columns->hopcount);
+    free(columns->family);
+    free(columns->prefixlen);
+    free(columns->gateway_family);
+    free(columns->dst);
+    free(columns->gateway);
+    memset(columns, 0, sizeof(*columns));
+}
+
+static int
+grow(void *arrayp, size_t elem, size_t cap)
+{
+    void *p = realloc(*(void **)arrayp, elem * cap);
+
+    if (p == NULL) {
+        return -1;
+    }
+    *(void **)arrayp = p;
+    return 0;
+}
+
+static int
+reserve(struct route_columns *c, size_t n)
+{
+    size_t cap;
+
+    if (n <= c->cap) {
+        return 0;
+    }
+    cap = c->cap ? c->cap : 256;
+    while (cap < n) {
+        cap *= 2;
+    }
+    if (grow(&c->flags, sizeof(*c->flags), cap) || grow(&c->kernel_flags, sizeof(*c->kernel_flags), cap) ||
+        grow(&c->ifindex, sizeof(*c->ifindex), cap) || grow(&c->priority, sizeof(*c->priority), cap) ||
+        grow(&c->mtu, sizeof(*c->mtu), cap) || grow(&c->rtt, sizeof(*c->rtt), cap) ||
+        grow(&c->rttvar, sizeof(*c->rttvar), cap) || grow(&c->hopcount, sizeof(*c->hopcount), cap) ||
+        grow(&c->family, sizeof(*c->family), cap) || grow(&c->prefixlen, sizeof(*c->prefixlen), cap) ||
+        grow(&c->gateway_family, sizeof(*c->gateway_family), cap) ||
+        grow(&c->dst, sizeof(*c->dst), cap) || grow(&c->gateway, sizeof(*c->gateway), cap)) {
+        return -1;
+    }
+    c->cap = cap;
+    return 0;
+}
+
+static void
+set_row(struct route_columns *c, size_t row, const struct route_entry *e)
+{
+    c->flags[row] = e->flags;
+    c->kernel_flags[row] = e->kernel_flags;
+    c->ifindex[row] = e->ifindex;
+    c->priority[row] = e->priority;
+    c->mtu[row] = e->mtu;
+    c->rtt[row] = e->rtt;
+    c->rttvar[row] = e->rttvar;
+    c->hopcount[row] = e->hopcount;
+    c->family[row] = e->family;
+    c->prefixlen[row] = e->prefixlen;
+    c->gateway_family[row] = e->gateway_family;
+    memcpy(c->dst[row], e->dst, sizeof(e->dst));
+    memcpy(c->gateway[row], e->gateway, sizeof(e->gateway));
+}
+
+int
+route_columns_build(struct route_columns *columns, const struct route_entry *entries, size_t count)
+{
+    size_t i;
+
+    if (reserve(columns, count) != 0) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        set_row(columns, i, &entries[i]);
+    }
+    columns->count = count;
+    return 0;
+}
+
+long
+route_columns_load_dump(struct route_columns *columns, const void *buf, size_t len)
+{
+    struct route_dump_iter iter;
+    struct route_view view;
+    struct route_entry e;
+    uint64_t scanned = 0;
+    int rc;
+
+    columns->count = 0;
+    route_dump_iter_init(&iter, buf, len);
+    while ((rc = route_dump_iter_next(&iter, &view)) == 1) {
+        scanned++;
+        if (route_entry_from_view(&e, &view) != 0) {
+            continue;
+        }
+        if (reserve(columns, columns->count + 1) != 0) {
+            return -1;
+        }
+        set_row(columns, columns->count++, &e);
+    }
+    netif_stats_add(NETIF_ROUTES_SCANNED, scanned);
+    return rc < 0 ? -1 : (long)columns->count;
+}
+
+void
+route_columns_get(const struct route_columns *c, size_t row, struct route_entry *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->flags = c->flags[row];
+    e->kernel_flags = c->kernel_flags[row];
+    e->ifindex = c->ifindex[row];
+    e->priority = c->priority[row];
+    e->mtu = c->mtu[row];
+    e->rtt = c->rtt[row];
+    e->rttvar = c->rttvar[row];
+    e->hopcount = c->hopcount[row];
+    e->family = c->family[row];
+    e->prefixlen = c->prefixlen[row];
+    e->gateway_family = c->gateway_family[row];
+    memcpy(e->dst, c->dst[row], sizeof(e->dst));
+    memcpy(e->gateway, c->gateway[row], sizeof(e->gateway));
+}
+
+static const uint32_t *
+column_u32(const struct route_columns *c, enum route_column column)
+{
+    switch (column) {
+        case ROUTE_COL_FLAGS: return c->flags;
+        case ROUTE_COL_KERNEL_FLAGS: return c->kernel_flags;
+        case ROUTE_COL_IFINDEX: return c->ifindex;
+        case ROUTE_COL_PRIORITY: return c->priority;
+        case ROUTE_COL_MTU: return c->mtu;
+        case ROUTE_COL_RTT: return c->rtt;
+        case ROUTE_COL_HOPCOUNT: return c->hopcount;
+        default: return NULL;
+    }
+}
+
+static const uint8_t *
+column_u8(const struct route_columns *c, enum route_column column)
+{
+    switch (column) {
+        case ROUTE_COL_FAMILY: return c->family;
+        case ROUTE_COL_PREFIXLEN: return c->prefixlen;
+        case ROUTE_COL_GATEWAY_FAMILY: return c->gateway_family;
+        default: return NULL;
+    }
+}
+
+static int
+make_filter(const struct route_predicate *p, uint32_t width_mask, struct filter *f)
+{
+    if (p->value & ~width_mask) {
+        return -1;
+    }
+    f->mask = width_mask;
+    f->value = p->value;
+    f->invert = 0;
+    switch (p->op) {
+        case ROUTE_OP_EQ: f->cmp = CMP_EQ; break;
+        case ROUTE_OP_NE: f->cmp = CMP_EQ; f->invert = 1; break;
+        case ROUTE_OP_LT: f->cmp = CMP_LT; break;
+        case ROUTE_OP_GE: f->cmp = CMP_LT; f->invert = 1; break;
+        case ROUTE_OP_GT: f->cmp = CMP_GT; break;
+        case ROUTE_OP_LE: f->cmp = CMP_GT; f->invert = 1; break;
+        case ROUTE_OP_ALL: f->cmp = CMP_EQ; f->mask = p->value; break;
+        case ROUTE_OP_NONE: f->cmp = CMP_EQ; f->mask = p->value; f->value = 0; break;
+        case ROUTE_OP_ANY: f->cmp = CMP_EQ; f->mask = p->value; f->value = 0; f->invert = 1; break;
+        default: return -1;
+    }
+    return 0;
+}
+
+static int
+bitmap_resize(struct route_bitmap *b, size_t nbits)
+{
+    size_t words = (nbits + 63) / 64;
+
+    if (words > b->cap) {
+        uint64_t *p = realloc(b->words, (words ? words : 1) * sizeof(*p));
+        if (p == NULL) {
+            return -1;
+        }
+        b->words = p;
+        b->cap = words;
+    }
+    b->nbits = nbits;
+    return 0;
+}
+
+/* Bits past the last row are kept clear so counting and iteration can ignore them */
+static void
+clear_tail(struct route_bitmap *b)
+{
+    if (b->nbits % 64) {
+        b->words[b->nbits / 64] &= ((uint64_t)1 << (b->nbits % 64)) - 1;
+    }
+}
+
+static int
+filter(const struct route_columns *columns, const struct route_predicate *p,
+       struct route_bitmap *out, int refine)
+{
+    const struct kernel *k = kernel();
+    int narrow = p->column >= ROUTE_COL_FAMILY;
+    struct filter f;
+
+    if ((unsigned)p->column >= ROUTE_COL_COUNT || (refine && out->nbits != columns->count) ||
+        make_filter(p, narrow ? 0xffu : 0xffffffffu, &f) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!refine && bitmap_resize(out, columns->count) != 0) {
+        return -1;
+    }
+    if (narrow) {
+        k->u8(column_u8(columns, p->column), columns->count, &f, out->words, refine);
+    } else {
+        k->u32(column_u32(columns, p->column), columns->count, &f, out->words, refine);
+    }
+    clear_tail(out);
+    return 0;
+}
+
+int
+route_columns_select(const struct route_columns *columns, const struct route_predicate *predicate,
+                     struct route_bitmap *out)
+{
+    return filter(columns, predicate, out, 0);
+}
+
+int
+route_columns_refine(const struct route_columns *columns, const struct route_predicate *predicate,
+                     struct route_bitmap *out)
+{
+    return filter(columns, predicate, out, 1);
+}
+
+int
+route_columns_where(const struct route_columns *columns, const struct route_predicate *predicates,
+                    size_t count, struct route_bitmap *out)
+{
+    size_t i;
+
+    if (count == 0) {
+        if (bitmap_resize(out, columns->count) != 0) {
+            return -1;
+        }
+        memset(out->words, 0xff, (columns->count + 63) / 64 * sizeof(*out->words));
+        clear_tail(out);
+        return 0;
+    }
+    // Each further predicate only narrows the bitmap in place
+    for (i = 0; i < count; i++) {
+        if (filter(columns, &predicates[i], out, i > 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+route_bitmap_init(struct route_bitmap *bitmap)
+{
+    memset(bitmap, 0, sizeof(*bitmap));
+}
+
+void
+route_bitmap_free(struct route_bitmap *bitmap)
+{
+    free(bitmap->words);
+    memset(bitmap, 0, sizeof(*bitmap));
+}
+
+size_t
+route_bitmap_count(const struct route_bitmap *bitmap)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < (bitmap->nbits + 63) / 64; i++) {
+        n += (size_t)__builtin_popcountll(bitmap->words[i]);
+    }
+    return n;
+}
+
+long
+route_bitmap_next(const struct route_bitmap *bitmap, size_t from)
+{
+    size_t w = from / 64, words = (bitmap->nbits + 63) / 64;
+    uint64_t bits;
+
+    if (from >= bitmap->nbits) {
+        return -1;
+    }
+    bits = bitmap->words[w] & (~(uint64_t)0 << (from % 64));
+    while (bits == 0) {
+        if (++w == words) {
+            return -1;
+        }
+        bits = bitmap->words[w];
+    }
+    return (long)(w * 64 + (size_t)__builtin_ctzll(bits));
+}
+
+#define BITMAP_OP(name, expr)                                               \
+int                                                                         \
+name(struct route_bitmap *dst, const struct route_bitmap *src)              \
+{                                                                           \
+    size_t i;                                                               \
+                                                                            \
+    if (dst->nbits != src->nbits) {                                         \
+        errno = EINVAL;                                                     \
+        return -1;                                                          \
+    }                                                                       \
+    for (i = 0; i < (dst->nbits + 63) / 64; i++) {                          \
+        dst->words[i] = (expr);                                             \
+    }                                                                       \
+    return 0;                                                               \
+}
+
+BITMAP_OP(route_bitmap_and, dst->words[i] & src->words[i])
+BITMAP_OP(route_bitmap_or, dst->words[i] | src->words[i])
+BITMAP_OP(route_bitmap_andnot, dst->words[i] & ~src->words[i])
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Columnar copy of a routing table for bulk queries such as "all
+ * gateway routes on ifindex 4", "everything scoped to an interface" or
+ * "all routes with an MTU below 1400".
+ *
+ * Each route field is stored in its own array, row `i` of every column
+ * describing the same route. A predicate compares one column against a
+ * constant and sets one bit per row in a route_bitmap; predicates are
+ * combined by intersecting (route_columns_refine) or with the bitmap
+ * operations. E.g.:
+ *
+ *  struct route_predicate q[] = {
+ *      { ROUTE_COL_FLAGS, ROUTE_OP_ALL, ROUTE_F_GATEWAY },
+ *      { ROUTE_COL_IFINDEX, ROUTE_OP_EQ, 4 },
+ *  };
+ *  route_columns_where(&columns, q, 2, &rows);
+ *  for (row = route_bitmap_next(&rows, 0); row >= 0; row = route_bitmap_next(&rows, row + 1))
+ *      ...
+ *
+ * Predicates are evaluated by vector kernels, 32 or 64 rows at a time:
+ * AVX2 when the CPU has it and SSE2 otherwise on x86-64, NEON on arm64,
+ * and a scalar kernel elsewhere.
+ */
+
+#ifndef route_columns_h
+#define route_columns_h
+
+#include "route_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum route_column {
+    /* 32-bit columns */
+    ROUTE_COL_FLAGS,                /* ROUTE_F_* */
+    ROUTE_COL_KERNEL_FLAGS,
+    ROUTE_COL_IFINDEX,
+    ROUTE_COL_PRIORITY,
+    ROUTE_COL_MTU,
+    ROUTE_COL_RTT,
+    ROUTE_COL_HOPCOUNT,
+    /* 8-bit columns */
+    ROUTE_COL_FAMILY,
+    ROUTE_COL_PREFIXLEN,
+    ROUTE_COL_GATEWAY_FAMILY,
+    ROUTE_COL_COUNT
+};
+
+enum route_op {
+    ROUTE_OP_EQ,
+    ROUTE_OP_NE,
+    ROUTE_OP_LT,                    /* unsigned comparisons */
+    ROUTE_OP_LE,
+    ROUTE_OP_GT,
+    ROUTE_OP_GE,
+    ROUTE_OP_ALL,                   /* every bit of the value is set */
+    ROUTE_OP_ANY,                   /* some bit of the value is set */
+    ROUTE_OP_NONE,                  /* no bit of the value is set */
+};
+
+struct route_predicate {
+    enum route_column column;
+    enum route_op op;
+    uint32_t value;
+};
+
+struct route_columns {
+    size_t count;
+    size_t cap;
+    uint32_t *flags;
+    uint32_t *kernel_flags;
+    uint32_t *ifindex;
+    uint32_t *priority;
+    uint32_t *mtu;
+    uint32_t *rtt;
+    uint32_t *rttvar;
+    uint32_t *hopcount;
+    uint8_t *family;
+    uint8_t *prefixlen;
+    uint8_t *gateway_family;
+    uint8_t (*dst)[16];
+    uint8_t (*gateway)[16];
+};
+
+/* One bit per row, set when the row matches */
+struct route_bitmap {
+    uint64_t *words;
+    size_t nbits;
+    size_t cap;                     /* words */
+};
+
+void
+route_columns_init(struct route_columns *columns);
+
+void
+route_columns_free(struct route_columns *columns);
+
+/*
+ * Replaces the contents of `columns` with `entries`, reusing storage.
+ * Returns 0 or -1 when out of memory.
+ */
+int
+route_columns_build(struct route_columns *columns, const struct route_entry *entries, size_t count);
+
+/*
+ * Replaces the contents of `columns` with the routes of a NET_RT_DUMP2
+ * buffer. Returns the number of routes or -1.
+ */
+long
+route_columns_load_dump(struct route_columns *columns, const void *buf, size_t len);
+
+/* Reassembles row `row` */
+void
+route_columns_get(const struct route_columns *columns, size_t row, struct route_entry *e);
+
+/*
+ * Sets `out` to the rows matching `predicate`. Returns 0, or -1 with
+ * errno EINVAL for an unknown column or operation (or a value that does
+ * not fit an 8-bit column) and ENOMEM.
+ */
+int
+route_columns_select(const struct route_columns *columns, const struct route_predicate *predicate,
+                     struct route_bitmap *out);
+
+/* Clears the rows of `out` that do not match `predicate`. Same returns. */
+int
+route_columns_refine(const struct route_columns *columns, const struct route_predicate *predicate,
+                     struct route_bitmap *out);
+
+/* Sets `out` to the rows matching all `count` predicates (all rows for none) */
+int
+route_columns_where(const struct route_columns *columns, const struct route_predicate *predicates,
+                    size_t count, struct route_bitmap *out);
+
+void
+route_bitmap_init(struct route_bitmap *bitmap);
+
+void
+route_bitmap_free(struct route_bitmap *bitmap);
+
+/* Number of rows set */
+size_t
+route_bitmap_count(const struct route_bitmap *bitmap);
+
+/* Returns the first row set at or after `from`, or -1 */
+long
+route_bitmap_next(const struct route_bitmap *bitmap, size_t from);
+
+/* `dst` op= `src`, over rows both have; returns -1 when their sizes differ */
+int
+route_bitmap_and(struct route_bitmap *dst, const struct route_bitmap *src);
+
+int
+route_bitmap_or(struct route_bitmap *dst, const struct route_bitmap *src);
+
+int
+route_bitmap_andnot(struct route_bitmap *dst, const struct route_bitmap *src);
+
+/*
+ * The filter kernel in use ("avx2", "sse2", "neon" or "scalar"), and a
+ * way to force one for testing and benchmarks: returns 0, or -1 when
+ * `name` is not available on this CPU.
+ */
+const char *
+route_columns_kernel(void);
+
+int
+route_columns_use_kernel(const char *name);
+
+#endif /* route_columns_h */
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_compact.h
+ */
+
+#include "route_compact.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+_Static_assert(ROUTE_F_MULTIPATH <= 0x80, "ROUTE_F_* must fit the record's flags byte");
+
+/* Deduplicates fixed-size items; items[i] is referred to by index i */
+struct interner {
+    char *items;
+    size_t size;
+    size_t count;
+    uint32_t *slots;                /* index + 1, 0 when empty */
+    size_t mask;
+};
+
+static uint32_t
+hash_bytes(const void *p, size_t len)
+{
+    const uint8_t *b = p;
+    uint32_t h = 2166136261u;       // FNV-1a
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ b[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int
+interner_init(struct interner *t, struct route_arena *scratch, size_t size, size_t max_items)
+{
+    size_t nslots = 16;
+
+    while (nslots < max_items * 2) {
+        nslots *= 2;
+    }
+    t->size = size;
+    t->count = 0;
+    t->mask = nslots - 1;
+    t->items = route_arena_alloc(scratch, size * max_items, sizeof(uint32_t));
+    t->slots = route_arena_alloc(scratch, nslots * sizeof(*t->slots), sizeof(uint32_t));
+    if (t->items == NULL || t->slots == NULL) {
+        return -1;
+    }
+    memset(t->slots, 0, nslots * sizeof(*t->slots));
+    return 0;
+}
+
+static uint32_t
+intern(struct interner *t, const void *item)
+{
+    size_t slot = hash_bytes(item, t->size) & t->mask;
+
+    while (t->slots[slot] != 0) {
+        uint32_t index = t->slots[slot] - 1;
+        if (memcmp(t->items + (size_t)index * t->size, item, t->size) == 0) {
+            return index;
+        }
+        slot = (slot + 1) & t->mask;
+    }
+    memcpy(t->items + t->count * t->size, item, t->size);
+    t->slots[slot] = (uint32_t)++t->count;
+    return (uint32_t)(t->count - 1);
+}
+
+int
+route_compact_build(struct route_compact *compact, const struct route_entry *routes, size_t count)
+{
+    struct route_arena scratch;
+    struct interner gateways, attrs;
+    struct route_gateway gw;
+    struct route_attrs at;
+    struct route_record4 *r4;
+    struct route_record6 *r6;
+    struct route_gateway *gws;
+    struct route_attrs *ats;
+    uint32_t *gw_index, *attr_index;
+    size_t i, n4 = 0, n6 = 0, total;
+
+    memset(compact, 0, sizeof(*compact));
+    if (count >= UINT32_MAX) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        n4 += routes[i].family == AF_INET;
+        n6 += routes[i].family == AF_INET6;
+    }
+    if (n4 + n6 == 0) {
+        // Nothing to hold, and a zero sized arena would reserve its
+        // default chunk: only the empty gateway is needed
+        static const struct route_gateway empty_gateway;
+        compact->gateways = &empty_gateway;
+        compact->ngateways = 1;
+        return 0;
+    }
+
+    // Interning happens in a scratch arena freed before returning
+    route_arena_init(&scratch, 0);
+    gw_index = route_arena_alloc(&scratch, (count ? count : 1) * sizeof(*gw_index), sizeof(uint32_t));
+    attr_index = route_arena_alloc(&scratch, (count ? count : 1) * sizeof(*attr_index), sizeof(uint32_t));
+    if (gw_index == NULL || attr_index == NULL ||
+        interner_init(&gateways, &scratch, sizeof(gw), count + 1) != 0 ||
+        interner_init(&attrs, &scratch, sizeof(at), count + 1) != 0) {
+        route_arena_free(&scratch);
+        return -1;
+    }
+    memset(&gw, 0, sizeof(gw));
+    intern(&gateways, &gw);
+    for (i = 0; i < count; i++) {
+        const struct route_entry *e = &routes[i];
+        if (e->family != AF_INET && e->family != AF_INET6) {
+            continue;
+        }
+        memset(&gw, 0, sizeof(gw));
+        if (e->gateway_family != 0) {
+            gw.family = e->gateway_family;
+            memcpy(gw.addr, e->gateway, sizeof(gw.addr));
+        }
+        gw_index[i] = intern(&gateways, &gw);
+        at.kernel_flags = e->kernel_flags;
+        at.mtu = e->mtu;
+        at.rtt = e->rtt;
+        at.rttvar = e->rttvar;
+        at.hopcount = e->hopcount;
+        attr_index[i] = intern(&attrs, &at);
+    }
+
+    // Every array has 4 byte alignment and a size that is a multiple of 4,
+    // so one chunk of exactly the total holds them all. The total is never
+    // 0 here, which would select the arena's default chunk size instead.
+    total = n4 * sizeof(*r4) + n6 * sizeof(*r6) + gateways.count * sizeof(*gws) +
+            attrs.count * sizeof(*ats);
+    route_arena_init(&compact->arena, total);
+    r4 = route_arena_alloc(&compact->arena, n4 * sizeof(*r4), sizeof(uint32_t));
+    r6 = route_arena_alloc(&compact->arena, n6 * sizeof(*r6), sizeof(uint32_t));
+    gws = route_arena_alloc(&compact->arena, gateways.count * sizeof(*gws), sizeof(uint32_t));
+    ats = route_arena_alloc(&compact->arena, attrs.count * sizeof(*ats), sizeof(uint32_t));
+    if (r4 == NULL || r6 == NULL || gws == NULL || ats == NULL) {
+        route_arena_free(&compact->arena);
+        route_arena_free(&scratch);
+        return -1;
+    }
+    memcpy(gws, gateways.items, gateways.count * sizeof(*gws));
+    memcpy(ats, attrs.items, attrs.count * sizeof(*ats));
+
+    n4 = n6 = 0;
+    for (i = 0; i < count; i++) {
+        const struct route_entry *e = &routes[i];
+        if (e->family == AF_INET) {
+            struct route_record4 *r = &r4[n4++];
+            memcpy(r->dst, e->dst, sizeof(r->dst));
+            r->prefixlen = e->prefixlen;
+            r->flags = (uint8_t)e->flags;
+            r->reserved = 0;
+            r->ifindex = e->ifindex;
+            r->priority = e->priority;
+            r->gateway = gw_index[i];
+            r->attrs = attr_index[i];
+        } else if (e->family == AF_INET6) {
+            struct route_record6 *r = &r6[n6++];
+            memcpy(r->dst, e->dst, sizeof(r->dst));
+            r->prefixlen = e->prefixlen;
+            r->flags = (uint8_t)e->flags;
+            r->reserved = 0;
+            r->ifindex = e->ifindex;
+            r->priority = e->priority;
+            r->gateway = gw_index[i];
+            r->attrs = attr_index[i];
+        }
+    }
+    route_arena_free(&scratch);
+
+    compact->routes4 = r4;
+    compact->count4 = n4;
+    compact->routes6 = r6;
+    compact->count6 = n6;
+    compact->gateways = gws;
+    compact->ngateways = gateways.count;
+    compact->attrs = ats;
+    compact->nattrs = attrs.count;
+    return 0;
+}
+
+void
+route_compact_free(struct route_compact *compact)
+{
+    route_arena_free(&compact->arena);
+    memset(compact, 0, sizeof(*compact));
+}
+
+size_t
+route_compact_bytes(const struct route_compact *compact)
+{
+    return compact->arena.reserved;
+}
+
+/* Fills the fields shared by both record layouts */
+static void
+expand(const struct route_compact *compact, uint8_t flags, uint32_t ifindex, uint32_t priority,
+       uint32_t gateway, uint32_t attrs, struct route_entry *e)
+{
+    const struct route_gateway *gw = &compact->gateways[gateway];
+    const struct route_attrs *at = &compact->attrs[attrs];
+
+    e->flags = flags;
+    e->ifindex = ifindex;
+    e->priority = priority;
+    e->gateway_family = gw->family;
+    memcpy(e->gateway, gw->addr, sizeof(e->gateway));
+    e->kernel_flags = at->kernel_flags;
+    e->mtu = at->mtu;
+    e->rtt = at->rtt;
+    e->rttvar = at->rttvar;
+    e->hopcount = at->hopcount;
+}
+
+void
+route_compact_get4(const struct route_compact *compact, size_t i, struct route_entry *e)
+{
+    const struct route_record4 *r = &compact->routes4[i];
+
+    memset(e, 0, sizeof(*e));
+    e->family = AF_INET;
+    e->prefixlen = r->prefixlen;
+    memcpy(e->dst, r->dst, sizeof(r->dst));
+    expand(compact, r->flags, r->ifindex, r->priority, r->gateway, r->attrs, e);
+}
+
+void
+route_compact_get6(const struct route_compact *compact, size_t i, struct route_entry *e)
+{
+    const struct route_record6 *r = &compact->routes6[i];
+
+    memset(e, 0, sizeof(*e));
+    e->family = AF_INET6;
+    e->prefixlen = r->prefixlen;
+    memcpy(e->dst, r->dst, sizeof(r->dst));
+    expand(compact, r->flags, r->ifindex, r->priority, r->gateway, r->attrs, e);
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Read-only routing table in compact fixed-width records, for
+ * snapshots (route_snapshot.h) and other copies kept around.
+ *
+ * A struct route_entry takes 68 bytes. Here an IPv4 route takes 24
+ * and an IPv6 route 36: the destination prefix at its family's width,
+ * prefix length, ROUTE_F_* flags in a byte, ifindex, priority, and
+ * indexes into two interned tables. One holds the distinct gateways
+ * and the other the distinct (kernel flags, MTU, RTT, RTT variance, hop
+ * count) tuples; hosts with many routes have few of either.
+ *
+ * Everything lives in one arena block sized exactly at build time, so
+ * the table is freed with a single free(). A table without IPv4 or IPv6
+ * routes allocates nothing and only holds the empty gateway.
+ */
+
+#ifndef route_compact_h
+#define route_compact_h
+
+#include "route_arena.h"
+#include "route_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct route_gateway {
+    uint8_t family;                 /* AF_UNSPEC for no gateway */
+    uint8_t reserved[3];
+    uint8_t addr[16];
+};
+
+struct route_attrs {
+    uint32_t kernel_flags;
+    uint32_t mtu;
+    uint32_t rtt;
+    uint32_t rttvar;
+    uint32_t hopcount;
+};
+
+struct route_record4 {
+    uint8_t dst[4];
+    uint8_t prefixlen;
+    uint8_t flags;                  /* ROUTE_F_* */
+    uint16_t reserved;
+    uint32_t ifindex;
+    uint32_t priority;
+    uint32_t gateway;               /* into route_compact.gateways, 0 for none */
+    uint32_t attrs;                 /* into route_compact.attrs */
+};
+
+struct route_record6 {
+    uint8_t dst[16];
+    uint8_t prefixlen;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t ifindex;
+    uint32_t priority;
+    uint32_t gateway;
+    uint32_t attrs;
+};
+
+struct route_compact {
+    struct route_arena arena;       /* owns everything below */
+    const struct route_record4 *routes4;
+    size_t count4;
+    const struct route_record6 *routes6;
+    size_t count6;
+    const struct route_gateway *gateways;   /* [0] is the empty gateway */
+    size_t ngateways;
+    const struct route_attrs *attrs;
+    size_t nattrs;
+};
+
+/*
+ * Builds `compact` from the IPv4 and IPv6 routes among `count`, keeping
+ * their order within each family. Returns 0 or -1 when out of memory.
+ */
+int
+route_compact_build(struct route_compact *compact, const struct route_entry *routes, size_t count);
+
+void
+route_compact_free(struct route_compact *compact);
+
+/* Bytes held, records and interned tables included */
+size_t
+route_compact_bytes(const struct route_compact *compact);
+
+/* Expands record `i` of the IPv4 or IPv6 routes back into `e` */
+void
+route_compact_get4(const struct route_compact *compact, size_t i, struct route_entry *e);
+
+void
+route_compact_get6(const struct route_compact *compact, size_t i, struct route_entry *e);
+
+#endif /* route_compact_h */
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_diff.h
+ */
+
+#include "route_diff.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t
+scope_of(const struct route_entry *e)
+{
+    return (e->flags & ROUTE_F_IFSCOPE) ? e->ifindex : 0;
+}
+
+int
+route_entry_key_compare(const struct route_entry *a, const struct route_entry *b)
+{
+    int c;
+
+    if (a->family != b->family) {
+        return a->family < b->family ? -1 : 1;
+    }
+    if ((c = memcmp(a->dst, b->dst, sizeof(a->dst))) != 0) {
+        return c;
+    }
+    if (a->prefixlen != b->prefixlen) {
+        return a->prefixlen < b->prefixlen ? -1 : 1;
+    }
+    if (a->priority != b->priority) {
+        return a->priority < b->priority ? -1 : 1;
+    }
+    if (scope_of(a) != scope_of(b)) {
+        return scope_of(a) < scope_of(b) ? -1 : 1;
+    }
+    return 0;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+    return route_entry_key_compare(a, b);
+}
+
+void
+route_diff_sort(struct route_entry *entries, size_t count)
+{
+    qsort(entries, count, sizeof(*entries), compare_entries);
+}
+
+static int
+is_sorted(const struct route_entry *entries, size_t count)
+{
+    size_t i;
+
+    for (i = 1; i < count; i++) {
+        if (route_entry_key_compare(&entries[i - 1], &entries[i]) > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Reports a pair of routes with the same key */
+static void
+emit_pair(const struct route_entry *old, const struct route_entry *new,
+          const struct route_diff_ops *ops, void *ctx, struct route_diff_counts *counts)
+{
+    if (route_entry_equal(old, new)) {
+        counts->unchanged++;
+        return;
+    }
+    counts->changed++;
+    if (ops && ops->changed) {
+        ops->changed(old, new, ctx);
+    }
+}
+
+static void
+emit_added(const struct route_entry *e, const struct route_diff_ops *ops, void *ctx,
+           struct route_diff_counts *counts)
+{
+    counts->added++;
+    if (ops && ops->added) {
+        ops->added(e, ctx);
+    }
+}
+
+static void
+emit_removed(const struct route_entry *e, const struct route_diff_ops *ops, void *ctx,
+             struct route_diff_counts *counts)
+{
+    counts->removed++;
+    if (ops && ops->removed) {
+        ops->removed(e, ctx);
+    }
+}
+
+static long
+finish(struct route_diff_counts *local, struct route_diff_counts *counts)
+{
+    if (counts) {
+        *counts = *local;
+    }
+    return (long)(local->added + local->removed + local->changed);
+}
+
+/*
+ * Both arrays in key order: one merge pass. Removed routes are held
+ * back until the end to keep the order documented in route_diff.h.
+ */
+static void
+diff_sorted(const struct route_entry *old, size_t nold, const struct route_entry *new, size_t nnew,
+            uint8_t *matched, const struct route_diff_ops *ops, void *ctx,
+            struct route_diff_counts *counts)
+{
+    size_t i = 0, j = 0;
+    int c;
+
+    while (j < nnew) {
+        c = i < nold ? route_entry_key_compare(&old[i], &new[j]) : 1;
+        if (c < 0) {
+            i++;
+        } else if (c > 0) {
+            emit_added(&new[j++], ops, ctx, counts);
+        } else {
+            matched[i] = 1;
+            emit_pair(&old[i++], &new[j++], ops, ctx, counts);
+        }
+    }
+}
+
+/* Otherwise: index `old` by key hash and probe it with `new` */
+static int
+diff_hashed(const struct route_entry *old, size_t nold, const struct route_entry *new, size_t nnew,
+            uint8_t *matched, const struct route_diff_ops *ops, void *ctx,
+            struct route_diff_counts *counts)
+{
+    uint32_t *slots;
+    size_t nslots = 16, mask, i, j;
+    uint32_t pos;
+
+    while (nslots < nold * 2) {
+        nslots <<= 1;
+    }
+    if ((slots = calloc(nslots, sizeof(*slots))) == NULL) {
+        return -1;
+    }
+    mask = nslots - 1;
+    for (i = 0; i < nold; i++) {
+        for (j = route_entry_key_hash(&old[i]) & mask; slots[j]; j = (j + 1) & mask) {
+        }
+        slots[j] = (uint32_t)i + 1;
+    }
+
+    for (i = 0; i < nnew; i++) {
+        // Duplicate keys pair up with the first unmatched old route
+        for (j = route_entry_key_hash(&new[i]) & mask; (pos = slots[j]) != 0; j = (j + 1) & mask) {
+            if (!matched[pos - 1] && route_entry_same_key(&old[pos - 1], &new[i])) {
+                break;
+            }
+        }
+        if (pos == 0) {
+            emit_added(&new[i], ops, ctx, counts);
+        } else {
+            matched[pos - 1] = 1;
+            emit_pair(&old[pos - 1], &new[i], ops, ctx, counts);
+        }
+    }
+    free(slots);
+    return 0;
+}
+
+long
+route_diff_entries(const struct route_entry *old, size_t nold,
+                   const struct route_entry *new, size_t nnew,
+                   const struct route_diff_ops *ops, void *ctx,
+                   struct route_diff_counts *counts)
+{
+    struct route_diff_counts local;
+    uint8_t *matched;
+    size_t i;
+
+    memset(&local, 0, sizeof(local));
+    if ((matched = calloc(nold ? nold : 1, 1)) == NULL) {
+        return -1;
+    }
+    if (is_sorted(old, nold) && is_sorted(new, nnew)) {
+        diff_sorted(old, nold, new, nnew, matched, ops, ctx, &local);
+    } else if (diff_hashed(old, nold, new, nnew, matched, ops, ctx, &local) != 0) {
+        free(matched);
+        return -1;
+    }
+    for (i = 0; i < nold; i++) {
+        if (!matched[i]) {
+            emit_removed(&old[i], ops, ctx, &local);
+        }
+    }
+    free(matched);
+    return finish(&local, counts);
+}
+
+long
+route_diff_tables(const struct route_table *old, const struct route_table *new,
+                  const struct route_diff_ops *ops, void *ctx,
+                  struct route_diff_counts *counts)
+{
+    struct route_diff_counts local;
+    const struct route_entry *match;
+    size_t i;
+
+    memset(&local, 0, sizeof(local));
+    // Keys are unique within a table, so each side is probed once
+    for (i = 0; i < new->count; i++) {
+        if ((match = route_table_find(old, &new->entries[i])) == NULL) {
+            emit_added(&new->entries[i], ops, ctx, &local);
+        } else {
+            emit_pair(match, &new->entries[i], ops, ctx, &local);
+        }
+    }
+    for (i = 0; i < old->count; i++) {
+        if (route_table_find(new, &old->entries[i]) == NULL) {
+            emit_removed(&old->entries[i], ops, ctx, &local);
+        }
+    }
+    return finish(&local, counts);
+}
+
+/* Returns 1 if link `i` of `a` has an address equal to address `k` of `b` */
+static int
+has_address(const struct interface_table *a, size_t i, const struct interface_table *b, size_t k)
+{
+    size_t n;
+
+    for (n = a->addr_first[i]; n < a->addr_first[i] + a->addr_count[i]; n++) {
+        if (a->addr_family[n] == b->addr_family[k] &&
+            a->addr_prefixlen[n] == b->addr_prefixlen[k] &&
+            memcmp(a->addr[n], b->addr[k], sizeof(a->addr[n])) == 0 &&
+            memcmp(a->addr_broadcast[n], b->addr_broadcast[k], sizeof(a->addr_broadcast[n])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned
+link_changes(const struct interface_table *old, size_t i, const struct interface_table *new, size_t j)
+{
+    unsigned changes = 0;
+    size_t k;
+
+    if (old->flags[i] != new->flags[j]) {
+        changes |= INTERFACE_DIFF_FLAGS;
+    }
+    if (old->mtu[i] != new->mtu[j]) {
+        changes |= INTERFACE_DIFF_MTU;
+    }
+    if (strncmp(old->name[i], new->name[j], IFNAMSIZ) != 0) {
+        changes |= INTERFACE_DIFF_NAME;
+    }
+    // Links carry a handful of addresses, in no particular order
+    if (old->addr_count[i] != new->addr_count[j]) {
+        changes |= INTERFACE_DIFF_ADDRESSES;
+    } else {
+        for (k = new->addr_first[j]; k < new->addr_first[j] + new->addr_count[j]; k++) {
+            if (!has_address(old, i, new, k)) {
+                changes |= INTERFACE_DIFF_ADDRESSES;
+                break;
+            }
+        }
+    }
+    return changes;
+}
+
+static int
+compare_keys(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Returns the positions of the links of `table` in interface index
+ * order, as interface index << 32 | position.
+ */
+static uint64_t *
+link_order(const struct interface_table *table)
+{
+    uint64_t *order;
+    size_t i;
+
+    if ((order = malloc((table->count ? table->count : 1) * sizeof(*order))) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < table->count; i++) {
+        order[i] = (uint64_t)table->index[i] << 32 | i;
+    }
+    if (!table->sorted) {
+        qsort(order, table->count, sizeof(*order), compare_keys);
+    }
+    return order;
+}
+
+long
+interface_diff(const struct interface_table *old, const struct interface_table *new,
+               const struct interface_diff_ops *ops, void *ctx,
+               struct route_diff_counts *counts)
+{
+    struct route_diff_counts local;
+    uint64_t *old_order, *new_order;
+    size_t i = 0, j = 0, a, b;
+    unsigned changes;
+
+    memset(&local, 0, sizeof(local));
+    old_order = link_order(old);
+    new_order = link_order(new);
+    if (old_order == NULL || new_order == NULL) {
+        free(old_order);
+        free(new_order);
+        return -1;
+    }
+
+    while (i < old->count || j < new->count) {
+        a = i < old->count ? (uint32_t)old_order[i] : 0;
+        b = j < new->count ? (uint32_t)new_order[j] : 0;
+        if (j == new->count || (i < old->count && old->index[a] < new->index[b])) {
+            local.removed++;
+            if (ops && ops->removed) {
+                ops->removed(old, a, ctx);
+            }
+            i++;
+        } else if (i == old->count || new->index[b] < old->index[a]) {
+            local.added++;
+            if (ops && ops->added) {
+                ops->added(new, b, ctx);
+            }
+            j++;
+        } else {
+            if ((changes = link_changes(old, a, new, b)) != 0) {
+                local.changed++;
+                if (ops && ops->changed) {
+                    ops->changed(old, a, new, b, changes, ctx);
+                }
+            } else {
+                local.unchanged++;
+            }
+            i++;
+            j++;
+        }
+    }
+    free(old_order);
+    free(new_order);
+    return finish(&local, counts);
+}
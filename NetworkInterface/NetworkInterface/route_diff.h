@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compares two snapshots of the routing table or of the interfaces and
+ * reports only what was added, removed or changed, so that consumers
+ * can react to the one route that changed instead of re-validating
+ * everything.
+ *
+ * Routes are matched by key (see route_entry_same_key). Two route
+ * arrays that are both in route_entry_key_compare() order are merged in
+ * one pass; otherwise the old array is indexed by route_entry_key_hash()
+ * and the new one probed against it. Two route tables are diffed with
+ * their own hash indexes. All three are linear in the number of routes.
+ *
+ * Interfaces are matched by interface index.
+ *
+ * Callbacks may be NULL. They are called synchronously, with pointers
+ * into the snapshots being compared.
+ */
+
+#ifndef route_diff_h
+#define route_diff_h
+
+#include "interface_table.h"
+#include "route_table.h"
+
+#include <stddef.h>
+
+struct route_diff_ops {
+    void (*added)(const struct route_entry *e, void *ctx);
+    void (*removed)(const struct route_entry *e, void *ctx);
+    void (*changed)(const struct route_entry *old, const struct route_entry *new, void *ctx);
+};
+
+struct route_diff_counts {
+    size_t added;
+    size_t removed;
+    size_t changed;
+    size_t unchanged;
+};
+
+/*
+ * Total order on route keys, consistent with route_entry_same_key():
+ * family, destination, prefix length, priority, then interface scope.
+ */
+int
+route_entry_key_compare(const struct route_entry *a, const struct route_entry *b);
+
+/* Sorts `entries` into route_entry_key_compare() order */
+void
+route_diff_sort(struct route_entry *entries, size_t count);
+
+/*
+ * Diffs two route arrays, e.g. decoded dumps or mapped captures.
+ * Emits changes in the order of `new`, then the removed routes in the
+ * order of `old`. `counts` may be NULL. Returns the number of changes,
+ * or -1 when out of memory.
+ */
+long
+route_diff_entries(const struct route_entry *old, size_t nold,
+                   const struct route_entry *new, size_t nnew,
+                   const struct route_diff_ops *ops, void *ctx,
+                   struct route_diff_counts *counts);
+
+/* Same as route_diff_entries() for two route tables; cannot fail */
+long
+route_diff_tables(const struct route_table *old, const struct route_table *new,
+                  const struct route_diff_ops *ops, void *ctx,
+                  struct route_diff_counts *counts);
+
+/* What changed on a link present in both snapshots */
+#define INTERFACE_DIFF_FLAGS        0x1
+#define INTERFACE_DIFF_MTU          0x2
+#define INTERFACE_DIFF_NAME         0x4
+#define INTERFACE_DIFF_ADDRESSES    0x8     /* an address was added, removed or changed */
+
+struct interface_diff_ops {
+    void (*added)(const struct interface_table *table, size_t link, void *ctx);
+    void (*removed)(const struct interface_table *table, size_t link, void *ctx);
+    void (*changed)(const struct interface_table *old, size_t old_link,
+                    const struct interface_table *new, size_t new_link,
+                    unsigned changes, void *ctx);
+};
+
+/*
+ * Diffs two interface tables. `counts` may be NULL. Returns the number
+ * of links added, removed or changed, or -1 when out of memory.
+ */
+long
+interface_diff(const struct interface_table *old, const struct interface_table *new,
+               const struct interface_diff_ops *ops, void *ctx,
+               struct route_diff_counts *counts);
+
+#endif /* route_diff_h */
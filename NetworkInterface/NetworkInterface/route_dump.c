@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_dump.h
+ */
+
+#include "route_dump.h"
+
+#include "netif_stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+/* Offset of the address within sockaddr_in and sockaddr_in6 */
+#define SIN_ADDR_OFFSET     4
+#define SIN6_ADDR_OFFSET    8
+
+void
+route_dump_iter_init(struct route_dump_iter *iter, const void *buf, size_t len)
+{
+    iter->next = buf;
+    iter->lim = (const char *)buf + len;
+}
+
+int
+route_family_from_bsd(int bsd_family)
+{
+    switch (bsd_family) {
+        case RT_BSD_AF_INET:
+            return AF_INET;
+        case RT_BSD_AF_INET6:
+            return AF_INET6;
+        default:
+            return AF_UNSPEC;
+    }
+}
+
+int
+route_view_decode_addrs_generic(struct route_view *view, int addrs, const void *sa_start, const void *end_ptr)
+{
+    const struct sockaddr *rti_info[RTAX_MAX];
+    const char *sa = sa_start, *end = end_ptr;
+    int i;
+
+    // NOTE: adapted from get_rtaddrs in Apple netstat source
+    for (i = 0; i < RTAX_MAX; i++) {
+        if (addrs & (1 << i)) {
+            if (sa >= end || sa + ROUNDUP(RT_SA_LEN(sa)) > end) {
+                return -1;
+            }
+            rti_info[i] = (const struct sockaddr *)sa;
+            sa += ROUNDUP(RT_SA_LEN(sa));
+        } else {
+            rti_info[i] = NULL;
+        }
+    }
+
+    view->dst = rti_info[RTAX_DST];
+    view->mask = rti_info[RTAX_NETMASK];
+    view->gateway = rti_info[RTAX_GATEWAY];
+    view->family = view->dst ? route_family_from_bsd(RT_SA_FAMILY(view->dst)) : AF_UNSPEC;
+    return 0;
+}
+
+/*
+ * The rtm_addrs and address family layouts that make up nearly every
+ * route in a dump: a full sockaddr_in or sockaddr_in6 destination, then
+ * a gateway of the same family or an AF_LINK one, then for network
+ * routes the netmask.
+ *
+ *  X(name, rtm_addrs, destination family, its sa_len, gateway family, its sa_len)
+ *
+ * A gateway sa_len of 0 is read from the message (sockaddr_dl varies).
+ * The netmask is always last, so its varying length only matters for
+ * the bounds check.
+ */
+#define LAYOUT_NET      (RTA_DST | RTA_GATEWAY | RTA_NETMASK)
+#define LAYOUT_HOST     (RTA_DST | RTA_GATEWAY)
+
+#define ROUTE_DUMP_LAYOUTS(X) \
+    X(net4_inet,    LAYOUT_NET,  RT_BSD_AF_INET,  16, RT_BSD_AF_INET,  16) \
+    X(net4_link,    LAYOUT_NET,  RT_BSD_AF_INET,  16, RT_BSD_AF_LINK,  0)  \
+    X(host4_inet,   LAYOUT_HOST, RT_BSD_AF_INET,  16, RT_BSD_AF_INET,  16) \
+    X(host4_link,   LAYOUT_HOST, RT_BSD_AF_INET,  16, RT_BSD_AF_LINK,  0)  \
+    X(net6_inet6,   LAYOUT_NET,  RT_BSD_AF_INET6, 28, RT_BSD_AF_INET6, 28) \
+    X(net6_link,    LAYOUT_NET,  RT_BSD_AF_INET6, 28, RT_BSD_AF_LINK,  0)  \
+    X(host6_inet6,  LAYOUT_HOST, RT_BSD_AF_INET6, 28, RT_BSD_AF_INET6, 28) \
+    X(host6_link,   LAYOUT_HOST, RT_BSD_AF_INET6, 28, RT_BSD_AF_LINK,  0)
+
+#define LAYOUT_KEY(addrs, dst_family, gw_family) \
+    ((uint32_t)(addrs) << 16 | (uint32_t)(dst_family) << 8 | (uint32_t)(gw_family))
+
+/*
+ * Defines decode_<name>(), which reads the sockaddrs at the offsets the
+ * layout fixes. It returns -1 when a length differs from the layout's
+ * or a sockaddr overruns `end`, leaving the message to the generic
+ * walker, which decides whether it is malformed.
+ */
+#define DEFINE_LAYOUT_DECODER(name, addrs, dst_family, dst_len, gw_family, gw_len) \
+static int \
+decode_##name(struct route_view *view, const char *sa, const char *end) \
+{ \
+    const char *gateway = sa + (dst_len), *mask; \
+    size_t gateway_size; \
+ \
+    if (end - gateway < ((gw_len) ? (gw_len) : 2) || RT_SA_LEN(sa) != (dst_len)) { \
+        return -1; \
+    } \
+    gateway_size = (gw_len) ? (gw_len) : ROUNDUP(RT_SA_LEN(gateway)); \
+    if ((gw_len) ? RT_SA_LEN(gateway) != (gw_len) : gateway_size > (size_t)(end - gateway)) { \
+        return -1; \
+    } \
+    mask = gateway + gateway_size; \
+    if (((addrs) & RTA_NETMASK) && \
+        (mask >= end || ROUNDUP(RT_SA_LEN(mask)) > (size_t)(end - mask))) { \
+        return -1; \
+    } \
+    view->dst = (const struct sockaddr *)sa; \
+    view->gateway = (const struct sockaddr *)gateway; \
+    view->mask = ((addrs) & RTA_NETMASK) ? (const struct sockaddr *)mask : NULL; \
+    view->family = (dst_family) == RT_BSD_AF_INET ? AF_INET : AF_INET6; \
+    return 0; \
+}
+
+ROUTE_DUMP_LAYOUTS(DEFINE_LAYOUT_DECODER)
+
+#define LAYOUT_CASE(name, addrs, dst_family, dst_len, gw_family, gw_len) \
+    case LAYOUT_KEY(addrs, dst_family, gw_family): \
+        if (decode_##name(view, sa, end) == 0) { \
+            return 0; \
+        } \
+        break;
+
+int
+route_view_decode_addrs(struct route_view *view, int addrs, const void *sa_start, const void *end_ptr)
+{
+    const char *sa = sa_start, *end = end_ptr;
+    size_t dst_size;
+
+    // The families at the offsets a common layout would have
+    if ((addrs == LAYOUT_NET || addrs == LAYOUT_HOST) && end - sa >= 2) {
+        dst_size = ROUNDUP(RT_SA_LEN(sa));
+        if (dst_size + 2 <= (size_t)(end - sa)) {
+            switch (LAYOUT_KEY(addrs, RT_SA_FAMILY(sa), RT_SA_FAMILY(sa + dst_size))) {
+            ROUTE_DUMP_LAYOUTS(LAYOUT_CASE)
+            default:
+                break;
+            }
+        }
+    }
+    return route_view_decode_addrs_generic(view, addrs, sa, end);
+}
+
+int
+route_dump_iter_next(struct route_dump_iter *iter, struct route_view *view)
+{
+    const struct rt_msghdr2 *rtm;
+    const char *end;
+
+    if (iter->next >= iter->lim) {
+        return 0;
+    }
+    if ((size_t)(iter->lim - iter->next) < sizeof(*rtm)) {
+        return -1;
+    }
+    rtm = (const struct rt_msghdr2 *)iter->next;
+    if (rtm->rtm_msglen < sizeof(*rtm) || rtm->rtm_msglen > iter->lim - iter->next) {
+        return -1;
+    }
+    end = iter->next + rtm->rtm_msglen;
+
+    if (route_view_decode_addrs(view, rtm->rtm_addrs, rtm + 1, end) != 0) {
+        return -1;
+    }
+    view->rtm = rtm;
+    view->flags = rtm->rtm_flags;
+    view->ifindex = rtm->rtm_index;
+    view->metrics = &rtm->rtm_rmx;
+
+    iter->next = end;
+    return 1;
+}
+
+int
+route_msg_decode(const void *msg, size_t len, struct route_view *view)
+{
+    const struct rt_msghdr *rtm = msg;
+
+    if (len < sizeof(*rtm) || rtm->rtm_msglen < sizeof(*rtm) || rtm->rtm_msglen > len) {
+        return -1;
+    }
+    if (route_view_decode_addrs(view, rtm->rtm_addrs, rtm + 1,
+                                (const char *)msg + rtm->rtm_msglen) != 0) {
+        return -1;
+    }
+    view->rtm = NULL;
+    view->flags = rtm->rtm_flags;
+    view->ifindex = rtm->rtm_index;
+    view->metrics = &rtm->rtm_rmx;
+    return 1;
+}
+
+const uint8_t *
+route_sockaddr_addr(const struct sockaddr *sa, int family, size_t *len)
+{
+    size_t offset, size, sa_len;
+
+    if (family == AF_INET) {
+        offset = SIN_ADDR_OFFSET;
+        size = 4;
+    } else if (family == AF_INET6) {
+        offset = SIN6_ADDR_OFFSET;
+        size = 16;
+    } else {
+        *len = 0;
+        return NULL;
+    }
+
+    sa_len = RT_SA_LEN(sa);
+    if (sa_len <= offset) {
+        *len = 0;
+    } else if (sa_len - offset < size) {
+        *len = sa_len - offset;
+    } else {
+        *len = size;
+    }
+    return (const uint8_t *)sa + offset;
+}
+
+int
+route_view_prefixlen(const struct route_view *view)
+{
+    const uint8_t *bytes;
+    size_t len, i;
+    int bits, prefixlen = 0;
+
+    if (view->family == AF_INET) {
+        bits = 32;
+    } else if (view->family == AF_INET6) {
+        bits = 128;
+    } else {
+        return -1;
+    }
+
+    if (view->mask == NULL) {
+        return bits;
+    }
+
+    bytes = route_sockaddr_addr(view->mask, view->family, &len);
+    for (i = 0; i < len; i++) {
+        uint8_t b = bytes[i];
+        if (b == 0xff) {
+            prefixlen += 8;
+            continue;
+        }
+        while (b & 0x80) {
+            prefixlen++;
+            b <<= 1;
+        }
+        break;
+    }
+    return prefixlen;
+}
+
+// NOTE: adapted from p_sockaddr in Apple netstat source
+int
+route_view_is_default(const struct route_view *view)
+{
+    const uint8_t *bytes;
+    size_t len, i;
+
+    if (!(view->flags & RTF_GATEWAY) || view->dst == NULL) {
+        return 0;
+    }
+    if (view->family != AF_INET && view->family != AF_INET6) {
+        return 0;
+    }
+
+    bytes = route_sockaddr_addr(view->dst, view->family, &len);
+    for (i = 0; i < len; i++) {
+        if (bytes[i] != 0) {
+            return 0;
+        }
+    }
+
+    // A missing or zero-length netmask is an all-zero netmask
+    if (view->mask == NULL) {
+        return 1;
+    }
+    return route_view_prefixlen(view) == 0;
+}
+
+int
+route_entry_from_view(struct route_entry *e, const struct route_view *view)
+{
+    const uint8_t *bytes;
+    size_t len, i;
+    int prefixlen;
+
+    if ((prefixlen = route_view_prefixlen(view)) < 0) {
+        return -1;
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->family = (uint8_t)view->family;
+    e->prefixlen = (uint8_t)prefixlen;
+    bytes = route_sockaddr_addr(view->dst, view->family, &len);
+    memcpy(e->dst, bytes, len);
+    // Clear host bits so equal prefixes compare equal
+    for (i = 0; i < sizeof(e->dst); i++) {
+        int bits = prefixlen - (int)i * 8;
+        if (bits <= 0) {
+            e->dst[i] = 0;
+        } else if (bits < 8) {
+            e->dst[i] &= (uint8_t)(0xff << (8 - bits));
+        }
+    }
+
+    if (view->gateway && route_family_from_bsd(RT_SA_FAMILY(view->gateway)) == view->family) {
+        bytes = route_sockaddr_addr(view->gateway, view->family, &len);
+        memcpy(e->gateway, bytes, len);
+        e->gateway_family = (uint8_t)view->family;
+    }
+
+    e->kernel_flags = (uint32_t)view->flags;
+    e->flags = (view->flags & RTF_UP ? ROUTE_F_UP : 0) |
+               (view->flags & RTF_GATEWAY ? ROUTE_F_GATEWAY : 0) |
+               (view->flags & RTF_HOST ? ROUTE_F_HOST : 0) |
+               (view->flags & RTF_STATIC ? ROUTE_F_STATIC : 0) |
+               (view->flags & RTF_IFSCOPE ? ROUTE_F_IFSCOPE : 0) |
+               (view->flags & (RTF_REJECT | RTF_BLACKHOLE) ? ROUTE_F_REJECT : 0) |
+               (view->flags & RTF_WASCLONED ? ROUTE_F_CLONED : 0);
+    e->ifindex = view->ifindex;
+    e->mtu = view->metrics->rmx_mtu;
+    e->rtt = view->metrics->rmx_rtt;
+    e->rttvar = view->metrics->rmx_rttvar;
+    e->hopcount = view->metrics->rmx_hopcount;
+    return 0;
+}
+
+#ifdef __APPLE__
+int
+route_dump_fetch(char **buf, size_t *len)
+{
+    size_t extra_space;
+    size_t needed;
+    int mib[6];
+    char *dump;
+    int try = 1;
+    int saved_errno;
+    uint64_t start;
+
+again:
+    mib[0] = CTL_NET;
+    mib[1] = PF_ROUTE;
+    mib[2] = 0;
+    mib[3] = 0;
+    mib[4] = NET_RT_DUMP2;
+    mib[5] = 0;
+    start = netif_stats_now();
+    if (sysctl(mib, 6, NULL, &needed, NULL, 0) < 0) {
+        return -1;
+    }
+    netif_stats_record_since(NETIF_SYSCTL_ESTIMATE_NS, start);
+    /* allocate extra space in case the table grows */
+    extra_space = needed / 2;
+    if (needed <= (SIZE_MAX - extra_space)) {
+        needed += extra_space;
+    }
+    if ((dump = malloc(needed)) == NULL) {
+        return -1;
+    }
+    start = netif_stats_now();
+    if (sysctl(mib, 6, dump, &needed, NULL, 0) < 0) {
+#define MAX_TRIES    10
+        if (errno == ENOMEM && try < MAX_TRIES) {
+            /* the buffer we provided was too small, try again */
+            free(dump);
+            try++;
+            netif_stats_add(NETIF_SYSCTL_RETRIES, 1);
+            goto again;
+        }
+        saved_errno = errno;
+        free(dump);
+        errno = saved_errno;
+        return -1;
+    }
+    netif_stats_record_since(NETIF_SYSCTL_DUMP_NS, start);
+    netif_stats_add(NETIF_BYTES_DUMPED, needed);
+    *buf = dump;
+    *len = needed;
+    return 0;
+}
+#endif
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Zero-copy iterator over a `NET_RT_DUMP2` routing table dump.
+ *
+ * The iterator walks the buffer returned by sysctl in place and yields
+ * a `struct route_view` per route. Every pointer in a view points
+ * straight into the caller's buffer, so nothing is copied and the
+ * buffer must outlive the views taken from it.
+ *
+ * The dump format is decoded by hand (sa_len is read as the first byte
+ * of each sockaddr, address families are mapped from their BSD values)
+ * so recorded dumps can be replayed on any platform, e.g. Linux.
+ *
+ * WARNING: some of the datastructures contained within <net/route.h>
+ * have been duplicated here because that header is not exposed on iOS.
+ */
+
+#ifndef route_dump_h
+#define route_dump_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "route_table.h"
+
+// Redefine required <net/route.h> code
+
+#define RTA_DST         0x1     /* destination sockaddr present */
+#define RTA_GATEWAY     0x2     /* gateway sockaddr present */
+#define RTA_NETMASK     0x4     /* netmask sockaddr present */
+#define RTA_GENMASK     0x8     /* cloning mask sockaddr present */
+#define RTA_IFP         0x10    /* interface name sockaddr present */
+#define RTA_IFA         0x20    /* interface addr sockaddr present */
+#define RTA_AUTHOR      0x40    /* sockaddr for author of redirect */
+#define RTA_BRD         0x80    /* for NEWADDR, broadcast or p-p dest addr */
+
+#define RTAX_DST        0
+#define RTAX_GATEWAY    1
+#define RTAX_NETMASK    2
+#define RTAX_GENMASK    3
+#define RTAX_IFP        4
+#define RTAX_IFA        5
+#define RTAX_AUTHOR     6
+#define RTAX_BRD        7
+#define RTAX_MAX        8
+
+#define RTM_VERSION     5       /* Up the ante and ignore older versions */
+
+#define RTM_ADD         0x1     /* Add Route */
+#define RTM_DELETE      0x2     /* Delete Route */
+#define RTM_CHANGE      0x3     /* Change Metrics or flags */
+#define RTM_GET         0x4     /* Report Metrics */
+#define RTM_LOSING      0x5     /* RTM_LOSING is no longer generated by xnu */
+#define RTM_REDIRECT    0x6     /* Told to use different route */
+#define RTM_MISS        0x7     /* Lookup failed on this address */
+#define RTM_LOCK        0x8     /* fix specified metrics */
+#define RTM_OLDADD      0x9     /* caused by SIOCADDRT */
+#define RTM_OLDDEL      0xa     /* caused by SIOCDELRT */
+#define RTM_RESOLVE     0xb     /* req to resolve dst to LL addr */
+#define RTM_NEWADDR     0xc     /* address being added to iface */
+#define RTM_DELADDR     0xd     /* address being removed from iface */
+#define RTM_IFINFO      0xe     /* iface going up/down etc. */
+#define RTM_NEWMADDR    0xf     /* mcast group membership being added to if */
+#define RTM_DELMADDR    0x10    /* mcast group membership being deleted */
+#define RTM_IFINFO2     0x12    /* */
+#define RTM_NEWMADDR2   0x13    /* */
+#define RTM_GET2        0x14    /* */
+
+#define RTF_UP          0x1             /* route usable */
+#define RTF_GATEWAY     0x2             /* destination is a gateway */
+#define RTF_HOST        0x4             /* host entry (net otherwise) */
+#define RTF_REJECT      0x8             /* host or net unreachable */
+#define RTF_DYNAMIC     0x10            /* created dynamically (by redirect) */
+#define RTF_MODIFIED    0x20            /* modified dynamically (by redirect) */
+#define RTF_DONE        0x40            /* message confirmed */
+#define RTF_DELCLONE    0x80            /* delete cloned route */
+#define RTF_CLONING     0x100           /* generate new routes on use */
+#define RTF_XRESOLVE    0x200           /* external daemon resolves name */
+#define RTF_LLINFO      0x400           /* DEPRECATED - exists ONLY for backward
+*  compatibility */
+#define RTF_LLDATA      0x400           /* used by apps to add/del L2 entries */
+#define RTF_STATIC      0x800           /* manually added */
+#define RTF_BLACKHOLE   0x1000          /* just discard pkts (during updates) */
+#define RTF_NOIFREF     0x2000          /* not eligible for RTF_IFREF */
+#define RTF_PROTO2      0x4000          /* protocol specific routing flag */
+#define RTF_PROTO1      0x8000          /* protocol specific routing flag */
+
+#define RTF_PRCLONING   0x10000         /* protocol requires cloning */
+#define RTF_WASCLONED   0x20000         /* route generated through cloning */
+#define RTF_PROTO3      0x40000         /* protocol specific routing flag */
+/* 0x80000 unused */
+#define RTF_PINNED      0x100000        /* future use */
+#define RTF_LOCAL       0x200000        /* route represents a local address */
+#define RTF_BROADCAST   0x400000        /* route represents a bcast address */
+#define RTF_MULTICAST   0x800000        /* route represents a mcast address */
+#define RTF_IFSCOPE     0x1000000       /* has valid interface scope */
+#define RTF_CONDEMNED   0x2000000       /* defunct; no longer modifiable */
+#define RTF_IFREF       0x4000000       /* route holds a ref to interface */
+#define RTF_PROXY       0x8000000       /* proxying, no interface scope */
+#define RTF_ROUTER      0x10000000      /* host is a router */
+#define RTF_DEAD        0x20000000      /* Route entry is being freed */
+/* 0x40000000 and up unassigned */
+
+/*
+ * These numbers are used by reliable protocols for determining
+ * retransmission behavior and are included in the routing structure.
+ */
+struct rt_metrics {
+    u_int32_t       rmx_locks;      /* Kernel leaves these values alone */
+    u_int32_t       rmx_mtu;        /* MTU for this path */
+    u_int32_t       rmx_hopcount;   /* max hops expected */
+    int32_t         rmx_expire;     /* lifetime for route, e.g. redirect */
+    u_int32_t       rmx_recvpipe;   /* inbound delay-bandwidth product */
+    u_int32_t       rmx_sendpipe;   /* outbound delay-bandwidth product */
+    u_int32_t       rmx_ssthresh;   /* outbound gateway buffer limit */
+    u_int32_t       rmx_rtt;        /* estimated round trip time */
+    u_int32_t       rmx_rttvar;     /* estimated rtt variance */
+    u_int32_t       rmx_pksent;     /* packets sent using this route */
+    u_int32_t       rmx_state;      /* route state */
+    u_int32_t       rmx_filler[3];  /* will be used for T/TCP later */
+};
+
+// NOTE: copied from <net/route.h>
+struct rt_msghdr2 {
+    u_short rtm_msglen;     /* to skip over non-understood messages */
+    u_char  rtm_version;    /* future binary compatibility */
+    u_char  rtm_type;       /* message type */
+    u_short rtm_index;      /* index for associated ifp */
+    int     rtm_flags;      /* flags, incl. kern & message, e.g. DONE */
+    int     rtm_addrs;      /* bitmask identifying sockaddrs in msg */
+    int32_t rtm_refcnt;     /* reference count */
+    int     rtm_parentflags; /* flags of the parent route */
+    int     rtm_reserved;   /* reserved field set to 0 */
+    int     rtm_use;        /* from rtentry */
+    u_int32_t rtm_inits;    /* which metrics we are initializing */
+    struct rt_metrics rtm_rmx; /* metrics themselves */
+};
+
+// NOTE: copied from <net/route.h>
+struct rt_msghdr {
+    u_short rtm_msglen;     /* to skip over non-understood messages */
+    u_char  rtm_version;    /* future binary compatibility */
+    u_char  rtm_type;       /* message type */
+    u_short rtm_index;      /* index for associated ifp */
+    int     rtm_flags;      /* flags, incl. kern & message, e.g. DONE */
+    int     rtm_addrs;      /* bitmask identifying sockaddrs in msg */
+    int32_t rtm_pid;        /* identify sender */
+    int     rtm_seq;        /* for sender to identify action */
+    int     rtm_errno;      /* why failed */
+    int     rtm_use;        /* from rtentry */
+    u_int32_t rtm_inits;    /* which metrics we are initializing */
+    struct rt_metrics rtm_rmx; /* metrics themselves */
+};
+
+// NOTE: copied from Apple netstat source
+#define ROUNDUP(a) \
+((a) > 0 ? (1 + (((a) - 1) | (sizeof(uint32_t) - 1))) : sizeof(uint32_t))
+
+/*
+ * Address family values as they appear in a dump taken on Apple
+ * platforms. These differ from the host values on Linux.
+ */
+#define RT_BSD_AF_INET      2
+#define RT_BSD_AF_LINK      18
+#define RT_BSD_AF_INET6     30
+
+/*
+ * Accessors for the BSD sockaddr header. `struct sockaddr` has no
+ * sa_len member on Linux, so the header bytes are read directly.
+ */
+#define RT_SA_LEN(sa)       (((const uint8_t *)(sa))[0])
+#define RT_SA_FAMILY(sa)    (((const uint8_t *)(sa))[1])
+
+/*
+ * A single route inside a dump. All pointers reference the dump buffer.
+ */
+struct route_view {
+    const struct rt_msghdr2 *rtm;       /* the dump message, NULL for route_msg_decode */
+    int family;                         /* host AF_INET, AF_INET6 or AF_UNSPEC */
+    int flags;                          /* RTF_* */
+    unsigned short ifindex;             /* rtm_index */
+    const struct sockaddr *dst;         /* RTAX_DST or NULL */
+    const struct sockaddr *mask;        /* RTAX_NETMASK or NULL */
+    const struct sockaddr *gateway;     /* RTAX_GATEWAY or NULL */
+    const struct rt_metrics *metrics;   /* rtm_rmx */
+};
+
+struct route_dump_iter {
+    const char *next;
+    const char *lim;
+};
+
+void
+route_dump_iter_init(struct route_dump_iter *iter, const void *buf, size_t len);
+
+/*
+ * Decodes the next route into `view`.
+ * Returns 1 when a route was decoded, 0 at the end of the dump and -1
+ * when the dump is malformed (truncated message or sockaddr).
+ */
+int
+route_dump_iter_next(struct route_dump_iter *iter, struct route_view *view);
+
+/*
+ * Decodes a single PF_ROUTE socket message (`struct rt_msghdr`, as
+ * received for RTM_ADD, RTM_DELETE, RTM_CHANGE, ...) into `view`.
+ * Returns 1 on success and -1 when the message is malformed.
+ */
+int
+route_msg_decode(const void *msg, size_t len, struct route_view *view);
+
+/*
+ * Locates the sockaddrs `addrs` (rtm_addrs) names, laid out from `sa`
+ * up to `end`, and fills in the dst, gateway, mask and family of
+ * `view`. Returns 0 or -1 when they overrun `end`.
+ *
+ * The few layouts that make up nearly every route (destination and
+ * gateway, with or without a netmask, for IPv4 and IPv6 with an IP or
+ * link gateway) are read at offsets fixed at compile time; any other
+ * is walked slot by slot with route_view_decode_addrs_generic(). Both
+ * give the same result.
+ */
+int
+route_view_decode_addrs(struct route_view *view, int addrs, const void *sa, const void *end);
+
+/* As route_view_decode_addrs(), walking all RTAX_MAX slots like netstat's get_rtaddrs() */
+int
+route_view_decode_addrs_generic(struct route_view *view, int addrs, const void *sa, const void *end);
+
+/*
+ * Maps a BSD address family, as found in a dump, to the host value.
+ * Unknown families map to AF_UNSPEC.
+ */
+int
+route_family_from_bsd(int bsd_family);
+
+/*
+ * Returns a pointer to the raw address bytes (in_addr or in6_addr) of
+ * `sa`, interpreted as `family`, and stores the number of bytes that
+ * are present in `len`. Netmasks are commonly truncated, so `len` may
+ * be shorter than the address; missing trailing bytes are zero.
+ */
+const uint8_t *
+route_sockaddr_addr(const struct sockaddr *sa, int family, size_t *len);
+
+/*
+ * Returns the prefix length of the route: the number of leading one
+ * bits in the netmask, or the full address length when no netmask is
+ * present. Returns -1 for families other than AF_INET and AF_INET6.
+ */
+int
+route_view_prefixlen(const struct route_view *view);
+
+/*
+ * Returns 1 if the route is a default route via a gateway (0.0.0.0/0 or
+ * ::/0 with RTF_GATEWAY), otherwise 0.
+ */
+int
+route_view_is_default(const struct route_view *view);
+
+/*
+ * Decodes `view` into a `struct route_entry`. Returns 0 on success and
+ * -1 for routes that are not AF_INET or AF_INET6.
+ */
+int
+route_entry_from_view(struct route_entry *e, const struct route_view *view);
+
+#ifdef __APPLE__
+/*
+ * Dumps the routing table with sysctl(NET_RT_DUMP2), retrying when the
+ * table grows between the estimate and the dump. On success `*buf` must
+ * be released with free(). Returns 0 on success and -1 on failure with
+ * errno set.
+ */
+int
+route_dump_fetch(char **buf, size_t *len);
+#endif
+
+#endif /* route_dump_h */
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_export.h
+ */
+
+#include "route_export.h"
+#include "netif_stats.h"
+#include "route_dump.h"
+#include "route_netlink.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+static int
+family_code(int family)
+{
+    return family == AF_INET ? 4 : family == AF_INET6 ? 6 : 0;
+}
+
+static size_t
+address_len(int code)
+{
+    return code == 4 ? 4 : code == 6 ? 16 : 0;
+}
+
+static size_t
+put_varint(uint8_t *p, uint32_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/* Returns the varint's length, 0 when truncated or -1 when too long */
+static int
+get_varint(const uint8_t *p, size_t len, uint32_t *v)
+{
+    uint32_t value = 0;
+    size_t i;
+
+    for (i = 0; i < 5; i++) {
+        if (i == len) {
+            return 0;
+        }
+        if (i == 4 && p[i] > 0x0f) {
+            return -1;
+        }
+        value |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *v = value;
+            return (int)i + 1;
+        }
+    }
+    return -1;
+}
+
+static size_t
+encode_binary(uint8_t *p, const struct route_entry *e)
+{
+    const int gateway = family_code(e->gateway_family);
+    const int family = family_code(e->family);
+    size_t n = 0, dst;
+
+    p[n++] = (uint8_t)family;
+    p[n++] = e->prefixlen;
+    p[n++] = (uint8_t)gateway;
+    n += put_varint(p + n, e->flags);
+    n += put_varint(p + n, e->ifindex);
+    n += put_varint(p + n, e->priority);
+    n += put_varint(p + n, e->kernel_flags);
+    n += put_varint(p + n, e->mtu);
+    n += put_varint(p + n, e->rtt);
+    n += put_varint(p + n, e->rttvar);
+    n += put_varint(p + n, e->hopcount);
+    dst = (e->prefixlen + 7) / 8;
+    memcpy(p + n, e->dst, dst);
+    n += dst;
+    memcpy(p + n, e->gateway, address_len(gateway));
+    return n + address_len(gateway);
+}
+
+long
+route_export_decode(const void *buf, size_t len, struct route_entry *e)
+{
+    const uint8_t *p = buf;
+    uint32_t *fields[8];
+    size_t n = 3, i, dst, gateway;
+    int rc;
+
+    if (len < 3) {
+        return 0;
+    }
+    memset(e, 0, sizeof(*e));
+    if ((e->family = p[0] == 4 ? AF_INET : p[0] == 6 ? AF_INET6 : 0) == 0 ||
+        p[1] > address_len(p[0]) * 8 ||
+        (p[2] != 0 && p[2] != 4 && p[2] != 6)) {
+        return -1;
+    }
+    e->prefixlen = p[1];
+    e->gateway_family = p[2] == 4 ? AF_INET : p[2] == 6 ? AF_INET6 : AF_UNSPEC;
+
+    fields[0] = &e->flags;
+    fields[1] = &e->ifindex;
+    fields[2] = &e->priority;
+    fields[3] = &e->kernel_flags;
+    fields[4] = &e->mtu;
+    fields[5] = &e->rtt;
+    fields[6] = &e->rttvar;
+    fields[7] = &e->hopcount;
+    for (i = 0; i < 8; i++) {
+        if ((rc = get_varint(p + n, len - n, fields[i])) <= 0) {
+            return rc;
+        }
+        n += rc;
+    }
+
+    dst = (e->prefixlen + 7) / 8;
+    gateway = address_len(p[2]);
+    if (len - n < dst + gateway) {
+        return 0;
+    }
+    memcpy(e->dst, p + n, dst);
+    memcpy(e->gateway, p + n + dst, gateway);
+    return (long)(n + dst + gateway);
+}
+
+/* netstat(1) style flag letters */
+static void
+flag_letters(char *out, uint32_t flags)
+{
+    static const struct {
+        uint32_t flag;
+        char letter;
+    } letters[] = {
+        { ROUTE_F_UP, 'U' },
+        { ROUTE_F_GATEWAY, 'G' },
+        { ROUTE_F_HOST, 'H' },
+        { ROUTE_F_STATIC, 'S' },
+        { ROUTE_F_IFSCOPE, 'I' },
+        { ROUTE_F_REJECT, 'R' },
+        { ROUTE_F_CLONED, 'W' },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(letters) / sizeof(letters[0]); i++) {
+        if (flags & letters[i].flag) {
+            *out++ = letters[i].letter;
+        }
+    }
+    *out = '\0';
+}
+
+static size_t
+encode_ndjson(char *p, size_t size, const struct route_entry *e)
+{
+    char dst[INET6_ADDRSTRLEN], gateway[INET6_ADDRSTRLEN + 16], flags[8];
+    int n;
+
+    if (inet_ntop(e->family, e->dst, dst, sizeof(dst)) == NULL) {
+        dst[0] = '\0';
+    }
+    gateway[0] = '\0';
+    if (e->gateway_family == AF_INET || e->gateway_family == AF_INET6) {
+        strcpy(gateway, ",\"gateway\":\"");
+        if (inet_ntop(e->gateway_family, e->gateway, gateway + strlen(gateway),
+                      INET6_ADDRSTRLEN) == NULL) {
+            gateway[0] = '\0';
+        } else {
+            strcat(gateway, "\"");
+        }
+    }
+    flag_letters(flags, e->flags);
+    n = snprintf(p, size,
+                 "{\"dst\":\"%s/%u\"%s,\"ifindex\":%u,\"flags\":\"%s\",\"priority\":%u,"
+                 "\"mtu\":%u,\"rtt\":%u,\"rttvar\":%u,\"hopcount\":%u}\n",
+                 dst, e->prefixlen, gateway, e->ifindex, flags, e->priority,
+                 e->mtu, e->rtt, e->rttvar, e->hopcount);
+    return n < 0 ? 0 : (size_t)n;
+}
+
+int
+route_exporter_init(struct route_exporter *ex, int format, size_t chunk_size,
+                    route_export_write_fn write, void *ctx)
+{
+    memset(ex, 0, sizeof(*ex));
+    if (format != ROUTE_EXPORT_NDJSON && format != ROUTE_EXPORT_BINARY) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (chunk_size < ROUTE_EXPORT_MAX_RECORD) {
+        chunk_size = ROUTE_EXPORT_MAX_RECORD;
+    }
+    if ((ex->buf = malloc(chunk_size)) == NULL) {
+        return -1;
+    }
+    ex->format = format;
+    ex->size = chunk_size;
+    ex->write = write;
+    ex->ctx = ctx;
+    if (format == ROUTE_EXPORT_BINARY) {
+        memcpy(ex->buf, ROUTE_EXPORT_MAGIC, sizeof(ROUTE_EXPORT_MAGIC));
+        ex->buf[sizeof(ROUTE_EXPORT_MAGIC)] = ROUTE_EXPORT_VERSION;
+        ex->len = ROUTE_EXPORT_HEADER_LEN;
+    }
+    return 0;
+}
+
+void
+route_exporter_free(struct route_exporter *ex)
+{
+    free(ex->buf);
+    ex->buf = NULL;
+}
+
+int
+route_exporter_flush(struct route_exporter *ex)
+{
+    if (ex->failed) {
+        errno = EIO;
+        return -1;
+    }
+    if (ex->len == 0) {
+        return 0;
+    }
+    if (ex->write(ex->ctx, ex->buf, ex->len) != 0) {
+        ex->failed = 1;
+        return -1;
+    }
+    ex->bytes += ex->len;
+    ex->chunks++;
+    ex->len = 0;
+    netif_stats_add(NETIF_EXPORT_CHUNKS, 1);
+    return 0;
+}
+
+int
+route_exporter_add(struct route_exporter *ex, const struct route_entry *e)
+{
+    // NOTE: records are encoded in place, so a chunk is flushed once it
+    // has less than a record's worth of room left
+    if (ex->size - ex->len < ROUTE_EXPORT_MAX_RECORD && route_exporter_flush(ex) != 0) {
+        return -1;
+    }
+    if (ex->failed) {
+        errno = EIO;
+        return -1;
+    }
+    if (ex->format == ROUTE_EXPORT_BINARY) {
+        ex->len += encode_binary((uint8_t *)ex->buf + ex->len, e);
+    } else {
+        ex->len += encode_ndjson(ex->buf + ex->len, ex->size - ex->len, e);
+    }
+    ex->routes++;
+    return 0;
+}
+
+static long
+export_dump(struct route_exporter *ex, const void *dump, size_t len, int family)
+{
+    struct route_dump_iter iter;
+    struct route_view view;
+    struct route_entry e;
+    long count = 0;
+    int rc;
+
+    route_dump_iter_init(&iter, dump, len);
+    while ((rc = route_dump_iter_next(&iter, &view)) == 1) {
+        netif_stats_add(NETIF_ROUTES_SCANNED, 1);
+        if (route_entry_from_view(&e, &view) != 0 ||
+            (family != AF_UNSPEC && e.family != family)) {
+            continue;
+        }
+        if (route_exporter_add(ex, &e) != 0) {
+            return -1;
+        }
+        count++;
+    }
+    if (rc < 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return route_exporter_flush(ex) == 0 ? count : -1;
+}
+
+long
+route_export_dump(struct route_exporter *ex, const void *dump, size_t len)
+{
+    return export_dump(ex, dump, len, AF_UNSPEC);
+}
+
+#ifdef __linux__
+static int
+export_route(const struct route_entry *e, void *ctx)
+{
+    return route_exporter_add(ctx, e);
+}
+#endif
+
+long
+route_export_kernel(struct route_exporter *ex, int family)
+{
+#ifdef __linux__
+    uint64_t before = ex->routes;
+
+    if (route_netlink_walk_routes(family, export_route, ex) != 0 ||
+        route_exporter_flush(ex) != 0) {
+        return -1;
+    }
+    return (long)(ex->routes - before);
+#elif defined(__APPLE__)
+    long count;
+    size_t len;
+    char *dump;
+    int saved;
+
+    // NOTE: sysctl(NET_RT_DUMP2) has no way to continue a dump, so the
+    // raw dump is the one allocation that grows with the table. Routes
+    // are encoded straight from it rather than decoded into a table.
+    if (route_dump_fetch(&dump, &len) != 0) {
+        return -1;
+    }
+    count = export_dump(ex, dump, len, family);
+    saved = errno;
+    free(dump);
+    errno = saved;
+    return count;
+#else
+    (void)ex;
+    (void)family;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
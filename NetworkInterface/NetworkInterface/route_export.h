@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Streaming export of routing tables in bounded memory.
+ *
+ * Routes are decoded one at a time and encoded into a single buffer of
+ * a fixed chunk size, handed to the caller's write function whenever
+ * the next route would not fit. Chunks only ever hold whole records, so
+ * each can be parsed on its own. Nothing else grows with the table.
+ *
+ * Two formats:
+ *
+ *  ROUTE_EXPORT_NDJSON     one JSON object per line, e.g.
+ *      {"dst":"10.0.0.0/8","gateway":"192.0.2.1","ifindex":2,"flags":"UG",
+ *       "priority":100,"mtu":1500,"rtt":0,"rttvar":0,"hopcount":0}
+ *  ROUTE_EXPORT_BINARY     ROUTE_EXPORT_MAGIC and a version byte, then
+ *      per route: family (4 or 6), prefix length and gateway family
+ *      (0, 4 or 6) bytes; ROUTE_F_* flags, ifindex, priority, kernel
+ *      flags, MTU, RTT, RTT variance and hop count as LEB128 varints;
+ *      the destination's prefix bytes and the gateway address. About 20
+ *      bytes for a typical IPv4 route. See route_export_decode().
+ *
+ * route_export_kernel() streams the kernel's table: on Linux with a
+ * netlink dump read through one ROUTE_NETLINK_BUFSIZE receive buffer;
+ * on Apple, where sysctl(NET_RT_DUMP2) can only return the table at
+ * once, through a single dump buffer without decoding it into a table.
+ */
+
+#ifndef route_export_h
+#define route_export_h
+
+#include "route_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROUTE_EXPORT_NDJSON     0
+#define ROUTE_EXPORT_BINARY     1
+
+#define ROUTE_EXPORT_MAGIC      "NIRTEXP"   /* 8 bytes with the NUL */
+#define ROUTE_EXPORT_VERSION    1
+#define ROUTE_EXPORT_HEADER_LEN 9
+
+/* Largest record of either format; chunks must be at least this size */
+#define ROUTE_EXPORT_MAX_RECORD 512
+
+/* Returns 0, or -1 to stop the export with errno set */
+typedef int (*route_export_write_fn)(void *ctx, const void *buf, size_t len);
+
+struct route_exporter {
+    int format;
+    char *buf;
+    size_t size;                    /* chunk size */
+    size_t len;                     /* bytes pending in `buf` */
+    route_export_write_fn write;
+    void *ctx;
+    int failed;                     /* a write failed; everything else is refused */
+    /* Statistics */
+    uint64_t routes;
+    uint64_t bytes;
+    uint64_t chunks;
+};
+
+/*
+ * Allocates the chunk buffer, of at least ROUTE_EXPORT_MAX_RECORD bytes.
+ * Returns 0 or -1 with errno set.
+ */
+int
+route_exporter_init(struct route_exporter *ex, int format, size_t chunk_size,
+                    route_export_write_fn write, void *ctx);
+
+void
+route_exporter_free(struct route_exporter *ex);
+
+/* Encodes one route. Returns 0 or -1 with errno set. */
+int
+route_exporter_add(struct route_exporter *ex, const struct route_entry *e);
+
+/* Writes out the pending chunk. Returns 0 or -1 with errno set. */
+int
+route_exporter_flush(struct route_exporter *ex);
+
+/*
+ * Exports every route in a NET_RT_DUMP2 buffer (see route_dump.h), then
+ * flushes. Returns the number of routes exported or -1.
+ */
+long
+route_export_dump(struct route_exporter *ex, const void *dump, size_t len);
+
+/*
+ * Exports the kernel's routes of `family` (AF_UNSPEC for all), then
+ * flushes. Returns the number of routes exported or -1 with errno set.
+ */
+long
+route_export_kernel(struct route_exporter *ex, int family);
+
+/*
+ * Decodes the binary record at the start of `buf`, after the stream
+ * header, into `e`. Returns the record's length, 0 when `buf` ends
+ * within it, or -1 when it is malformed.
+ */
+long
+route_export_decode(const void *buf, size_t len, struct route_entry *e);
+
+#endif /* route_export_h */
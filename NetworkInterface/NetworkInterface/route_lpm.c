@@ -0,0 +1,815 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_lpm.h
+ */
+
+#include "route_lpm.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define MAX_ENTRY       0x7fffu     /* largest DIR-24-8 nexthop or group index */
+#define NEXTHOP_SLOTS   4096        /* dedup hash size, grows with the nexthops */
+
+/* Shared by every part of tbl24 without a route; never written */
+static struct route_lpm_chunk empty_chunk;
+
+struct build {
+    struct route_lpm *lpm;
+    int family;                     /* of the next hops in `slots` */
+    uint32_t *slots;                /* nexthop index + 1, 0 when empty */
+    size_t nslots;
+    uint16_t *free8;                /* unused tbl8 group indexes */
+    size_t nfree8;
+    size_t free8_cap;
+};
+
+static uint32_t
+mask4(int prefixlen)
+{
+    return prefixlen ? ~0u << (32 - prefixlen) : 0;
+}
+
+static uint32_t
+prefix4(const struct route_entry *e)
+{
+    uint32_t a = ((uint32_t)e->dst[0] << 24) | ((uint32_t)e->dst[1] << 16) |
+                 ((uint32_t)e->dst[2] << 8) | e->dst[3];
+
+    return a & mask4(e->prefixlen);
+}
+
+/* Orders routes by family, prefix length and prefix, best candidate first */
+static int
+compare_routes(const void *a, const void *b)
+{
+    const struct route_entry *x = *(const struct route_entry * const *)a;
+    const struct route_entry *y = *(const struct route_entry * const *)b;
+    int c;
+
+    if (x->family != y->family) {
+        return x->family < y->family ? -1 : 1;
+    }
+    if (x->prefixlen != y->prefixlen) {
+        return x->prefixlen < y->prefixlen ? -1 : 1;
+    }
+    if ((c = memcmp(x->dst, y->dst, sizeof(x->dst))) != 0) {
+        return c;
+    }
+    if ((x->flags & ROUTE_F_IFSCOPE) != (y->flags & ROUTE_F_IFSCOPE)) {
+        return (x->flags & ROUTE_F_IFSCOPE) ? 1 : -1;
+    }
+    if (x->priority != y->priority) {
+        return x->priority < y->priority ? -1 : 1;
+    }
+    // Stable for identical keys
+    return x < y ? -1 : (x > y);
+}
+
+/* Orders IPv4 routes by prefix, then prefix length, best candidate first */
+static int
+compare_routes4(const void *a, const void *b)
+{
+    const struct route_entry *x = *(const struct route_entry * const *)a;
+    const struct route_entry *y = *(const struct route_entry * const *)b;
+    uint32_t px = prefix4(x), py = prefix4(y);
+
+    if (px != py) {
+        return px < py ? -1 : 1;
+    }
+    if (x->prefixlen != y->prefixlen) {
+        return x->prefixlen < y->prefixlen ? -1 : 1;
+    }
+    if ((x->flags & ROUTE_F_IFSCOPE) != (y->flags & ROUTE_F_IFSCOPE)) {
+        return (x->flags & ROUTE_F_IFSCOPE) ? 1 : -1;
+    }
+    if (x->priority != y->priority) {
+        return x->priority < y->priority ? -1 : 1;
+    }
+    return x < y ? -1 : (x > y);
+}
+
+static int
+compare_prefix4(const struct route_lpm_prefix4 *x, const struct route_lpm_prefix4 *y)
+{
+    if (x->dst != y->dst) {
+        return x->dst < y->dst ? -1 : 1;
+    }
+    return x->prefixlen < y->prefixlen ? -1 : (x->prefixlen > y->prefixlen);
+}
+
+/* Position of the first prefix at or after `dst` */
+static size_t
+lower_bound4(const struct route_lpm_prefix4 *p, size_t n, uint32_t dst)
+{
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (p[mid].dst < dst) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static const struct route_lpm_prefix4 *
+find_prefix4(const struct route_lpm_prefix4 *p, size_t n, uint32_t dst, int prefixlen)
+{
+    size_t i;
+
+    for (i = lower_bound4(p, n, dst); i < n && p[i].dst == dst; i++) {
+        if (p[i].prefixlen == prefixlen) {
+            return &p[i];
+        }
+    }
+    return NULL;
+}
+
+static uint32_t
+hash_nexthop(const struct route_nexthop *nh)
+{
+    const uint8_t *p = (const uint8_t *)nh;
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(*nh); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Returns the 1-based index of the deduplicated `family` nexthop for
+ * `e`, or 0 on failure. Only the gateway, the interface and whether
+ * the route rejects traffic make a nexthop: they are all a lookup
+ * reports.
+ */
+static uint32_t
+intern_nexthop(struct build *bld, int family, const struct route_entry *e)
+{
+    struct route_lpm *lpm = bld->lpm;
+    struct route_nexthop **nexthops = family == AF_INET ? &lpm->nexthops4 : &lpm->nexthops6;
+    size_t *n = family == AF_INET ? &lpm->nnexthops4 : &lpm->nnexthops6;
+    size_t *cap = family == AF_INET ? &lpm->nexthops4_cap : &lpm->nexthops6_cap;
+    struct route_nexthop nh;
+    size_t i;
+
+    memset(&nh, 0, sizeof(nh));
+    nh.ifindex = e->ifindex;
+    nh.gateway_family = e->gateway_family;
+    nh.reject = (e->flags & ROUTE_F_REJECT) != 0;
+    if (e->gateway_family != AF_UNSPEC) {
+        memcpy(nh.gateway, e->gateway, sizeof(nh.gateway));
+    }
+
+    if (bld->family != family) {
+        // Rehashed below from this family's nexthops
+        free(bld->slots);
+        bld->slots = NULL;
+        bld->nslots = 0;
+        bld->family = family;
+    }
+    if (*n * 2 >= bld->nslots) {
+        size_t nslots = bld->nslots ? bld->nslots * 2 : NEXTHOP_SLOTS;
+        uint32_t *slots;
+        while (*n * 2 >= nslots) {
+            nslots *= 2;
+        }
+        if ((slots = calloc(nslots, sizeof(*slots))) == NULL) {
+            return 0;
+        }
+        for (i = 0; i < *n; i++) {
+            size_t s = hash_nexthop(&(*nexthops)[i]) & (nslots - 1);
+            while (slots[s]) {
+                s = (s + 1) & (nslots - 1);
+            }
+            slots[s] = (uint32_t)(i + 1);
+        }
+        free(bld->slots);
+        bld->slots = slots;
+        bld->nslots = nslots;
+    }
+
+    i = hash_nexthop(&nh) & (bld->nslots - 1);
+    while (bld->slots[i]) {
+        if (memcmp(&(*nexthops)[bld->slots[i] - 1], &nh, sizeof(nh)) == 0) {
+            return bld->slots[i];
+        }
+        i = (i + 1) & (bld->nslots - 1);
+    }
+
+    if (*n == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 64;
+        struct route_nexthop *grown = realloc(*nexthops, ncap * sizeof(*grown));
+        if (grown == NULL) {
+            return 0;
+        }
+        *nexthops = grown;
+        *cap = ncap;
+    }
+    (*nexthops)[(*n)++] = nh;
+    bld->slots[i] = (uint32_t)*n;
+    return (uint32_t)*n;
+}
+
+static void
+release_chunk(struct route_lpm_chunk *chunk)
+{
+    if (chunk && chunk != &empty_chunk && atomic_fetch_sub(&chunk->refs, 1) == 1) {
+        free(chunk);
+    }
+}
+
+static void
+release_group(struct route_lpm_group *group)
+{
+    if (group && atomic_fetch_sub(&group->refs, 1) == 1) {
+        free(group);
+    }
+}
+
+/* Returns chunk `c` of tbl24 for writing, copying it first when shared */
+static struct route_lpm_chunk *
+own_chunk(struct build *bld, size_t c)
+{
+    struct route_lpm_chunk *chunk = bld->lpm->tbl24[c], *copy;
+
+    // Indexes sharing a chunk each hold a reference, so a count of one
+    // means it was copied during this update
+    if (chunk != &empty_chunk && atomic_load(&chunk->refs) == 1) {
+        return chunk;
+    }
+    if ((copy = malloc(sizeof(*copy))) == NULL) {
+        return NULL;
+    }
+    atomic_init(&copy->refs, 1);
+    memcpy(copy->entries, chunk->entries, sizeof(copy->entries));
+    release_chunk(chunk);
+    bld->lpm->tbl24[c] = copy;
+    return copy;
+}
+
+static struct route_lpm_group *
+own_group(struct build *bld, size_t g)
+{
+    struct route_lpm_group *group = bld->lpm->tbl8[g], *copy;
+
+    if (atomic_load(&group->refs) == 1) {
+        return group;
+    }
+    if ((copy = malloc(sizeof(*copy))) == NULL) {
+        return NULL;
+    }
+    atomic_init(&copy->refs, 1);
+    memcpy(copy->entries, group->entries, sizeof(copy->entries));
+    release_group(group);
+    bld->lpm->tbl8[g] = copy;
+    return copy;
+}
+
+/* Returns an unused tbl8 group index, or -1 */
+static long
+alloc_group(struct build *bld)
+{
+    struct route_lpm *lpm = bld->lpm;
+
+    if (bld->nfree8) {
+        return bld->free8[--bld->nfree8];
+    }
+    if (lpm->tbl8_groups > MAX_ENTRY) {
+        return -1;
+    }
+    if (lpm->tbl8_groups == lpm->tbl8_cap) {
+        size_t cap = lpm->tbl8_cap ? lpm->tbl8_cap * 2 : 64;
+        struct route_lpm_group **tbl8 = realloc(lpm->tbl8, cap * sizeof(*tbl8));
+        if (tbl8 == NULL) {
+            return -1;
+        }
+        memset(tbl8 + lpm->tbl8_cap, 0, (cap - lpm->tbl8_cap) * sizeof(*tbl8));
+        lpm->tbl8 = tbl8;
+        lpm->tbl8_cap = cap;
+    }
+    return (long)lpm->tbl8_groups++;
+}
+
+static int
+drop_group(struct build *bld, size_t g)
+{
+    struct route_lpm *lpm = bld->lpm;
+
+    if (bld->nfree8 == bld->free8_cap) {
+        size_t cap = bld->free8_cap ? bld->free8_cap * 2 : 64;
+        uint16_t *free8 = realloc(bld->free8, cap * sizeof(*free8));
+        if (free8 == NULL) {
+            return -1;
+        }
+        bld->free8 = free8;
+        bld->free8_cap = cap;
+    }
+    release_group(lpm->tbl8[g]);
+    lpm->tbl8[g] = NULL;
+    bld->free8[bld->nfree8++] = (uint16_t)g;
+    return 0;
+}
+
+/*
+ * Sets tbl24 entries [first, end) to `value`, releasing the groups they
+ * replace. Chunks already holding `value` throughout are left shared.
+ */
+static int
+fill24(struct build *bld, size_t first, size_t end, uint16_t value)
+{
+    const size_t mask = ROUTE_LPM_CHUNK_SIZE - 1;
+
+    while (first < end) {
+        size_t c = first >> ROUTE_LPM_CHUNK_BITS, i;
+        size_t stop = (c + 1) << ROUTE_LPM_CHUNK_BITS;
+        struct route_lpm_chunk *chunk = bld->lpm->tbl24[c];
+
+        if (stop > end) {
+            stop = end;
+        }
+        for (i = first; i < stop && chunk->entries[i & mask] == value; i++) {
+        }
+        if (i < stop) {
+            if ((chunk = own_chunk(bld, c)) == NULL) {
+                return -1;
+            }
+            for (; i < stop; i++) {
+                uint16_t old = chunk->entries[i & mask];
+                if ((old & ROUTE_LPM_TBL8_FLAG) && old != value &&
+                    drop_group(bld, old & ~ROUTE_LPM_TBL8_FLAG) != 0) {
+                    return -1;
+                }
+                chunk->entries[i & mask] = value;
+            }
+        }
+        first = stop;
+    }
+    return 0;
+}
+
+/*
+ * Points tbl24 entry `i` at a group holding `base` overlaid with the
+ * `n` prefixes longer than /24 within it, in prefixes4 order. An
+ * existing group is reused, and copied only when its entries change.
+ */
+static int
+paint_group(struct build *bld, size_t i, uint16_t base,
+            const struct route_lpm_prefix4 *p, size_t n)
+{
+    struct route_lpm *lpm = bld->lpm;
+    struct route_lpm_group *group;
+    uint16_t entries[256], entry;
+    size_t j, k;
+    long g;
+
+    for (j = 0; j < 256; j++) {
+        entries[j] = base;
+    }
+    // In address order a prefix follows every prefix containing it
+    for (k = 0; k < n; k++) {
+        size_t first = p[k].dst & 0xff, count = (size_t)1 << (32 - p[k].prefixlen);
+        for (j = first; j < first + count; j++) {
+            entries[j] = p[k].nexthop;
+        }
+    }
+
+    entry = lpm->tbl24[i >> ROUTE_LPM_CHUNK_BITS]->entries[i & (ROUTE_LPM_CHUNK_SIZE - 1)];
+    if (entry & ROUTE_LPM_TBL8_FLAG) {
+        g = entry & ~ROUTE_LPM_TBL8_FLAG;
+        if (memcmp(lpm->tbl8[g]->entries, entries, sizeof(entries)) != 0) {
+            if ((group = own_group(bld, (size_t)g)) == NULL) {
+                return -1;
+            }
+            memcpy(group->entries, entries, sizeof(entries));
+        }
+        return 0;
+    }
+
+    if ((group = malloc(sizeof(*group))) == NULL) {
+        return -1;
+    }
+    if ((g = alloc_group(bld)) < 0) {
+        free(group);
+        return -1;
+    }
+    atomic_init(&group->refs, 1);
+    memcpy(group->entries, entries, sizeof(entries));
+    lpm->tbl8[g] = group;
+    return fill24(bld, i, i + 1, (uint16_t)(ROUTE_LPM_TBL8_FLAG | g));
+}
+
+/*
+ * Repaints the tbl24 range of prefix `dst`/`prefixlen` (at most /24)
+ * from prefixes4. Entries are swept in address order with a stack of
+ * the prefixes covering the current one, so each is written at most
+ * once, with its final value.
+ */
+static int
+repaint4(struct build *bld, uint32_t dst, int prefixlen)
+{
+    const struct route_lpm_prefix4 *p = bld->lpm->prefixes4, *cover;
+    const size_t n = bld->lpm->nprefixes4;
+    const uint64_t limit = (uint64_t)dst + ((uint64_t)1 << (32 - prefixlen));
+    struct {
+        size_t end;
+        uint16_t value;
+    } stack[26];
+    size_t i, j, pos = dst >> 8, at;
+    int top = 0, len;
+
+    // The range starts out with the longest prefix covering all of it
+    stack[0].end = pos + ((size_t)1 << (24 - prefixlen));
+    stack[0].value = 0;
+    for (len = prefixlen - 1; len >= 0; len--) {
+        if ((cover = find_prefix4(p, n, dst & mask4(len), len)) != NULL) {
+            stack[0].value = cover->nexthop;
+            break;
+        }
+    }
+
+    for (i = lower_bound4(p, n, dst); i < n && p[i].dst < limit; i++) {
+        if (p[i].prefixlen < prefixlen) {
+            continue;
+        }
+        at = p[i].dst >> 8;
+        while (stack[top].end <= at) {
+            if (fill24(bld, pos, stack[top].end, stack[top].value) != 0) {
+                return -1;
+            }
+            pos = stack[top--].end;
+        }
+        if (fill24(bld, pos, at, stack[top].value) != 0) {
+            return -1;
+        }
+        pos = at;
+        if (p[i].prefixlen <= 24) {
+            top++;
+            stack[top].end = at + ((size_t)1 << (24 - p[i].prefixlen));
+            stack[top].value = p[i].nexthop;
+            continue;
+        }
+        // The longer prefixes within this entry share its group
+        for (j = i; j + 1 < n && p[j + 1].dst >> 8 == at; j++) {
+        }
+        if (paint_group(bld, at, stack[top].value, p + i, j - i + 1) != 0) {
+            return -1;
+        }
+        i = j;
+        pos = at + 1;
+    }
+    for (; top >= 0; top--) {
+        if (fill24(bld, pos, stack[top].end, stack[top].value) != 0) {
+            return -1;
+        }
+        pos = stack[top].end;
+    }
+    return 0;
+}
+
+/* Releases the IPv4 part of `lpm` */
+static void
+free4(struct route_lpm *lpm)
+{
+    size_t i;
+
+    if (lpm->tbl24) {
+        for (i = 0; i < ROUTE_LPM_CHUNKS; i++) {
+            release_chunk(lpm->tbl24[i]);
+        }
+    }
+    for (i = 0; i < lpm->tbl8_groups; i++) {
+        release_group(lpm->tbl8[i]);
+    }
+    free(lpm->tbl24);
+    free(lpm->tbl8);
+    free(lpm->prefixes4);
+    free(lpm->nexthops4);
+    lpm->tbl24 = NULL;
+    lpm->tbl8 = NULL;
+    lpm->tbl8_groups = lpm->tbl8_cap = 0;
+    lpm->prefixes4 = NULL;
+    lpm->nprefixes4 = 0;
+    lpm->nexthops4 = NULL;
+    lpm->nnexthops4 = lpm->nexthops4_cap = 0;
+}
+
+/* Starts the IPv4 part of `lpm` as a copy sharing everything with `base` */
+static int
+share4(struct build *bld, const struct route_lpm *base)
+{
+    struct route_lpm *lpm = bld->lpm;
+    size_t i;
+
+    if ((lpm->tbl24 = malloc(ROUTE_LPM_CHUNKS * sizeof(*lpm->tbl24))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < ROUTE_LPM_CHUNKS; i++) {
+        lpm->tbl24[i] = base ? base->tbl24[i] : &empty_chunk;
+        if (lpm->tbl24[i] != &empty_chunk) {
+            atomic_fetch_add(&lpm->tbl24[i]->refs, 1);
+        }
+    }
+    if (base == NULL) {
+        return 0;
+    }
+
+    if (base->tbl8_cap) {
+        if ((lpm->tbl8 = calloc(base->tbl8_cap, sizeof(*lpm->tbl8))) == NULL) {
+            return -1;
+        }
+        lpm->tbl8_cap = base->tbl8_cap;
+        lpm->tbl8_groups = base->tbl8_groups;
+    }
+    for (i = 0; i < base->tbl8_groups; i++) {
+        if ((lpm->tbl8[i] = base->tbl8[i]) != NULL) {
+            atomic_fetch_add(&lpm->tbl8[i]->refs, 1);
+        } else if (drop_group(bld, i) != 0) {
+            return -1;
+        }
+    }
+
+    // Next hop indexes are kept, since the shared entries refer to them
+    if (base->nnexthops4) {
+        if ((lpm->nexthops4 = malloc(base->nnexthops4 * sizeof(*lpm->nexthops4))) == NULL) {
+            return -1;
+        }
+        memcpy(lpm->nexthops4, base->nexthops4, base->nnexthops4 * sizeof(*lpm->nexthops4));
+        lpm->nnexthops4 = lpm->nexthops4_cap = base->nnexthops4;
+    }
+    return 0;
+}
+
+/*
+ * Builds the IPv4 part of `lpm` from the `n` routes of `sorted`, in
+ * compare_routes4() order, repainting only the prefixes whose next hop
+ * differs from `base`. Returns 0, -1 on failure, or -2 when the next hop
+ * indexes carried over from `base` leave no room.
+ */
+static int
+build4(struct build *bld, const struct route_lpm *base, const struct route_entry **sorted, size_t n)
+{
+    struct route_lpm *lpm = bld->lpm;
+    const struct route_lpm_prefix4 *old = base ? base->prefixes4 : NULL;
+    const size_t nold = base ? base->nprefixes4 : 0;
+    size_t i, j, done_first = 0, done_end = 0;
+
+    if (share4(bld, base) != 0) {
+        return -1;
+    }
+    if ((lpm->prefixes4 = malloc((n ? n : 1) * sizeof(*lpm->prefixes4))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        struct route_lpm_prefix4 *p = &lpm->prefixes4[lpm->nprefixes4];
+        uint32_t nh;
+
+        p->dst = prefix4(sorted[i]);
+        p->prefixlen = sorted[i]->prefixlen;
+        p->reserved = 0;
+        // Only the best route of each prefix is indexed
+        if (lpm->nprefixes4 && compare_prefix4(p - 1, p) == 0) {
+            continue;
+        }
+        if ((nh = intern_nexthop(bld, AF_INET, sorted[i])) == 0) {
+            return -1;
+        }
+        if (nh > MAX_ENTRY) {
+            return -2;
+        }
+        p->nexthop = (uint16_t)nh;
+        lpm->nprefixes4++;
+    }
+
+    if (base == NULL) {
+        return repaint4(bld, 0, 0);
+    }
+
+    // Both lists are in address order: merge them for the prefixes
+    // added, removed or moved to another next hop
+    i = j = 0;
+    while (i < nold || j < lpm->nprefixes4) {
+        const struct route_lpm_prefix4 *p;
+        size_t first, end;
+        int c = i == nold ? 1 : j == lpm->nprefixes4 ? -1 :
+                compare_prefix4(&old[i], &lpm->prefixes4[j]);
+
+        if (c < 0) {
+            p = &old[i++];
+        } else if (c > 0) {
+            p = &lpm->prefixes4[j++];
+        } else if (old[i++].nexthop == lpm->prefixes4[j++].nexthop) {
+            continue;
+        } else {
+            p = &lpm->prefixes4[j - 1];
+        }
+        first = p->dst >> 8;
+        end = first + ((size_t)1 << (24 - (p->prefixlen < 24 ? p->prefixlen : 24)));
+        // Prefixes come after those containing them, so a range already
+        // repainted can only contain the ones that follow it
+        if (first >= done_first && end <= done_end) {
+            continue;
+        }
+        if (repaint4(bld, p->prefixlen < 24 ? p->dst : p->dst & ~0xffu,
+                     p->prefixlen < 24 ? p->prefixlen : 24) != 0) {
+            return -1;
+        }
+        done_first = first;
+        done_end = end;
+    }
+    return 0;
+}
+
+/* Returns the index of a new node whose entries are all `fill`, or -1 */
+static long
+new_node6(struct route_lpm *lpm, uint32_t fill)
+{
+    size_t n = lpm->nnodes6, j;
+
+    if (n >= ROUTE_LPM_NODE_FLAG >> 8) {
+        return -1;
+    }
+    if (n == lpm->nodes6_cap) {
+        size_t cap = lpm->nodes6_cap ? lpm->nodes6_cap * 2 : 16;
+        uint32_t *nodes = realloc(lpm->nodes6, cap * 256 * sizeof(*nodes));
+        if (nodes == NULL) {
+            return -1;
+        }
+        lpm->nodes6 = nodes;
+        lpm->nodes6_cap = cap;
+    }
+    for (j = 0; j < 256; j++) {
+        lpm->nodes6[(n << 8) + j] = fill;
+    }
+    lpm->nnodes6++;
+    return (long)n;
+}
+
+static int
+insert6(struct route_lpm *lpm, const struct route_entry *e, uint32_t nh)
+{
+    size_t node = 0, first, count, j;
+    int level, last = e->prefixlen ? (e->prefixlen - 1) / 8 : 0;
+
+    // Walk (and create) the nodes covering the whole bytes of the prefix
+    for (level = 0; level < last; level++) {
+        uint32_t *entry = &lpm->nodes6[(node << 8) + e->dst[level]];
+        if (!(*entry & ROUTE_LPM_NODE_FLAG)) {
+            // Push the shorter prefix covering this entry down into the child
+            long child = new_node6(lpm, *entry);
+            if (child < 0) {
+                return -1;
+            }
+            entry = &lpm->nodes6[(node << 8) + e->dst[level]];
+            *entry = ROUTE_LPM_NODE_FLAG | (uint32_t)child;
+        }
+        node = *entry & ~ROUTE_LPM_NODE_FLAG;
+    }
+
+    // Expand the remaining bits of the prefix over a range of entries
+    count = (size_t)1 << (8 * (last + 1) - e->prefixlen);
+    first = e->dst[last] & ~(count - 1);
+    for (j = first; j < first + count; j++) {
+        // Routes are inserted shortest first, so no child exists below yet
+        lpm->nodes6[(node << 8) + j] = nh;
+    }
+    return 0;
+}
+
+/* Builds the IPv6 trie from the `n` routes of `sorted`, in compare_routes() order */
+static int
+build6(struct build *bld, const struct route_entry **sorted, size_t n)
+{
+    size_t i;
+
+    if (new_node6(bld->lpm, 0) < 0) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        const struct route_entry *e = sorted[i];
+        uint32_t nh;
+
+        // Only the best route of each prefix is indexed
+        if (i > 0 && sorted[i - 1]->prefixlen == e->prefixlen &&
+            memcmp(sorted[i - 1]->dst, e->dst, sizeof(e->dst)) == 0) {
+            continue;
+        }
+        if ((nh = intern_nexthop(bld, AF_INET6, e)) == 0 || nh >= ROUTE_LPM_NODE_FLAG ||
+            insert6(bld->lpm, e, nh) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void
+route_lpm_free(struct route_lpm *lpm)
+{
+    free4(lpm);
+    free(lpm->nodes6);
+    free(lpm->nexthops6);
+    memset(lpm, 0, sizeof(*lpm));
+}
+
+int
+route_lpm_update(struct route_lpm *lpm, const struct route_lpm *base,
+                 const struct route_entry *routes, size_t count)
+{
+    const struct route_entry **sorted;
+    struct build bld;
+    size_t i, n4 = 0, n6 = 0;
+    int rc;
+
+    memset(lpm, 0, sizeof(*lpm));
+    memset(&bld, 0, sizeof(bld));
+    bld.lpm = lpm;
+    if (base && base->tbl24 == NULL) {
+        base = NULL;
+    }
+
+    if ((sorted = malloc((count ? count : 1) * sizeof(*sorted))) == NULL) {
+        return -1;
+    }
+    // IPv4 routes first, then IPv6 from the end
+    for (i = 0; i < count; i++) {
+        const struct route_entry *e = &routes[i];
+        if (!(e->flags & ROUTE_F_UP)) {
+            continue;
+        }
+        if (e->family == AF_INET && e->prefixlen <= 32) {
+            sorted[n4++] = e;
+        } else if (e->family == AF_INET6 && e->prefixlen <= 128) {
+            sorted[count - ++n6] = e;
+        }
+    }
+    qsort(sorted, n4, sizeof(*sorted), compare_routes4);
+    qsort(sorted + count - n6, n6, sizeof(*sorted), compare_routes);
+
+    rc = build4(&bld, base, sorted, n4);
+    if (rc == -2) {
+        // Start the next hops over, leaving out those no route uses anymore
+        free4(lpm);
+        free(bld.slots);
+        bld.slots = NULL;
+        bld.nslots = 0;
+        bld.nfree8 = 0;
+        rc = build4(&bld, NULL, sorted, n4);
+    }
+    if (rc == 0) {
+        rc = build6(&bld, sorted + count - n6, n6);
+    }
+
+    free(bld.slots);
+    free(bld.free8);
+    free(sorted);
+    if (rc != 0) {
+        route_lpm_free(lpm);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+int
+route_lpm_build(struct route_lpm *lpm, const struct route_entry *routes, size_t count)
+{
+    return route_lpm_update(lpm, NULL, routes, count);
+}
+
+const struct route_nexthop *
+route_lpm_lookup(const struct route_lpm *lpm, int family, const void *addr)
+{
+    if (family == AF_INET) {
+        uint32_t a;
+        memcpy(&a, addr, sizeof(a));
+        return route_lpm_lookup4(lpm, a);
+    }
+    if (family == AF_INET6) {
+        return route_lpm_lookup6(lpm, addr);
+    }
+    return NULL;
+}
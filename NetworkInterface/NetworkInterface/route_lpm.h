@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Longest-prefix-match index answering "which interface and gateway
+ * carry traffic to X?" for arbitrary IPv4 and IPv6 destinations.
+ *
+ * IPv4 uses DIR-24-8: a 2^24 entry first level indexed by the top 24
+ * bits of the address, and 256 entry second level groups for prefixes
+ * longer than /24. A lookup is two or three memory reads: the first
+ * level is split into chunks of ROUTE_LPM_CHUNK_SIZE entries.
+ *
+ * IPv6 uses a multibit trie with an 8 bit stride and leaf pushing
+ * (controlled prefix expansion), so a lookup reads at most one entry
+ * per address byte and stops at the first leaf.
+ *
+ * Next hops are a gateway and an interface, deduplicated within each
+ * family, so the many routes through one gateway share a next hop.
+ * Reject routes are indexed like the others, since they still hide
+ * less specific routes, with a next hop marked as rejecting.
+ *
+ * The index is immutable once built. When the route table's generation
+ * changes, route_lpm_update() derives a new index from the previous
+ * one: the IPv4 chunks and groups are reference counted and shared
+ * between the two, and only the ranges of prefixes whose next hop
+ * changed are repainted, on copies of the chunks they touch.
+ */
+
+#ifndef route_lpm_h
+#define route_lpm_h
+
+#include "route_table.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct route_nexthop {
+    uint32_t ifindex;
+    uint8_t gateway_family;     /* AF_UNSPEC for directly connected routes */
+    uint8_t reject;             /* 1 for ROUTE_F_REJECT routes: traffic is dropped */
+    uint8_t reserved[2];
+    uint8_t gateway[16];
+};
+
+/* DIR-24-8 entries: bit 15 set means the low bits index a tbl8 group */
+#define ROUTE_LPM_TBL8_FLAG     0x8000u
+/* Trie entries: bit 31 set means the low bits index a child node */
+#define ROUTE_LPM_NODE_FLAG     0x80000000u
+
+#define ROUTE_LPM_CHUNK_BITS    12
+#define ROUTE_LPM_CHUNK_SIZE    (1u << ROUTE_LPM_CHUNK_BITS)
+#define ROUTE_LPM_CHUNKS        (1u << (24 - ROUTE_LPM_CHUNK_BITS))
+
+/* Part of tbl24, shared by the indexes updated from one another */
+struct route_lpm_chunk {
+    _Atomic unsigned refs;
+    uint16_t entries[ROUTE_LPM_CHUNK_SIZE];
+};
+
+struct route_lpm_group {
+    _Atomic unsigned refs;
+    uint16_t entries[256];
+};
+
+/* The next hop of the best route for one IPv4 prefix */
+struct route_lpm_prefix4 {
+    uint32_t dst;               /* host byte order, masked to prefixlen */
+    uint8_t prefixlen;
+    uint8_t reserved;
+    uint16_t nexthop;           /* index into nexthops4 + 1 */
+};
+
+struct route_lpm {
+    /* IPv4 */
+    struct route_lpm_chunk **tbl24;     /* ROUTE_LPM_CHUNKS chunks, entries nexthop index + 1 or 0 */
+    struct route_lpm_group **tbl8;      /* NULL where unused */
+    size_t tbl8_groups;                 /* highest group index in use + 1 */
+    size_t tbl8_cap;
+    struct route_lpm_prefix4 *prefixes4;    /* sorted by address, then length */
+    size_t nprefixes4;
+    struct route_nexthop *nexthops4;    /* indexes carry over to updated indexes */
+    size_t nnexthops4;
+    size_t nexthops4_cap;
+    /* IPv6 */
+    uint32_t *nodes6;           /* nodes of 256 entries, node 0 is the root */
+    size_t nnodes6;
+    size_t nodes6_cap;
+    struct route_nexthop *nexthops6;
+    size_t nnexthops6;
+    size_t nexthops6_cap;
+};
+
+/*
+ * Builds the index from `count` routes. Where several routes share a
+ * prefix the unscoped one with the lowest priority wins, matching the
+ * kernel's choice for unscoped lookups. Returns 0 or -1 when out of
+ * memory or when there are more than 32767 distinct IPv4 next hops or
+ * tbl8 groups.
+ */
+int
+route_lpm_build(struct route_lpm *lpm, const struct route_entry *routes, size_t count);
+
+/*
+ * Builds into `lpm` the index of `count` routes, as route_lpm_build()
+ * does, from `base`, the index of a previous version of the same table.
+ * `base` is not modified and may be freed in any order; the work done is
+ * proportional to the prefixes whose next hop changed. `base` may be
+ * NULL. Returns 0 or -1 as route_lpm_build().
+ */
+int
+route_lpm_update(struct route_lpm *lpm, const struct route_lpm *base,
+                 const struct route_entry *routes, size_t count);
+
+void
+route_lpm_free(struct route_lpm *lpm);
+
+/* `addr` in network byte order (in_addr.s_addr). Returns NULL for no route. */
+static inline const struct route_nexthop *
+route_lpm_lookup4(const struct route_lpm *lpm, uint32_t addr)
+{
+    const uint8_t *b = (const uint8_t *)&addr;
+    uint32_t a = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    uint16_t entry;
+
+    if (lpm->tbl24 == NULL) {
+        return NULL;
+    }
+    entry = lpm->tbl24[a >> (8 + ROUTE_LPM_CHUNK_BITS)]->entries[(a >> 8) & (ROUTE_LPM_CHUNK_SIZE - 1)];
+    if (entry & ROUTE_LPM_TBL8_FLAG) {
+        entry = lpm->tbl8[entry & ~ROUTE_LPM_TBL8_FLAG]->entries[a & 0xff];
+    }
+    return entry ? &lpm->nexthops4[entry - 1] : NULL;
+}
+
+/* `addr` is an in6_addr. Returns NULL for no route. */
+static inline const struct route_nexthop *
+route_lpm_lookup6(const struct route_lpm *lpm, const uint8_t addr[16])
+{
+    const uint32_t *node = lpm->nodes6;
+    uint32_t entry;
+    int i;
+
+    if (node == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < 16; i++) {
+        entry = node[addr[i]];
+        if (!(entry & ROUTE_LPM_NODE_FLAG)) {
+            return entry ? &lpm->nexthops6[entry - 1] : NULL;
+        }
+        node = lpm->nodes6 + ((size_t)(entry & ~ROUTE_LPM_NODE_FLAG) << 8);
+    }
+    return NULL;
+}
+
+/* Dispatches on `family` (AF_INET or AF_INET6); `addr` is an in_addr or in6_addr */
+const struct route_nexthop *
+route_lpm_lookup(const struct route_lpm *lpm, int family, const void *addr);
+
+#endif /* route_lpm_h */
@@ -0,0 +1,568 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_netlink.h
+ */
+
+#ifdef __linux__
+
+#include "route_netlink.h"
+
+#include "netif_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/rtnetlink.h>
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK             270
+#endif
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK  12      /* Linux 4.20 */
+#endif
+
+int
+route_netlink_open(unsigned groups)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+route_netlink_open_route_events(void)
+{
+    int fd = route_netlink_open(RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE | RTMGRP_LINK);
+
+    if (fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+route_netlink_request_dump(int fd, int family, uint32_t seq)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct rtmsg rtm;
+    } req;
+    struct sockaddr_nl kernel;
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = sizeof(req);
+    req.nlh.nlmsg_type = RTM_GETROUTE;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = seq;
+    req.rtm.rtm_family = (unsigned char)family;
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(fd, &req, sizeof(req), 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Decodes the nexthops of an ECMP route into `e`: the first one the
+ * kernel has not marked dead, or the first when all are. Returns 0, or
+ * -1 when the attribute is malformed.
+ */
+static int
+parse_multipath(const struct rtattr *multipath, size_t addrlen, struct route_entry *e)
+{
+    const struct rtnexthop *nh, *chosen = NULL;
+    const struct rtattr *rta;
+    int len = (int)RTA_PAYLOAD(multipath), alen;
+
+    for (nh = RTA_DATA(multipath); RTNH_OK(nh, len); nh = RTNH_NEXT(nh)) {
+        if (chosen == NULL || ((chosen->rtnh_flags & RTNH_F_DEAD) && !(nh->rtnh_flags & RTNH_F_DEAD))) {
+            chosen = nh;
+        }
+        len -= (int)RTNH_ALIGN(nh->rtnh_len);
+    }
+    if (chosen == NULL) {
+        return -1;
+    }
+    e->ifindex = (uint32_t)chosen->rtnh_ifindex;
+    e->flags |= ROUTE_F_MULTIPATH;
+    alen = (int)chosen->rtnh_len - (int)RTNH_LENGTH(0);
+    for (rta = RTNH_DATA(chosen); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+        if (rta->rta_type == RTA_GATEWAY) {
+            if (RTA_PAYLOAD(rta) != addrlen) {
+                return -1;
+            }
+            memcpy(e->gateway, RTA_DATA(rta), addrlen);
+            e->gateway_family = e->family;
+            e->flags |= ROUTE_F_GATEWAY;
+        }
+    }
+    return 0;
+}
+
+int
+route_netlink_parse_route(const struct nlmsghdr *nlh, struct route_entry *e)
+{
+    const struct rtmsg *rtm;
+    const struct rtattr *rta;
+    size_t addrlen;
+    int len;
+    uint32_t table;
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm))) {
+        return -1;
+    }
+    rtm = NLMSG_DATA(nlh);
+    if (rtm->rtm_family == AF_INET) {
+        addrlen = 4;
+    } else if (rtm->rtm_family == AF_INET6) {
+        addrlen = 16;
+    } else {
+        return 1;
+    }
+    if (rtm->rtm_flags & RTM_F_CLONED) {
+        return 1;
+    }
+    if (rtm->rtm_dst_len > addrlen * 8) {
+        return -1;
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->family = rtm->rtm_family;
+    e->prefixlen = rtm->rtm_dst_len;
+    e->kernel_flags = rtm->rtm_flags;
+    e->flags = ROUTE_F_UP;
+    if (rtm->rtm_dst_len == addrlen * 8) {
+        e->flags |= ROUTE_F_HOST;
+    }
+    if (rtm->rtm_protocol == RTPROT_STATIC || rtm->rtm_protocol == RTPROT_BOOT) {
+        e->flags |= ROUTE_F_STATIC;
+    }
+    switch (rtm->rtm_type) {
+        case RTN_UNICAST:
+            break;
+        case RTN_BLACKHOLE:
+        case RTN_UNREACHABLE:
+        case RTN_PROHIBIT:
+            e->flags |= ROUTE_F_REJECT;
+            break;
+        default:
+            // local, broadcast, multicast, ... live outside the main table
+            return 1;
+    }
+    table = rtm->rtm_table;
+
+    len = (int)RTM_PAYLOAD(nlh);
+    for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+            case RTA_DST:
+                if (RTA_PAYLOAD(rta) != addrlen) {
+                    return -1;
+                }
+                memcpy(e->dst, RTA_DATA(rta), addrlen);
+                break;
+            case RTA_GATEWAY:
+                if (RTA_PAYLOAD(rta) != addrlen) {
+                    return -1;
+                }
+                memcpy(e->gateway, RTA_DATA(rta), addrlen);
+                e->gateway_family = rtm->rtm_family;
+                e->flags |= ROUTE_F_GATEWAY;
+                break;
+            case RTA_OIF:
+                if (RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+                    memcpy(&e->ifindex, RTA_DATA(rta), sizeof(uint32_t));
+                }
+                break;
+            case RTA_MULTIPATH:
+                if (parse_multipath(rta, addrlen, e) != 0) {
+                    return -1;
+                }
+                break;
+            case RTA_PRIORITY:
+                if (RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+                    memcpy(&e->priority, RTA_DATA(rta), sizeof(uint32_t));
+                }
+                break;
+            case RTA_TABLE:
+                if (RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+                    memcpy(&table, RTA_DATA(rta), sizeof(uint32_t));
+                }
+                break;
+            case RTA_METRICS: {
+                const struct rtattr *m;
+                int mlen = (int)RTA_PAYLOAD(rta);
+                for (m = RTA_DATA(rta); RTA_OK(m, mlen); m = RTA_NEXT(m, mlen)) {
+                    uint32_t value;
+                    if (RTA_PAYLOAD(m) < sizeof(value)) {
+                        continue;
+                    }
+                    memcpy(&value, RTA_DATA(m), sizeof(value));
+                    if (m->rta_type == RTAX_MTU) {
+                        e->mtu = value;
+                    } else if (m->rta_type == RTAX_RTT) {
+                        e->rtt = value;
+                    } else if (m->rta_type == RTAX_RTTVAR) {
+                        e->rttvar = value;
+                    } else if (m->rta_type == RTAX_HOPLIMIT) {
+                        e->hopcount = value;
+                    }
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    if (table != RT_TABLE_MAIN) {
+        return 1;
+    }
+    return 0;
+}
+
+int
+route_netlink_read_reply(int fd, uint32_t seq, route_netlink_msg_cb cb, void *ctx)
+{
+    char *buf;
+    ssize_t n;
+    int rc = 0, done = 0;
+
+    if ((buf = malloc(ROUTE_NETLINK_BUFSIZE)) == NULL) {
+        return -1;
+    }
+    while (!done) {
+        const struct nlmsghdr *nlh;
+        int len;
+
+        n = recv(fd, buf, ROUTE_NETLINK_BUFSIZE, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        netif_stats_add(NETIF_BYTES_DUMPED, (uint64_t)n);
+        len = (int)n;
+        for (nlh = (const struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_seq != seq) {
+                continue;
+            }
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                done = 1;
+                break;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                const struct nlmsgerr *e = NLMSG_DATA(nlh);
+                if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*e))) {
+                    errno = EPROTO;
+                    rc = -1;
+                } else if (e->error != 0) {
+                    errno = -e->error;
+                    rc = -1;
+                }
+                done = 1;
+                break;
+            }
+            if ((rc = cb(nlh, ctx)) != 0) {
+                done = 1;
+                break;
+            }
+            if (!(nlh->nlmsg_flags & NLM_F_MULTI)) {
+                done = 1;
+            }
+        }
+    }
+    free(buf);
+    return rc;
+}
+
+static int
+load_route(const struct nlmsghdr *nlh, void *ctx)
+{
+    struct route_table *table = ctx;
+    struct route_entry e;
+
+    if (nlh->nlmsg_type != RTM_NEWROUTE) {
+        return 0;
+    }
+    netif_stats_add(NETIF_ROUTES_SCANNED, 1);
+    if (route_netlink_parse_route(nlh, &e) == 0 && route_table_upsert(table, &e) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+int
+route_netlink_load_table(struct route_table *table)
+{
+    static const uint32_t seq = 1;
+    uint64_t start = netif_stats_now();
+    int fd, rc;
+
+    if ((fd = route_netlink_open(0)) < 0) {
+        return -1;
+    }
+    route_table_clear(table);
+    rc = route_netlink_request_dump(fd, AF_UNSPEC, seq);
+    if (rc == 0) {
+        rc = route_netlink_read_reply(fd, seq, load_route, table);
+    }
+    close(fd);
+    netif_stats_add(NETIF_NETLINK_DUMPS, 1);
+    netif_stats_record_since(NETIF_NETLINK_DUMP_NS, start);
+    return rc == 0 ? (int)table->count : -1;
+}
+
+struct walk {
+    route_netlink_route_cb cb;
+    void *ctx;
+};
+
+static int
+walk_route(const struct nlmsghdr *nlh, void *ctx)
+{
+    struct walk *w = ctx;
+    struct route_entry e;
+    int rc;
+
+    if (nlh->nlmsg_type != RTM_NEWROUTE) {
+        return 0;
+    }
+    netif_stats_add(NETIF_ROUTES_SCANNED, 1);
+    if ((rc = route_netlink_parse_route(nlh, &e)) != 0) {
+        if (rc < 0) {
+            errno = EBADMSG;
+            return -1;
+        }
+        return 0;
+    }
+    return w->cb(&e, w->ctx);
+}
+
+int
+route_netlink_walk_routes(int family, route_netlink_route_cb cb, void *ctx)
+{
+    static const uint32_t seq = 1;
+    struct walk w = { cb, ctx };
+    uint64_t start = netif_stats_now();
+    int fd, rc, saved;
+
+    if ((fd = route_netlink_open(0)) < 0) {
+        return -1;
+    }
+    rc = route_netlink_request_dump(fd, family, seq);
+    if (rc == 0) {
+        rc = route_netlink_read_reply(fd, seq, walk_route, &w);
+    }
+    saved = errno;
+    close(fd);
+    errno = saved;
+    netif_stats_add(NETIF_NETLINK_DUMPS, 1);
+    netif_stats_record_since(NETIF_NETLINK_DUMP_NS, start);
+    return rc;
+}
+
+struct defaults {
+    struct route_entry *routes;
+    size_t max;
+    size_t count;
+};
+
+static int
+collect_default(const struct nlmsghdr *nlh, void *ctx)
+{
+    static const uint8_t unspecified[16] = { 0 };
+    struct defaults *d = ctx;
+    struct route_entry e;
+    int rc;
+
+    if (nlh->nlmsg_type != RTM_NEWROUTE) {
+        return 0;
+    }
+    netif_stats_add(NETIF_ROUTES_SCANNED, 1);
+    if ((rc = route_netlink_parse_route(nlh, &e)) != 0) {
+        if (rc < 0) {
+            errno = EBADMSG;
+            return -1;
+        }
+        return 0;
+    }
+    if (e.prefixlen != 0) {
+        // The IPv4 FIB trie is dumped in key order: every route with
+        // destination 0.0.0.0 comes before any other
+        if (e.family == AF_INET && memcmp(e.dst, unspecified, 4) != 0) {
+            return 1;
+        }
+        return 0;
+    }
+    if (d->count < d->max) {
+        d->routes[d->count] = e;
+    }
+    d->count++;
+    return 0;
+}
+
+int
+route_netlink_get_defaults(int family, struct route_entry *routes, size_t max)
+{
+    static const uint32_t seq = 1;
+    struct {
+        struct nlmsghdr nlh;
+        struct rtmsg rtm;
+        struct rtattr rta;
+        uint32_t table;
+    } req;
+    struct sockaddr_nl kernel;
+    struct defaults d;
+    uint64_t start = netif_stats_now();
+    int fd, one = 1, rc;
+
+    if (family != AF_INET && family != AF_INET6) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    if ((fd = route_netlink_open(0)) < 0) {
+        return -1;
+    }
+    // Older kernels ignore the filters, the results are the same
+    if (setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one, sizeof(one)) < 0 &&
+        errno != ENOPROTOOPT) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_len = sizeof(req);
+    req.nlh.nlmsg_type = RTM_GETROUTE;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = seq;
+    req.rtm.rtm_family = (unsigned char)family;
+    req.rtm.rtm_table = RT_TABLE_MAIN;
+    req.rtm.rtm_type = RTN_UNICAST;
+    req.rta.rta_len = RTA_LENGTH(sizeof(req.table));
+    req.rta.rta_type = RTA_TABLE;
+    req.table = RT_TABLE_MAIN;
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    memset(&d, 0, sizeof(d));
+    d.routes = routes;
+    d.max = max;
+    rc = (int)sendto(fd, &req, sizeof(req), 0, (struct sockaddr *)&kernel, sizeof(kernel));
+    if (rc >= 0) {
+        // A positive return stops reading early; closing the socket
+        // abandons the rest of the dump
+        rc = route_netlink_read_reply(fd, seq, collect_default, &d);
+    }
+    netif_stats_add(NETIF_NETLINK_DUMPS, 1);
+    netif_stats_record_since(NETIF_NETLINK_DUMP_NS, start);
+    if (rc < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    close(fd);
+    return (int)d.count;
+}
+
+/* Prunes the routes of a link that is down or deleted */
+static int
+apply_link(struct route_table *table, const struct nlmsghdr *nlh)
+{
+    const struct ifinfomsg *ifi;
+
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi))) {
+        return -1;
+    }
+    ifi = NLMSG_DATA(nlh);
+    if (nlh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_UP)) {
+        return 0;
+    }
+    return route_netlink_prune_link(table, (unsigned)ifi->ifi_index) > 0;
+}
+
+int
+route_netlink_apply(struct route_table *table, const struct nlmsghdr *nlh)
+{
+    struct route_entry e;
+    int rc;
+
+    if (nlh->nlmsg_type == RTM_NEWLINK || nlh->nlmsg_type == RTM_DELLINK) {
+        return apply_link(table, nlh);
+    }
+    if (nlh->nlmsg_type != RTM_NEWROUTE && nlh->nlmsg_type != RTM_DELROUTE) {
+        return 0;
+    }
+    if ((rc = route_netlink_parse_route(nlh, &e)) != 0) {
+        return rc < 0 ? -1 : 0;
+    }
+    if (nlh->nlmsg_type == RTM_DELROUTE) {
+        return route_table_remove(table, &e);
+    }
+    rc = route_table_upsert(table, &e);
+    return rc < 0 ? -1 : rc > 0;
+}
+
+int
+route_netlink_prune_link(struct route_table *table, unsigned ifindex)
+{
+    size_t i = 0;
+    int removed = 0;
+
+    if (ifindex == 0) {
+        return 0;
+    }
+    while (i < table->count) {
+        const struct route_entry *e = &table->entries[i];
+        if (e->family == AF_INET && e->ifindex == ifindex && !(e->flags & ROUTE_F_MULTIPATH)) {
+            struct route_entry key = *e;
+            // The last entry moves into slot `i`
+            removed += route_table_remove(table, &key);
+            continue;
+        }
+        i++;
+    }
+    return removed;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Linux rtnetlink routing table access: the counterpart of the
+ * PF_ROUTE code in route_dump.c. Only built on Linux.
+ *
+ * NOTE: only <linux/netlink.h> is included here so this header can be
+ * used next to route_dump.h; <linux/rtnetlink.h> collides with it.
+ */
+
+#ifndef route_netlink_h
+#define route_netlink_h
+
+#ifdef __linux__
+
+#include "route_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/netlink.h>
+
+/* Receive buffer size recommended for NETLINK_ROUTE dumps */
+#define ROUTE_NETLINK_BUFSIZE   32768
+
+/*
+ * Opens a NETLINK_ROUTE socket subscribed to the RTMGRP_* multicast
+ * `groups` (0 for a request-only socket). Returns the fd or -1.
+ */
+int
+route_netlink_open(unsigned groups);
+
+/*
+ * Opens a non-blocking NETLINK_ROUTE socket subscribed to IPv4 and
+ * IPv6 route change notifications and to link changes, the latter for
+ * route_netlink_apply_link(). Returns the fd or -1.
+ */
+int
+route_netlink_open_route_events(void);
+
+/*
+ * Requests a dump of the routes of `family` (AF_UNSPEC for all) with
+ * sequence number `seq`. Returns 0 or -1 with errno set.
+ */
+int
+route_netlink_request_dump(int fd, int family, uint32_t seq);
+
+/*
+ * Decodes a RTM_NEWROUTE/RTM_DELROUTE message into `e`. Of the
+ * nexthops of an ECMP route only the first live one is kept, and the
+ * route is flagged ROUTE_F_MULTIPATH.
+ * Returns 0 on success, 1 for routes that are not tracked (tables other
+ * than main, cloned/cache entries, non-IP families) and -1 when the
+ * message is malformed.
+ */
+int
+route_netlink_parse_route(const struct nlmsghdr *nlh, struct route_entry *e);
+
+typedef int (*route_netlink_msg_cb)(const struct nlmsghdr *nlh, void *ctx);
+
+/*
+ * Reads the reply to the request with sequence number `seq`, calling
+ * `cb` for every message until NLMSG_DONE (or, for non-dump requests,
+ * the first reply). Messages with other sequence numbers are ignored.
+ * Returns 0 on success or -1 with errno set; a non-zero return from
+ * `cb` stops reading and is returned.
+ */
+int
+route_netlink_read_reply(int fd, uint32_t seq, route_netlink_msg_cb cb, void *ctx);
+
+typedef int (*route_netlink_route_cb)(const struct route_entry *e, void *ctx);
+
+/*
+ * Dumps the routes of `family` (AF_UNSPEC for all), calling `cb` for
+ * each tracked route as it is decoded; nothing is kept beyond the
+ * ROUTE_NETLINK_BUFSIZE receive buffer. Returns 0 or -1 with errno set;
+ * a non-zero return from `cb` stops the dump and is returned.
+ */
+int
+route_netlink_walk_routes(int family, route_netlink_route_cb cb, void *ctx);
+
+/*
+ * Replaces the contents of `table` with a fresh dump of the main table.
+ * Returns the number of routes or -1.
+ */
+int
+route_netlink_load_table(struct route_table *table);
+
+/*
+ * Fetches the default routes of `family` (AF_INET or AF_INET6) from the
+ * main table without transferring the rest of it. Up to `max` routes
+ * are stored in `routes`. Returns the number of default routes found,
+ * which may exceed `max`, or -1 with errno set.
+ *
+ * NOTE: the request is sent with NETLINK_GET_STRICT_CHK so the kernel
+ * only dumps unicast routes of the main table. Strict checking rejects
+ * dump requests with a non-zero rtm_dst_len, so the prefix length is
+ * checked here; IPv4 defaults come first in the dump and reading stops
+ * at the first other prefix, which keeps a full BGP table to a single
+ * receive.
+ */
+int
+route_netlink_get_defaults(int family, struct route_entry *routes, size_t max);
+
+/*
+ * Applies a RTM_NEWROUTE or RTM_DELROUTE notification to `table`, or a
+ * RTM_NEWLINK or RTM_DELLINK one by pruning the routes of a link that
+ * is down or deleted as route_netlink_prune_link() does.
+ * Returns 1 when the table changed, 0 when it did not and -1 when the
+ * message is malformed or memory runs out.
+ */
+int
+route_netlink_apply(struct route_table *table, const struct nlmsghdr *nlh);
+
+/*
+ * Removes the IPv4 routes through `ifindex`, never those without an
+ * interface such as blackholes. ECMP routes are kept: the kernel only
+ * marks their nexthop dead. Returns the number removed.
+ *
+ * NOTE: Linux flushes the IPv4 routes of a link that goes down or away
+ * without sending RTM_DELROUTE; IPv6 routes are deleted with one.
+ */
+int
+route_netlink_prune_link(struct route_table *table, unsigned ifindex);
+
+#endif /* __linux__ */
+
+#endif /* route_netlink_h */
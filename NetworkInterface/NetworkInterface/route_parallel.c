@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_parallel.h
+ */
+
+#include "route_parallel.h"
+#include "netif_stats.h"
+#include "route_arena.h"
+#include "route_dump.h"
+#include "route_netlink.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct batch_output {
+    struct route_entry *entries;    /* in the decoding worker's arena */
+    size_t count;
+    size_t offset;                  /* into the merged result */
+};
+
+struct decoder;
+
+struct worker {
+    _Atomic size_t next;            /* next batch of this worker's share */
+    size_t end;                     /* end of this worker's share */
+    struct route_arena arena;
+    uint64_t steals;
+    struct decoder *d;
+    unsigned id;
+    int started;
+    pthread_t thread;
+    char pad[64];                   /* keeps neighbouring cursors off one cache line */
+};
+
+struct decoder {
+    const char *buf;
+    int format;
+    const size_t *bounds;           /* nbatches + 1 message offsets */
+    size_t nbatches;
+    size_t messages;
+    route_parallel_filter_fn filter;
+    void *ctx;
+    struct batch_output *out;
+    struct worker *workers;
+    unsigned nworkers;
+    _Atomic int failed;             /* errno of the first failure */
+    /* Between the phases: the workers wait for the merged array */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned decoding;              /* workers still decoding */
+    int merging;                    /* 1 once `merged` is ready, -1 on failure */
+    struct route_entry *merged;
+    _Atomic size_t merge_next;      /* next batch to copy */
+};
+
+/*
+ * Records the offset of every ROUTE_PARALLEL_BATCH-th message, and of
+ * the end of the dump, in a new array. Returns the number of batches or
+ * -1 with errno set.
+ */
+static long
+index_batches(const char *buf, size_t len, int format, size_t **bounds, size_t *messages)
+{
+    size_t off = 0, count = 0, nbounds = 0, cap = 16, msglen, *b, *grown;
+
+    if ((b = malloc(cap * sizeof(*b))) == NULL) {
+        return -1;
+    }
+    while (off < len) {
+        if (count % ROUTE_PARALLEL_BATCH == 0) {
+            // One spare slot for the end of the dump
+            if (nbounds + 1 == cap) {
+                if ((grown = realloc(b, 2 * cap * sizeof(*b))) == NULL) {
+                    free(b);
+                    return -1;
+                }
+                b = grown;
+                cap *= 2;
+            }
+            b[nbounds++] = off;
+        }
+        if (format == ROUTE_PARALLEL_BSD_DUMP) {
+            const struct rt_msghdr2 *rtm = (const struct rt_msghdr2 *)(buf + off);
+
+            if (len - off < sizeof(*rtm) || rtm->rtm_msglen < sizeof(*rtm) ||
+                rtm->rtm_msglen > len - off) {
+                goto malformed;
+            }
+            msglen = rtm->rtm_msglen;
+        } else {
+#ifdef __linux__
+            const struct nlmsghdr *nlh = (const struct nlmsghdr *)(buf + off);
+
+            if (len - off < sizeof(*nlh) || nlh->nlmsg_len < sizeof(*nlh) ||
+                nlh->nlmsg_len > len - off) {
+                goto malformed;
+            }
+            // The last message need not be padded
+            msglen = NLMSG_ALIGN(nlh->nlmsg_len);
+            if (msglen > len - off) {
+                msglen = len - off;
+            }
+#else
+            free(b);
+            errno = ENOTSUP;
+            return -1;
+#endif
+        }
+        off += msglen;
+        count++;
+    }
+    b[nbounds] = len;
+    *bounds = b;
+    *messages = count;
+    return (long)nbounds;
+
+malformed:
+    free(b);
+    errno = EBADMSG;
+    return -1;
+}
+
+static void
+fail(struct decoder *d, int error)
+{
+    int expected = 0;
+
+    atomic_compare_exchange_strong(&d->failed, &expected, error);
+}
+
+/* Decodes batch `i` into `w`'s arena */
+static void
+decode_batch(struct decoder *d, struct worker *w, size_t i)
+{
+    struct batch_output *out = &d->out[i];
+    size_t start = d->bounds[i], end = d->bounds[i + 1];
+    size_t max = d->messages - i * ROUTE_PARALLEL_BATCH;
+    struct route_entry *e;
+
+    if (max > ROUTE_PARALLEL_BATCH) {
+        max = ROUTE_PARALLEL_BATCH;
+    }
+    e = route_arena_alloc(&w->arena, max * sizeof(*e), alignof(struct route_entry));
+    if (e == NULL) {
+        fail(d, ENOMEM);
+        return;
+    }
+    out->entries = e;
+    out->count = 0;
+
+    if (d->format == ROUTE_PARALLEL_BSD_DUMP) {
+        struct route_dump_iter iter;
+        struct route_view view;
+        int rc;
+
+        route_dump_iter_init(&iter, d->buf + start, end - start);
+        while ((rc = route_dump_iter_next(&iter, &view)) == 1) {
+            if (route_entry_from_view(e, &view) != 0 ||
+                (d->filter && !d->filter(e, d->ctx))) {
+                continue;
+            }
+            out->count++;
+            e++;
+        }
+        if (rc < 0) {
+            fail(d, EBADMSG);
+        }
+    } else {
+#ifdef __linux__
+        const struct nlmsghdr *nlh;
+        size_t off;
+        int rc;
+
+        for (off = start; off < end; off += NLMSG_ALIGN(nlh->nlmsg_len)) {
+            nlh = (const struct nlmsghdr *)(d->buf + off);
+            if (nlh->nlmsg_type < NLMSG_MIN_TYPE) {
+                continue;
+            }
+            if ((rc = route_netlink_parse_route(nlh, e)) < 0) {
+                fail(d, EBADMSG);
+                return;
+            }
+            if (rc != 0 || (d->filter && !d->filter(e, d->ctx))) {
+                continue;
+            }
+            out->count++;
+            e++;
+        }
+#endif
+    }
+}
+
+/* Claims the next batch of `victim`'s share, or returns 0 when it has none left */
+static int
+claim(struct worker *victim, size_t *batch)
+{
+    if (atomic_load_explicit(&victim->next, memory_order_relaxed) >= victim->end) {
+        return 0;
+    }
+    *batch = atomic_fetch_add_explicit(&victim->next, 1, memory_order_relaxed);
+    return *batch < victim->end;
+}
+
+/* Copies batches into the merged array, at their offsets, until none is left */
+static void
+merge_batches(struct decoder *d)
+{
+    size_t i;
+
+    while ((i = atomic_fetch_add_explicit(&d->merge_next, 1, memory_order_relaxed)) < d->nbatches) {
+        memcpy(d->merged + d->out[i].offset, d->out[i].entries,
+               d->out[i].count * sizeof(struct route_entry));
+    }
+}
+
+static void
+decode_batches(struct worker *w)
+{
+    struct decoder *d = w->d;
+    unsigned i;
+    size_t batch = 0;
+
+    while (!atomic_load_explicit(&d->failed, memory_order_relaxed)) {
+        if (claim(w, &batch)) {
+            decode_batch(d, w, batch);
+            continue;
+        }
+        // Own share done: steal, starting with the next worker
+        for (i = 1; i < d->nworkers; i++) {
+            if (claim(&d->workers[(w->id + i) % d->nworkers], &batch)) {
+                break;
+            }
+        }
+        if (i == d->nworkers) {
+            break;
+        }
+        w->steals++;
+        decode_batch(d, w, batch);
+    }
+}
+
+static void *
+worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct decoder *d = w->d;
+    int merging;
+
+    decode_batches(w);
+    pthread_mutex_lock(&d->lock);
+    if (--d->decoding == 0) {
+        pthread_cond_broadcast(&d->cond);
+    }
+    while (d->merging == 0) {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    merging = d->merging;
+    pthread_mutex_unlock(&d->lock);
+    if (merging > 0) {
+        merge_batches(d);
+    }
+    return NULL;
+}
+
+static unsigned
+default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n < 1 ? 1 : n > ROUTE_PARALLEL_MAX_THREADS ? ROUTE_PARALLEL_MAX_THREADS : (unsigned)n;
+}
+
+int
+route_parallel_decode(const void *buf, size_t len, int format, unsigned nthreads,
+                      route_parallel_filter_fn filter, void *ctx,
+                      struct route_parallel_result *result)
+{
+    struct decoder d;
+    size_t *bounds, i, total;
+    uint64_t start;
+    unsigned k;
+    long nbatches;
+    int error;
+
+    memset(result, 0, sizeof(*result));
+    if (format != ROUTE_PARALLEL_BSD_DUMP && format != ROUTE_PARALLEL_NETLINK) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    start = netif_stats_now();
+    if ((nbatches = index_batches(buf, len, format, &bounds, &result->messages)) < 0) {
+        return -1;
+    }
+    result->index_ns = netif_stats_now() - start;
+
+    start = netif_stats_now();
+    memset(&d, 0, sizeof(d));
+    d.buf = buf;
+    d.format = format;
+    d.bounds = bounds;
+    d.nbatches = (size_t)nbatches;
+    d.messages = result->messages;
+    d.filter = filter;
+    d.ctx = ctx;
+    atomic_init(&d.failed, 0);
+    atomic_init(&d.merge_next, 0);
+    if (nthreads == 0) {
+        nthreads = default_threads();
+    } else if (nthreads > ROUTE_PARALLEL_MAX_THREADS) {
+        nthreads = ROUTE_PARALLEL_MAX_THREADS;
+    }
+    d.nworkers = d.nbatches < nthreads ? (unsigned)d.nbatches : nthreads;
+    if (d.nworkers == 0) {
+        d.nworkers = 1;
+    }
+    d.out = calloc(d.nbatches ? d.nbatches : 1, sizeof(*d.out));
+    d.workers = calloc(d.nworkers, sizeof(*d.workers));
+    if (d.out == NULL || d.workers == NULL) {
+        free(d.out);
+        free(d.workers);
+        free(bounds);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (k = 0; k < d.nworkers; k++) {
+        struct worker *w = &d.workers[k];
+        atomic_init(&w->next, d.nbatches * k / d.nworkers);
+        w->end = d.nbatches * (k + 1) / d.nworkers;
+        route_arena_init(&w->arena, 0);
+        w->d = &d;
+        w->id = k;
+    }
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    d.decoding = d.nworkers;
+    // The caller is worker 0. A worker that fails to start has its
+    // share stolen by the others.
+    for (k = 1; k < d.nworkers; k++) {
+        d.workers[k].started =
+            pthread_create(&d.workers[k].thread, NULL, worker_run, &d.workers[k]) == 0;
+        if (!d.workers[k].started) {
+            d.decoding--;
+        }
+    }
+    decode_batches(&d.workers[0]);
+    pthread_mutex_lock(&d.lock);
+    d.decoding--;
+    while (d.decoding > 0) {
+        pthread_cond_wait(&d.cond, &d.lock);
+    }
+    pthread_mutex_unlock(&d.lock);
+    result->decode_ns = netif_stats_now() - start;
+
+    // Each batch's place in the result is the sum of the counts before
+    // it; the workers then copy the batches in parallel
+    start = netif_stats_now();
+    error = atomic_load(&d.failed);
+    total = 0;
+    for (i = 0; !error && i < d.nbatches; i++) {
+        d.out[i].offset = total;
+        total += d.out[i].count;
+    }
+    if (!error && (d.merged = malloc(total ? total * sizeof(struct route_entry) : 1)) == NULL) {
+        error = ENOMEM;
+    }
+    pthread_mutex_lock(&d.lock);
+    d.merging = error ? -1 : 1;
+    pthread_cond_broadcast(&d.cond);
+    pthread_mutex_unlock(&d.lock);
+    if (!error) {
+        merge_batches(&d);
+    }
+
+    result->threads = 1;
+    for (k = 1; k < d.nworkers; k++) {
+        if (d.workers[k].started) {
+            pthread_join(d.workers[k].thread, NULL);
+            result->threads++;
+        }
+    }
+    for (k = 0; k < d.nworkers; k++) {
+        result->steals += d.workers[k].steals;
+    }
+    netif_stats_add(NETIF_DECODE_STEALS, result->steals);
+    if (!error) {
+        result->entries = d.merged;
+        result->count = total;
+    }
+    result->merge_ns = netif_stats_now() - start;
+    netif_stats_add(NETIF_ROUTES_SCANNED, result->messages);
+
+    for (k = 0; k < d.nworkers; k++) {
+        route_arena_free(&d.workers[k].arena);
+    }
+    pthread_cond_destroy(&d.cond);
+    pthread_mutex_destroy(&d.lock);
+    free(d.workers);
+    free(d.out);
+    free(bounds);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+void
+route_parallel_result_free(struct route_parallel_result *result)
+{
+    free(result->entries);
+    result->entries = NULL;
+    result->count = 0;
+}
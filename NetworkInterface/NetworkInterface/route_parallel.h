@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Multi-threaded decoding of large route dumps, in two phases.
+ *
+ * The index phase walks the message lengths alone (rtm_msglen, or
+ * nlmsg_len for netlink) on the calling thread and records where every
+ * ROUTE_PARALLEL_BATCH-th message starts. The decode phase then hands
+ * those batches to a pool of workers: each worker starts on its own
+ * contiguous share of the batches and, once that is exhausted, steals
+ * batches from the others' shares, so a worker slowed down by
+ * scheduling or a batch of expensive messages does not hold up the
+ * rest. Workers decode and filter into their own route arenas without
+ * sharing anything but the batch cursors. A prefix sum of the batch
+ * counts then gives each batch its place in the result, in dump order,
+ * and the same workers copy the batches there in parallel.
+ *
+ * Dumps of fewer than two batches, or a pool of one, are decoded on the
+ * calling thread without starting any threads.
+ */
+
+#ifndef route_parallel_h
+#define route_parallel_h
+
+#include "route_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROUTE_PARALLEL_BSD_DUMP     0   /* NET_RT_DUMP2 buffer, see route_dump.h */
+#define ROUTE_PARALLEL_NETLINK      1   /* RTM_NEWROUTE messages, see route_capture.h */
+
+#define ROUTE_PARALLEL_BATCH        4096    /* messages per unit of work */
+#define ROUTE_PARALLEL_MAX_THREADS  64
+
+/*
+ * Returns 1 to keep `e`. Called from every worker at once, so it must
+ * be thread safe.
+ */
+typedef int (*route_parallel_filter_fn)(const struct route_entry *e, void *ctx);
+
+struct route_parallel_result {
+    struct route_entry *entries;    /* kept routes in dump order, free() */
+    size_t count;
+    size_t messages;                /* messages indexed */
+    unsigned threads;               /* workers used, the caller included */
+    uint64_t steals;                /* batches decoded by a worker they were not assigned to */
+    uint64_t index_ns;
+    uint64_t decode_ns;
+    uint64_t merge_ns;
+};
+
+/*
+ * Decodes the dump in `buf`, of `format`, with `nthreads` workers (0 for
+ * one per online CPU, capped at ROUTE_PARALLEL_MAX_THREADS), keeping
+ * the IPv4 and IPv6 routes `filter` accepts (all of them when `filter`
+ * is NULL). Netlink messages of routes that are not tracked (see
+ * route_netlink_parse_route()) are skipped.
+ * Returns 0 or -1 with errno set: EBADMSG when the dump is malformed.
+ */
+int
+route_parallel_decode(const void *buf, size_t len, int format, unsigned nthreads,
+                      route_parallel_filter_fn filter, void *ctx,
+                      struct route_parallel_result *result);
+
+void
+route_parallel_result_free(struct route_parallel_result *result);
+
+#endif /* route_parallel_h */
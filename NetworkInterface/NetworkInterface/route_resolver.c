@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_resolver.h
+ */
+
+#include "route_resolver.h"
+#include "netif_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+
+#ifdef __linux__
+// NOTE: route_dump.h must not be included here, its RTA_* macros
+// collide with <linux/rtnetlink.h>.
+#include "route_netlink.h"
+#include <linux/rtnetlink.h>
+#else
+#include "route_dump.h"
+#include <net/if_dl.h>
+#endif
+
+/* How long the kernel gets to answer a window before its lookups fail */
+#define REPLY_TIMEOUT_MS    2000
+
+/* Receive buffer room per lookup in flight */
+#define REPLY_SPACE         512
+
+/* Distinguishes the lookups of concurrent batches sharing a routing socket (Apple) */
+static _Atomic uint32_t next_seq = 1;
+
+struct batch {
+    int fd;
+    const struct sockaddr_storage *destinations;
+    struct route_resolution *results;
+    size_t count;
+    uint32_t seq;                   /* of destination 0 */
+    size_t inflight;
+    char *buf;                      /* requests, then replies */
+    size_t bufsize;
+};
+
+/* The address bytes of `ss` and their length, or NULL for other families */
+static const uint8_t *
+destination_addr(const struct sockaddr_storage *ss, size_t *len)
+{
+    if (ss->ss_family == AF_INET) {
+        *len = 4;
+        return (const uint8_t *)&((const struct sockaddr_in *)ss)->sin_addr;
+    }
+    if (ss->ss_family == AF_INET6) {
+        *len = 16;
+        return (const uint8_t *)&((const struct sockaddr_in6 *)ss)->sin6_addr;
+    }
+    return NULL;
+}
+
+/* The pending destination a reply with sequence number `seq` answers, or NULL */
+static struct route_resolution *
+pending_result(struct batch *b, uint32_t seq)
+{
+    uint32_t i = seq - b->seq;
+
+    if (i >= b->count || b->results[i].error != EINPROGRESS) {
+        return NULL;
+    }
+    return &b->results[i];
+}
+
+static void
+complete(struct batch *b, struct route_resolution *r, int error)
+{
+    r->error = error;
+    b->inflight--;
+}
+
+#ifdef __linux__
+
+static int
+open_socket(size_t window)
+{
+    int fd = route_netlink_open(0), size = (int)(window * REPLY_SPACE);
+
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    return fd;
+}
+
+static void
+add_attr(struct nlmsghdr *nlh, unsigned short type, const void *data, size_t len)
+{
+    struct rtattr *rta = (struct rtattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = (unsigned short)RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* Largest RTM_GETROUTE request: header, RTA_DST and RTA_OIF */
+#define REQUEST_SPACE   (NLMSG_SPACE(sizeof(struct rtmsg)) + RTA_SPACE(16) + RTA_SPACE(4))
+
+/*
+ * Sends the lookups of destinations [*next, *next + n) in one datagram,
+ * skipping those already settled. Returns 0 or -1 with errno set.
+ */
+static int
+send_lookups(struct batch *b, size_t *next, size_t n)
+{
+    struct sockaddr_nl kernel;
+    size_t len = 0, addrlen = 0;
+    ssize_t sent;
+
+    for (; n > 0 && *next < b->count; (*next)++, n--) {
+        const struct sockaddr_storage *ss = &b->destinations[*next];
+        const uint8_t *addr = destination_addr(ss, &addrlen);
+        struct nlmsghdr *nlh = (struct nlmsghdr *)(b->buf + len);
+        struct rtmsg *rtm = NLMSG_DATA(nlh);
+
+        if (b->results[*next].error != EINPROGRESS) {
+            continue;
+        }
+        memset(nlh, 0, REQUEST_SPACE);
+        nlh->nlmsg_len = NLMSG_LENGTH(sizeof(*rtm));
+        nlh->nlmsg_type = RTM_GETROUTE;
+        nlh->nlmsg_flags = NLM_F_REQUEST;
+        nlh->nlmsg_seq = b->seq + (uint32_t)*next;
+        rtm->rtm_family = ss->ss_family;
+        rtm->rtm_dst_len = (unsigned char)(addrlen * 8);
+        add_attr(nlh, RTA_DST, addr, addrlen);
+        // Link-local destinations are only reachable over their interface
+        if (ss->ss_family == AF_INET6 && ((const struct sockaddr_in6 *)ss)->sin6_scope_id) {
+            uint32_t oif = ((const struct sockaddr_in6 *)ss)->sin6_scope_id;
+            add_attr(nlh, RTA_OIF, &oif, sizeof(oif));
+        }
+        len += NLMSG_ALIGN(nlh->nlmsg_len);
+        b->inflight++;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    do {
+        sent = sendto(b->fd, b->buf, len, 0, (struct sockaddr *)&kernel, sizeof(kernel));
+    } while (sent < 0 && errno == EINTR);
+    return sent < 0 ? -1 : 0;
+}
+
+static void
+parse_route(const struct nlmsghdr *nlh, struct route_resolution *r)
+{
+    const struct rtmsg *rtm = NLMSG_DATA(nlh);
+    const struct rtattr *rta, *metric;
+    size_t addrlen = rtm->rtm_family == AF_INET ? 4 : 16;
+    int len, mlen;
+
+    len = (int)RTM_PAYLOAD(nlh);
+    for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case RTA_OIF:
+            if (RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+                memcpy(&r->ifindex, RTA_DATA(rta), sizeof(uint32_t));
+            }
+            break;
+        case RTA_GATEWAY:
+            if (RTA_PAYLOAD(rta) >= addrlen) {
+                memcpy(r->gateway, RTA_DATA(rta), addrlen);
+                r->gateway_family = rtm->rtm_family;
+            }
+            break;
+        case RTA_PREFSRC:
+            if (RTA_PAYLOAD(rta) >= addrlen) {
+                memcpy(r->source, RTA_DATA(rta), addrlen);
+                r->source_family = rtm->rtm_family;
+            }
+            break;
+        case RTA_METRICS:
+            mlen = (int)RTA_PAYLOAD(rta);
+            for (metric = RTA_DATA(rta); RTA_OK(metric, mlen); metric = RTA_NEXT(metric, mlen)) {
+                if (metric->rta_type == RTAX_MTU && RTA_PAYLOAD(metric) >= sizeof(uint32_t)) {
+                    memcpy(&r->mtu, RTA_DATA(metric), sizeof(uint32_t));
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* Handles every reply in `len` bytes of `b->buf` */
+static void
+handle_replies(struct batch *b, size_t len)
+{
+    const struct nlmsghdr *nlh;
+    struct route_resolution *r;
+    int rem = (int)len;
+
+    for (nlh = (const struct nlmsghdr *)b->buf; NLMSG_OK(nlh, rem); nlh = NLMSG_NEXT(nlh, rem)) {
+        if ((r = pending_result(b, nlh->nlmsg_seq)) == NULL) {
+            continue;
+        }
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+            const struct nlmsgerr *e = NLMSG_DATA(nlh);
+            complete(b, r, nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(*e)) && e->error ? -e->error : EPROTO);
+        } else if (nlh->nlmsg_type == RTM_NEWROUTE && nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct rtmsg))) {
+            parse_route(nlh, r);
+            complete(b, r, 0);
+        }
+    }
+}
+
+#else
+
+static int
+open_socket(size_t window)
+{
+    int fd = socket(PF_ROUTE, SOCK_RAW, AF_UNSPEC), size = (int)(window * REPLY_SPACE);
+
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    return fd;
+}
+
+/* An RTM_GET: header, the destination and an empty RTA_IFP asking for the interface */
+struct request {
+    struct rt_msghdr rtm;
+    char addrs[sizeof(struct sockaddr_in6) + sizeof(struct sockaddr_dl) + 8];
+};
+
+#define REQUEST_SPACE   sizeof(struct request)
+
+/*
+ * Writes the lookups of destinations [*next, *next + n), skipping those
+ * already settled. A lookup the kernel refuses outright fails at once.
+ */
+static int
+send_lookups(struct batch *b, size_t *next, size_t n)
+{
+    struct request *req = (struct request *)b->buf;
+    struct sockaddr_dl *ifp;
+    size_t salen;
+    ssize_t sent;
+
+    for (; n > 0 && *next < b->count; (*next)++, n--) {
+        const struct sockaddr_storage *ss = &b->destinations[*next];
+        struct route_resolution *r = &b->results[*next];
+
+        if (r->error != EINPROGRESS) {
+            continue;
+        }
+        salen = ss->ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        memset(req, 0, sizeof(*req));
+        memcpy(req->addrs, ss, salen);
+        req->addrs[0] = (char)salen;       // sa_len, which callers often leave 0
+        ifp = (struct sockaddr_dl *)(req->addrs + ROUNDUP(salen));
+        ifp->sdl_len = sizeof(*ifp);
+        ifp->sdl_family = AF_LINK;
+        req->rtm.rtm_msglen = (u_short)(sizeof(req->rtm) + ROUNDUP(salen) + ROUNDUP(sizeof(*ifp)));
+        req->rtm.rtm_version = RTM_VERSION;
+        req->rtm.rtm_type = RTM_GET;
+        req->rtm.rtm_flags = RTF_UP | RTF_GATEWAY | RTF_HOST | RTF_STATIC;
+        req->rtm.rtm_addrs = RTA_DST | RTA_IFP;
+        req->rtm.rtm_seq = (int)(b->seq + (uint32_t)*next);
+        b->inflight++;
+        do {
+            sent = write(b->fd, req, req->rtm.rtm_msglen);
+        } while (sent < 0 && errno == EINTR);
+        if (sent < 0) {
+            // e.g. ESRCH: no route. The echoed reply is ignored.
+            complete(b, r, errno);
+        }
+    }
+    return 0;
+}
+
+static void
+parse_route(const struct rt_msghdr *rtm, const char *end, struct route_resolution *r)
+{
+    const struct sockaddr *rti_info[RTAX_MAX];
+    const char *sa = (const char *)(rtm + 1);
+    const uint8_t *addr;
+    size_t len;
+    int i, family;
+
+    // NOTE: adapted from get_rtaddrs in Apple netstat source
+    for (i = 0; i < RTAX_MAX; i++) {
+        rti_info[i] = NULL;
+        if (rtm->rtm_addrs & (1 << i)) {
+            if (sa >= end || sa + ROUNDUP(RT_SA_LEN(sa)) > end) {
+                break;
+            }
+            rti_info[i] = (const struct sockaddr *)sa;
+            sa += ROUNDUP(RT_SA_LEN(sa));
+        }
+    }
+    r->ifindex = rtm->rtm_index;
+    r->mtu = rtm->rtm_rmx.rmx_mtu;
+    // An AF_LINK gateway means the destination is on-link
+    if (rti_info[RTAX_GATEWAY] &&
+        (family = route_family_from_bsd(RT_SA_FAMILY(rti_info[RTAX_GATEWAY]))) != AF_UNSPEC &&
+        (addr = route_sockaddr_addr(rti_info[RTAX_GATEWAY], family, &len)) != NULL) {
+        memcpy(r->gateway, addr, len);
+        r->gateway_family = (uint8_t)family;
+    }
+    if (rti_info[RTAX_IFA] &&
+        (family = route_family_from_bsd(RT_SA_FAMILY(rti_info[RTAX_IFA]))) != AF_UNSPEC &&
+        (addr = route_sockaddr_addr(rti_info[RTAX_IFA], family, &len)) != NULL) {
+        memcpy(r->source, addr, len);
+        r->source_family = (uint8_t)family;
+    }
+    if (rti_info[RTAX_IFP] && RT_SA_FAMILY(rti_info[RTAX_IFP]) == AF_LINK && r->ifindex == 0) {
+        r->ifindex = ((const struct sockaddr_dl *)rti_info[RTAX_IFP])->sdl_index;
+    }
+}
+
+/* Handles the reply in `len` bytes of `b->buf`, if it is one of ours */
+static void
+handle_replies(struct batch *b, size_t len)
+{
+    const struct rt_msghdr *rtm = (const struct rt_msghdr *)b->buf;
+    struct route_resolution *r;
+
+    // The socket also receives every other routing message on the system
+    if (len < sizeof(*rtm) || rtm->rtm_msglen > len || rtm->rtm_version != RTM_VERSION ||
+        rtm->rtm_type != RTM_GET || rtm->rtm_pid != getpid() ||
+        (r = pending_result(b, (uint32_t)rtm->rtm_seq)) == NULL) {
+        return;
+    }
+    if (rtm->rtm_errno != 0) {
+        complete(b, r, rtm->rtm_errno);
+        return;
+    }
+    parse_route(rtm, b->buf + rtm->rtm_msglen, r);
+    complete(b, r, 0);
+}
+
+#endif
+
+/* Waits for and handles replies until all in flight are in or the kernel goes quiet */
+static int
+read_replies(struct batch *b, size_t sent_up_to)
+{
+    struct pollfd pfd = { b->fd, POLLIN, 0 };
+    ssize_t n;
+    size_t i;
+    int rc;
+
+    while (b->inflight > 0) {
+        if ((rc = poll(&pfd, 1, REPLY_TIMEOUT_MS)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            // Lost, e.g. to a full receive buffer
+            for (i = 0; i < sent_up_to; i++) {
+                if (b->results[i].error == EINPROGRESS) {
+                    complete(b, &b->results[i], ETIMEDOUT);
+                }
+            }
+            break;
+        }
+        if ((n = recv(b->fd, b->buf, b->bufsize, 0)) < 0) {
+            if (errno == EINTR || errno == ENOBUFS) {
+                continue;
+            }
+            return -1;
+        }
+        handle_replies(b, (size_t)n);
+    }
+    return 0;
+}
+
+/* Fills in the MTU of routes without one from their interface */
+static void
+interface_mtus(struct route_resolution *results, size_t count)
+{
+    struct { unsigned ifindex; uint32_t mtu; } cache[16];
+    size_t ncached = 0, victim = 0, i, j;
+    struct ifreq ifr;
+    int fd = -1;
+
+    for (i = 0; i < count; i++) {
+        struct route_resolution *r = &results[i];
+        if (r->error != 0 || r->mtu != 0 || r->ifindex == 0) {
+            continue;
+        }
+        for (j = 0; j < ncached && cache[j].ifindex != r->ifindex; j++) {
+        }
+        if (j == ncached) {
+            memset(&ifr, 0, sizeof(ifr));
+            if ((fd < 0 && (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) ||
+                if_indextoname(r->ifindex, ifr.ifr_name) == NULL ||
+                ioctl(fd, SIOCGIFMTU, &ifr) != 0) {
+                continue;
+            }
+            // Once full, entries are replaced in the order they were
+            // added, so the oldest one makes room
+            if (ncached < sizeof(cache) / sizeof(cache[0])) {
+                j = ncached++;
+            } else {
+                j = victim;
+                victim = (victim + 1) % ncached;
+            }
+            cache[j].ifindex = r->ifindex;
+            cache[j].mtu = (uint32_t)ifr.ifr_mtu;
+        }
+        r->mtu = cache[j].mtu;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+int
+route_resolve_batch(const struct sockaddr_storage *destinations, size_t count, size_t window,
+                    struct route_resolution *results)
+{
+    struct batch b;
+    size_t i, next = 0, addrlen;
+    int resolved = 0, saved_errno;
+
+    if (window == 0) {
+        window = ROUTE_RESOLVE_WINDOW;
+    }
+    memset(&b, 0, sizeof(b));
+    b.destinations = destinations;
+    b.results = results;
+    b.count = count;
+    memset(results, 0, count * sizeof(*results));
+    for (i = 0; i < count; i++) {
+        results[i].error = destination_addr(&destinations[i], &addrlen) ? EINPROGRESS : EAFNOSUPPORT;
+        results[i].family = destinations[i].ss_family;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // Room for a window of requests, or the largest datagram of replies
+    b.bufsize = window * REQUEST_SPACE > ROUTE_RESOLVE_WINDOW * REPLY_SPACE / 4 ?
+                window * REQUEST_SPACE : ROUTE_RESOLVE_WINDOW * REPLY_SPACE / 4;
+    if ((b.buf = malloc(b.bufsize)) == NULL) {
+        return -1;
+    }
+    if ((b.fd = open_socket(window)) < 0) {
+        saved_errno = errno;
+        free(b.buf);
+        errno = saved_errno;
+        return -1;
+    }
+    b.seq = atomic_fetch_add_explicit(&next_seq, (uint32_t)count, memory_order_relaxed);
+    netif_stats_add(NETIF_RESOLVE_LOOKUPS, count);
+
+    // One window at a time: every lookup sent, then every reply read
+    while (next < count) {
+        if (send_lookups(&b, &next, window) != 0) {
+            break;
+        }
+        if (b.inflight > 0) {
+            netif_stats_add(NETIF_RESOLVE_ROUNDS, 1);
+            if (read_replies(&b, next) != 0) {
+                break;
+            }
+        }
+    }
+    if (next < count || b.inflight > 0) {
+        saved_errno = errno;
+        close(b.fd);
+        free(b.buf);
+        errno = saved_errno;
+        return -1;
+    }
+    close(b.fd);
+    free(b.buf);
+
+    interface_mtus(results, count);
+    for (i = 0; i < count; i++) {
+        resolved += results[i].error == 0;
+    }
+    return resolved;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Asks the kernel which route it would use for each of many
+ * destinations, e.g. every upstream of a proxy, in about one round trip
+ * instead of one per destination. The answer is the kernel's own: it
+ * accounts for scoped routes, policy rules and anything else the
+ * routing table scan of print_default_gateway() cannot see.
+ *
+ * Requests are pipelined: up to `window` lookups are sent before any
+ * reply is read, and replies are matched to destinations by sequence
+ * number. On Linux each window is a single send() of RTM_GETROUTE
+ * messages on a NETLINK_ROUTE socket; on Apple each lookup is an
+ * RTM_GET written to a PF_ROUTE socket, replies being filtered by pid
+ * and rtm_seq from everything else the socket receives.
+ *
+ * NOTE: a lookup does not create or change a route, but on Apple it
+ * may clone a host route the way a connect() to the destination would.
+ */
+
+#ifndef route_resolver_h
+#define route_resolver_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Lookups in flight when no window is given */
+#define ROUTE_RESOLVE_WINDOW    256
+
+struct route_resolution {
+    int error;                  /* 0, or the errno the lookup failed with, e.g. ENETUNREACH */
+    unsigned ifindex;           /* egress interface */
+    uint8_t family;             /* AF_INET or AF_INET6, of the destination */
+    uint8_t gateway_family;     /* AF_UNSPEC when the destination is on-link */
+    uint8_t source_family;      /* AF_UNSPEC when the kernel chose no source */
+    uint8_t reserved;
+    uint32_t mtu;               /* the route's, or its interface's when it has none */
+    uint8_t gateway[16];        /* network byte order */
+    uint8_t source[16];
+};
+
+/*
+ * Resolves `count` AF_INET or AF_INET6 `destinations` into `results`,
+ * with at most `window` lookups in flight (0 for ROUTE_RESOLVE_WINDOW,
+ * 1 for one round trip per destination). Destinations of other
+ * families fail with EAFNOSUPPORT. Returns the number resolved without
+ * error, or -1 with errno set when the kernel cannot be asked at all.
+ */
+int
+route_resolve_batch(const struct sockaddr_storage *destinations, size_t count, size_t window,
+                    struct route_resolution *results);
+
+#endif /* route_resolver_h */
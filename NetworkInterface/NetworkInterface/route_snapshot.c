@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_snapshot.h
+ */
+
+#include "route_snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct route_snapshot *
+route_snapshot_create(const struct route_snapshot *previous,
+                      const struct route_entry *routes, size_t count)
+{
+    struct route_snapshot *snapshot;
+
+    if ((snapshot = calloc(1, sizeof(*snapshot))) == NULL) {
+        return NULL;
+    }
+    if (route_compact_build(&snapshot->routes, routes, count) != 0) {
+        free(snapshot);
+        return NULL;
+    }
+    if (route_lpm_update(&snapshot->lpm, previous ? &previous->lpm : NULL, routes, count) != 0) {
+        route_compact_free(&snapshot->routes);
+        free(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void
+route_snapshot_destroy(struct route_snapshot *snapshot)
+{
+    if (snapshot == NULL) {
+        return;
+    }
+    route_lpm_free(&snapshot->lpm);
+    route_compact_free(&snapshot->routes);
+    free(snapshot);
+}
+
+void
+route_snapshot_domain_init(struct route_snapshot_domain *domain)
+{
+    memset(domain, 0, sizeof(*domain));
+    atomic_init(&domain->current, NULL);
+    // Epoch 0 marks a reader outside a read section
+    atomic_init(&domain->epoch, 1);
+    pthread_mutex_init(&domain->lock, NULL);
+}
+
+void
+route_snapshot_domain_destroy(struct route_snapshot_domain *domain)
+{
+    struct route_snapshot *s, *next;
+
+    route_snapshot_destroy(atomic_load(&domain->current));
+    for (s = domain->retired; s; s = next) {
+        next = s->retired_next;
+        route_snapshot_destroy(s);
+    }
+    pthread_mutex_destroy(&domain->lock);
+    memset(domain, 0, sizeof(*domain));
+}
+
+void
+route_snapshot_reader_register(struct route_snapshot_domain *domain,
+                               struct route_snapshot_reader *reader)
+{
+    atomic_init(&reader->epoch, 0);
+    pthread_mutex_lock(&domain->lock);
+    reader->next = domain->readers;
+    domain->readers = reader;
+    pthread_mutex_unlock(&domain->lock);
+}
+
+void
+route_snapshot_reader_unregister(struct route_snapshot_domain *domain,
+                                 struct route_snapshot_reader *reader)
+{
+    struct route_snapshot_reader **p;
+
+    pthread_mutex_lock(&domain->lock);
+    for (p = &domain->readers; *p; p = &(*p)->next) {
+        if (*p == reader) {
+            *p = reader->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&domain->lock);
+}
+
+/* Called with domain->lock held */
+static size_t
+reclaim_locked(struct route_snapshot_domain *domain)
+{
+    struct route_snapshot_reader *r;
+    struct route_snapshot **p;
+    uint64_t oldest = UINT64_MAX;
+    size_t pending = 0;
+
+    // The oldest epoch any reader may still be reading under
+    for (r = domain->readers; r; r = r->next) {
+        uint64_t e = atomic_load(&r->epoch);
+        if (e != 0 && e < oldest) {
+            oldest = e;
+        }
+    }
+
+    // A snapshot retired at epoch E is unreachable once every active
+    // reader entered its read section at an epoch after E
+    p = &domain->retired;
+    while (*p) {
+        struct route_snapshot *s = *p;
+        if (s->retired_epoch < oldest) {
+            *p = s->retired_next;
+            route_snapshot_destroy(s);
+        } else {
+            p = &s->retired_next;
+            pending++;
+        }
+    }
+    return pending;
+}
+
+uint64_t
+route_snapshot_publish(struct route_snapshot_domain *domain, struct route_snapshot *snapshot)
+{
+    struct route_snapshot *old;
+    uint64_t version;
+
+    pthread_mutex_lock(&domain->lock);
+    version = snapshot->version = ++domain->version;
+    old = atomic_exchange(&domain->current, snapshot);
+    if (old) {
+        old->retired_epoch = atomic_fetch_add(&domain->epoch, 1);
+        old->retired_next = domain->retired;
+        domain->retired = old;
+    }
+    reclaim_locked(domain);
+    pthread_mutex_unlock(&domain->lock);
+    return version;
+}
+
+size_t
+route_snapshot_reclaim(struct route_snapshot_domain *domain)
+{
+    size_t pending;
+
+    pthread_mutex_lock(&domain->lock);
+    pending = reclaim_locked(domain);
+    pthread_mutex_unlock(&domain->lock);
+    return pending;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Immutable, versioned routing table snapshots published RCU style.
+ *
+ * A single updater builds a new snapshot and publishes it with an
+ * atomic pointer swap. Any number of reader threads read the current
+ * snapshot without locks: a read section only stores the global epoch
+ * into the reader's own slot and loads the current pointer.
+ *
+ * Replaced snapshots are retired with the epoch at which they were
+ * replaced and freed once every registered reader is either outside a
+ * read section or entered one after that epoch (epoch based deferred
+ * reclamation). Readers never block the updater and the updater never
+ * blocks readers.
+ */
+
+#ifndef route_snapshot_h
+#define route_snapshot_h
+
+#include "route_compact.h"
+#include "route_lpm.h"
+#include "route_table.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct route_snapshot {
+    uint64_t version;               /* increases with every publication */
+    struct route_compact routes;
+    struct route_lpm lpm;
+    /* Owned by the domain once published */
+    struct route_snapshot *retired_next;
+    uint64_t retired_epoch;
+};
+
+struct route_snapshot_reader {
+    _Atomic uint64_t epoch;         /* 0 when outside a read section */
+    struct route_snapshot_reader *next;
+};
+
+struct route_snapshot_domain {
+    _Atomic(struct route_snapshot *) current;
+    _Atomic uint64_t epoch;
+    pthread_mutex_t lock;           /* reader registration and the retired list */
+    struct route_snapshot_reader *readers;
+    struct route_snapshot *retired;
+    uint64_t version;
+};
+
+/*
+ * Builds a snapshot holding a compact copy of `count` routes (see
+ * route_compact.h) and their longest-prefix-match index. The index is
+ * updated from the one of `previous`, typically the snapshot currently
+ * published, sharing what the change left alone (see route_lpm_update()).
+ * `previous` may be NULL and must stay alive during the call. Returns
+ * NULL when out of memory.
+ */
+struct route_snapshot *
+route_snapshot_create(const struct route_snapshot *previous,
+                      const struct route_entry *routes, size_t count);
+
+void
+route_snapshot_destroy(struct route_snapshot *snapshot);
+
+void
+route_snapshot_domain_init(struct route_snapshot_domain *domain);
+
+/* Frees every snapshot. No reader may be registered. */
+void
+route_snapshot_domain_destroy(struct route_snapshot_domain *domain);
+
+/* Registers the calling thread's reader. `reader` must stay valid until unregistered. */
+void
+route_snapshot_reader_register(struct route_snapshot_domain *domain,
+                               struct route_snapshot_reader *reader);
+
+void
+route_snapshot_reader_unregister(struct route_snapshot_domain *domain,
+                                 struct route_snapshot_reader *reader);
+
+/*
+ * Enters a read section and returns the current snapshot (NULL before
+ * the first publication). The snapshot stays valid until
+ * route_snapshot_read_end(). Read sections must not nest.
+ */
+static inline const struct route_snapshot *
+route_snapshot_read_begin(struct route_snapshot_domain *domain,
+                          struct route_snapshot_reader *reader)
+{
+    // The store must be ordered before the load of `current` (seq_cst)
+    atomic_store(&reader->epoch, atomic_load(&domain->epoch));
+    return atomic_load(&domain->current);
+}
+
+static inline void
+route_snapshot_read_end(struct route_snapshot_reader *reader)
+{
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+/*
+ * Publishes `snapshot`, which must not be modified afterwards, and
+ * retires the previous one. Frees retired snapshots no reader can
+ * still see. Only one thread may publish at a time.
+ * Returns the version assigned to `snapshot`.
+ */
+uint64_t
+route_snapshot_publish(struct route_snapshot_domain *domain, struct route_snapshot *snapshot);
+
+/*
+ * Frees retired snapshots that no reader can still see.
+ * Returns the number of snapshots still waiting for readers.
+ */
+size_t
+route_snapshot_reclaim(struct route_snapshot_domain *domain);
+
+#endif /* route_snapshot_h */
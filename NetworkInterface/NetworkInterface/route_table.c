@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_table.h
+ */
+
+#include "route_table.h"
+
+#include "netif_stats.h"
+#include "route_dump.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+static uint32_t
+scope_of(const struct route_entry *e)
+{
+    return (e->flags & ROUTE_F_IFSCOPE) ? e->ifindex : 0;
+}
+
+int
+route_entry_same_key(const struct route_entry *a, const struct route_entry *b)
+{
+    return a->family == b->family &&
+           a->prefixlen == b->prefixlen &&
+           a->priority == b->priority &&
+           scope_of(a) == scope_of(b) &&
+           memcmp(a->dst, b->dst, sizeof(a->dst)) == 0;
+}
+
+int
+route_entry_equal(const struct route_entry *a, const struct route_entry *b)
+{
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+uint32_t
+route_entry_key_hash(const struct route_entry *e)
+{
+    // FNV-1a over the key fields
+    uint32_t h = 2166136261u;
+    uint32_t scope = scope_of(e);
+    size_t i, n = e->family == AF_INET ? 4 : 16;
+
+    h = (h ^ e->family) * 16777619u;
+    h = (h ^ e->prefixlen) * 16777619u;
+    for (i = 0; i < n; i++) {
+        h = (h ^ e->dst[i]) * 16777619u;
+    }
+    h = (h ^ scope) * 16777619u;
+    h = (h ^ e->priority) * 16777619u;
+    return h;
+}
+
+int
+route_entry_is_default(const struct route_entry *e)
+{
+    static const uint8_t zero[16];
+
+    return e->prefixlen == 0 && (e->flags & ROUTE_F_GATEWAY) &&
+           (e->family == AF_INET || e->family == AF_INET6) &&
+           memcmp(e->dst, zero, sizeof(zero)) == 0;
+}
+
+void
+route_table_init(struct route_table *table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+void
+route_table_free(struct route_table *table)
+{
+    free(table->entries);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+void
+route_table_clear(struct route_table *table)
+{
+    table->count = 0;
+    if (table->slots) {
+        memset(table->slots, 0, table->nslots * sizeof(*table->slots));
+    }
+    table->generation++;
+}
+
+/* Returns the slot holding `key`, or the empty slot where it belongs */
+static size_t
+find_slot(const struct route_table *table, const struct route_entry *key)
+{
+    size_t mask = table->nslots - 1;
+    size_t i = route_entry_key_hash(key) & mask;
+
+    while (table->slots[i] != 0 &&
+           !route_entry_same_key(&table->entries[table->slots[i] - 1], key)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int
+rehash(struct route_table *table, size_t nslots)
+{
+    uint32_t *slots = calloc(nslots, sizeof(*slots));
+    size_t i;
+
+    if (slots == NULL) {
+        return -1;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->nslots = nslots;
+    for (i = 0; i < table->count; i++) {
+        table->slots[find_slot(table, &table->entries[i])] = (uint32_t)(i + 1);
+    }
+    return 0;
+}
+
+int
+route_table_upsert(struct route_table *table, const struct route_entry *e)
+{
+    size_t slot;
+
+    // Keep the load factor at or below one half
+    if ((table->count + 1) * 2 > table->nslots) {
+        if (rehash(table, table->nslots ? table->nslots * 2 : 64) != 0) {
+            return -1;
+        }
+    }
+
+    slot = find_slot(table, e);
+    if (table->slots[slot] != 0) {
+        struct route_entry *existing = &table->entries[table->slots[slot] - 1];
+        if (route_entry_equal(existing, e)) {
+            return 0;
+        }
+        *existing = *e;
+        table->generation++;
+        return 2;
+    }
+
+    if (table->count == table->cap) {
+        size_t cap = table->cap ? table->cap * 2 : 64;
+        struct route_entry *entries = realloc(table->entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            return -1;
+        }
+        table->entries = entries;
+        table->cap = cap;
+    }
+    table->entries[table->count] = *e;
+    table->slots[slot] = (uint32_t)(++table->count);
+    table->generation++;
+    return 1;
+}
+
+int
+route_table_remove(struct route_table *table, const struct route_entry *key)
+{
+    size_t mask, slot, i, j, index, last;
+
+    if (table->count == 0) {
+        return 0;
+    }
+    mask = table->nslots - 1;
+    slot = find_slot(table, key);
+    if (table->slots[slot] == 0) {
+        return 0;
+    }
+    index = table->slots[slot] - 1;
+
+    // Backward shift deletion keeps probe sequences intact
+    i = slot;
+    j = slot;
+    for (;;) {
+        size_t home;
+        table->slots[i] = 0;
+        do {
+            j = (j + 1) & mask;
+            if (table->slots[j] == 0) {
+                goto shifted;
+            }
+            home = route_entry_key_hash(&table->entries[table->slots[j] - 1]) & mask;
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        table->slots[i] = table->slots[j];
+        i = j;
+    }
+shifted:
+
+    // Move the last dense entry into the hole
+    last = table->count - 1;
+    if (index != last) {
+        table->entries[index] = table->entries[last];
+        table->slots[find_slot(table, &table->entries[index])] = (uint32_t)(index + 1);
+    }
+    table->count--;
+    table->generation++;
+    return 1;
+}
+
+const struct route_entry *
+route_table_find(const struct route_table *table, const struct route_entry *key)
+{
+    size_t slot;
+
+    if (table->count == 0) {
+        return NULL;
+    }
+    slot = find_slot(table, key);
+    return table->slots[slot] ? &table->entries[table->slots[slot] - 1] : NULL;
+}
+
+int
+route_table_load_dump(struct route_table *table, const void *buf, size_t len)
+{
+    struct route_dump_iter iter;
+    struct route_view view;
+    struct route_entry e;
+    uint64_t scanned = 0;
+    int rc;
+
+    route_table_clear(table);
+    route_dump_iter_init(&iter, buf, len);
+    while ((rc = route_dump_iter_next(&iter, &view)) == 1) {
+        scanned++;
+        if (route_entry_from_view(&e, &view) == 0 && route_table_upsert(table, &e) < 0) {
+            return -1;
+        }
+    }
+    netif_stats_add(NETIF_ROUTES_SCANNED, scanned);
+    return rc < 0 ? -1 : (int)table->count;
+}
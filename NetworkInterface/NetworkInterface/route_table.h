@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * In-memory routing table of decoded routes, keyed by destination
+ * prefix, interface scope and priority.
+ *
+ * Routes are decoded into a platform independent `struct route_entry`
+ * from either a PF_ROUTE dump/message (Apple) or a netlink message
+ * (Linux). This header deliberately does not include route_dump.h or
+ * <linux/rtnetlink.h>, whose RTA_* and RTAX_* names collide.
+ */
+
+#ifndef route_table_h
+#define route_table_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Portable route flags (not the kernel's RTF_* values) */
+#define ROUTE_F_UP          0x1     /* route usable */
+#define ROUTE_F_GATEWAY     0x2     /* destination is reached via a gateway */
+#define ROUTE_F_HOST        0x4     /* host entry */
+#define ROUTE_F_STATIC      0x8     /* manually added */
+#define ROUTE_F_IFSCOPE     0x10    /* scoped to `ifindex` (Apple RTF_IFSCOPE) */
+#define ROUTE_F_REJECT      0x20    /* reject, blackhole or unreachable */
+#define ROUTE_F_CLONED      0x40    /* generated through cloning */
+#define ROUTE_F_MULTIPATH   0x80    /* one of several nexthops (Linux RTA_MULTIPATH) */
+
+struct route_entry {
+    uint8_t family;             /* AF_INET or AF_INET6 */
+    uint8_t prefixlen;
+    uint8_t gateway_family;     /* AF_INET, AF_INET6 or AF_UNSPEC when no IP gateway */
+    uint8_t reserved;
+    uint32_t flags;             /* ROUTE_F_* */
+    uint32_t kernel_flags;      /* RTF_* on Apple, rtm_flags on Linux */
+    uint32_t ifindex;
+    uint32_t priority;          /* RTA_PRIORITY on Linux, 0 on Apple */
+    uint32_t mtu;
+    uint32_t rtt;
+    uint32_t rttvar;
+    uint32_t hopcount;
+    uint8_t dst[16];            /* network byte order, host bits zero */
+    uint8_t gateway[16];
+};
+
+/*
+ * Returns 1 if `a` and `b` identify the same route: same family,
+ * destination prefix, priority and, for scoped routes, interface.
+ */
+int
+route_entry_same_key(const struct route_entry *a, const struct route_entry *b);
+
+/* Returns 1 if `a` and `b` describe the same route with the same attributes */
+int
+route_entry_equal(const struct route_entry *a, const struct route_entry *b);
+
+uint32_t
+route_entry_key_hash(const struct route_entry *e);
+
+/* Returns 1 for 0.0.0.0/0 and ::/0 routes via a gateway */
+int
+route_entry_is_default(const struct route_entry *e);
+
+struct route_table {
+    struct route_entry *entries;    /* dense, unordered */
+    size_t count;
+    size_t cap;
+    uint32_t *slots;                /* open addressing: entry index + 1, 0 when empty */
+    size_t nslots;                  /* power of two */
+    uint64_t generation;            /* incremented on every change */
+};
+
+void
+route_table_init(struct route_table *table);
+
+void
+route_table_free(struct route_table *table);
+
+void
+route_table_clear(struct route_table *table);
+
+/*
+ * Inserts or replaces the route with the key of `e`.
+ * Returns 1 when added, 2 when an existing route changed, 0 when the
+ * route was already present unchanged and -1 when out of memory.
+ */
+int
+route_table_upsert(struct route_table *table, const struct route_entry *e);
+
+/* Removes the route with the key of `key`. Returns 1 if removed, 0 if absent */
+int
+route_table_remove(struct route_table *table, const struct route_entry *key);
+
+const struct route_entry *
+route_table_find(const struct route_table *table, const struct route_entry *key);
+
+/*
+ * Replaces the contents of the table with the routes in a
+ * `NET_RT_DUMP2` buffer. Returns the number of routes loaded or -1 when
+ * the dump is malformed or memory runs out.
+ */
+int
+route_table_load_dump(struct route_table *table, const void *buf, size_t len);
+
+#endif /* route_table_h */
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in route_tracker.h
+ */
+
+#include "route_tracker.h"
+
+#include "route_dump.h"
+#include "route_netlink.h"
+#include "route_parallel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#define EVENT_BUFSIZE   ROUTE_NETLINK_BUFSIZE
+#else
+#define EVENT_BUFSIZE   8192
+#endif
+
+int
+route_tracker_apply_msg(struct route_table *table, const void *msg, size_t len)
+{
+    const struct rt_msghdr *rtm = msg;
+    struct route_view view;
+    struct route_entry e;
+    int rc;
+
+    if (len < sizeof(*rtm) || rtm->rtm_version != RTM_VERSION || rtm->rtm_errno != 0) {
+        return 0;
+    }
+    if (rtm->rtm_type != RTM_ADD && rtm->rtm_type != RTM_DELETE && rtm->rtm_type != RTM_CHANGE) {
+        return 0;
+    }
+    if (route_msg_decode(msg, len, &view) < 0) {
+        return -1;
+    }
+    if (route_entry_from_view(&e, &view) < 0) {
+        return 0;
+    }
+    if (rtm->rtm_type == RTM_DELETE) {
+        return route_table_remove(table, &e);
+    }
+    rc = route_table_upsert(table, &e);
+    return rc < 0 ? -1 : rc > 0;
+}
+
+static int
+load_table(struct route_table *table)
+{
+#ifdef __linux__
+    return route_netlink_load_table(table) < 0 ? -1 : 0;
+#elif defined(__APPLE__)
+    struct route_parallel_result decoded;
+    char *buf;
+    size_t len, i;
+    int rc, saved_errno;
+
+    if (route_dump_fetch(&buf, &len) != 0) {
+        return -1;
+    }
+    // Decoding dominates reloads of large tables; spread it over the
+    // cores and only insert on this thread
+    rc = route_parallel_decode(buf, len, ROUTE_PARALLEL_BSD_DUMP, 0, NULL, NULL, &decoded);
+    saved_errno = errno;
+    free(buf);
+    if (rc != 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    route_table_clear(table);
+    for (i = 0; i < decoded.count; i++) {
+        if (route_table_upsert(table, &decoded.entries[i]) < 0) {
+            route_parallel_result_free(&decoded);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    route_parallel_result_free(&decoded);
+    return 0;
+#else
+    (void)table;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int
+route_tracker_open(struct route_tracker *tracker)
+{
+    memset(tracker, 0, sizeof(*tracker));
+    route_table_init(&tracker->table);
+
+    // Subscribe before dumping so no change between the two is missed
+#ifdef __linux__
+    tracker->fd = route_netlink_open_route_events();
+#else
+    tracker->fd = socket(PF_ROUTE, SOCK_RAW, AF_UNSPEC);
+    if (tracker->fd >= 0 && fcntl(tracker->fd, F_SETFL, fcntl(tracker->fd, F_GETFL) | O_NONBLOCK) < 0) {
+        close(tracker->fd);
+        tracker->fd = -1;
+    }
+#endif
+    if (tracker->fd < 0) {
+        return -1;
+    }
+    if (load_table(&tracker->table) != 0) {
+        int saved_errno = errno;
+        route_tracker_close(tracker);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+void
+route_tracker_close(struct route_tracker *tracker)
+{
+    if (tracker->fd >= 0) {
+        close(tracker->fd);
+    }
+    tracker->fd = -1;
+    route_table_free(&tracker->table);
+}
+
+int
+route_tracker_process(struct route_tracker *tracker)
+{
+    char buf[EVENT_BUFSIZE];
+    int changes = 0;
+
+    for (;;) {
+        ssize_t n = recv(tracker->fd, buf, sizeof(buf), 0);
+        int rc;
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == ENOBUFS) {
+                // Notifications were dropped: the only way back is a full dump
+                if (load_table(&tracker->table) != 0) {
+                    return -1;
+                }
+                tracker->resyncs++;
+                changes++;
+                continue;
+            }
+            return -1;
+        }
+
+#ifdef __linux__
+        {
+            const struct nlmsghdr *nlh;
+            int len = (int)n;
+            for (nlh = (const struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+                if ((rc = route_netlink_apply(&tracker->table, nlh)) < 0) {
+                    return -1;
+                }
+                tracker->events++;
+                changes += rc;
+            }
+        }
+#else
+        if ((rc = route_tracker_apply_msg(&tracker->table, buf, (size_t)n)) < 0) {
+            return -1;
+        }
+        tracker->events++;
+        changes += rc;
+#endif
+    }
+    return changes;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Keeps a `struct route_table` current from routing change events.
+ *
+ * The tracker subscribes to route change messages (PF_ROUTE RTM_ADD,
+ * RTM_DELETE and RTM_CHANGE on Apple, netlink RTM_NEWROUTE and
+ * RTM_DELROUTE on Linux), then takes a single full dump. Afterwards
+ * each change is applied as a delta; the table is only re-dumped when
+ * the kernel reports that notifications were lost. On Linux the tracker
+ * also follows link changes, since the IPv4 routes of a link that goes
+ * down are flushed without RTM_DELROUTE.
+ */
+
+#ifndef route_tracker_h
+#define route_tracker_h
+
+#include "route_table.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct route_tracker {
+    struct route_table table;
+    int fd;                 /* non-blocking event socket */
+    uint64_t events;        /* change messages applied */
+    uint64_t resyncs;       /* full re-dumps after lost notifications */
+};
+
+/*
+ * Opens the event socket and loads the initial table.
+ * Returns 0 on success or -1 with errno set.
+ */
+int
+route_tracker_open(struct route_tracker *tracker);
+
+void
+route_tracker_close(struct route_tracker *tracker);
+
+/*
+ * Applies all pending change messages without blocking. Call when
+ * `tracker->fd` is readable, or before reading the table.
+ * Returns the number of changes applied or -1 with errno set.
+ */
+int
+route_tracker_process(struct route_tracker *tracker);
+
+/*
+ * Applies one PF_ROUTE socket message to `table`. Messages other than
+ * successful RTM_ADD, RTM_DELETE and RTM_CHANGE are ignored.
+ * Returns 1 when the table changed, 0 when it did not and -1 when the
+ * message is malformed or memory runs out.
+ */
+int
+route_tracker_apply_msg(struct route_table *table, const void *msg, size_t len);
+
+#endif /* route_tracker_h */
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * See comments in socket_pool.h
+ */
+
+#include "socket_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+/* What a socket is bound to, copied out of the pool under its lock */
+struct binding {
+    unsigned ifindex;
+    uint64_t generation;
+    struct sockaddr_storage source;
+    socklen_t source_len;
+};
+
+int
+socket_pool_init(struct socket_pool *pool, int family, int type, size_t target)
+{
+    int rc;
+
+    if ((family != AF_INET && family != AF_INET6) || target == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(pool, 0, sizeof(*pool));
+    pool->ready = calloc(target, sizeof(*pool->ready));
+    if (pool->ready == NULL) {
+        return -1;
+    }
+    if ((rc = pthread_mutex_init(&pool->lock, NULL)) != 0) {
+        free(pool->ready);
+        errno = rc;
+        return -1;
+    }
+    pool->family = family;
+    pool->type = type;
+    pool->target = target;
+    return 0;
+}
+
+void
+socket_pool_destroy(struct socket_pool *pool)
+{
+    size_t i;
+
+    for (i = 0; i < pool->count; i++) {
+        close(pool->ready[i]);
+    }
+    free(pool->ready);
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof(*pool));
+}
+
+#ifdef __linux__
+/*
+ * First address of `family` on the interface, for binding when the
+ * device cannot be. Returns its length or 0 if there is none.
+ */
+static socklen_t
+interface_address(unsigned ifindex, int family, struct sockaddr_storage *source)
+{
+    struct ifaddrs *ifaddrs, *ifa;
+    char name[IF_NAMESIZE];
+    socklen_t len = 0;
+
+    if (if_indextoname(ifindex, name) == NULL || getifaddrs(&ifaddrs) != 0) {
+        return 0;
+    }
+    for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != family ||
+            strcmp(ifa->ifa_name, name) != 0) {
+            continue;
+        }
+        len = family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        memcpy(source, ifa->ifa_addr, len);
+        // Any port: bind() must not pick one before connect() does
+        if (family == AF_INET) {
+            ((struct sockaddr_in *)source)->sin_port = 0;
+        } else {
+            ((struct sockaddr_in6 *)source)->sin6_port = 0;
+        }
+        break;
+    }
+    freeifaddrs(ifaddrs);
+    return len;
+}
+
+static int
+bind_device(int fd, unsigned ifindex)
+{
+    char name[IF_NAMESIZE];
+#ifdef SO_BINDTOIFINDEX
+    int index = (int)ifindex;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BINDTOIFINDEX, &index, sizeof(index)) == 0) {
+        return 0;
+    }
+    if (errno != ENOPROTOOPT) {
+        return -1;
+    }
+    // Kernels before 5.0 only take the name
+#endif
+    if (if_indextoname(ifindex, name) == NULL) {
+        return -1;
+    }
+    return setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, name, (socklen_t)strlen(name));
+}
+#endif
+
+static int
+bind_interface(int fd, int family, const struct binding *binding)
+{
+#ifdef __linux__
+    struct sockaddr_storage source = binding->source;
+    socklen_t source_len = binding->source_len;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    int one = 1;
+#endif
+
+    if (bind_device(fd, binding->ifindex) == 0) {
+        return 0;
+    }
+    if (errno != EPERM) {
+        return -1;
+    }
+    if (source_len == 0 &&
+        (source_len = interface_address(binding->ifindex, family, &source)) == 0) {
+        errno = EPERM;
+        return -1;
+    }
+    // NOTE: without CAP_NET_RAW, fall back to the interface's address. That
+    // selects the source but not the route; the kernel still picks the
+    // egress from the destination.
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+    return bind(fd, (const struct sockaddr *)&source, source_len);
+#else
+    int index = (int)binding->ifindex;
+
+    if (family == AF_INET) {
+        return setsockopt(fd, IPPROTO_IP, IP_BOUND_IF, &index, sizeof(index));
+    }
+    return setsockopt(fd, IPPROTO_IPV6, IPV6_BOUND_IF, &index, sizeof(index));
+#endif
+}
+
+static int
+create_socket(int family, int type, const struct binding *binding)
+{
+    int fd, saved;
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+#endif
+
+#ifdef SOCK_NONBLOCK
+    fd = socket(family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#else
+    fd = socket(family, type, 0);
+    if (fd >= 0 && (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0)) {
+        saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+#endif
+    if (fd < 0) {
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    if (binding->ifindex != 0 && bind_interface(fd, family, binding) != 0) {
+        saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+int
+socket_pool_create_bound(int family, int type, unsigned ifindex)
+{
+    struct binding binding;
+
+    memset(&binding, 0, sizeof(binding));
+    binding.ifindex = ifindex;
+    return create_socket(family, type, &binding);
+}
+
+/* Caller holds the lock */
+static void
+current_binding(const struct socket_pool *pool, struct binding *binding)
+{
+    binding->ifindex = pool->ifindex;
+    binding->generation = pool->generation;
+    binding->source = pool->source;
+    binding->source_len = pool->source_len;
+}
+
+int
+socket_pool_set_interface(struct socket_pool *pool, unsigned ifindex)
+{
+    struct sockaddr_storage source;
+    socklen_t source_len = 0;
+    int *retired, *swap;
+    size_t count, i;
+
+    memset(&source, 0, sizeof(source));
+#ifdef __linux__
+    if (ifindex != 0) {
+        source_len = interface_address(ifindex, pool->family, &source);
+    }
+#endif
+    // Replacement array allocated up front: the swap itself cannot fail
+    if ((retired = calloc(pool->target, sizeof(*retired))) == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (ifindex == pool->ifindex) {
+        pool->source = source;
+        pool->source_len = source_len;
+        pthread_mutex_unlock(&pool->lock);
+        free(retired);
+        return 0;
+    }
+    swap = pool->ready;
+    pool->ready = retired;
+    retired = swap;
+    count = pool->count;
+    pool->count = 0;
+    pool->ifindex = ifindex;
+    pool->source = source;
+    pool->source_len = source_len;
+    pool->generation++;
+    pool->retired += count;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < count; i++) {
+        close(retired[i]);
+    }
+    free(retired);
+    return (int)count;
+}
+
+int
+socket_pool_refill(struct socket_pool *pool)
+{
+    struct binding binding;
+    int added = 0, fd;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->count >= pool->target) {
+            pthread_mutex_unlock(&pool->lock);
+            return added;
+        }
+        current_binding(pool, &binding);
+        pthread_mutex_unlock(&pool->lock);
+
+        if ((fd = create_socket(pool->family, pool->type, &binding)) < 0) {
+            return added > 0 ? added : -1;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->created++;
+        if (pool->generation == binding.generation && pool->count < pool->target) {
+            pool->ready[pool->count++] = fd;
+            fd = -1;
+            added++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (fd >= 0) {
+            // Bound for an interface no longer selected, or lost a race
+            // with another refill
+            close(fd);
+        }
+    }
+}
+
+int
+socket_pool_take(struct socket_pool *pool, uint64_t *generation)
+{
+    struct binding binding;
+    int fd = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count > 0) {
+        fd = pool->ready[--pool->count];
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    current_binding(pool, &binding);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (fd < 0) {
+        if ((fd = create_socket(pool->family, pool->type, &binding)) < 0) {
+            return -1;
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->created++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (generation) {
+        *generation = binding.generation;
+    }
+    return fd;
+}
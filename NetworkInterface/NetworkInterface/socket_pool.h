@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2020, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Pool of pre-created sockets bound to the currently selected
+ * interface, so a new connection after a network change does not pay
+ * for socket creation and binding on its critical path.
+ *
+ * Sockets are bound with IP_BOUND_IF/IPV6_BOUND_IF on Apple and
+ * SO_BINDTOIFINDEX (SO_BINDTODEVICE on older kernels) on Linux. Where
+ * Linux refuses device binding without CAP_NET_RAW they are bound to
+ * the interface's first address of the pool's family instead.
+ *
+ * socket_pool_set_interface() retires every ready socket at once: they
+ * are swapped out under the lock and closed afterwards, and a refill
+ * racing with the change discards what it created for the old
+ * interface. Sockets already taken are the caller's; compare the
+ * generation returned by socket_pool_take() with the pool's to tell
+ * whether one predates a change.
+ *
+ * All sockets are non-blocking and close-on-exec. The pool is thread
+ * safe; socket creation never happens with the lock held.
+ */
+
+#ifndef socket_pool_h
+#define socket_pool_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct socket_pool {
+    pthread_mutex_t lock;
+    int family;                     /* AF_INET or AF_INET6 */
+    int type;                       /* SOCK_STREAM or SOCK_DGRAM */
+    size_t target;                  /* ready sockets kept by refill */
+    unsigned ifindex;               /* 0: sockets are not bound */
+    uint64_t generation;            /* incremented by every interface change */
+    struct sockaddr_storage source; /* fallback binding, when source_len > 0 */
+    socklen_t source_len;
+    int *ready;
+    size_t count;
+    /* Statistics */
+    uint64_t created;
+    uint64_t hits;                  /* takes served from the pool */
+    uint64_t misses;                /* takes that had to create a socket */
+    uint64_t retired;
+};
+
+/* Returns 0 or -1 with errno set. The pool starts empty and unbound. */
+int
+socket_pool_init(struct socket_pool *pool, int family, int type, size_t target);
+
+void
+socket_pool_destroy(struct socket_pool *pool);
+
+/*
+ * Selects the interface new sockets are bound to (0 for none) and
+ * retires the ready sockets bound to the previous one. Returns the
+ * number of sockets retired, or -1 with errno set. Selecting the
+ * current interface again retires nothing.
+ */
+int
+socket_pool_set_interface(struct socket_pool *pool, unsigned ifindex);
+
+/*
+ * Creates sockets until `target` are ready. Meant to run off the
+ * critical path, e.g. right after socket_pool_set_interface() or after
+ * takes. Returns the number of sockets added or -1 with errno set.
+ */
+int
+socket_pool_refill(struct socket_pool *pool);
+
+/*
+ * Returns a socket bound to the selected interface, from the pool when
+ * one is ready and created on the spot otherwise, or -1 with errno set.
+ * Stores the pool generation it was bound for in `generation` if not
+ * NULL.
+ */
+int
+socket_pool_take(struct socket_pool *pool, uint64_t *generation);
+
+/*
+ * Creates one non-blocking, close-on-exec socket bound to `ifindex` (0
+ * for none) the way pooled sockets are, for callers that need sockets
+ * on several interfaces at once. Returns it or -1 with errno set.
+ */
+int
+socket_pool_create_bound(int family, int type, unsigned ifindex);
+
+#endif /* socket_pool_h */